@@ -19,166 +19,234 @@
 #include <unistd.h>
 
 #include <stdbool.h>
+#include <time.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+
+#include "../common/rpi_net.h"
+#include "../common/h264_nal.h"
+#include "../common/aead.h"
+#include "../common/rpi_tls.h"
+#include "../common/serial_link.h"
+#include "../common/multipath.h"
 
 #define VIDEO_DECODE_PORT 130
 
 int sockfd = -1;
+RPI_TLS tls;                            /// -T: TLS 1.3 to raspivid -tlscert, plain recv() otherwise
+
+/*
+ * -s: where the latency goes. The kernel stamps every packet on arrival
+ * (SO_TIMESTAMPING, by the NIC if it can), recv() returns later by the time
+ * it sat in the socket queue, the decoder gets it later still. With
+ * raspivid -timesei every frame starts with its send time, that gives the
+ * wire part too; it needs the clocks of both ends synced (NTP, PTP).
+ */
+#define LAT_SAMPLES 4096
+
+typedef struct
+{
+   unsigned n;
+   float ms[LAT_SAMPLES];
+} LAT_SERIES;
 
-int
-SetupListenSocket (struct in_addr* ip, unsigned short port, unsigned short rcv_timeout, bool bVerbose)
+static struct
+{
+   int interval;                        /// seconds between stats lines, 0 = off
+   int64_t kernel_us;                   /// arrival of the data net_recv() returned last, 0 if the kernel gave no time
+   int64_t user_us;                     /// when that recv returned
+   bool bHardware;                      /// kernel_us is from the NIC clock, only comparable if it is synced (phc2sys)
+   int64_t next_us;
+   unsigned long ulHw, ulSw, ulNone;
+   LAT_SERIES wire, queue, app, total;
+} lat;
+
+/*
+ * -q: the decoder input queue. Every buffer the decoder holds and has not
+ * started on is data waiting, fewer and smaller buffers mean less of it, but
+ * the network has to wait for a free one more often.
+ */
+static struct
 {
-   int sfd = -1;
-   struct sockaddr_in saddr={};
-   saddr.sin_family = AF_INET;
-   saddr.sin_port = htons(port);
-   saddr.sin_addr = *ip;
+   unsigned count;                      /// buffers, 0 = the component's default
+   unsigned size;                       /// bytes each, 0 = the component's default
+   bool bAuto;                          /// as few as the decoder takes
+   unsigned total;                      /// what the port got
+   int in_flight;                       /// handed to the decoder and not given back yet
+   unsigned max, sum, samples;          /// in_flight when a buffer goes in, since the last stats line
+   unsigned long ulFull;                /// the receiver had to wait for a free buffer
+} inq;
+
+static int64_t
+now_us (void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_REALTIME, &ts);
+   return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-   int sockListen = socket(AF_INET, SOCK_STREAM, 0);
-   if (sockListen >= 0)
+/* software stamps always, hardware ones if the NIC and the driver can and we may switch them on */
+static void
+timestamps_enable (int fd, bool bVerbose)
+{
+   int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+               SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+   struct hwtstamp_config hw = { 0, HWTSTAMP_TX_OFF, HWTSTAMP_FILTER_ALL };
+   struct sockaddr_in local;
+   socklen_t len = sizeof(local);
+   struct ifaddrs *ifa, *i;
+   struct ifreq ifr;
+
+   if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)))
    {
-      int iTmp = 1;
-      setsockopt(sockListen, SOL_SOCKET, SO_REUSEADDR, &iTmp, sizeof(int)); //no error handling, just go on
-      if (bind(sockListen, (struct sockaddr *) &saddr, sizeof(saddr)) >= 0)
-      {
-         while ((-1 == (iTmp = listen(sockListen, 0))) && (EINTR == errno))
-            ;
-         if (-1 != iTmp)
-         {
-            fprintf(stderr, "Waiting for a TCP connection on %s:%"SCNu16"...", inet_ntoa(saddr.sin_addr), ntohs(saddr.sin_port));
-            struct sockaddr_in cli_addr;
-            socklen_t clilen = sizeof(cli_addr);
-            while ((-1 == (sfd = accept(sockListen, (struct sockaddr *) &cli_addr, &clilen))) && (EINTR == errno))
-               ;
-            if (sfd >= 0)
-            {
-               struct timeval timeout;
-               timeout.tv_sec = rcv_timeout;
-               timeout.tv_usec = 0;
-               if (setsockopt(sfd, SOL_SOCKET, SO_RCVTIMEO, (char *) &timeout, sizeof(timeout)) < 0)
-                  fprintf(stderr, "setsockopt failed\n");
-               fprintf(stderr, "Client connected from %s:%"SCNu16"\n", inet_ntoa(cli_addr.sin_addr), ntohs(cli_addr.sin_port));
-            }
-            else
-               fprintf(stderr, "Error on accept: %s\n", strerror(errno));
-         }
-         else //if (-1 != iTmp)
-         {
-            fprintf(stderr, "Error trying to listen on a socket: %s\n", strerror(errno));
-         }
-      }
-      else //if (bind(sockListen, (struct sockaddr *) &saddr, sizeof(saddr)) >= 0)
+      int on = 1;
+      if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) && bVerbose)
+         fprintf(stderr, "no kernel receive timestamps: %s\n", strerror(errno));
+      return;
+   }
+   //the interface our address is on
+   if (getsockname(fd, (struct sockaddr*) &local, &len) || getifaddrs(&ifa))
+      return;
+   for (i = ifa; i; i = i->ifa_next)
+   {
+      if (i->ifa_addr && (AF_INET == i->ifa_addr->sa_family) &&
+          (((struct sockaddr_in*) i->ifa_addr)->sin_addr.s_addr == local.sin_addr.s_addr))
       {
-         fprintf(stderr, "Error on binding socket: %s\n", strerror(errno));
+         memset(&ifr, 0, sizeof(ifr));
+         snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", i->ifa_name);
+         ifr.ifr_data = (char*) &hw;
+         if (bVerbose)
+            fprintf(stderr, "%s: hardware receive timestamps %s\n", i->ifa_name,
+                    ioctl(fd, SIOCSHWTSTAMP, &ifr) ? "not available" : "on");
+         else
+            ioctl(fd, SIOCSHWTSTAMP, &ifr);
+         break;
       }
    }
-   else //if (sockListen >= 0)
+   freeifaddrs(ifa);
+}
+
+/* every read of the stream comes here, with -s it also takes the arrival time from the kernel */
+static ssize_t
+net_recv (void* buf, size_t len)
+{
+   char ctrl[256];
+   struct iovec iov = { buf, len };
+   struct msghdr msg = {};
+   struct cmsghdr* cm;
+   ssize_t n;
+
+   if (!lat.interval || (tls.ssl && !tls.bKernelRx))
    {
-      fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
+      n = rpi_tls_recv(&tls, buf, len);
+      lat.user_us = lat.interval ? now_us() : 0;
+      lat.kernel_us = 0;
+      return n;
    }
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = ctrl;
+   msg.msg_controllen = sizeof(ctrl);
+   n = recvmsg(sockfd, &msg, 0);
+   lat.user_us = now_us();
+   lat.kernel_us = 0;
+   for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+   {
+      if ((SOL_SOCKET == cm->cmsg_level) && (SCM_TIMESTAMPING == cm->cmsg_type))
+      {
+         struct timespec* ts = (struct timespec*) CMSG_DATA(cm); //[0] software, [2] raw hardware
+         lat.bHardware = (ts[2].tv_sec || ts[2].tv_nsec);
+         if (lat.bHardware)
+            ts += 2;
+         lat.kernel_us = (int64_t) ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+      }
+      else if ((SOL_SOCKET == cm->cmsg_level) && (SCM_TIMESTAMPNS == cm->cmsg_type))
+      {
+         struct timespec* ts = (struct timespec*) CMSG_DATA(cm);
+         lat.bHardware = false;
+         lat.kernel_us = (int64_t) ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+      }
+   }
+   return n;
+}
 
-   if (sockListen >= 0) //regardless success or error
-      close(sockListen); //do not listen on a given port anymore
-
-   return sfd;
+static void
+lat_add (LAT_SERIES* s, int64_t us)
+{
+   if (s->n < LAT_SAMPLES)
+      s->ms[s->n++] = us / 1000.0f;
 }
 
+static int
+lat_cmp (const void* a, const void* b)
+{
+   float d = *(const float*) a - *(const float*) b;
+   return (d > 0) - (d < 0);
+}
 
-int
-ConnectToHost (struct in_addr* ip, unsigned short port, bool bVerbose)
+static void
+lat_print (const char* name, LAT_SERIES* s)
 {
-   int sfd = -1;
+   double sum = 0;
+   unsigned i;
+
+   if (!s->n)
+      return;
+   qsort(s->ms, s->n, sizeof(s->ms[0]), lat_cmp);
+   for (i = 0; i < s->n; i++)
+      sum += s->ms[i];
+   fprintf(stderr, " %s %.2f/%.2f/%.2f/%.2f", name, sum / s->n, s->ms[s->n / 2], s->ms[s->n * 95 / 100], s->ms[s->n - 1]);
+   s->n = 0;
+}
 
-   struct sockaddr_in saddr = {};
-   saddr.sin_family = AF_INET;
-   saddr.sin_port = htons(port);
-   saddr.sin_addr = *ip;
+/* a buffer was handed to the decoder */
+static void
+lat_sample (const uint8_t* data, size_t len)
+{
+   int64_t now = now_us(), sent;
 
-   bool bConnected = false;
-   int iConnectCnt = 0;
-   while ((!bConnected) && (iConnectCnt++ < 10000000))
+   if (lat.kernel_us)
    {
-      if (0 <= (sfd = socket(AF_INET, SOCK_STREAM, 0)))
-      {
-         fcntl(sfd, F_SETFL, O_NONBLOCK);
-
-         if(bVerbose)
-            fprintf(stderr, "Connecting(%d) to %s:%hu...", iConnectCnt, inet_ntoa(saddr.sin_addr), port);
-         int iTmp = connect(sfd, (struct sockaddr *) &saddr, sizeof(struct sockaddr_in));
-         if ((iTmp == -1) && (errno != EINPROGRESS))
-         {
-            fprintf(stderr, "connect error: %s\n", strerror(errno));
-            return 1;
-         }
-         if (iTmp == 0)
-         {
-            bConnected = true;
-            continue; //connected immediately, not realistic
-         }
-         fd_set fdset;
-         FD_ZERO(&fdset);
-         FD_SET(sfd, &fdset);
-         struct timeval tv;
-         tv.tv_sec = 1;
-         tv.tv_usec = 0;
-
-         iTmp = select(sfd + 1, NULL, &fdset, NULL, &tv);
-         switch (iTmp)
-         {
-            case 1: // data to read
-            {
-               int so_error;
-               socklen_t len = sizeof(so_error);
-               getsockopt(sfd, SOL_SOCKET, SO_ERROR, &so_error, &len);
-               if (so_error == 0)
-               {
-                  if(bVerbose)
-                     fprintf(stderr, "connected, receiving data\n");
-                  bConnected = true;
-                  continue;
-               }
-               else
-               { // error
-                  if ((ECONNREFUSED == so_error)||
-                      (EHOSTUNREACH == so_error))
-                  {
-                     if(bVerbose)
-                        fprintf(stderr, "%s\n", strerror(so_error));
-                     close(sfd);
-                     usleep(100000);
-                     continue;
-                  }
-
-                  fprintf(stderr, "socket select %d, %s\n", so_error, strerror(so_error));
-                  return -1;
-               }
-            }
-               break;
-            case 0: //timeout
-               if(bVerbose)
-                  fprintf(stderr, "timeout connecting\n");
-               close(sfd);
-               break;
-         }
-      }
+      lat_add(&lat.queue, lat.user_us - lat.kernel_us);
+      if (lat.bHardware)
+         lat.ulHw++;
       else
-      {
-         fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
-         return -1;
-      }
+         lat.ulSw++;
+   }
+   else
+      lat.ulNone++;
+   lat_add(&lat.app, now - lat.user_us);
+   if (h264_find_time_sei(data, len, &sent))
+   {
+      //the first bytes of a frame, the rest of it follows at link speed
+      if (lat.kernel_us)
+         lat_add(&lat.wire, lat.kernel_us - sent);
+      lat_add(&lat.total, now - sent);
    }
 
-   if (bConnected && (-1 != sfd))
+   if (now >= lat.next_us)
    {
-      int flags = fcntl(sfd, F_GETFL, 0);
-      if (0 != fcntl(sfd, F_SETFL, flags ^ O_NONBLOCK))
+      if (lat.next_us)
       {
-         fprintf(stderr, "fcntl O_NONBLOCK");
-         close(sfd);
-         exit(134);
+         fprintf(stderr, "latency ms avg/p50/p95/max:");
+         lat_print("wire", &lat.wire);
+         lat_print("kernel queue", &lat.queue);
+         lat_print("app", &lat.app);
+         lat_print("total", &lat.total);
+         fprintf(stderr, " (stamps hw %lu sw %lu none %lu)", lat.ulHw, lat.ulSw, lat.ulNone);
+         if (inq.samples)
+            fprintf(stderr, " decoder in flight avg/max %.1f/%u of %u, waited for a buffer %lu times",
+                    (double) inq.sum / inq.samples, inq.max, inq.total, inq.ulFull);
+         fprintf(stderr, "\n");
+         lat.ulHw = lat.ulSw = lat.ulNone = 0;
+         inq.max = inq.sum = inq.samples = 0;
+         inq.ulFull = 0;
       }
-      return sfd;
+      lat.next_us = now + lat.interval * 1000000LL;
    }
-   return -1;
 }
 
 void
@@ -322,27 +390,408 @@ error_callback (void *userdata, COMPONENT_T *comp, OMX_U32 data)
    fprintf(stderr, "OMX error %s\n", err2str(data));
 }
 
+/*
+ * -k: the stream is sealed per packet (common/aead.h), over TCP as
+ * [len 4][packet] records, over UDP one packet per datagram. A packet is
+ * decrypted in place and handed out over as many OMX buffers as it takes.
+ */
+#define AEAD_MAX_RECORD   (16 << 20)
+
+static struct
+{
+   const char* keyFile;
+   time_t keyMtime;
+   time_t keyChecked;                  /// last stat() of keyFile for a rotation, at most once a second
+   bool bDgram;
+   uint8_t master[AEAD_KEY_LEN];
+   AEAD_SESSION session;
+   AEAD_REPLAY replay;
+   uint8_t* pkt;
+   uint32_t size;
+   uint32_t plain_off, plain_end;      /// payload left in pkt
+   unsigned long ulRejected;
+} aead;
+
+static bool
+recv_all (void* buf, size_t len)
+{
+   char* p = (char*) buf;
+   while (len)
+   {
+      ssize_t n = net_recv(p, len);
+      if ((n < 0) && (EINTR == errno))
+         continue;
+      if (n <= 0)
+         return false;
+      p += n;
+      len -= n;
+   }
+   return true;
+}
+
+static void
+aead_load_or_exit (void)
+{
+   struct stat st;
+
+   if (!aead_load_key(aead.keyFile, aead.master))
+   {
+      fprintf(stderr, "%s: no key, 64 hex digits expected\n", aead.keyFile);
+      exit(EXIT_FAILURE);
+   }
+   if (0 == stat(aead.keyFile, &st))
+      aead.keyMtime = st.st_mtime;
+}
+
+/* one record or datagram into aead.pkt */
+static bool
+aead_read_packet (uint32_t* pLen)
+{
+   ssize_t n;
+
+   if (aead.bDgram)
+   {
+      if (aead.size < 65536)
+      {
+         aead.size = 65536;
+         aead.pkt = realloc(aead.pkt, aead.size);
+      }
+      while (((n = net_recv(aead.pkt, aead.size)) < 0) && (EINTR == errno))
+         ;
+      *pLen = n;
+      return n > 0;
+   }
+   if (!recv_all(pLen, 4))
+      return false;
+   if ((*pLen < AEAD_OVERHEAD) || (*pLen > AEAD_MAX_RECORD))
+   {
+      fprintf(stderr, "bad record length %u, not an encrypted stream?\n", *pLen);
+      exit(EXIT_FAILURE);
+   }
+   if (aead.size < *pLen)
+   {
+      aead.size = *pLen;
+      aead.pkt = realloc(aead.pkt, aead.size);
+   }
+   return recv_all(aead.pkt, *pLen);
+}
+
+/* authenticates and decrypts aead.pkt in place */
+static bool
+aead_accept (uint32_t len)
+{
+   uint64_t id, seq;
+   AEAD_SESSION next;
+   struct stat st;
+
+   if (len < AEAD_OVERHEAD)
+      return false;
+   id = aead_packet_session(aead.pkt);
+   seq = aead_packet_seq(aead.pkt);
+   if (aead.session.bStarted && (id == aead.session.session))
+   {
+      if (!aead_replay_check(&aead.replay, seq) || !aead_packet_open(&aead.session, aead.pkt, len, aead.pkt + AEAD_HDR_LEN))
+         return false;
+      aead_replay_update(&aead.replay, seq);
+      return true;
+   }
+
+   //the sender restarted or rotated the key: only a newer session (see aead_session_id()), once a packet authenticates
+   if (aead.session.bStarted && (id <= aead.session.session))
+      return false;
+   aead_session_start(&next, aead.master, id);
+   if (!aead_packet_open(&next, aead.pkt, len, aead.pkt + AEAD_HDR_LEN))
+   {
+      //after a rotation the key file has been replaced here too, looked at once a second
+      if (time(NULL) == aead.keyChecked)
+         return false;
+      aead.keyChecked = time(NULL);
+      if ((0 != stat(aead.keyFile, &st)) || (st.st_mtime == aead.keyMtime))
+         return false;
+      aead_load_or_exit();
+      fprintf(stderr, "%s reloaded\n", aead.keyFile);
+      aead_session_start(&next, aead.master, id);
+      if (!aead_packet_open(&next, aead.pkt, len, aead.pkt + AEAD_HDR_LEN))
+         return false;
+   }
+   aead.session = next;
+   memset(&aead.replay, 0, sizeof(aead.replay));
+   aead_replay_update(&aead.replay, seq);
+   return true;
+}
+
+/*
+ * -S: frames from a serial port or telemetry radio (raspivid -o serial://...),
+ * see common/serial_link.h. Only complete frames reach the decoder, after a
+ * lost one nothing until the next IDR.
+ */
+static struct
+{
+   const char* url;
+   bool bVerbose;
+   SL_RX rx;
+   const uint8_t* frame;
+   uint32_t off, len;
+   time_t last;                         /// of the -v stats line
+} ser;
+
+static ssize_t
+serial_receive (uint8_t* buf, size_t size)
+{
+   uint32_t n;
+   uint8_t flags;
+
+   while (ser.off == ser.len)
+   {
+      if (!(ser.frame = sl_rx_frame(&ser.rx, &ser.len, &flags)))
+         return -1;
+      ser.off = 0;
+      if (ser.bVerbose && (time(NULL) - ser.last >= 5))
+      {
+         ser.last = time(NULL);
+         sl_rx_print(stderr, &ser.rx);
+      }
+   }
+   n = ser.len - ser.off;
+   if (n > size)
+      n = size;
+   memcpy(buf, ser.frame + ser.off, n);
+   ser.off += n;
+   return n;
+}
+
+/*
+ * -M: raspivid -o multipath://... over several links, see common/multipath.h.
+ * Packets come back in order with the copies dropped, a missing one is given
+ * reorder_ms before the stream goes on without it.
+ */
+static struct
+{
+   unsigned short port;
+   int reorder_ms;
+   bool bVerbose;
+   MP_RX rx;
+   const uint8_t* data;
+   uint32_t off, len;
+   time_t last;                         /// of the -v stats line
+} mp;
+
+static ssize_t
+multipath_receive (uint8_t* buf, size_t size)
+{
+   uint32_t n;
+
+   while (mp.off == mp.len)
+   {
+      if (!(mp.data = mp_rx_next(&mp.rx, &mp.len)))
+         return -1;
+      mp.off = 0;
+      if (mp.bVerbose && (time(NULL) - mp.last >= 5))
+      {
+         mp.last = time(NULL);
+         mp_rx_print(stderr, &mp.rx);
+      }
+   }
+   n = mp.len - mp.off;
+   if (n > size)
+      n = size;
+   memcpy(buf, mp.data + mp.off, n);
+   mp.off += n;
+   return n;
+}
+
+static ssize_t
+receive_stream (uint8_t* buf, size_t size)
+{
+   uint32_t n;
+
+   if (ser.url)
+      return serial_receive(buf, size);
+   if (mp.port)
+      return multipath_receive(buf, size);
+   if (!aead.keyFile)
+      return net_recv(buf, size);
+
+   while (aead.plain_off == aead.plain_end)
+   {
+      if (!aead_read_packet(&n))
+         return -1;
+      if (aead_accept(n))
+      {
+         aead.plain_off = AEAD_HDR_LEN;
+         aead.plain_end = n - AEAD_TAG_LEN;
+      }
+      else if (0 == (aead.ulRejected++ % 100))
+         fprintf(stderr, "%lu packets rejected (replayed, forged or another key)\n", aead.ulRejected);
+   }
+   n = aead.plain_end - aead.plain_off;
+   if (n > size)
+      n = size;
+   memcpy(buf, aead.pkt + aead.plain_off, n);
+   aead.plain_off += n;
+   return n;
+}
+
+/*
+ * -A: raspivid -m android framing, [len4][data] for the config and every
+ * frame. With raspivid -slices a frame comes in parts as the encoder hands
+ * them out, all but the last one with ANDROID_LEN_SLICE. Every part goes to
+ * the decoder as soon as it is in, the last one of a frame (and the config)
+ * with OMX_BUFFERFLAG_ENDOFFRAME, so the decoder starts on it right away
+ * instead of when the next frame begins.
+ */
+#define ANDROID_LEN_SLICE 0x80000000u
+#define ANDROID_MAX_PART (8 * 1024 * 1024)
+
+static struct
+{
+   bool bOn;
+   uint32_t left;                       /// of the current part
+   bool bLast;                          /// the current part ends a frame
+} andr;
+
+/* at most size bytes of one part, bEnd: they end a frame */
+static ssize_t
+android_receive (uint8_t* buf, size_t size, bool* bEnd)
+{
+   size_t got = 0;
+   ssize_t n;
+
+   while (!andr.left)
+   {
+      uint32_t len, have = 0;
+
+      while (have < 4)
+      {
+         if ((n = receive_stream((uint8_t*) &len + have, 4 - have)) <= 0)
+            return n;
+         have += n;
+      }
+      andr.bLast = !(len & ANDROID_LEN_SLICE);
+      andr.left = len & ~ANDROID_LEN_SLICE;
+      if (andr.left > ANDROID_MAX_PART)
+      {
+         fprintf(stderr, "-A: a part of %u bytes, not an android stream\n", andr.left);
+         return -1;
+      }
+   }
+   while ((got < size) && andr.left)
+   {
+      if ((n = receive_stream(buf + got, ((size - got) < andr.left) ? size - got : andr.left)) <= 0)
+         return n;
+      got += n;
+      andr.left -= n;
+   }
+   *bEnd = andr.bLast && !andr.left;
+   return got;
+}
+
 unsigned int ui = 0;
 OMX_ERRORTYPE
 read_into_buffer_and_empty (COMPONENT_T *component, OMX_BUFFERHEADERTYPE *buff_header)
 {
    OMX_ERRORTYPE r;
+   bool bEnd = false;
+   ssize_t n = andr.bOn ? android_receive(buff_header->pBuffer, buff_header->nAllocLen, &bEnd)
+                        : receive_stream(buff_header->pBuffer, buff_header->nAllocLen);
+   uint64_t mode;
 
-   buff_header->nFilledLen = recv(sockfd, buff_header->pBuffer, buff_header->nAllocLen, 0);
-   if (buff_header->nFilledLen <= 0)
+   if (n <= 0)
    {
       exit(1);
    }
+   buff_header->nFilledLen = n;
+   if (andr.bOn)
+      buff_header->nFlags = bEnd ? OMX_BUFFERFLAG_ENDOFFRAME : 0;
    //buff_header->nFlags |= OMX_BUFFERFLAG_EOS;
 
+   int in_flight = __atomic_add_fetch(&inq.in_flight, 1, __ATOMIC_RELAXED);
    r = OMX_EmptyThisBuffer(ilclient_get_handle(component), buff_header);
    if (r != OMX_ErrorNone)
    {
       fprintf(stderr, "Empty buffer error %s\n", err2str(r));
+      __atomic_sub_fetch(&inq.in_flight, 1, __ATOMIC_RELAXED);
+   }
+   else
+   {
+      inq.sum += in_flight;
+      inq.samples++;
+      if ((unsigned) in_flight > inq.max)
+         inq.max = in_flight;
    }
+   if (lat.interval)
+      lat_sample(buff_header->pBuffer, n);
+   if (h264_find_hex_sei(buff_header->pBuffer, n, h264_mode_sei_uuid, &mode))
+      fprintf(stderr, "camera: %s, sensor mode %u, %.2f-%.2f fps\n", (mode >> 56) ? "low light" : "day",
+              (unsigned)(mode >> 48) & 0xff, ((mode >> 0) & 0xffff) / 100.0, ((mode >> 16) & 0xffff) / 100.0);
    return r;
 }
 
+/* the decoder is done with an input buffer, called on the ilclient thread */
+static void
+empty_buffer_done_callback (void *userdata, COMPONENT_T *comp)
+{
+   __atomic_sub_fetch(&inq.in_flight, 1, __ATOMIC_RELAXED);
+}
+
+/* a free input buffer, counts how often all of them are with the decoder */
+static OMX_BUFFERHEADERTYPE *
+get_input_buffer (COMPONENT_T *component)
+{
+   OMX_BUFFERHEADERTYPE *buff_header = ilclient_get_input_buffer(component, VIDEO_DECODE_PORT, 0);
+
+   if (buff_header)
+      return buff_header;
+   inq.ulFull++;
+   return ilclient_get_input_buffer(component, VIDEO_DECODE_PORT, 1 /* block */);
+}
+
+/* -q: buffer count and size of the input port, before its buffers are allocated */
+static void
+set_video_decoder_input_buffers (COMPONENT_T *component, bool bVerbose)
+{
+   OMX_PARAM_PORTDEFINITIONTYPE portdef;
+   int err;
+
+   memset(&portdef, 0, sizeof(portdef));
+   portdef.nSize = sizeof(portdef);
+   portdef.nVersion.nVersion = OMX_VERSION;
+   portdef.nPortIndex = VIDEO_DECODE_PORT;
+   err = OMX_GetParameter(ilclient_get_handle(component), OMX_IndexParamPortDefinition, &portdef);
+   if (err != OMX_ErrorNone)
+   {
+      fprintf(stderr, "Error getting video decoder input port %s\n", err2str(err));
+      exit(1);
+   }
+   if (bVerbose)
+      fprintf(stderr, "decoder input: default %u buffers of %u bytes, at least %u\n",
+              portdef.nBufferCountActual, portdef.nBufferSize, portdef.nBufferCountMin);
+   if (inq.bAuto)
+   {
+      //one with the decoder, one queued behind it, one being received into
+      inq.count = (portdef.nBufferCountMin > 3) ? portdef.nBufferCountMin : 3;
+      if (!inq.size)
+         inq.size = 64 * 1024;
+   }
+   if (inq.count || inq.size)
+   {
+      if (inq.count)
+         portdef.nBufferCountActual = (inq.count < portdef.nBufferCountMin) ? portdef.nBufferCountMin : inq.count;
+      if (inq.size)
+         portdef.nBufferSize = inq.size;
+      err = OMX_SetParameter(ilclient_get_handle(component), OMX_IndexParamPortDefinition, &portdef);
+      if (err != OMX_ErrorNone)
+      {
+         fprintf(stderr, "Error setting video decoder input buffers %s\n", err2str(err));
+         exit(1);
+      }
+      OMX_GetParameter(ilclient_get_handle(component), OMX_IndexParamPortDefinition, &portdef);
+   }
+   inq.total = portdef.nBufferCountActual;
+   if (bVerbose || inq.count || inq.size)
+      fprintf(stderr, "decoder input: %u buffers of %u bytes\n", portdef.nBufferCountActual, portdef.nBufferSize);
+}
+
 static void
 set_video_decoder_input_format (COMPONENT_T *component)
 {
@@ -414,9 +863,18 @@ void show_usage_and_exit(char** argv)
 {
    char* bname = strdupa(argv[0]);
    fprintf(stderr,
-         "Usage: %s [-l port] [-t timeout sec] -p port"
+         "Usage: %s [-l port] [-t timeout sec] [-u] [-k keyfile] [-T cert.pem] [-s stats_sec] [-q count|auto[,size_kb]] [-A] -p port | -S tty | -M port[,reorder_ms]"
          "\n\tconnect: %s -h 1.2.3.4 -l -p 1234 -t 3"
-         "\n\twait for incoming: %s -l -p 1234\n", bname, bname, bname);
+         "\n\twait for incoming: %s -l -p 1234"
+         "\n\treceive raspivid -o udp://...: %s -u -h 0.0.0.0 -p 1234"
+         "\n\treceive raspivid -o serial://...: %s -S /dev/ttyUSB0?baud=115200 (-v prints link stats every 5s)"
+         "\n\treceive raspivid -o multipath://...: %s -M 5000[,80] (-v prints path stats every 5s)"
+         "\n\t-A: raspivid -m android (-slices) framing over TCP, every part of a frame to the decoder as soon as it is in"
+         "\n\t-k: the stream is encrypted with raspivid -keyfile, same key file"
+         "\n\t-T: TLS to raspivid -tlscert, its certificate (or the CA that signed it)"
+         "\n\t-s: latency split into wire (needs raspivid -timesei), kernel queue and app every stats_sec"
+         "\n\t-q: decoder input buffers, auto = as few as the decoder takes; -s shows how many are in flight\n", bname, bname, bname, bname, bname,
+         bname);
    exit(EXIT_FAILURE);
 }
 
@@ -432,17 +890,49 @@ main (int argc, char** argv)
    if(argc < 3)
       show_usage_and_exit(argv);
 
-   bool bListen = false, bVerbose = false;
+   bool bListen = false, bVerbose = false, bUDP = false;
+   const char* tlsCA = NULL;
    unsigned short port, recv_timeout = 3;
    struct in_addr ip={};
    int opt;
-   while ((opt = getopt(argc, argv, "t:vlh:p:")) != -1)
+   while ((opt = getopt(argc, argv, "t:vlh:p:uk:T:s:q:S:M:A")) != -1)
    {
       switch (opt)
       {
          case 'l':
             bListen = true;
             break;
+         case 'u':
+            bUDP = true;
+            break;
+         case 'S':
+            ser.url = optarg;
+            break;
+         case 'M':
+            if (1 > sscanf(optarg, "%hu,%d", &mp.port, &mp.reorder_ms) || !mp.port || (mp.reorder_ms < 0))
+               show_usage_and_exit(argv);
+            break;
+         case 'A':
+            andr.bOn = true;
+            break;
+         case 'k':
+            aead.keyFile = optarg;
+            aead_load_or_exit();
+            break;
+         case 'T':
+            tlsCA = optarg;
+            break;
+         case 's':
+            lat.interval = atoi(optarg);
+            break;
+         case 'q':
+            inq.bAuto = !strncmp(optarg, "auto", 4);
+            if (!inq.bAuto && (1 != sscanf(optarg, "%u", &inq.count)))
+               show_usage_and_exit(argv);
+            if (strchr(optarg, ','))
+               sscanf(strchr(optarg, ',') + 1, "%u", &inq.size);
+            inq.size *= 1024;
+            break;
          case 'v':
             bVerbose = true;
             break;
@@ -486,12 +976,14 @@ main (int argc, char** argv)
 
    ilclient_set_error_callback(handle, error_callback, NULL);
    ilclient_set_eos_callback(handle, eos_callback, NULL);
+   ilclient_set_empty_buffer_done_callback(handle, empty_buffer_done_callback, NULL);
 
    setup_decodeComponent(handle, "video_decode", &decodeComponent);
    setup_renderComponent(handle, "video_render", &renderComponent);
    // both components now in Idle state, no buffers, ports disabled
 
    // input port
+   set_video_decoder_input_buffers(decodeComponent, bVerbose);
    ilclient_enable_port_buffers(decodeComponent, VIDEO_DECODE_PORT, NULL, NULL, NULL);
    ilclient_enable_port(decodeComponent, VIDEO_DECODE_PORT);
 
@@ -500,7 +992,53 @@ main (int argc, char** argv)
 
    printState(ilclient_get_handle(decodeComponent));
 
-   if(bListen)
+   aead.bDgram = bUDP;
+   if (andr.bOn && (bUDP || ser.url || mp.port || aead.keyFile))
+   {
+      fprintf(stderr, "-A is TCP (or -T) only, no -u, -S, -M or -k\n");
+      exit(EXIT_FAILURE);
+   }
+   if (ser.url)
+   {
+      char path[256];
+      unsigned baud = 115200, mtu = SL_DEFAULT_MTU;
+
+      if (aead.keyFile || tlsCA || lat.interval)
+      {
+         fprintf(stderr, "-S takes no -k, -T or -s\n");
+         exit(EXIT_FAILURE);
+      }
+      if (!sl_parse_url(ser.url, path, sizeof(path), &baud, &mtu))
+      {
+         fprintf(stderr, "%s: expected /dev/tty...?baud=<n>\n", ser.url);
+         exit(EXIT_FAILURE);
+      }
+      if ((sockfd = sl_open_tty(path, baud, O_RDONLY)) < 0)
+      {
+         fprintf(stderr, "%s: %s\n", path, strerror(errno));
+         exit(EXIT_FAILURE);
+      }
+      sl_rx_init(&ser.rx, sockfd);
+      ser.bVerbose = bVerbose;
+   }
+   else if (mp.port)
+   {
+      if (aead.keyFile || tlsCA || lat.interval)
+      {
+         fprintf(stderr, "-M takes no -k, -T or -s\n");
+         exit(EXIT_FAILURE);
+      }
+      if (!mp_rx_open(&mp.rx, mp.port, mp.reorder_ms))
+      {
+         fprintf(stderr, "multipath port %hu: %s\n", mp.port, strerror(errno));
+         exit(EXIT_FAILURE);
+      }
+      sockfd = mp.rx.fd;
+      mp.bVerbose = bVerbose;
+   }
+   else if(bUDP)
+      sockfd = OpenUDPSocket(&ip, port, bVerbose);
+   else if(bListen)
       sockfd = SetupListenSocket(&ip, port, 3, bVerbose);
    else
       sockfd = ConnectToHost(&ip, port, bVerbose);
@@ -510,13 +1048,21 @@ main (int argc, char** argv)
       fprintf(stderr, "connect failed");
       exit(133);
    }
+   tls.fd = sockfd;
+   if (lat.interval)
+      timestamps_enable(sockfd, bVerbose);
+   if (tlsCA && (bUDP || !rpi_tls_connect(&tls, sockfd, tlsCA, bVerbose)))
+   {
+      fprintf(stderr, "no TLS connection (TCP only)\n");
+      exit(EXIT_FAILURE);
+   }
 
    // Read the first block so that the decodeComponent can get
    // the dimensions of the video and call port settings
    // changed on the output port to configure it
    while (1)
    {
-      buff_header = ilclient_get_input_buffer(decodeComponent, VIDEO_DECODE_PORT, 1 /* block */);
+      buff_header = get_input_buffer(decodeComponent);
       if (buff_header != NULL)
          read_into_buffer_and_empty(decodeComponent, buff_header);
 
@@ -578,7 +1124,7 @@ main (int argc, char** argv)
    while (1)
    {
       // do we have a decode input buffer we can fill and empty?
-      buff_header = ilclient_get_input_buffer(decodeComponent, 130, 1 /* block */);
+      buff_header = get_input_buffer(decodeComponent);
       if (buff_header != NULL)
       {
          read_into_buffer_and_empty(decodeComponent, buff_header);
@@ -0,0 +1,1872 @@
+/*
+ * relay.c
+ *
+ * Headless relay/ingest daemon for an NVR box. It pulls the H264 streams of
+ * many camera PIs (raspivid -l ...), keeps the last GOP of every stream and
+ * fans it out to any number of viewers and to a recorder. Nothing is decoded
+ * or transcoded and there is no VideoCore dependency, so it builds on any
+ * Linux box:
+ *
+ *    gcc -O2 -pthread -o relay relay.c
+ *
+ * All sockets live on one epoll loop, file writes of the recorder are done by
+ * a small thread pool so a slow disk never stalls the network.
+ *
+ * Every stream is given with -i name,mode,source,viewer_port[,viewer_mode]
+ *    mode         raw_tcp | android | android_motion | rtp
+ *    source       tcp://1.2.3.4:5001 (relay connects to "raspivid -l") or
+ *                 udp://0.0.0.0:6000 (rtp only, RFC 6184 H264 payload)
+ *    viewer_port  viewers connect here, exactly like they would connect to raspivid
+ *    viewer_mode  raw_tcp | android | android_motion, default derived from mode
+ *
+ * e.g.
+ *    relay -i front,android_motion,tcp://192.168.1.10:5001,7001 \
+ *          -i back,raw_tcp,tcp://192.168.1.11:5001,7002 -r /srv/rec -s 600
+ *
+ * For load tests -S n adds n synthetic streams (syn0, syn1, ...) served on
+ * ports starting at -P, see -f/-B for their frame rate and bitrate.
+ *
+ * With -p port the recordings can be played back: a client connects, sends
+ * one line "play=<stream>,<HH:MM:SS or YYYYmmdd-HHMMSS>\n" and gets raw_tcp
+ * (Annex-B) from the last IDR before that time on, as fast as the network
+ * takes it, up to the end of the last segment. With -c cert.pem -k key.pem
+ * the playback connection is TLS 1.3 and the segments still go out with
+ * sendfile, encrypted by the kernel (common/rpi_tls.h, build with
+ * -DRPI_WITH_TLS -lssl -lcrypto).
+ *
+ * Frames are shared by reference between the ring, the viewers and the
+ * recorder (common/frame.h), their data lives in a slab of -m MB (default 64)
+ * that is allocated up front, frames that do not fit go to the heap.
+ *
+ * With -H every segment gets a .hsh file next to it that chains the GOPs of a
+ * stream with BLAKE3 from segment to segment (common/rec_hash.h), -K keyfile[,sec]
+ * adds a keyed seal every sec seconds (default 60) and at the end of every
+ * segment. RPI_Tools/rechash verifies the recordings against it.
+ */
+
+#ifndef _GNU_SOURCE
+   #define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
+
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "../common/rpi_net.h"
+#include "../common/h264_nal.h"
+#include "../common/rec_index.h"
+#include "../common/event_log.h"
+#include "../common/rpi_tls.h"
+#include "../common/rec_hash.h"
+#include "../common/aead.h"
+#include "../common/frame.h"
+
+#define MAX_STREAMS           256
+#define RING_SIZE             512      /// frames kept per stream, the IDR cache lives inside it
+#define VIEWER_QUEUE          256      /// frames queued per viewer before we drop to the next IDR
+#define VIEWER_QUEUE_BYTES    (8*1024*1024)
+#define REC_QUEUE             512      /// frames queued per recorder before we drop
+#define MAX_FRAME_LEN         (8*1024*1024)
+#define RTP_MAX_PACKET        2048
+#define POOL_QUEUE            1024
+#define IOV_BATCH             32
+#define FRAME_BLOCK           (16*1024) /// slab block, frames up to FRAME_MAX_FRAGS of them come from the slab
+
+#define FRAME_FLAG_CONFIG     (1<<0)   /// SPS/PPS only
+#define FRAME_FLAG_IDR        (1<<1)
+#define FRAME_FLAG_MOTION     (1<<2)   /// 1 byte motion value of an android_motion stream
+#define FRAME_FLAG_ALARM      (1<<3)   /// motion alarm of an android_motion stream, no payload
+#define FRAME_FLAG_SPS        (1<<4)   /// carries its own SPS/PPS
+#define ANDROID_LEN_SLICE     0x80000000u /// raspivid -m android -slices: more of this frame follows
+
+typedef enum ANDROID_DATA_TYPES
+{
+    CurrentResolution=0,
+    RegularFrame,
+    MotionInFrame,
+    MotionAlarm
+} ANDROID_DATA_TYPES;
+
+typedef enum
+{
+   MODE_RAW_TCP = 0,
+   MODE_ANDROID,
+   MODE_ANDROID_MOTION,
+   MODE_RTP,
+   MODE_SYNTHETIC
+} STREAM_MODE;
+
+static const char* mode_names[] = {"raw_tcp", "android", "android_motion", "rtp", "synthetic"};
+
+typedef enum
+{
+   EP_STREAM = 0,
+   EP_VIEWER_LISTEN,
+   EP_VIEWER,
+   EP_PLAYBACK_LISTEN
+} EP_KIND;
+
+typedef struct stream stream;
+
+/// epoll data.ptr of a viewer listen socket
+typedef struct
+{
+   EP_KIND kind;
+   stream* st;
+} LISTEN_TAG;
+
+/// f->len is kept as uint32 in host order, it is directly the 4 byte length prefix of the android framing
+typedef struct
+{
+   FRAME* f;
+   uint8_t hdr[5];                      /// framing bytes sent in front of the frame
+   uint8_t hdr_len;
+} VQ_ENTRY;
+
+typedef struct viewer
+{
+   EP_KIND kind;
+   int fd;
+   stream* st;
+   bool bNeedIDR;                       /// dropped or just joined without a cached IDR, wait for the next one
+   bool bConfigSent;                    /// android_motion: the very first config goes untyped
+   bool bWantOut;                       /// EPOLLOUT armed
+   VQ_ENTRY q[VIEWER_QUEUE];
+   unsigned q_rd, q_wr;
+   size_t q_off;                        /// bytes of q[q_rd] already written
+   size_t q_bytes;
+   uint64_t ulDropped;
+   struct viewer* next;
+} viewer;
+
+typedef struct
+{
+   pthread_mutex_t lock;
+   FRAME* q[REC_QUEUE];
+   unsigned rd, wr;
+   bool bScheduled;                     /// a pool worker owns the drain loop
+   FILE* fp;                            /// only touched by the worker
+   FILE* idx_fp;                        /// time index of the segment, see rec_index.h
+   uint64_t offset;                     /// bytes written to the segment
+   int64_t segment_start_us;
+   FRAME* config;                 /// written at the start of every segment
+   FILE* hsh_fp;                        /// -H: hash chain of the segment, see rec_hash.h
+   REC_HASH hash;                       /// carried on from segment to segment
+   bool bChained;                       /// hash continues the stream's chain (from the last .hsh at startup)
+   char segment_name[64];               /// file name of the current segment
+   int64_t sealed_us;                   /// last seal
+   uint64_t ulDropped;
+   bool bDropping;                      /// only the first drop of a burst goes to the event log
+} recorder;
+
+struct stream
+{
+   EP_KIND kind;
+   char name[32];
+   int idx;                             /// position in streams[], source of its event log records
+   STREAM_MODE mode;
+   STREAM_MODE viewer_mode;
+   struct sockaddr_in src;
+   int fd;
+   bool bConnecting;
+   int64_t reconnect_at_us;
+   int64_t idr_requested_us;
+
+   //receive/parse state
+   uint8_t* rbuf;
+   size_t rlen, rcap, scan_pos;
+   bool bAuHasVcl;                      /// raw_tcp: current access unit already has a slice
+   bool bConfigSeen;                    /// android_motion: first message has no type byte
+   uint8_t* parts;                      /// android -slices: the frame so far, it goes on as a whole
+   size_t parts_len, parts_cap;
+   uint16_t rtp_seq;
+   bool bRtpSeqValid, bRtpBroken;
+
+   FRAME* config;                 /// last SPS/PPS seen
+   FRAME* ring[RING_SIZE];
+   uint64_t ring_wr;
+   uint64_t last_idr_seq;               /// UINT64_MAX if no IDR in the ring
+
+   int listen_fd;
+   LISTEN_TAG listen_tag;
+   viewer* viewers;
+   int viewers_cnt;
+
+   recorder rec;
+
+   //synthetic generator
+   int64_t next_frame_us;
+   unsigned synth_cnt;
+
+   //stats since the last print
+   uint64_t frames_in, bytes_in, viewer_drops;
+};
+
+static stream* streams[MAX_STREAMS];
+static viewer* dead_viewers = NULL;       /// closed during this epoll batch, freed after it
+static int streams_cnt = 0;
+static int epfd = -1;
+static bool bVerbose = false;
+static const char* rec_dir = NULL;
+static EVLOG* evlog = NULL;              /// -e, NULL if not logging
+static const char* tls_cert = NULL;      /// -c/-k, playback over TLS
+static const char* tls_key = NULL;
+static int rec_segment_sec = 600;
+static bool bRecHash = false;            /// -H
+static bool bRecSeal = false;            /// -K
+static uint8_t rec_seal_key[32];
+static int rec_seal_sec = 60;
+static int synth_fps = 30, synth_gop = 30, synth_bitrate = 2000000;
+static FRAME_POOL frame_pool;            /// -m, shared by all streams
+static bool bFramePool = false;
+
+static int64_t
+now_us (void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* wall clock time of a CLOCK_MONOTONIC time stamp */
+static int64_t
+mono_to_wall_us (int64_t mono_us)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_REALTIME, &ts);
+   return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000 - (now_us() - mono_us);
+}
+
+/*************************************** frames ***************************************/
+
+/* a frame with a copy of p (NULL: written later), from the slab while it has room */
+static FRAME*
+frame_new (const uint8_t* p, uint32_t len, uint8_t flags)
+{
+   FRAME* f = frame_alloc(bFramePool ? &frame_pool : NULL, len);
+   if (!f)
+   {
+      fprintf(stderr, "out of memory\n");
+      exit(__LINE__);
+   }
+   if (p)
+      frame_write(f, 0, p, len);
+   f->flags = flags;
+   f->ts_us = now_us();
+   return f;
+}
+
+/*************************************** thread pool ***************************************/
+
+typedef struct
+{
+   void (*fn)(void*);
+   void* arg;
+} POOL_JOB;
+
+static struct
+{
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   POOL_JOB q[POOL_QUEUE];
+   unsigned rd, wr;
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void*
+pool_worker (void* unused)
+{
+   for (;;)
+   {
+      pthread_mutex_lock(&pool.lock);
+      while (pool.rd == pool.wr)
+         pthread_cond_wait(&pool.cond, &pool.lock);
+      POOL_JOB job = pool.q[pool.rd++ % POOL_QUEUE];
+      pthread_mutex_unlock(&pool.lock);
+      job.fn(job.arg);
+   }
+   return NULL;
+}
+
+static void
+pool_start (int threads)
+{
+   int i;
+   for (i = 0; i < threads; i++)
+   {
+      pthread_t th;
+      if (0 != pthread_create(&th, NULL, pool_worker, NULL))
+      {
+         fprintf(stderr, "pthread_create failed\n");
+         exit(__LINE__);
+      }
+      pthread_detach(th);
+   }
+}
+
+static bool
+pool_submit (void (*fn)(void*), void* arg)
+{
+   bool bOk = false;
+   pthread_mutex_lock(&pool.lock);
+   if (pool.wr - pool.rd < POOL_QUEUE)
+   {
+      pool.q[pool.wr++ % POOL_QUEUE] = (POOL_JOB){fn, arg};
+      pthread_cond_signal(&pool.cond);
+      bOk = true;
+   }
+   pthread_mutex_unlock(&pool.lock);
+   return bOk;
+}
+
+/*************************************** recorder ***************************************/
+
+/* -H: the GOP written so far goes into the chain, bSeal adds a seal after it (with -K) */
+static void
+rec_hash_gop_end (stream* st, bool bSeal)
+{
+   recorder* r = &st->rec;
+   REC_HASH_RECORD rec;
+   bool bOk;
+
+   if (!rec_hash_end(&r->hash, &rec) || !r->hsh_fp)
+      return;
+   bOk = rec_hash_append(r->hsh_fp, &rec);
+   if (bOk && bRecSeal && (bSeal || (now_us() - r->sealed_us >= (int64_t) rec_seal_sec * 1000000)))
+   {
+      rec.type = REC_HASH_SEAL;
+      rec.offset += rec.len;
+      rec.len = 0;
+      rec.time_us = mono_to_wall_us(now_us());
+      rec_hash_seal(rec_seal_key, r->hash.link, rec.offset, rec.time_us, rec.hash);
+      r->sealed_us = now_us();
+      bOk = rec_hash_append(r->hsh_fp, &rec);
+   }
+   if (bOk)
+      return;
+   fprintf(stderr, "%s: hash write error %s, the rest of the segment is not covered\n", st->name, strerror(errno));
+   fclose(r->hsh_fp);
+   r->hsh_fp = NULL;
+}
+
+/* -H after a restart: the chain goes on from the newest .hsh of the stream */
+static void
+rec_hash_resume (stream* st)
+{
+   recorder* r = &st->rec;
+   char last[256] = "", path[PATH_MAX];
+   uint8_t link[32];
+   size_t nl = strlen(st->name);
+   struct dirent* d;
+   DIR* dir;
+
+   r->bChained = true;
+   rec_hash_init(&r->hash, NULL);
+   if (NULL == (dir = opendir(rec_dir)))
+      return;
+   //name-YYYYmmdd-HHMMSS.hsh, the time stamp sorts chronologically
+   while ((d = readdir(dir)))
+      if ((strlen(d->d_name) == nl + 20) && !strncmp(d->d_name, st->name, nl) && ('-' == d->d_name[nl]) &&
+          !strcmp(d->d_name + nl + 16, ".hsh") && (strcmp(d->d_name, last) > 0))
+         strcpy(last, d->d_name);
+   closedir(dir);
+   if (!last[0])
+      return;
+   snprintf(path, sizeof(path), "%s/%s", rec_dir, last);
+   if (!rec_hash_last_link(path, link))
+   {
+      fprintf(stderr, "%s: %s is no hash file, starting a new chain\n", st->name, path);
+      return;
+   }
+   rec_hash_init(&r->hash, link);
+   snprintf(r->segment_name, sizeof(r->segment_name), "%.*s.h264", (int) nl + 16, last);
+}
+
+static void
+rec_open_segment (stream* st)
+{
+   recorder* r = &st->rec;
+   char path[PATH_MAX], stamp[32];
+   time_t t = time(NULL);
+   struct tm tm;
+
+   rec_hash_gop_end(st, true);
+   if (r->hsh_fp)
+      fclose(r->hsh_fp);
+   r->hsh_fp = NULL;
+   if (r->fp)
+      fclose(r->fp);
+   if (r->idx_fp)
+      fclose(r->idx_fp);
+   r->idx_fp = NULL;
+   r->offset = 0;
+   strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime_r(&t, &tm));
+   snprintf(path, sizeof(path), "%s/%s-%s.h264", rec_dir, st->name, stamp);
+   if (NULL == (r->fp = fopen(path, "wb")))
+      fprintf(stderr, "%s: can't open %s: %s\n", st->name, path, strerror(errno));
+   else
+   {
+      if (bVerbose)
+         fprintf(stderr, "%s: recording to %s\n", st->name, path);
+      strcpy(path + strlen(path) - 5, ".idx");
+      if (NULL == (r->idx_fp = fopen(path, "wb")))
+         fprintf(stderr, "%s: can't open %s: %s\n", st->name, path, strerror(errno));
+      if (bRecHash)
+      {
+         if (!r->bChained)
+            rec_hash_resume(st);
+         strcpy(path + strlen(path) - 4, ".hsh");
+         if ((NULL == (r->hsh_fp = fopen(path, "wb"))) || !rec_hash_write_header(r->hsh_fp, r->hash.link, r->segment_name))
+         {
+            fprintf(stderr, "%s: can't write %s: %s\n", st->name, path, strerror(errno));
+            if (r->hsh_fp)
+               fclose(r->hsh_fp);
+            r->hsh_fp = NULL;
+         }
+         snprintf(r->segment_name, sizeof(r->segment_name), "%s-%s.h264", st->name, stamp);
+      }
+   }
+   r->segment_start_us = now_us();
+}
+
+static void
+rec_write (stream* st, const FRAME* f)
+{
+   recorder* r = &st->rec;
+   int i;
+
+   for (i = 0; i < f->nfrags; i++)
+   {
+      const FRAME_FRAG* fr = &f->frag[i];
+      if (fr->len != fwrite(fr->data, 1, fr->len, r->fp))
+      {
+         fprintf(stderr, "%s: write error %s, recording stopped until the next IDR\n", st->name, strerror(errno));
+         fclose(r->fp);
+         r->fp = NULL;
+         //what made it to the file before is still covered
+         rec_hash_gop_end(st, true);
+         return;
+      }
+      rec_hash_update(&r->hash, fr->data, fr->len);
+      r->offset += fr->len;
+   }
+}
+
+/* pool job, drains the recorder queue of one stream, only one worker per stream at a time */
+static void
+rec_drain (void* arg)
+{
+   stream* st = arg;
+   recorder* r = &st->rec;
+
+   for (;;)
+   {
+      pthread_mutex_lock(&r->lock);
+      if (r->rd == r->wr)
+      {
+         r->bScheduled = false;
+         pthread_mutex_unlock(&r->lock);
+         if (r->fp)
+            fflush(r->fp);
+         return;
+      }
+      FRAME* f = r->q[r->rd++ % REC_QUEUE];
+      pthread_mutex_unlock(&r->lock);
+
+      if (f->flags & FRAME_FLAG_CONFIG)
+      {
+         frame_unref(r->config);
+         r->config = frame_ref(f);
+      }
+      else if (f->flags & FRAME_FLAG_IDR)
+      {
+         //segments start at an IDR
+         if ((!r->fp) || (f->ts_us - r->segment_start_us >= (int64_t) rec_segment_sec * 1000000))
+            rec_open_segment(st);
+         else
+            rec_hash_gop_end(st, false);
+         //every indexed IDR has SPS/PPS in front of it, so playback can start at any of them
+         if (r->fp)
+         {
+            uint64_t idr_offset = r->offset;
+            if (r->hsh_fp)
+               rec_hash_begin(&r->hash, idr_offset, mono_to_wall_us(f->ts_us));
+            if (r->config && !(f->flags & FRAME_FLAG_SPS))
+               rec_write(st, r->config);
+            if (r->fp && r->idx_fp)
+            {
+               //the data has to be on disk before the index points to it
+               fflush(r->fp);
+               if (!rec_index_append(r->idx_fp, mono_to_wall_us(f->ts_us), idr_offset))
+               {
+                  fprintf(stderr, "%s: index write error %s\n", st->name, strerror(errno));
+                  fclose(r->idx_fp);
+                  r->idx_fp = NULL;
+               }
+            }
+         }
+      }
+
+      if (r->fp && !(f->flags & FRAME_FLAG_CONFIG))
+         rec_write(st, f);
+      frame_unref(f);
+   }
+}
+
+static void
+rec_push (stream* st, FRAME* f)
+{
+   recorder* r = &st->rec;
+   bool bSchedule = false;
+
+   if (!rec_dir || (f->flags & (FRAME_FLAG_MOTION | FRAME_FLAG_ALARM)))
+      return;
+
+   pthread_mutex_lock(&r->lock);
+   if (r->wr - r->rd < REC_QUEUE)
+   {
+      r->q[r->wr++ % REC_QUEUE] = frame_ref(f);
+      if (!r->bScheduled)
+         bSchedule = r->bScheduled = true;
+      r->bDropping = false;
+   }
+   else
+   {
+      r->ulDropped++;
+      if (!r->bDropping)
+         evlog_add(evlog, EVLOG_REC_DROP, st->idx, r->ulDropped, 0);
+      r->bDropping = true;
+   }
+   pthread_mutex_unlock(&r->lock);
+
+   if (bSchedule && !pool_submit(rec_drain, st))
+   {
+      pthread_mutex_lock(&r->lock);
+      r->bScheduled = false;
+      pthread_mutex_unlock(&r->lock);
+   }
+}
+
+/*************************************** viewers ***************************************/
+
+static void
+ep_mod (int fd, void* ptr, uint32_t events)
+{
+   struct epoll_event ev = { .events = events, .data.ptr = ptr };
+   if (0 != epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev))
+      fprintf(stderr, "epoll_ctl mod: %s\n", strerror(errno));
+}
+
+static void
+ep_add (int fd, void* ptr, uint32_t events)
+{
+   struct epoll_event ev = { .events = events, .data.ptr = ptr };
+   if (0 != epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev))
+   {
+      fprintf(stderr, "epoll_ctl add: %s\n", strerror(errno));
+      exit(__LINE__);
+   }
+}
+
+static void
+viewer_clear_queue (viewer* v, bool bKeepPartial)
+{
+   //a frame that is already half way on the wire has to be finished or the stream is corrupt
+   unsigned keep = (bKeepPartial && v->q_off && (v->q_rd != v->q_wr)) ? 1 : 0;
+   while (v->q_wr - v->q_rd > keep)
+   {
+      VQ_ENTRY* e = &v->q[--v->q_wr % VIEWER_QUEUE];
+      v->q_bytes -= e->hdr_len + e->f->len;
+      frame_unref(e->f);
+   }
+   if (!keep)
+      v->q_off = 0;
+}
+
+static void
+viewer_close (viewer* v)
+{
+   stream* st = v->st;
+   viewer** pp;
+   for (pp = &st->viewers; *pp; pp = &(*pp)->next)
+   {
+      if (*pp == v)
+      {
+         *pp = v->next;
+         break;
+      }
+   }
+   st->viewers_cnt--;
+   if (bVerbose)
+      fprintf(stderr, "%s: viewer left, %d viewers\n", st->name, st->viewers_cnt);
+   viewer_clear_queue(v, false);
+   close(v->fd);
+   //other events of this epoll batch may still point to it
+   v->fd = -1;
+   v->next = dead_viewers;
+   dead_viewers = v;
+}
+
+/* write as much of the queue as the socket takes, returns false if the viewer is gone */
+static bool
+viewer_flush (viewer* v)
+{
+   while (v->q_rd != v->q_wr)
+   {
+      struct iovec iov[IOV_BATCH * 2 + FRAME_MAX_FRAGS];
+      int n = 0;
+      unsigned i;
+      size_t skip = v->q_off;
+
+      for (i = v->q_rd; (i != v->q_wr) && (n < IOV_BATCH * 2); i++)
+      {
+         VQ_ENTRY* e = &v->q[i % VIEWER_QUEUE];
+         if (e->hdr_len)
+            iov[n++] = (struct iovec){ e->hdr, e->hdr_len };
+         n += frame_iov(e->f, iov + n, FRAME_MAX_FRAGS);
+      }
+      //skip what was already written of the first entry
+      for (i = 0; skip; i++)
+      {
+         size_t s = (skip < iov[i].iov_len) ? skip : iov[i].iov_len;
+         iov[i].iov_base = (uint8_t*) iov[i].iov_base + s;
+         iov[i].iov_len -= s;
+         skip -= s;
+      }
+
+      ssize_t w = writev(v->fd, iov, n);
+      if (w < 0)
+      {
+         if ((EAGAIN == errno) || (EWOULDBLOCK == errno))
+         {
+            if (!v->bWantOut)
+            {
+               v->bWantOut = true;
+               ep_mod(v->fd, v, EPOLLIN | EPOLLOUT);
+            }
+            return true;
+         }
+         if (EINTR == errno)
+            continue;
+         return false;
+      }
+
+      size_t done = v->q_off + w;
+      while (v->q_rd != v->q_wr)
+      {
+         VQ_ENTRY* e = &v->q[v->q_rd % VIEWER_QUEUE];
+         size_t l = e->hdr_len + e->f->len;
+         if (done < l)
+            break;
+         done -= l;
+         v->q_bytes -= l;
+         frame_unref(e->f);
+         v->q_rd++;
+      }
+      v->q_off = done;
+   }
+
+   if (v->bWantOut)
+   {
+      v->bWantOut = false;
+      ep_mod(v->fd, v, EPOLLIN);
+   }
+   return true;
+}
+
+/* queue one frame for a viewer using the viewer's framing, false if the queue is full */
+static bool
+viewer_enqueue (viewer* v, FRAME* f)
+{
+   VQ_ENTRY e = { .f = f, .hdr_len = 0 };
+
+   switch (v->st->viewer_mode)
+   {
+      case MODE_ANDROID:
+         if (f->flags & (FRAME_FLAG_MOTION | FRAME_FLAG_ALARM))
+            return true;
+         memcpy(e.hdr, &f->len, 4);
+         e.hdr_len = 4;
+         break;
+      case MODE_ANDROID_MOTION:
+         if (f->flags & FRAME_FLAG_MOTION)
+            e.hdr[e.hdr_len++] = MotionInFrame;
+         else if (f->flags & FRAME_FLAG_ALARM)
+            e.hdr[e.hdr_len++] = MotionAlarm;
+         else
+         {
+            //raspivid sends the first SPS/PPS without a type byte, everything after it is typed
+            if (v->bConfigSent)
+               e.hdr[e.hdr_len++] = RegularFrame;
+            memcpy(e.hdr + e.hdr_len, &f->len, 4);
+            e.hdr_len += 4;
+            v->bConfigSent = true;
+         }
+         break;
+      default:
+         if (f->flags & (FRAME_FLAG_MOTION | FRAME_FLAG_ALARM))
+            return true;
+         break;
+   }
+
+   if ((v->q_wr - v->q_rd >= VIEWER_QUEUE) || (v->q_bytes + f->len > VIEWER_QUEUE_BYTES))
+      return false;
+   e.f = frame_ref(f);
+   v->q[v->q_wr++ % VIEWER_QUEUE] = e;
+   v->q_bytes += e.hdr_len + f->len;
+   return true;
+}
+
+static void
+stream_request_idr (stream* st)
+{
+   int64_t now = now_us();
+   if ((st->mode != MODE_RAW_TCP) && (st->mode != MODE_ANDROID) && (st->mode != MODE_ANDROID_MOTION))
+      return;
+   if ((st->fd < 0) || st->bConnecting || (now - st->idr_requested_us < 1000000))
+      return;
+   st->idr_requested_us = now;
+   //raspivid reads its commands from the same TCP connection
+   if (6 != send(st->fd, "idr=1\n", 6, MSG_NOSIGNAL | MSG_DONTWAIT))
+      fprintf(stderr, "%s: could not request an IDR\n", st->name);
+}
+
+static void
+viewer_accept (stream* st)
+{
+   struct sockaddr_in cli_addr;
+   socklen_t clilen = sizeof(cli_addr);
+   int fd = accept4(st->listen_fd, (struct sockaddr *) &cli_addr, &clilen, SOCK_NONBLOCK);
+   if (fd < 0)
+   {
+      if ((EAGAIN != errno) && (EINTR != errno))
+         fprintf(stderr, "%s: Error on accept: %s\n", st->name, strerror(errno));
+      return;
+   }
+
+   viewer* v = calloc(1, sizeof(viewer));
+   if (!v)
+   {
+      close(fd);
+      return;
+   }
+   v->kind = EP_VIEWER;
+   v->fd = fd;
+   v->st = st;
+   v->next = st->viewers;
+   st->viewers = v;
+   st->viewers_cnt++;
+   ep_add(fd, v, EPOLLIN);
+   fprintf(stderr, "%s: viewer connected from %s:%"SCNu16", %d viewers\n",
+           st->name, inet_ntoa(cli_addr.sin_addr), ntohs(cli_addr.sin_port), st->viewers_cnt);
+
+   //start the new viewer at the last IDR in the ring
+   if ((st->last_idr_seq != UINT64_MAX) && (st->ring_wr - st->last_idr_seq <= RING_SIZE))
+   {
+      uint64_t s;
+      bool bOk = true;
+      FRAME* idr = st->ring[st->last_idr_seq % RING_SIZE];
+      if (st->config && !(idr->flags & FRAME_FLAG_SPS))
+         bOk = viewer_enqueue(v, st->config);
+      for (s = st->last_idr_seq; bOk && (s < st->ring_wr); s++)
+         bOk = viewer_enqueue(v, st->ring[s % RING_SIZE]);
+      if (!bOk)
+      {
+         viewer_clear_queue(v, false);
+         v->bNeedIDR = true;
+         stream_request_idr(st);
+      }
+      else if (!viewer_flush(v))
+         viewer_close(v);
+   }
+   else
+   {
+      v->bNeedIDR = true;
+      stream_request_idr(st);
+   }
+}
+
+static void
+viewer_on_event (viewer* v, uint32_t events)
+{
+   if (events & (EPOLLERR | EPOLLHUP))
+   {
+      viewer_close(v);
+      return;
+   }
+   if (events & EPOLLIN)
+   {
+      //viewers have nothing to say to us, only detect the close
+      char buf[256];
+      ssize_t r = recv(v->fd, buf, sizeof(buf), 0);
+      if ((0 == r) || ((r < 0) && (EAGAIN != errno) && (EINTR != errno)))
+      {
+         viewer_close(v);
+         return;
+      }
+   }
+   if (events & EPOLLOUT)
+   {
+      if (!viewer_flush(v))
+         viewer_close(v);
+   }
+}
+
+/*************************************** playback ***************************************/
+
+/* "14:03:12" (today, or yesterday if that is still to come) or "20261017-140312" */
+static bool
+parse_play_time (const char* str, time_t* t)
+{
+   struct tm tm;
+   time_t now = time(NULL);
+   int Y, M, D, h, m, s;
+
+   localtime_r(&now, &tm);
+   if (6 == sscanf(str, "%4d%2d%2d-%2d%2d%2d", &Y, &M, &D, &h, &m, &s))
+   {
+      tm.tm_year = Y - 1900;
+      tm.tm_mon = M - 1;
+      tm.tm_mday = D;
+   }
+   else if (3 != sscanf(str, "%d:%d:%d", &h, &m, &s))
+      return false;
+   tm.tm_hour = h;
+   tm.tm_min = m;
+   tm.tm_sec = s;
+   tm.tm_isdst = -1;
+   *t = mktime(&tm);
+   if ((*t > now) && (6 != sscanf(str, "%4d%2d%2d-%2d%2d%2d", &Y, &M, &D, &h, &m, &s)))
+   {
+      tm.tm_mday--;
+      tm.tm_isdst = -1;
+      *t = mktime(&tm);
+   }
+   return true;
+}
+
+static const char* play_filter_name;     /// scandir has no user pointer for the filter
+static pthread_mutex_t play_filter_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* segments of one stream: name-YYYYmmdd-HHMMSS.h264 */
+static int
+play_filter (const struct dirent* d)
+{
+   size_t nl = strlen(play_filter_name), l = strlen(d->d_name);
+   return (l == nl + 21) && !strncmp(d->d_name, play_filter_name, nl) && ('-' == d->d_name[nl]) &&
+          !strcmp(d->d_name + l - 5, ".h264");
+}
+
+static bool
+send_segment (RPI_TLS* t, const char* path, uint64_t offset)
+{
+   struct stat st;
+   int in = open(path, O_RDONLY);
+   bool bOk = true;
+   off_t off = offset;
+
+   if (in < 0)
+      return true; //deleted meanwhile, go on with the next one
+   //the file may still be growing if it is the segment being recorded
+   while (bOk && (0 == fstat(in, &st)) && (off < st.st_size))
+   {
+      ssize_t w = rpi_tls_sendfile(t, in, &off, st.st_size - off);
+      if (w <= 0)
+      {
+         if ((w < 0) && (EINTR == errno))
+            continue;
+         bOk = false;
+      }
+   }
+   close(in);
+   return bOk;
+}
+
+/* one thread per playback client, it does nothing but blocking sendfile */
+static void*
+playback_thread (void* arg)
+{
+   int fd = (intptr_t) arg;
+   RPI_TLS tls = { fd };
+   char line[128], name[64], when[32], path[PATH_MAX];
+   size_t len = 0;
+   struct timeval timeout = { 5, 0 };
+   struct dirent** list = NULL;
+   int i, n = 0, first = -1;
+   time_t t;
+
+   setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char *) &timeout, sizeof(timeout));
+   if (tls_cert && !rpi_tls_accept(&tls, fd, tls_cert, tls_key, bVerbose))
+      goto out;
+   while (len < sizeof(line) - 1)
+   {
+      ssize_t r = rpi_tls_recv(&tls, line + len, 1);
+      if (r <= 0)
+         goto out;
+      if ('\n' == line[len])
+         break;
+      len++;
+   }
+   line[len] = 0;
+
+   if ((2 != sscanf(line, "play=%63[^,],%31s", name, when)) || !parse_play_time(when, &t))
+   {
+      fprintf(stderr, "playback: bad request '%s', use play=<stream>,<HH:MM:SS>\n", line);
+      goto out;
+   }
+
+   //scandir sorts by name, with the time stamp in the name that is chronological
+   pthread_mutex_lock(&play_filter_lock);
+   play_filter_name = name;
+   n = scandir(rec_dir, &list, play_filter, alphasort);
+   pthread_mutex_unlock(&play_filter_lock);
+   for (i = 0; i < n; i++)
+   {
+      struct tm tm = {};
+      const char* stamp = list[i]->d_name + strlen(name) + 1;
+      if (6 != sscanf(stamp, "%4d%2d%2d-%2d%2d%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec))
+         continue;
+      tm.tm_year -= 1900;
+      tm.tm_mon -= 1;
+      tm.tm_isdst = -1;
+      if ((mktime(&tm) <= t) || (first < 0))
+         first = i;
+      if (mktime(&tm) > t)
+         break;
+   }
+   if (first < 0)
+   {
+      fprintf(stderr, "playback: no recordings of %s\n", name);
+      goto out;
+   }
+
+   for (i = first; i < n; i++)
+   {
+      uint64_t offset = 0;
+      snprintf(path, sizeof(path), "%s/%s", rec_dir, list[i]->d_name);
+      if (i == first)
+      {
+         char idx[PATH_MAX];
+         snprintf(idx, sizeof(idx), "%s", path);
+         strcpy(idx + strlen(idx) - 5, ".idx");
+         if (!rec_index_lookup(idx, (int64_t) t * 1000000, &offset))
+            fprintf(stderr, "playback: no index %s, starting at the segment start\n", idx);
+         if (bVerbose)
+            fprintf(stderr, "playback: %s from %s offset %"PRIu64"\n", name, list[i]->d_name, offset);
+      }
+      if (!send_segment(&tls, path, offset))
+         break;
+   }
+
+out:
+   for (i = 0; i < n; i++)
+      free(list[i]);
+   free(list);
+   rpi_tls_close(&tls);
+   close(fd);
+   return NULL;
+}
+
+static void
+playback_accept (int listen_fd)
+{
+   pthread_t th;
+   int fd = accept(listen_fd, NULL, NULL);
+   if (fd < 0)
+      return;
+   if (0 != pthread_create(&th, NULL, playback_thread, (void*) (intptr_t) fd))
+   {
+      close(fd);
+      return;
+   }
+   pthread_detach(th);
+}
+
+/*************************************** streams ***************************************/
+
+/* copy the SPS/PPS NAL units of an access unit into a new config frame, NULL if there are none */
+static FRAME*
+extract_config (const uint8_t* p, size_t len)
+{
+   const uint8_t* end = p + len;
+   const uint8_t* sc;
+   FRAME* cfg = NULL;
+   size_t cfg_len = 0, off = 0;
+   int pass;
+
+   //first pass sizes, second pass copies with 4 byte start codes
+   for (pass = 0; pass < 2; pass++)
+   {
+      sc = h264_find_start_code(p, end);
+      while (sc + 3 < end)
+      {
+         const uint8_t* next = h264_find_start_code(sc + 3, end);
+         int type = NAL_TYPE(sc[3]);
+         if ((NAL_TYPE_SPS == type) || (NAL_TYPE_PPS == type))
+         {
+            size_t l = next - sc;
+            while ((l > 4) && (0 == sc[l - 1]))
+               l--; //leading zero of the next 4 byte start code
+            if (!cfg)
+               cfg_len += 1 + l;
+            else
+            {
+               frame_write(cfg, off, "", 1);
+               frame_write(cfg, off + 1, sc, l);
+               off += 1 + l;
+            }
+         }
+         sc = next;
+      }
+      if (!cfg_len)
+         return NULL;
+      if (!cfg)
+         cfg = frame_new(NULL, cfg_len, FRAME_FLAG_CONFIG | FRAME_FLAG_SPS);
+   }
+   return cfg;
+}
+
+static void
+stream_on_frame (stream* st, FRAME* f)
+{
+   viewer* v, *next;
+
+   if (!(f->flags & (FRAME_FLAG_MOTION | FRAME_FLAG_ALARM)))
+   {
+      if (!(f->flags & FRAME_FLAG_CONFIG))
+      {
+         frame_unref(st->ring[st->ring_wr % RING_SIZE]);
+         st->ring[st->ring_wr % RING_SIZE] = frame_ref(f);
+         if (f->flags & FRAME_FLAG_IDR)
+            st->last_idr_seq = st->ring_wr;
+         st->ring_wr++;
+      }
+      st->frames_in++;
+      st->bytes_in += f->len;
+   }
+
+   for (v = st->viewers; v; v = next)
+   {
+      next = v->next;
+      if (v->bNeedIDR)
+      {
+         if (!(f->flags & FRAME_FLAG_IDR))
+            continue;
+         if (st->config && !(f->flags & FRAME_FLAG_SPS))
+            viewer_enqueue(v, st->config);
+         v->bNeedIDR = false;
+      }
+      if (!viewer_enqueue(v, f))
+      {
+         //slow viewer, throw away what is queued and restart it at the next IDR
+         viewer_clear_queue(v, true);
+         v->bNeedIDR = true;
+         v->ulDropped++;
+         st->viewer_drops++;
+         evlog_add(evlog, EVLOG_VIEWER_DROP, st->idx, v->ulDropped, 0);
+         stream_request_idr(st);
+         continue;
+      }
+      if (!v->bWantOut && !viewer_flush(v))
+         viewer_close(v);
+   }
+
+   if (!(f->flags & FRAME_FLAG_CONFIG))
+      rec_push(st, f);
+   frame_unref(f);
+}
+
+/* the NAL units are looked at here, in one piece, the frame may be in slab blocks */
+static void
+stream_emit (stream* st, const uint8_t* p, size_t len, uint8_t flags)
+{
+   if (!(flags & (FRAME_FLAG_MOTION | FRAME_FLAG_ALARM)))
+   {
+      bool bVcl = h264_has_nal_type(p, len, NAL_TYPE_SLICE);
+      if (h264_has_nal_type(p, len, NAL_TYPE_IDR))
+         flags |= FRAME_FLAG_IDR;
+      bVcl |= !!(flags & FRAME_FLAG_IDR);
+
+      if (h264_has_nal_type(p, len, NAL_TYPE_SPS))
+      {
+         FRAME* cfg = extract_config(p, len);
+         flags |= FRAME_FLAG_SPS;
+         if (cfg)
+         {
+            frame_unref(st->config);
+            st->config = cfg;
+            rec_push(st, cfg);
+         }
+      }
+      if (!bVcl)
+         flags |= FRAME_FLAG_CONFIG;
+   }
+   stream_on_frame(st, frame_new(p, len, flags));
+}
+
+static void
+stream_disconnect (stream* st)
+{
+   if (st->fd >= 0)
+      close(st->fd);
+   st->fd = -1;
+   st->bConnecting = false;
+   st->rlen = st->scan_pos = st->parts_len = 0;
+   st->bAuHasVcl = st->bConfigSeen = false;
+   st->reconnect_at_us = now_us() + 1000000;
+}
+
+static void
+stream_connect (stream* st)
+{
+   if (MODE_RTP == st->mode)
+   {
+      int iTmp = 1;
+      st->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+      if (st->fd < 0)
+      {
+         fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
+         exit(__LINE__);
+      }
+      setsockopt(st->fd, SOL_SOCKET, SO_REUSEADDR, &iTmp, sizeof(int));
+      if (bind(st->fd, (struct sockaddr *) &st->src, sizeof(st->src)) < 0)
+      {
+         fprintf(stderr, "%s: Error on binding socket: %s\n", st->name, strerror(errno));
+         exit(__LINE__);
+      }
+      ep_add(st->fd, st, EPOLLIN);
+      return;
+   }
+
+   if (bVerbose)
+      fprintf(stderr, "%s: connecting to %s:%hu\n", st->name, inet_ntoa(st->src.sin_addr), ntohs(st->src.sin_port));
+   if ((st->fd = StartConnect(&st->src, SOCK_STREAM)) < 0)
+   {
+      st->reconnect_at_us = now_us() + 1000000;
+      return;
+   }
+   st->bConnecting = true;
+   ep_add(st->fd, st, EPOLLOUT);
+}
+
+static bool
+rbuf_reserve (stream* st, size_t need)
+{
+   if (st->rcap - st->rlen >= need)
+      return true;
+   size_t cap = st->rcap ? st->rcap : 65536;
+   while (cap - st->rlen < need)
+      cap *= 2;
+   if (cap > MAX_FRAME_LEN * 2)
+      return false;
+   uint8_t* p = realloc(st->rbuf, cap);
+   if (!p)
+      return false;
+   st->rbuf = p;
+   st->rcap = cap;
+   return true;
+}
+
+static void
+rbuf_consume (stream* st, size_t len)
+{
+   memmove(st->rbuf, st->rbuf + len, st->rlen - len);
+   st->rlen -= len;
+}
+
+/*
+ * raw_tcp: Annex-B byte stream, cut into access units. An access unit is only
+ * complete when the first NAL of the next one shows up, so raw_tcp ingest
+ * costs one frame of latency, android ingest does not.
+ */
+static void
+parse_raw (stream* st)
+{
+   for (;;)
+   {
+      const uint8_t* end = st->rbuf + st->rlen;
+      const uint8_t* sc = h264_find_start_code(st->rbuf + st->scan_pos, end);
+      if (sc + 4 >= end)
+      {
+         st->scan_pos = (st->rlen > 4) ? st->rlen - 4 : 0;
+         return;
+      }
+
+      int type = NAL_TYPE(sc[3]);
+      if (NAL_TYPE_FILLER == type)
+      {
+         //bandwidth probe of raspivid -probe, neither kept nor forwarded, cut out once complete
+         const uint8_t* next = h264_find_start_code(sc + 3, end);
+         size_t from = sc - st->rbuf, to;
+         if (next + 4 >= end)
+         {
+            st->scan_pos = from;
+            return;
+         }
+         if (from && (0 == sc[-1]))
+            from--;
+         to = next - st->rbuf;
+         if (0 == next[-1])
+            to--;
+         memmove(st->rbuf + from, st->rbuf + to, st->rlen - to);
+         st->rlen -= to - from;
+         st->scan_pos = from;
+         continue;
+      }
+      bool bVcl = (NAL_TYPE_SLICE == type) || (NAL_TYPE_IDR == type);
+      //new access unit: first slice of a picture (first_mb_in_slice == 0) or a non VCL NAL after slices
+      bool bBoundary = st->bAuHasVcl && ((bVcl && (sc[4] & 0x80)) ||
+                       (NAL_TYPE_AUD == type) || (NAL_TYPE_SEI == type) || (NAL_TYPE_SPS == type) || (NAL_TYPE_PPS == type));
+      if (bBoundary)
+      {
+         size_t au_len = sc - st->rbuf;
+         if (au_len && (0 == sc[-1]))
+            au_len--; //4 byte start code belongs to the next unit
+         stream_emit(st, st->rbuf, au_len, 0);
+         rbuf_consume(st, au_len);
+         st->scan_pos = 0;
+         st->bAuHasVcl = false;
+         continue;
+      }
+      if (bVcl)
+         st->bAuHasVcl = true;
+      st->scan_pos = sc + 3 - st->rbuf;
+   }
+}
+
+/* one part of an android -slices frame, false if the frame gets too big */
+static bool
+parts_append (stream* st, const uint8_t* p, size_t len)
+{
+   if (st->parts_len + len > MAX_FRAME_LEN)
+      return false;
+   if (st->parts_cap < st->parts_len + len)
+   {
+      size_t cap = st->parts_cap ? st->parts_cap : 65536;
+      uint8_t* n;
+
+      while (cap < st->parts_len + len)
+         cap *= 2;
+      if (!(n = realloc(st->parts, cap)))
+         return false;
+      st->parts = n;
+      st->parts_cap = cap;
+   }
+   memcpy(st->parts + st->parts_len, p, len);
+   st->parts_len += len;
+   return true;
+}
+
+/* android and android_motion framing as produced by raspivid, false on protocol error */
+static bool
+parse_android (stream* st)
+{
+   size_t pos = 0;
+   bool bOk = true;
+
+   while (bOk)
+   {
+      size_t avail = st->rlen - pos;
+      const uint8_t* p = st->rbuf + pos;
+      uint32_t len;
+
+      if ((MODE_ANDROID == st->mode) || !st->bConfigSeen)
+      {
+         bool bPart = false;
+
+         if (avail < 4)
+            break;
+         memcpy(&len, p, 4);
+         if (MODE_ANDROID == st->mode)
+         {
+            bPart = !!(len & ANDROID_LEN_SLICE);
+            len &= ~ANDROID_LEN_SLICE;
+         }
+         if (len > MAX_FRAME_LEN)
+            bOk = false;
+         else if (avail >= 4 + len)
+         {
+            //slices are put together, the ring, viewers and recordings keep whole frames
+            if (!bPart && !st->parts_len)
+               stream_emit(st, p + 4, len, 0);
+            else if (!parts_append(st, p + 4, len))
+               bOk = false;
+            else if (!bPart)
+            {
+               stream_emit(st, st->parts, st->parts_len, 0);
+               st->parts_len = 0;
+            }
+            pos += 4 + len;
+            st->bConfigSeen = true;
+         }
+         else
+            break;
+         continue;
+      }
+
+      if (avail < 1)
+         break;
+      switch (p[0])
+      {
+         case RegularFrame:
+            if (avail < 5)
+               goto out;
+            memcpy(&len, p + 1, 4);
+            if (len > MAX_FRAME_LEN)
+               bOk = false;
+            else if (avail < 5 + len)
+               goto out;
+            else
+            {
+               stream_emit(st, p + 5, len, 0);
+               pos += 5 + len;
+            }
+            break;
+         case MotionInFrame:
+            if (avail < 2)
+               goto out;
+            stream_emit(st, p + 1, 1, FRAME_FLAG_MOTION);
+            pos += 2;
+            break;
+         case MotionAlarm:
+            stream_emit(st, p, 0, FRAME_FLAG_ALARM);
+            pos += 1;
+            break;
+         default:
+            fprintf(stderr, "%s: unknown android data type %d\n", st->name, p[0]);
+            bOk = false;
+            break;
+      }
+   }
+out:
+   rbuf_consume(st, pos);
+   return bOk;
+}
+
+static void
+rtp_append (stream* st, const uint8_t* p, size_t len, bool bStartCode)
+{
+   if (!rbuf_reserve(st, len + 4))
+   {
+      st->bRtpBroken = true;
+      return;
+   }
+   if (bStartCode)
+   {
+      memcpy(st->rbuf + st->rlen, "\0\0\0\1", 4);
+      st->rlen += 4;
+   }
+   memcpy(st->rbuf + st->rlen, p, len);
+   st->rlen += len;
+}
+
+/* RFC 6184 depacketizer: single NAL, STAP-A and FU-A, the marker bit ends the access unit */
+static void
+rtp_on_packet (stream* st, const uint8_t* p, size_t len)
+{
+   if ((len < 13) || ((p[0] >> 6) != 2))
+      return;
+   size_t hlen = 12 + 4 * (p[0] & 0x0f);
+   if (p[0] & 0x10) //header extension
+   {
+      if (len < hlen + 4)
+         return;
+      hlen += 4 + 4 * ((p[hlen + 2] << 8) | p[hlen + 3]);
+   }
+   if (p[0] & 0x20) //padding
+      len -= p[len - 1];
+   if (len <= hlen)
+      return;
+
+   bool bMarker = p[1] & 0x80;
+   uint16_t seq = (p[2] << 8) | p[3];
+   if (st->bRtpSeqValid && (seq != (uint16_t) (st->rtp_seq + 1)))
+      st->bRtpBroken = true; //lost a packet, drop this access unit
+   st->rtp_seq = seq;
+   st->bRtpSeqValid = true;
+
+   const uint8_t* pl = p + hlen;
+   size_t pl_len = len - hlen;
+   int type = NAL_TYPE(pl[0]);
+
+   if ((type >= 1) && (type <= 23))
+      rtp_append(st, pl, pl_len, true);
+   else if (24 == type) //STAP-A
+   {
+      size_t off = 1;
+      while (off + 2 <= pl_len)
+      {
+         size_t nal_len = (pl[off] << 8) | pl[off + 1];
+         off += 2;
+         if (off + nal_len > pl_len)
+            break;
+         rtp_append(st, pl + off, nal_len, true);
+         off += nal_len;
+      }
+   }
+   else if ((28 == type) && (pl_len > 2)) //FU-A
+   {
+      if (pl[1] & 0x80)
+      {
+         uint8_t nal_hdr = (pl[0] & 0xe0) | (pl[1] & 0x1f);
+         rtp_append(st, &nal_hdr, 1, true);
+      }
+      rtp_append(st, pl + 2, pl_len - 2, false);
+   }
+
+   if (bMarker)
+   {
+      if (!st->bRtpBroken && st->rlen)
+         stream_emit(st, st->rbuf, st->rlen, 0);
+      st->rlen = 0;
+      st->bRtpBroken = false;
+   }
+}
+
+static void
+stream_on_event (stream* st, uint32_t events)
+{
+   if (st->bConnecting)
+   {
+      int so_error = 0;
+      socklen_t len = sizeof(so_error);
+      getsockopt(st->fd, SOL_SOCKET, SO_ERROR, &so_error, &len);
+      if (so_error)
+      {
+         if (bVerbose)
+            fprintf(stderr, "%s: %s\n", st->name, strerror(so_error));
+         stream_disconnect(st);
+         return;
+      }
+      fprintf(stderr, "%s: connected to %s:%hu, receiving %s\n", st->name,
+              inet_ntoa(st->src.sin_addr), ntohs(st->src.sin_port), mode_names[st->mode]);
+      evlog_add(evlog, EVLOG_CONNECT, st->idx, 0, (uint64_t) ntohl(st->src.sin_addr.s_addr) << 16 | ntohs(st->src.sin_port));
+      st->bConnecting = false;
+      ep_mod(st->fd, st, EPOLLIN);
+      return;
+   }
+
+   if (MODE_RTP == st->mode)
+   {
+      uint8_t pkt[RTP_MAX_PACKET];
+      ssize_t r;
+      while ((r = recv(st->fd, pkt, sizeof(pkt), 0)) > 0)
+         rtp_on_packet(st, pkt, r);
+      return;
+   }
+
+   for (;;)
+   {
+      if (!rbuf_reserve(st, 65536))
+      {
+         fprintf(stderr, "%s: receive buffer overflow\n", st->name);
+         evlog_add(evlog, EVLOG_DISCONNECT, st->idx, 0, (uint64_t) ntohl(st->src.sin_addr.s_addr) << 16 | ntohs(st->src.sin_port));
+         stream_disconnect(st);
+         return;
+      }
+      ssize_t r = recv(st->fd, st->rbuf + st->rlen, st->rcap - st->rlen, 0);
+      if (r > 0)
+      {
+         st->rlen += r;
+         continue;
+      }
+      if ((r < 0) && (EINTR == errno))
+         continue;
+      if ((r < 0) && ((EAGAIN == errno) || (EWOULDBLOCK == errno)))
+         break;
+      fprintf(stderr, "%s: connection closed\n", st->name);
+      evlog_add(evlog, EVLOG_DISCONNECT, st->idx, 0, (uint64_t) ntohl(st->src.sin_addr.s_addr) << 16 | ntohs(st->src.sin_port));
+      stream_disconnect(st);
+      return;
+   }
+
+   if (MODE_RAW_TCP == st->mode)
+      parse_raw(st);
+   else if (!parse_android(st))
+      stream_disconnect(st);
+}
+
+/*
+ * Synthetic source for load tests: SPS/PPS once, then an IDR every synth_gop
+ * frames at synth_fps and synth_bitrate. The payload contains no zero bytes,
+ * so it can't emulate start codes.
+ */
+static void
+synth_tick (stream* st, int64_t now)
+{
+   static const uint8_t sps_pps[] = {0,0,0,1, 0x67,0x64,0x00,0x28,0xac,0x2b,0x40,0x3c,0x01,0x13,0xf2,0xc0,
+                                     0,0,0,1, 0x68,0xee,0x3c,0xb0};
+   static uint8_t* synth_buf;
+   static size_t synth_cap;
+
+   while (st->next_frame_us <= now)
+   {
+      size_t avg = synth_bitrate / 8 / synth_fps;
+      bool bIdr = (0 == st->synth_cnt % synth_gop);
+      size_t len = bIdr ? avg * 4 : avg - avg * 3 / synth_gop;
+      size_t i;
+
+      if (0 == st->synth_cnt)
+         stream_emit(st, sps_pps, sizeof(sps_pps), 0);
+
+      if (len + 5 > synth_cap)
+      {
+         synth_cap = len + 5;
+         if (!(synth_buf = realloc(synth_buf, synth_cap)))
+            exit(__LINE__);
+      }
+      memcpy(synth_buf, "\0\0\0\1", 4);
+      synth_buf[4] = bIdr ? 0x65 : 0x41;
+      for (i = 5; i < len + 5; i++)
+         synth_buf[i] = 0x80 | ((st->synth_cnt + i) & 0x7f);
+      //copied like a received frame
+      stream_emit(st, synth_buf, len + 5, 0);
+
+      st->synth_cnt++;
+      st->next_frame_us += 1000000 / synth_fps;
+   }
+}
+
+static void
+print_stats (int64_t interval_us)
+{
+   int i;
+   for (i = 0; i < streams_cnt; i++)
+   {
+      stream* st = streams[i];
+      fprintf(stderr, "%-12s fps=%5.1f kbit/s=%7.1f viewers=%d viewer_drops=%"PRIu64" rec_drops=%"PRIu64"\n",
+              st->name, st->frames_in * 1000000.0 / interval_us, st->bytes_in * 8000.0 / interval_us,
+              st->viewers_cnt, st->viewer_drops, st->rec.ulDropped);
+      st->frames_in = st->bytes_in = st->viewer_drops = 0;
+   }
+   if (bFramePool)
+   {
+      pthread_mutex_lock(&frame_pool.lock);
+      fprintf(stderr, "frames: slab %u of %u blocks in use, peak %u, %"PRIu64" of %"PRIu64" frames from the heap\n",
+              frame_pool.in_use, frame_pool.blocks, frame_pool.peak, frame_pool.fallbacks, frame_pool.allocs);
+      pthread_mutex_unlock(&frame_pool.lock);
+   }
+}
+
+static stream*
+stream_new (const char* name, STREAM_MODE mode, unsigned short viewer_port)
+{
+   struct in_addr any = { INADDR_ANY };
+
+   if (streams_cnt >= MAX_STREAMS)
+   {
+      fprintf(stderr, "too many streams\n");
+      exit(EXIT_FAILURE);
+   }
+   stream* st = calloc(1, sizeof(stream));
+   st->kind = EP_STREAM;
+   snprintf(st->name, sizeof(st->name), "%s", name);
+   st->mode = mode;
+   st->viewer_mode = ((MODE_RTP == mode) || (MODE_SYNTHETIC == mode)) ? MODE_RAW_TCP : mode;
+   st->fd = -1;
+   st->last_idr_seq = UINT64_MAX;
+   pthread_mutex_init(&st->rec.lock, NULL);
+
+   if ((st->listen_fd = OpenListenSocket(&any, viewer_port, 64)) < 0)
+      exit(EXIT_FAILURE);
+   SetNonBlocking(st->listen_fd, true);
+   st->listen_tag.kind = EP_VIEWER_LISTEN;
+   st->listen_tag.st = st;
+   ep_add(st->listen_fd, &st->listen_tag, EPOLLIN);
+
+   st->idx = streams_cnt;
+   streams[streams_cnt++] = st;
+   return st;
+}
+
+static STREAM_MODE
+parse_mode (const char* str)
+{
+   int i;
+   for (i = 0; i < MODE_SYNTHETIC; i++)
+      if (!strcmp(mode_names[i], str))
+         return i;
+   fprintf(stderr, "'%s' is an unknown mode, use raw_tcp, android, android_motion or rtp\n", str);
+   exit(EXIT_FAILURE);
+}
+
+/* name,mode,source,viewer_port[,viewer_mode] */
+static void
+parse_stream_arg (char* arg)
+{
+   char* name = strtok(arg, ",");
+   char* mode = strtok(NULL, ",");
+   char* src = strtok(NULL, ",");
+   char* port = strtok(NULL, ",");
+   char* vmode = strtok(NULL, ",");
+   unsigned short viewer_port;
+
+   if (!name || !mode || !src || !port || (1 != sscanf(port, "%hu", &viewer_port)))
+   {
+      fprintf(stderr, "-i expects name,mode,source,viewer_port[,viewer_mode]\n");
+      exit(EXIT_FAILURE);
+   }
+   stream* st = stream_new(name, parse_mode(mode), viewer_port);
+   if (((MODE_RTP == st->mode) && strncmp("udp://", src, 6)) ||
+       ((MODE_RTP != st->mode) && strncmp("tcp://", src, 6)) ||
+       !ParseIPv4Port(src + 6, &st->src))
+   {
+      fprintf(stderr, "%s is not a valid source, use tcp://1.2.3.4:1234 (or udp://0.0.0.0:1234 for rtp)\n", src);
+      exit(EXIT_FAILURE);
+   }
+   if (vmode)
+   {
+      st->viewer_mode = parse_mode(vmode);
+      if (MODE_RTP == st->viewer_mode)
+      {
+         fprintf(stderr, "%s: viewers can get raw_tcp, android or android_motion framing\n", st->name);
+         exit(EXIT_FAILURE);
+      }
+   }
+}
+
+static void
+show_usage_and_exit (char** argv)
+{
+   fprintf(stderr,
+         "Usage: %s -i name,mode,source,viewer_port[,viewer_mode] [-i ...] [-r dir] [-s segment_sec] [-p playback_port [-c cert.pem -k key.pem]] [-H] [-K seal_key[,seal_sec]] [-e event_log] [-t threads] [-m frame_MB] [-v]\n"
+         "\t      [-S synthetic_streams -P first_port [-f fps] [-g gop] [-B bitrate]]\n"
+         "\tmode: raw_tcp, android, android_motion (source tcp://ip:port) or rtp (source udp://ip:port)\n"
+         "\te.g. %s -i front,android_motion,tcp://192.168.1.10:5001,7001 -r /srv/rec\n", argv[0], argv[0]);
+   exit(EXIT_FAILURE);
+}
+
+int
+main (int argc, char** argv)
+{
+   int opt, i, threads = 2, synth_streams = 0, frame_mb = 64;
+   unsigned short synth_port = 0, playback_port = 0;
+   EP_KIND playback_tag = EP_PLAYBACK_LISTEN;
+   int playback_fd = -1;
+   struct epoll_event events[64];
+   int64_t last_stats_us;
+
+   signal(SIGPIPE, SIG_IGN);
+   if ((epfd = epoll_create1(0)) < 0)
+   {
+      fprintf(stderr, "epoll_create1: %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+   }
+
+   while ((opt = getopt(argc, argv, "i:r:s:t:vS:P:f:g:B:p:e:c:k:HK:m:")) != -1)
+   {
+      switch (opt)
+      {
+         case 'i':
+            parse_stream_arg(optarg);
+            break;
+         case 'r':
+            rec_dir = optarg;
+            break;
+         case 's':
+            rec_segment_sec = atoi(optarg);
+            break;
+         case 't':
+            threads = atoi(optarg);
+            break;
+         case 'v':
+            bVerbose = true;
+            break;
+         case 'm':
+            frame_mb = atoi(optarg);
+            break;
+         case 'S':
+            synth_streams = atoi(optarg);
+            break;
+         case 'P':
+            if (1 != sscanf(optarg, "%hu", &synth_port))
+               show_usage_and_exit(argv);
+            break;
+         case 'f':
+            synth_fps = atoi(optarg);
+            break;
+         case 'g':
+            synth_gop = atoi(optarg);
+            break;
+         case 'B':
+            synth_bitrate = atoi(optarg);
+            break;
+         case 'p':
+            if (1 != sscanf(optarg, "%hu", &playback_port))
+               show_usage_and_exit(argv);
+            break;
+         case 'e':
+            if (NULL == (evlog = evlog_open(optarg)))
+               exit(EXIT_FAILURE);
+            evlog_add(evlog, EVLOG_START, 0, getpid(), 0);
+            break;
+         case 'c':
+            tls_cert = optarg;
+            break;
+         case 'k':
+            tls_key = optarg;
+            break;
+         case 'H':
+            bRecHash = true;
+            break;
+         case 'K':
+         {
+            char* comma = strchr(optarg, ',');
+            if (comma)
+            {
+               *comma = 0;
+               rec_seal_sec = atoi(comma + 1);
+            }
+            if (!aead_load_key(optarg, rec_seal_key))
+            {
+               fprintf(stderr, "-K: can't read a 64 hex digit key from %s\n", optarg);
+               exit(EXIT_FAILURE);
+            }
+            bRecHash = bRecSeal = true;
+            break;
+         }
+         default: /* '?' */
+            show_usage_and_exit(argv);
+      }
+   }
+   if ((synth_fps <= 0) || (synth_gop <= 0) || (synth_bitrate < 8 * synth_fps) || (rec_segment_sec <= 0) || (rec_seal_sec <= 0) || (threads <= 0) || (frame_mb < 0))
+      show_usage_and_exit(argv);
+
+   if (frame_mb)
+   {
+      if (!frame_pool_init(&frame_pool, FRAME_BLOCK, (uint32_t)((int64_t) frame_mb * 1024 * 1024 / FRAME_BLOCK)))
+      {
+         fprintf(stderr, "-m: no %d MB for frames\n", frame_mb);
+         exit(EXIT_FAILURE);
+      }
+      bFramePool = true;
+   }
+
+   if (tls_cert && !tls_key)
+   {
+      fprintf(stderr, "-c needs the private key with -k\n");
+      exit(EXIT_FAILURE);
+   }
+
+   if (bRecHash && !rec_dir)
+   {
+      fprintf(stderr, "-H/-K need the recordings directory -r\n");
+      exit(EXIT_FAILURE);
+   }
+
+   if (synth_streams && !synth_port)
+   {
+      fprintf(stderr, "-S needs the first viewer port with -P\n");
+      exit(EXIT_FAILURE);
+   }
+   for (i = 0; i < synth_streams; i++)
+   {
+      char name[32];
+      snprintf(name, sizeof(name), "syn%d", i);
+      stream* st = stream_new(name, MODE_SYNTHETIC, synth_port + i);
+      st->next_frame_us = now_us() + i * 1000000 / synth_fps / synth_streams;
+   }
+   if (!streams_cnt)
+      show_usage_and_exit(argv);
+
+   if (rec_dir)
+   {
+      mkdir(rec_dir, 0755);
+      pool_start(threads);
+   }
+   if (playback_port)
+   {
+      struct in_addr any = { INADDR_ANY };
+      if (!rec_dir)
+      {
+         fprintf(stderr, "-p needs the recordings directory -r\n");
+         exit(EXIT_FAILURE);
+      }
+      if ((playback_fd = OpenListenSocket(&any, playback_port, 16)) < 0)
+         exit(EXIT_FAILURE);
+      ep_add(playback_fd, &playback_tag, EPOLLIN);
+   }
+
+   for (i = 0; i < streams_cnt; i++)
+      if (MODE_SYNTHETIC != streams[i]->mode)
+         stream_connect(streams[i]);
+
+   last_stats_us = now_us();
+   for (;;)
+   {
+      int64_t now = now_us(), next = now + 1000000;
+      int n, timeout_ms;
+
+      for (i = 0; i < streams_cnt; i++)
+      {
+         stream* st = streams[i];
+         if (MODE_SYNTHETIC == st->mode)
+         {
+            synth_tick(st, now);
+            if (st->next_frame_us < next)
+               next = st->next_frame_us;
+         }
+         else if (st->fd < 0)
+         {
+            if (st->reconnect_at_us <= now)
+               stream_connect(st);
+            else if (st->reconnect_at_us < next)
+               next = st->reconnect_at_us;
+         }
+      }
+      if (bVerbose && (now - last_stats_us >= 10000000))
+      {
+         print_stats(now - last_stats_us);
+         last_stats_us = now;
+      }
+
+      timeout_ms = (next > now) ? (int) ((next - now + 999) / 1000) : 0;
+      n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), timeout_ms);
+      if ((n < 0) && (EINTR != errno))
+      {
+         fprintf(stderr, "epoll_wait: %s\n", strerror(errno));
+         exit(EXIT_FAILURE);
+      }
+
+      for (i = 0; i < n; i++)
+      {
+         EP_KIND* kind = events[i].data.ptr;
+         switch (*kind)
+         {
+            case EP_STREAM:
+               stream_on_event((stream*) kind, events[i].events);
+               break;
+            case EP_VIEWER_LISTEN:
+               viewer_accept(((LISTEN_TAG*) kind)->st);
+               break;
+            case EP_VIEWER:
+               if (((viewer*) kind)->fd >= 0)
+                  viewer_on_event((viewer*) kind, events[i].events);
+               break;
+            case EP_PLAYBACK_LISTEN:
+               playback_accept(playback_fd);
+               break;
+         }
+      }
+      while (dead_viewers)
+      {
+         viewer* v = dead_viewers;
+         dead_viewers = v->next;
+         free(v);
+      }
+   }
+
+   return 0;
+}
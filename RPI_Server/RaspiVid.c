@@ -85,8 +85,23 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "RaspiCLI.h"
 
 #include <semaphore.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 #include <stdbool.h>
+#include "../common/rpi_event.h"
+#include "../common/event_log.h"
+#include "../common/aead.h"
+#include "../common/rpi_tls.h"
+#include "../common/h264_nal.h"
+#include "../common/lat_hist.h"
+#include "../common/bw_probe.h"
+#include "../common/lowlight.h"
+#include "../common/splice_sink.h"
+#include "../common/motion.h"
+#include "../common/serial_link.h"
+#include "../common/multipath.h"
+#include <signal.h>
 
 // Standard port setting for the camera component
 #define MMAL_CAMERA_PREVIEW_PORT 0
@@ -170,6 +185,7 @@ MMAL_PORT_T *camera_video_port = NULL;
 MMAL_PORT_T *encoder_output_port = NULL;
 MMAL_PORT_T *preview_input_port = NULL;
 MMAL_PORT_T *encoder_input_port = NULL;
+MMAL_PORT_T *camera_still_port = NULL;
 
 // Forward
 typedef struct RASPIVID_STATE_S RASPIVID_STATE;
@@ -188,6 +204,8 @@ typedef struct
    int  header_wptr;
    long unsigned int ulValidCallbackCnt;
    int runTimeShowStat;
+   bool bMidFrame;                      /// raw_tcp, android -slices: the next buffer continues a frame, it is not the first one
+   bool bAtBoundary;                    /// raw_tcp: the last buffer ended a frame and nothing of the next one (SPS/PPS) went out
 } PORT_USERDATA;
 
 /** Structure containing all state information for the current run
@@ -213,7 +231,9 @@ struct RASPIVID_STATE_S
 
    int profile;                        /// H264 profile to use for encoding
    int level;                          /// H264 level to use for encoding
+   int rateControl;                    /// MMAL_VIDEO_RATECONTROL_T, see ratecontrol_map
    int waitMethod;                     /// Method for switching between pause and capture
+   int bCapturing;                     /// State of capture/pause at the start, -initial
 
    int onTime;                         /// In timed cycle mode, the amount of time the capture is on per cycle
    int offTime;                        /// In timed cycle mode, the amount of time the capture is off per cycle
@@ -226,6 +246,7 @@ struct RASPIVID_STATE_S
 
    unsigned short mbx;                 /// number of Macroblocks in x direction
    unsigned short mby;                 /// number of Macroblocks in y direction
+   int motionAlarm;                    /// MotionAlarm above this vector length (mot_alarm=), 0 is off
 
    RASPIPREVIEW_PARAMETERS preview_parameters;   /// Preview setup parameters
    RASPICAM_CAMERA_PARAMETERS camera_parameters; /// Camera setup parameters
@@ -240,6 +261,31 @@ struct RASPIVID_STATE_S
    MMAL_POOL_T *splitter_pool; /// Pointer to the pool of buffers used by splitter output port 0
    MMAL_POOL_T *encoder_pool; /// Pointer to the pool of buffers used by encoder output port
 
+   MMAL_COMPONENT_T *image_encoder_component; /// Pointer to the JPEG encoder for snapshots, NULL if snapshots are not available
+   MMAL_CONNECTION_T *still_connection;       /// Pointer to the connection from camera still port to the JPEG encoder
+   MMAL_POOL_T *image_encoder_pool;           /// Pointer to the pool of buffers used by the JPEG encoder output port
+   int snapshotWidth;                         /// Snapshot size, 0 = same as the video
+   int snapshotHeight;
+
+   char *eventDir;                      /// Directory for motion event clips, NULL = no clips
+   char *eventUrl;                      /// mqtt://ip:port/topic or http://ip:port/path to publish motion events to
+   int preRoll;                         /// Seconds of video before the first alarm in an event clip
+   int postRoll;                        /// Seconds after the last alarm until an event is closed
+   char *eventLog;                      /// Binary log of alarms, events, snapshots and connections, see common/event_log.h
+   char *keyFile;                       /// Pre-shared key, raw_tcp output is encrypted per packet, see common/aead.h
+   char *tlsCert;                       /// PEM certificate (chain), the TCP connection is TLS 1.3, see common/rpi_tls.h
+   char *tlsKey;                        /// PEM private key of tlsCert
+   int timeSei;                         /// raw_tcp: SEI with the send time in front of every frame, see h264_make_time_sei()
+   int encLat;                          /// Seconds between encoder latency histograms on stderr, 0 = only on the enclat command
+   int probe;                           /// raw_tcp over TCP: bandwidth probe at connect, then every <probe> seconds when idle, 0 = off
+   int telemetry;                       /// Seconds between exposure/gain metrics on stderr, !0 also lets the gain drive bitrate and min QP
+   int lowLightFps;                     /// Lowest frame rate in low light, 0 = no switching, see common/lowlight.h
+   int lowLightMode;                    /// Sensor mode in low light, 0 = keep sensor_mode
+   float lowLightSens;                  /// Sensitivity of lowLightMode relative to sensor_mode, 0 = the same
+   char *lowLightTrace;                 /// CSV of every sample the low-light policy sees, replay it with RPI_Tools/lowlight
+   int watchdog;                        /// Seconds without an encoder frame until camera and encoder are rebuilt, 0 = off
+   int sliceRows;                       /// Macroblock rows per slice, 0 = one slice per frame; -m android then sends every slice as it comes
+
    PORT_USERDATA callback_data;        /// Used to move data to the encoder callback
 
    int cameraNum;                       /// Camera number
@@ -259,6 +305,25 @@ struct RASPIVID_STATE_S
    MMAL_PORT_BH_CB_T enc_cb_func;
 };
 
+static void snapshot_request(RASPIVID_STATE *pState, const char *path);
+static void evlog_reply(RASPIVID_STATE *pState, char *args);
+static void enc_lat_print(RASPIVID_STATE *pState, bool bBars, bool bReset);
+static void telemetry_reply(RASPIVID_STATE *pState);
+static void rate_apply(RASPIVID_STATE *pState);
+static void lowlight_frame(RASPIVID_STATE *pState, MMAL_BUFFER_HEADER_T *buffer);
+static bool snapshot_capturing(void);
+static void aead_rotate_key(RASPIVID_STATE *pState, const char *hex);
+static MMAL_PORT_BH_CB_T encoder_callback(RASPIVID_STATE *pState);
+static void watchdog_reply(RASPIVID_STATE *pState);
+static void capture_pause(RASPIVID_STATE *pState, bool bPause);
+static void loss_reply(RASPIVID_STATE *pState);
+static void loss_format(char *buf, size_t size);
+static void pause_setup(RASPIVID_STATE *pState);
+static FILE *serial_open(const char *url);
+static void serial_reply(void);
+static FILE *multipath_open(const char *url);
+static void multipath_reply(void);
+
 
 /// Structure to cross reference H264 profile strings against the MMAL parameter equivalent
 static XREF_T  profile_map[] =
@@ -281,6 +346,18 @@ static XREF_T  level_map[] =
 
 static int level_map_size = sizeof(level_map) / sizeof(level_map[0]);
 
+/// Structure to cross reference rate control strings against the MMAL parameter equivalent
+static XREF_T  ratecontrol_map[] =
+{
+   {"variable_skip", MMAL_VIDEO_RATECONTROL_VARIABLE_SKIP_FRAMES},
+   {"variable",      MMAL_VIDEO_RATECONTROL_VARIABLE},
+   {"constant_skip", MMAL_VIDEO_RATECONTROL_CONSTANT_SKIP_FRAMES},
+   {"constant",      MMAL_VIDEO_RATECONTROL_CONSTANT},
+   {"default",       MMAL_VIDEO_RATECONTROL_DEFAULT},
+};
+
+static int ratecontrol_map_size = sizeof(ratecontrol_map) / sizeof(ratecontrol_map[0]);
+
 /// Command ID's and Structure defining our command line options
 #define CommandHelp         0
 #define CommandWidth        1
@@ -315,6 +392,24 @@ static int level_map_size = sizeof(level_map) / sizeof(level_map[0]);
 #define CommandLevel        31
 #define CommandRawFormat    33
 #define CommandNetListen    34
+#define CommandSnapshotSize 35
+#define CommandEventDir     36
+#define CommandEventUrl     37
+#define CommandPreRoll      38
+#define CommandPostRoll     39
+#define CommandEventLog     40
+#define CommandKeyFile      41
+#define CommandTlsCert      42
+#define CommandTlsKey       43
+#define CommandTimeSei      44
+#define CommandEncLat       45
+#define CommandProbe        46
+#define CommandTelemetry    47
+#define CommandLowLight     48
+#define CommandLowLightTrace 49
+#define CommandWatchdog     50
+#define CommandRateControl  51
+#define CommandSlices       52
 
 static COMMAND_LIST cmdline_commands[] =
 {
@@ -325,14 +420,16 @@ static COMMAND_LIST cmdline_commands[] =
    { CommandOutput,        "-output",     "o",  "Output filename <filename> (to write to stdout, use '-o -').\n"
          "\t\t  Connect to a remote IPv4 host (e.g. tcp://192.168.1.2:1234, udp://192.168.1.2:1234)\n"
          "\t\t  To listen on a TCP port (IPv4) and wait for an incoming connection use -l\n"
-         "\t\t  (e.g. raspvid -l -o tcp://0.0.0.0:3333 -> bind to all network interfaces, raspvid -l -o tcp://192.168.1.1:3333 -> bind to a certain local IPv4)", 1 },
+         "\t\t  (e.g. raspvid -l -o tcp://0.0.0.0:3333 -> bind to all network interfaces, raspvid -l -o tcp://192.168.1.1:3333 -> bind to a certain local IPv4)\n"
+         "\t\t  Serial port or telemetry radio, -m raw_tcp only (e.g. serial:///dev/ttyS0?baud=115200&mtu=200)\n"
+         "\t\t  UDP over several interfaces at once, -m raw_tcp only (e.g. multipath://192.168.1.2:5000?via=wlan0&via=wwan0)", 1 },
    { CommandDemoMode,      "-demo",       "d",  "Run a demo mode (cycle through range of camera options, no capture)", 1},
    { CommandFramerate,     "-framerate",  "fps","Specify the frames per second to record", 1},
    { CommandPreviewEnc,    "-penc",       "e",  "Display preview image *after* encoding (shows compression artifacts)", 0},
    { CommandIntraPeriod,   "-intra",      "g",  "Specify the intra refresh period (key frame rate/GoP size). Zero to produce an initial I-frame and then just P-frames.", 1},
    { CommandProfile,       "-profile",    "pf", "Specify H264 profile to use for encoding", 1},
-   { CommandTimed,         "-timed",      "td", "Cycle between capture and pause. -cycle on,off where on is record time and off is pause time in ms", 0},
-   { CommandSignal,        "-signal",     "s",  "Cycle between capture and pause on Signal", 0},
+   { CommandTimed,         "-timed",      "td", "Cycle between capture and pause. -timed on,off where on is record time and off is pause time in ms", 1},
+   { CommandSignal,        "-signal",     "s",  "Cycle between capture and pause on SIGUSR1", 0},
    { CommandKeypress,      "-keypress",   "k",  "Cycle between capture and pause on ENTER", 0},
    { CommandInitialState,  "-initial",    "i",  "Initial state. Use 'record' or 'pause'. Default 'record'", 1},
    { CommandQP,            "-qp",         "qp", "Quantisation parameter. Use approximately 10-40. Default 0 (off)", 1},
@@ -346,11 +443,30 @@ static COMMAND_LIST cmdline_commands[] =
    { CommandSavePTS,       "-save-pts",   "pts","Save Timestamps to file for mkvmerge", 1 },
    { CommandLevel,         "-level",      "lev","Specify H264 level to use for encoding", 1},
    { CommandNetListen,     "-listen",     "l", "Listen on a TCP socket", 0},
+   { CommandEventDir,      "-evdir",      "evd","Write a clip for every motion alarm event to <dir> (android_motion mode)", 1},
+   { CommandEventUrl,      "-evurl",      "evu","Publish motion alarm events to mqtt://ip:port/topic or http://ip:port/path", 1},
+   { CommandPreRoll,       "-preroll",    "prer","Seconds of video before the alarm in an event clip. Default 5", 1},
+   { CommandPostRoll,      "-postroll",   "postr","Seconds after the last alarm until the event is closed. Default 10", 1},
+   { CommandEventLog,      "-evlog",      "evl","Append alarms, events, snapshots and connections to a binary event log (dump it with RPI_Tools/evlog)", 1},
+   { CommandKeyFile,       "-keyfile",    "kf", "Encrypt and authenticate the raw_tcp stream (tcp:// or udp://) with the key in <file> (64 hex digits)", 1},
+   { CommandTlsCert,       "-tlscert",    "tlsc","TLS 1.3 on the TCP connection (any mode) with the PEM certificate in <file>, encrypted by the kernel if it has kTLS", 1},
+   { CommandTlsKey,        "-tlskey",     "tlsk","PEM private key for -tlscert", 1},
+   { CommandTimeSei,       "-timesei",    "tsei","raw_tcp: put the send time (SEI) in front of every frame, video -s splits the latency with it", 0},
+   { CommandEncLat,        "-enclat",     "encl","Print the capture to encoder output latency (I/P histograms) every <sec> seconds", 1},
+   { CommandProbe,         "-probe",      "prb","raw_tcp over tcp://: measure the bandwidth at connect and start at 3/4 of it (at most -b), re-measure every <sec> seconds when idle", 1},
+   { CommandTelemetry,     "-telemetry",  "tel","Exposure/gain metrics every <sec> seconds, bitrate and min QP go down before a dark, noisy scene blows up the bitrate", 1},
+   { CommandLowLight,      "-lowlight",   "ll", "Switch to <fps>[,<mode>[,<sens>]] in low light: frame rate may go down to fps, sensor mode (binned), its sensitivity relative to -md", 1},
+   { CommandLowLightTrace, "-lltrace",    "llt","Write exposure, gain and frame interval to the CSV <file> every 200 ms (RPI_Tools/lowlight replays it)", 1},
+   { CommandRateControl,   "-ratecontrol","rc", "Encoder rate control: variable_skip (default), variable, constant_skip, constant. The _skip ones drop frames when over budget", 1},
+   { CommandSlices,        "-slices",     "sl", "Encode <rows> macroblock rows per slice (1080p has 68), -m android sends every slice as soon as the encoder hands it out", 1},
+   { CommandWatchdog,      "-watchdog",   "wd", "Rebuild camera and encoder in-process when no frame came out for <sec> seconds, the client stays connected", 1},
+   { CommandSnapshotSize,  "-snapsize",   "snsz","Snapshot size WxH. Default is the video size, a bigger one makes the sensor switch mode for every snapshot", 1},
 };
 
 static int cmdline_commands_size = sizeof(cmdline_commands) / sizeof(cmdline_commands[0]);
 MMAL_PORT_T *g_encoder_output = NULL;
-int gMotionAlarm = 0;
+EVLOG *gEvLog = NULL;
+RPI_TLS gTls;                           /// every send to the client goes through it, plain send()/sendmsg() without -tlscert
 
 static struct
 {
@@ -500,7 +616,9 @@ static void default_status(RASPIVID_STATE *state)
    state->immutableInput = 1;
    state->profile = MMAL_VIDEO_PROFILE_H264_HIGH;
    state->level = MMAL_VIDEO_LEVEL_H264_4;
+   state->rateControl = MMAL_VIDEO_RATECONTROL_VARIABLE_SKIP_FRAMES;
    state->waitMethod = WAIT_METHOD_NONE;
+   state->bCapturing = 1;
    state->onTime = 5000;
    state->offTime = 5000;
 
@@ -523,6 +641,9 @@ static void default_status(RASPIVID_STATE *state)
 
    state->netListen = false;
 
+   state->preRoll = 5;
+   state->postRoll = 10;
+
 
    // Setup preview window defaults
    raspipreview_set_defaults(&state->preview_parameters);
@@ -550,6 +671,7 @@ static void dump_status(RASPIVID_STATE *state)
    fprintf(stderr, "Width %d, Height %d, filename %s\n", state->width, state->height, state->filename);
    fprintf(stderr, "H264 Profile %s\n", raspicli_unmap_xref(state->profile, profile_map, profile_map_size));
    fprintf(stderr, "H264 Level %s\n", raspicli_unmap_xref(state->level, level_map, level_map_size));
+   fprintf(stderr, "H264 Rate control %s\n", raspicli_unmap_xref(state->rateControl, ratecontrol_map, ratecontrol_map_size));
    fprintf(stderr, "H264 Quantisation level %d, Inline headers %s\n", state->quantisationParameter, state->bInlineHeaders ? "Yes" : "No");
 
    // Not going to display segment data unless asked for it.
@@ -712,6 +834,14 @@ static int parse_cmdline(int argc, const char **argv, RASPIVID_STATE *state)
          break;
       }
 
+      case CommandRateControl:
+      {
+         if (-1 == (state->rateControl = raspicli_map_xref(argv[i + 1], ratecontrol_map, ratecontrol_map_size)))
+            valid = 0;
+         i++;
+         break;
+      }
+
       case CommandInlineHeaders: // H264 inline headers
       {
          state->bInlineHeaders = 1;
@@ -737,6 +867,26 @@ static int parse_cmdline(int argc, const char **argv, RASPIVID_STATE *state)
          break;
       }
 
+      case CommandSignal:   // Toggle between pause and capture on SIGUSR1
+         state->waitMethod = WAIT_METHOD_SIGNAL;
+         break;
+
+      case CommandKeypress: // Toggle between pause and capture on ENTER
+         state->waitMethod = WAIT_METHOD_KEYPRESS;
+         break;
+
+      case CommandInitialState:
+      {
+         if (!strcmp(argv[i + 1], "record"))
+            state->bCapturing = 1;
+         else if (!strcmp(argv[i + 1], "pause"))
+            state->bCapturing = 0;
+         else
+            valid = 0;
+         i++;
+         break;
+      }
+
       case CommandCamSelect:  //Select camera input port
       {
          if (sscanf(argv[i + 1], "%u", &state->cameraNum) == 1)
@@ -781,6 +931,108 @@ static int parse_cmdline(int argc, const char **argv, RASPIVID_STATE *state)
          break;
       }
 
+      case CommandTimeSei:
+         state->timeSei = 1;
+         break;
+
+      case CommandEncLat:
+         if (sscanf(argv[i + 1], "%u", &state->encLat) != 1)
+            valid = 0;
+         else
+            i++;
+         break;
+
+      case CommandProbe:
+         if ((sscanf(argv[i + 1], "%u", &state->probe) != 1) || !state->probe)
+            valid = 0;
+         else
+            i++;
+         break;
+
+      case CommandTelemetry:
+         if ((sscanf(argv[i + 1], "%u", &state->telemetry) != 1) || !state->telemetry)
+            valid = 0;
+         else
+            i++;
+         break;
+
+      case CommandSlices:
+         if ((sscanf(argv[i + 1], "%u", &state->sliceRows) != 1) || !state->sliceRows)
+            valid = 0;
+         else
+            i++;
+         break;
+
+      case CommandWatchdog:
+         if ((sscanf(argv[i + 1], "%u", &state->watchdog) != 1) || !state->watchdog)
+            valid = 0;
+         else
+            i++;
+         break;
+
+      case CommandLowLight:
+         state->lowLightMode = 0;
+         state->lowLightSens = 0;
+         if ((sscanf(argv[i + 1], "%d,%d,%f", &state->lowLightFps, &state->lowLightMode, &state->lowLightSens) < 1) ||
+             (state->lowLightFps <= 0) || (state->lowLightMode < 0) || (state->lowLightSens < 0))
+            valid = 0;
+         else
+            i++;
+         break;
+
+      case CommandEventDir:
+      case CommandEventUrl:
+      case CommandEventLog:
+      case CommandKeyFile:
+      case CommandTlsCert:
+      case CommandTlsKey:
+      case CommandLowLightTrace:
+      {
+         char *str = strdup(argv[i + 1]);
+         vcos_assert(str);
+         if (command_id == CommandEventDir)
+            state->eventDir = str;
+         else if (command_id == CommandEventUrl)
+            state->eventUrl = str;
+         else if (command_id == CommandEventLog)
+            state->eventLog = str;
+         else if (command_id == CommandKeyFile)
+            state->keyFile = str;
+         else if (command_id == CommandTlsCert)
+            state->tlsCert = str;
+         else if (command_id == CommandLowLightTrace)
+            state->lowLightTrace = str;
+         else
+            state->tlsKey = str;
+         i++;
+         break;
+      }
+
+      case CommandPreRoll:
+         if (sscanf(argv[i + 1], "%u", &state->preRoll) != 1)
+            valid = 0;
+         else
+            i++;
+         break;
+
+      case CommandPostRoll:
+         if (sscanf(argv[i + 1], "%u", &state->postRoll) != 1)
+            valid = 0;
+         else
+            i++;
+         break;
+
+      case CommandSnapshotSize:
+      {
+         if (2 != sscanf(argv[i + 1], "%dx%d", &state->snapshotWidth, &state->snapshotHeight) ||
+               state->snapshotWidth <= 0 || state->snapshotHeight <= 0)
+            valid = 0;
+         else
+            i++;
+
+         break;
+      }
+
       default:
       {
          // Try parsing for any image specific parameters
@@ -823,40 +1075,65 @@ static int parse_cmdline(int argc, const char **argv, RASPIVID_STATE *state)
  * @param port Pointer to port from which callback originated
  * @param buffer mmal buffer header pointer
  */
+/*
+ * Latest MMAL_PARAMETER_CAMERA_SETTINGS, the camera sends them with every frame
+ * once asked for (-settings, -telemetry, -lowlight). The callback only stores
+ * them, the telemetry and low-light threads look at them a few times a second.
+ */
+static struct
+{
+   pthread_mutex_t lock;
+   bool bValid;
+   bool bPrint;                         /// -settings: every change to stderr as well
+   uint32_t exposure;                   /// us
+   float analog_gain, digital_gain;
+   float awb_red, awb_blue;
+   unsigned long updates;
+} gCamSettings = { PTHREAD_MUTEX_INITIALIZER };
+
+static float rational_to_float(MMAL_RATIONAL_T r)
+{
+   return r.den ? (float)r.num / r.den : 0;
+}
+
 static void camera_control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
 {
 
    if (buffer->cmd == MMAL_EVENT_PARAMETER_CHANGED)
    {
       MMAL_EVENT_PARAMETER_CHANGED_T *param = (MMAL_EVENT_PARAMETER_CHANGED_T *) buffer->data;
-      printf("param->hdr.id=%.8x\n", param->hdr.id);
-      /*switch (param->hdr.id)
+      switch (param->hdr.id)
       {
-         case MMAL_PARAMETER_ISO:
-         {
-            printf("MMAL_PARAMETER_ISO=%d\n", ((MMAL_PARAMETER_UINT32_T*) param)->value);
-         }
-            break;
-         case MMAL_PARAMETER_SHUTTER_SPEED:
-         {
-            printf("MMAL_PARAMETER_SHUTTER_SPEED=" SCNu32 "\n", ((MMAL_PARAMETER_UINT32_T*) param)->value);
-         }
-            break;
-
          case MMAL_PARAMETER_CAMERA_SETTINGS:
          {
             MMAL_PARAMETER_CAMERA_SETTINGS_T *settings = (MMAL_PARAMETER_CAMERA_SETTINGS_T*)param;
-            vcos_log_error("Exposure now %u, analog gain %u/%u, digital gain %u/%u",
-			settings->exposure,
-                        settings->analog_gain.num, settings->analog_gain.den,
-                        settings->digital_gain.num, settings->digital_gain.den);
-            vcos_log_error("AWB R=%u/%u, B=%u/%u",
-                        settings->awb_red_gain.num, settings->awb_red_gain.den,
-                        settings->awb_blue_gain.num, settings->awb_blue_gain.den
-                        );
+
+            pthread_mutex_lock(&gCamSettings.lock);
+            gCamSettings.exposure = settings->exposure;
+            gCamSettings.analog_gain = rational_to_float(settings->analog_gain);
+            gCamSettings.digital_gain = rational_to_float(settings->digital_gain);
+            gCamSettings.awb_red = rational_to_float(settings->awb_red_gain);
+            gCamSettings.awb_blue = rational_to_float(settings->awb_blue_gain);
+            gCamSettings.bValid = true;
+            gCamSettings.updates++;
+            pthread_mutex_unlock(&gCamSettings.lock);
+            if (gCamSettings.bPrint)
+            {
+               vcos_log_error("Exposure now %u, analog gain %u/%u, digital gain %u/%u",
+                              settings->exposure,
+                              settings->analog_gain.num, settings->analog_gain.den,
+                              settings->digital_gain.num, settings->digital_gain.den);
+               vcos_log_error("AWB R=%u/%u, B=%u/%u",
+                              settings->awb_red_gain.num, settings->awb_red_gain.den,
+                              settings->awb_blue_gain.num, settings->awb_blue_gain.den);
+            }
          }
          break;
-      }*/
+
+         default:
+            printf("param->hdr.id=%.8x\n", param->hdr.id);
+            break;
+      }
    }
    else if (buffer->cmd == MMAL_EVENT_ERROR)
    {
@@ -870,6 +1147,89 @@ static void camera_control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
    mmal_buffer_header_release(buffer);
 }
 
+/* held while the camera -> encoder pipeline is stopped for a change: motion vectors, low-light mode */
+static pthread_mutex_t gCameraReconfig = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Pause: capture off on the video port, the camera stays configured and
+ * running, so a resume is one frame period away. Whole frames the encoder
+ * still puts out after a pause are dropped in the callbacks, and a resume
+ * asks for an IDR first, so the client gets a clean cut at both ends.
+ */
+static struct
+{
+   pthread_mutex_t lock;
+   bool bPaused;
+   bool bDropping;                      /// callback only: the frame being put out is dropped
+   bool bAtStart;                       /// callback only: the next buffer starts a frame
+   int64_t since_us;                    /// when the pause started
+   int64_t resume_us;                   /// when capture went back on, 0 after its first frame
+   int64_t paused_us;                   /// all pauses before the current one
+   unsigned pauses;
+} gPause = { PTHREAD_MUTEX_INITIALIZER, false, false, true };
+
+/*
+ * Which layer lost a frame. The encoder puts out the capture PTS of every frame
+ * it codes, a gap of k frame periods is k - 1 frames missing. The sensor itself
+ * runs slower when the exposure is longer than the -fps period (low light, the
+ * camera settings tell), the frames that never were are sensor drops, the rest
+ * are encoder skips, which only the _skip rate control modes do. The network
+ * never drops here, a failed send ends the connection; the relay counts its
+ * viewer drops. Gaps across pauses and pipeline switches are not counted.
+ */
+static struct
+{
+   pthread_mutex_t lock;
+   int64_t last_pts;                    /// us, 0 = the next frame starts over
+   uint64_t frames;
+   uint64_t encoder_skips;
+   uint64_t sensor_drops;
+   uint64_t paused;                     /// our own: dropped by the pause gate
+} gLoss = { PTHREAD_MUTEX_INITIALIZER };
+
+static void loss_reset(void)
+{
+   pthread_mutex_lock(&gLoss.lock);
+   gLoss.last_pts = 0;
+   pthread_mutex_unlock(&gLoss.lock);
+}
+
+static bool capture_paused(void)
+{
+   bool bPaused;
+
+   pthread_mutex_lock(&gPause.lock);
+   bPaused = gPause.bPaused;
+   pthread_mutex_unlock(&gPause.lock);
+   return bPaused;
+}
+
+/* every encoder callback asks this for each buffer, it only changes its answer between frames */
+static bool pause_drop(MMAL_BUFFER_HEADER_T *buffer)
+{
+   bool bStart = gPause.bAtStart;
+
+   gPause.bAtStart = !!(buffer->flags & (MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_CONFIG | MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO));
+   if (!bStart)
+      return gPause.bDropping;
+   pthread_mutex_lock(&gPause.lock);
+   gPause.bDropping = gPause.bPaused;
+   if (gPause.bDropping && !(buffer->flags & (MMAL_BUFFER_HEADER_FLAG_CONFIG | MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO)))
+   {
+      pthread_mutex_lock(&gLoss.lock);
+      gLoss.paused++;
+      pthread_mutex_unlock(&gLoss.lock);
+   }
+   if (!gPause.bDropping && gPause.resume_us && !(buffer->flags & (MMAL_BUFFER_HEADER_FLAG_CONFIG | MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO)))
+   {
+      fprintf(stderr, "pause: first frame %.1f ms after the resume%s\n", (vcos_getmicrosecs64() - gPause.resume_us) / 1000.0,
+              (buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME) ? ", IDR" : ", no IDR");
+      gPause.resume_us = 0;
+   }
+   pthread_mutex_unlock(&gPause.lock);
+   return gPause.bDropping;
+}
+
 /* not sure if here everything is correct */
 static void SwitchMotionVectorsOnFly(RASPIVID_STATE* pState, int bTurnOn)
 {
@@ -883,6 +1243,7 @@ static void SwitchMotionVectorsOnFly(RASPIVID_STATE* pState, int bTurnOn)
    if(currState == bTurnOn)
       return;
 
+    pthread_mutex_lock(&gCameraReconfig);
     if (MMAL_SUCCESS != mmal_port_parameter_set_boolean(camera_video_port, MMAL_PARAMETER_CAPTURE, 0))
         fprintf(stderr, "%d\n", __LINE__);
     if (MMAL_SUCCESS != mmal_connection_disable(pState->encoder_connection))
@@ -901,7 +1262,7 @@ static void SwitchMotionVectorsOnFly(RASPIVID_STATE* pState, int bTurnOn)
     if (MMAL_SUCCESS != mmal_connection_enable(pState->encoder_connection))
         fprintf(stderr, "%d\n", __LINE__);
 
-    if (MMAL_SUCCESS != mmal_port_enable(encoder_output_port, pState->enc_cb_func))
+    if (MMAL_SUCCESS != mmal_port_enable(encoder_output_port, encoder_callback(pState)))
         fprintf(stderr, "%d\n", __LINE__);
 
     // Send all the buffers to the encoder output port
@@ -918,13 +1279,25 @@ static void SwitchMotionVectorsOnFly(RASPIVID_STATE* pState, int bTurnOn)
          vcos_log_error("Unable to send a buffer to encoder output port (%d)", q);
    }
 
-   if(MMAL_SUCCESS != mmal_port_parameter_set_boolean(camera_video_port, MMAL_PARAMETER_CAPTURE, 1))
+   loss_reset();
+   //also stands in for a serial_request_key() that found the lock taken
+   if (MMAL_SUCCESS != mmal_port_parameter_set_boolean(encoder_output_port, MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME, 1))
       fprintf(stderr, "%d\n", __LINE__);
+   if(MMAL_SUCCESS != mmal_port_parameter_set_boolean(camera_video_port, MMAL_PARAMETER_CAPTURE, !capture_paused()))
+      fprintf(stderr, "%d\n", __LINE__);
+   pthread_mutex_unlock(&gCameraReconfig);
+}
+
+/* TLS in user space: commands are read through SSL_read */
+static ssize_t tls_cookie_read(void *cookie, char *buf, size_t size)
+{
+   return rpi_tls_recv((RPI_TLS *)cookie, buf, size);
 }
 
 void receive_commands(RASPIVID_STATE* pState)
 {
-    FILE* fpSock = fdopen(pState->callback_data.sockFD, "r");
+    cookie_io_functions_t tls_io = { tls_cookie_read, NULL, NULL, NULL };
+    FILE* fpSock = (gTls.ssl && !gTls.bKernelRx) ? fopencookie(&gTls, "r", tls_io) : fdopen(pState->callback_data.sockFD, "r");
     if (fpSock)
     {
         char * line = NULL;
@@ -962,7 +1335,7 @@ void receive_commands(RASPIVID_STATE* pState)
             else if (!strncmp("motion=", line, 7))
             {
                //only switch off motion vectors if motion alarm is turned off
-               if (gMotionAlarm == 0)
+               if (pState->motionAlarm == 0)
                {
                   if (1 == sscanf(line, "motion=%d\n", &iPar))
                      SwitchMotionVectorsOnFly(pState, iPar);
@@ -972,11 +1345,73 @@ void receive_commands(RASPIVID_STATE* pState)
             {
                 my_raspicamcontrol_zoom_in_zoom_out(pState->camera_component, line[5]);
             }
+            else if (!strncmp("idr=", line, 4))
+            {
+               //e.g. a relay that has a new viewer but no IDR cached
+               if (MMAL_SUCCESS != mmal_port_parameter_set_boolean(encoder_output_port, MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME, 1))
+                  fprintf(stderr, "%d\n", __LINE__);
+            }
+            else if (!strncmp("snapshot", line, 8))
+            {
+               //"snapshot" sends the JPEG back over this connection, "snapshot=/path/file.jpg" writes it on the Pi
+               char path[256] = "";
+
+               if (line[8] == '=')
+                  sscanf(line + 9, "%255[^\n]", path);
+               snapshot_request(pState, path);
+            }
+            else if (!strncmp("evlog=", line, 6))
+            {
+               evlog_reply(pState, line + 6);
+            }
+            else if (!strncmp("telemetry", line, 9))
+            {
+               telemetry_reply(pState);
+            }
+            else if (!strncmp("watchdog", line, 8))
+            {
+               watchdog_reply(pState);
+            }
+            else if (!strncmp("frames", line, 6))
+            {
+               loss_reply(pState);
+            }
+            else if (!strncmp("serial", line, 6))
+            {
+               serial_reply();
+            }
+            else if (!strncmp("multipath", line, 9))
+            {
+               multipath_reply();
+            }
+            else if (!strncmp("pause", line, 5))
+            {
+               capture_pause(pState, true);
+            }
+            else if (!strncmp("resume", line, 6))
+            {
+               capture_pause(pState, false);
+            }
+            else if (('\n' == line[0]) && (WAIT_METHOD_KEYPRESS == pState->waitMethod))
+            {
+               //-keypress with the commands on stdin (-o -): ENTER
+               capture_pause(pState, !capture_paused());
+            }
+            else if (!strncmp("enclat", line, 6))
+            {
+               //"enclat" prints the histograms since the start, "enclat=0" also clears them
+               enc_lat_print(pState, true, line[6] == '=');
+            }
+            else if (!strncmp("key=", line, 4))
+            {
+               //new key sealed under the current one, see aead_rotate_seal()
+               aead_rotate_key(pState, line + 4);
+            }
             else if (!strncmp("mot_alarm=", line, 10))
             {
-               if (1 == sscanf(line, "mot_alarm=%d\n", &gMotionAlarm))
+               if (1 == sscanf(line, "mot_alarm=%d\n", &pState->motionAlarm))
                {
-                  SwitchMotionVectorsOnFly(pState, (gMotionAlarm==0)?(0):(1));
+                  SwitchMotionVectorsOnFly(pState, (pState->motionAlarm==0)?(0):(1));
                }
             }
 
@@ -1077,6 +1512,7 @@ static FILE *open_filename(RASPIVID_STATE *pState, char *filename, int* pSockFD)
                         if (setsockopt(sfd, SOL_SOCKET, SO_SNDTIMEO, (char *) &timeout, sizeof(timeout)) < 0)
                            fprintf(stderr, "setsockopt failed\n");
                         fprintf(stderr, "Client connected from %s:%"SCNu16"\n", inet_ntoa(cli_addr.sin_addr), ntohs(cli_addr.sin_port));
+                        evlog_add(gEvLog, EVLOG_CONNECT, 0, 0, (uint64_t)ntohl(cli_addr.sin_addr.s_addr) << 16 | ntohs(cli_addr.sin_port));
                      }
                      else
                         fprintf(stderr, "Error on accept: %s\n", strerror(errno));
@@ -1121,6 +1557,18 @@ static FILE *open_filename(RASPIVID_STATE *pState, char *filename, int* pSockFD)
          if(pSockFD)
             *pSockFD = sfd;
       }
+      else if (!strncmp("serial://", filename, 9))
+      {
+         new_handle = serial_open(filename + 9);
+      }
+      else if (!strncmp("multipath://", filename, 12))
+      {
+         new_handle = multipath_open(filename + 12);
+      }
+      else if (!strcmp(filename, "-"))
+      {
+         new_handle = stdout;
+      }
       else
       {
          new_handle = fopen(filename, "wb");
@@ -1143,73 +1591,188 @@ void my_annotate (MMAL_COMPONENT_T *camera, const char *string)
    mmal_port_parameter_set(camera->control, &annotate.hdr);
 }
 
-void handle_frame_end(PORT_USERDATA *pData)
+/*
+ * Capture to encoder output latency. buffer->pts is the camera STC (RAW_STC mode) at
+ * capture, the STC is mapped onto CLOCK_MONOTONIC by reading MMAL_PARAMETER_SYSTEM_TIME
+ * once a second between two clock reads and keeping the reading with the shortest
+ * round trip out of every 8. Frames are counted when their last buffer arrives.
+ * With -slices also the first buffer of every frame: the difference is what a
+ * sender that waits for whole frames adds.
+ */
+#define ENC_LAT_SYNC_US 1000000
+#define ENC_LAT_SYNC_WINDOW 8
+
+static struct
+{
+   pthread_mutex_t lock;
+   int64_t offset_us;                   /// CLOCK_MONOTONIC - STC, 0 until the first sync
+   int64_t rtt_us;                      /// round trip of the reading offset_us comes from
+   int64_t next_sync_us;
+   int64_t win_offset_us, win_rtt_us;   /// best reading of the current window
+   int win_n;
+   int64_t next_print_us;
+   LAT_HIST hist[3];                    /// [0] P frames, [1] I frames, [2] first slice of a frame (-slices)
+} gEncLat = { PTHREAD_MUTEX_INITIALIZER };
+
+static int64_t monotonic_us(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void enc_lat_sync(MMAL_PORT_T *port, int64_t now)
+{
+   uint64_t stc;
+   int64_t before = monotonic_us(), after;
+
+   if (MMAL_SUCCESS != mmal_port_parameter_get_uint64(port, MMAL_PARAMETER_SYSTEM_TIME, &stc))
+      return;
+   after = monotonic_us();
+   if (!gEncLat.win_n || (after - before < gEncLat.win_rtt_us))
+   {
+      gEncLat.win_rtt_us = after - before;
+      gEncLat.win_offset_us = before + (after - before) / 2 - (int64_t)stc;
+   }
+   //the first reading is used right away, then one per window
+   if (!gEncLat.offset_us || (++gEncLat.win_n == ENC_LAT_SYNC_WINDOW))
+   {
+      gEncLat.offset_us = gEncLat.win_offset_us;
+      gEncLat.rtt_us = gEncLat.win_rtt_us;
+      gEncLat.win_n = 0;
+   }
+   gEncLat.next_sync_us = now + ENC_LAT_SYNC_US;
+}
+
+static void enc_lat_print(RASPIVID_STATE *pState, bool bBars, bool bReset)
+{
+   char name[64];
+
+   pthread_mutex_lock(&gEncLat.lock);
+   fprintf(stderr, "encoder latency capture->callback %dx%d@%d sensor mode %d, intra refresh %d, level %d (STC sync rtt %lld us)\n",
+           pState->width, pState->height, pState->framerate, pState->sensor_mode, pState->intra_refresh_type,
+           pState->level, (long long)gEncLat.rtt_us);
+   snprintf(name, sizeof(name), "%dx%d I", pState->width, pState->height);
+   lat_hist_print(stderr, name, &gEncLat.hist[1], bBars);
+   name[strlen(name) - 1] = 'P';
+   lat_hist_print(stderr, name, &gEncLat.hist[0], bBars);
+   if (gEncLat.hist[2].n)
+   {
+      snprintf(name, sizeof(name), "%dx%d first slice", pState->width, pState->height);
+      lat_hist_print(stderr, name, &gEncLat.hist[2], bBars);
+   }
+   if (bReset)
+   {
+      lat_hist_reset(&gEncLat.hist[0]);
+      lat_hist_reset(&gEncLat.hist[1]);
+      lat_hist_reset(&gEncLat.hist[2]);
+   }
+   pthread_mutex_unlock(&gEncLat.lock);
+}
+
+static void enc_lat_frame(RASPIVID_STATE *pState, MMAL_BUFFER_HEADER_T *buffer)
+{
+   int64_t now = monotonic_us();
+
+   if (buffer->pts == MMAL_TIME_UNKNOWN)
+      return;
+   pthread_mutex_lock(&gEncLat.lock);
+   if (now >= gEncLat.next_sync_us)
+      enc_lat_sync(pState->camera_component->control, now);
+   if (gEncLat.offset_us)
+      lat_hist_add(&gEncLat.hist[!!(buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME)], now - (buffer->pts + gEncLat.offset_us));
+   pthread_mutex_unlock(&gEncLat.lock);
+
+   if (pState->encLat && (now >= gEncLat.next_print_us))
+   {
+      if (gEncLat.next_print_us)
+         enc_lat_print(pState, false, false);
+      gEncLat.next_print_us = now + pState->encLat * 1000000LL;
+   }
+}
+
+/* -slices: the first buffer of a frame, the callback may send it before the frame is encoded */
+static void enc_lat_slice(MMAL_BUFFER_HEADER_T *buffer)
+{
+   int64_t now = monotonic_us();
+
+   if (buffer->pts == MMAL_TIME_UNKNOWN)
+      return;
+   pthread_mutex_lock(&gEncLat.lock);
+   if (gEncLat.offset_us)
+      lat_hist_add(&gEncLat.hist[2], now - (buffer->pts + gEncLat.offset_us));
+   pthread_mutex_unlock(&gEncLat.lock);
+}
+
+static void loss_frame(RASPIVID_STATE *pState, MMAL_BUFFER_HEADER_T *buffer)
+{
+   int64_t period_us, sensor_us, gap;
+   int slots, sensor_slots;
+
+   if ((buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG) || (buffer->pts == MMAL_TIME_UNKNOWN) || (pState->framerate <= 0))
+      return;
+   period_us = 1000000 / pState->framerate;
+   sensor_us = period_us;
+   pthread_mutex_lock(&gCamSettings.lock);
+   if (gCamSettings.bValid && (gCamSettings.exposure > sensor_us))
+      sensor_us = gCamSettings.exposure;
+   pthread_mutex_unlock(&gCamSettings.lock);
+
+   pthread_mutex_lock(&gLoss.lock);
+   gLoss.frames++;
+   gap = buffer->pts - gLoss.last_pts;
+   //a second and more is a stopped pipeline, not lost frames
+   if (gLoss.last_pts && (gap > 0) && (gap < 1000000))
+   {
+      slots = (int)((gap + period_us / 2) / period_us);
+      sensor_slots = (int)((gap + sensor_us / 2) / sensor_us);
+      if (sensor_slots < 1)
+         sensor_slots = 1;
+      if (slots < sensor_slots)
+         slots = sensor_slots;
+      if ((MMAL_VIDEO_RATECONTROL_VARIABLE_SKIP_FRAMES == pState->rateControl) ||
+          (MMAL_VIDEO_RATECONTROL_CONSTANT_SKIP_FRAMES == pState->rateControl))
+      {
+         gLoss.encoder_skips += sensor_slots - 1;
+         gLoss.sensor_drops += slots - sensor_slots;
+      }
+      else
+         gLoss.sensor_drops += slots - 1;
+   }
+   gLoss.last_pts = buffer->pts;
+   pthread_mutex_unlock(&gLoss.lock);
+}
+
+void handle_frame_end(PORT_USERDATA *pData, MMAL_BUFFER_HEADER_T *buffer)
 {
    pData->pstate->i64FramesCnt++;
+   enc_lat_frame(pData->pstate, buffer);
+   lowlight_frame(pData->pstate, buffer);
+   loss_frame(pData->pstate, buffer);
    if(0 == pData->pstate->callback_data.runTimeShowStat)
       return;
    int64_t time_us = vcos_getmicrosecs64();
    static int64_t last_frame_time_us = -1;
    char strFPS[164];
    float fFPS = 1000000.0/(time_us-last_frame_time_us);
-   snprintf(strFPS, sizeof(strFPS), "FPS=%2.1f, %llu, %.2" SCNu8 ", %llu", fFPS, pData->pstate->i64FramesCnt, pData->lastFrameMotion, pData->pstate->i64FramesSkip);
+   snprintf(strFPS, sizeof(strFPS), "FPS=%2.1f, %llu, %.2" SCNu8 ", %llu, skip %llu/%llu", fFPS, pData->pstate->i64FramesCnt, pData->lastFrameMotion,
+            pData->pstate->i64FramesSkip, (unsigned long long)gLoss.encoder_skips, (unsigned long long)gLoss.sensor_drops);
    my_annotate(pData->pstate->camera_component, strFPS);
    last_frame_time_us = time_us;
 }
 
 
-typedef struct
-{
-   signed char x_vector;
-   signed char y_vector;
-   short sad;
-} INLINE_MOTION_VECTOR;
+typedef MOTION_VECTOR INLINE_MOTION_VECTOR;
 
 #define MOTION_DEBUG_STRONGNESS (1<<0)//1
 #define MOTION_DEBUG_STATISTICS (1<<1)//2
-#include <math.h>
-unsigned char DetectMotion(INLINE_MOTION_VECTOR *imv, RASPIVID_STATE *pstate)
-{
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
-   int64_t t_b;
-   if(pstate->motion_verbose & MOTION_DEBUG_STRONGNESS)
-      t_b = vcos_getmicrosecs64();
-   unsigned short x,j;
-   double sum = 0;
-   unsigned char max_vx=0, max_vy=0, max_vxvy=0;
-   //printf("\033[2J");//clear terminal
-   for(j=0; j<pstate->mby; j++)
-   {
-      for(x=0; x<pstate->mbx; x++)
-      {
-         signed char vx =-imv[x+(pstate->mbx+1)*j].x_vector;
-         signed char vy = imv[x+(pstate->mbx+1)*j].y_vector;
-         max_vxvy = MAX(max_vxvy, (unsigned char)sqrt(vx*vx+vy*vy));
-         /*max_vx=MAX(max_vx, abs(vx));
-         max_vy=MAX(max_vy, abs(vy));*/
-         //fprintf(stderr, "%.3d,%.3d|", vx,vy);
-
-         //sum += sqrt(vx*vx+vy*vy);
-         /*if(sum > pstate->motion_threshold)
-            goto _loop_end;*/
-         /*if((abs(vx) > pstate->motion_threshold)||
-               (abs(vy) > pstate->motion_threshold))
-         {
-            if(pstate->motion_verbose & MOTION_DEBUG_STRONGNESS)
-                  fprintf(stderr, "max_vx=%d, max_vy=%d, time us=%llu\n", max_vx, max_vy, vcos_getmicrosecs64() - t_b);
-            return 1;
-         }*/
-      }
-   }
-return max_vxvy;
-   if(pstate->motion_verbose & MOTION_DEBUG_STRONGNESS)
-      fprintf(stderr, "max_vx=%d, max_vy=%d, time us=%llu\n", max_vx, max_vy, vcos_getmicrosecs64() - t_b);
-   return 0;
-   //_loop_end:
-   if(sum > pstate->motion_threshold)
-      return 1;
-   return 0;
+
+/* length of the longest motion vector of the frame, see common/motion.h */
+unsigned char DetectMotion(INLINE_MOTION_VECTOR *imv, RASPIVID_STATE *pstate)
+{
+   return motion_strength(imv, pstate->mbx, pstate->mby);
 }
 
 void PrintDataType(PORT_USERDATA *pData, MMAL_BUFFER_HEADER_T *buffer)
@@ -1238,60 +1801,402 @@ void PrintDataType(PORT_USERDATA *pData, MMAL_BUFFER_HEADER_T *buffer)
    fprintf(stderr, "\n");
 }
 
+/* -m android -slices: bit 31 of the length prefix, more of this frame follows; the last part of a frame goes without it */
+#define ANDROID_LEN_SLICE 0x80000000u
+
 typedef enum ANDROID_DATA_TYPES
 {
     CurrentResolution=0,
     RegularFrame,
     MotionInFrame,
-    MotionAlarm
+    MotionAlarm,
+    Snapshot,
+    EventLog,
+    Telemetry,
+    CameraMode
 } ANDROID_DATA_TYPES;
 
 
-void SendToAndroid(int sockFD, void* buf, size_t len)
+/* one message in one syscall, the lock keeps messages of the encoder callback and of other threads (snapshots, replies) apart */
+void SendToAndroidV(int sockFD, struct iovec* iov, int iovcnt)
 {
    //size of an unsent data in skb
    /*#include <sys/ioctl.h>
    unsigned long size;
    ioctl( sockFD, TIOCOUTQ, &size );
    fprintf(stderr, "%d\n", size);*/
-
-   if(len != send(sockFD, buf, len, MSG_NOSIGNAL))
+   static pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
+   struct msghdr msg = {};
+   size_t len = 0;
+   int i;
+   bool bOK;
+
+   for (i = 0; i < iovcnt; i++)
+      len += iov[i].iov_len;
+   msg.msg_iov = iov;
+   msg.msg_iovlen = iovcnt;
+
+   pthread_mutex_lock(&send_lock);
+   bOK = len == rpi_tls_sendmsg(&gTls, &msg, MSG_NOSIGNAL);
+   //unlocked first, other senders must not block on it while exit() runs
+   pthread_mutex_unlock(&send_lock);
+   if (!bOK)
+   {
+      evlog_add(gEvLog, EVLOG_DISCONNECT, 0, 0, 0);
       exit(__LINE__);//TCP connection closed, stop program
+   }
 }
-MMAL_BUFFER_HEADER_T* p_buf_partial_begin = NULL;
 
-static void encoder_buffer_callback_android_dimon(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+void SendToAndroid(int sockFD, void* buf, size_t len)
 {
-   MMAL_BUFFER_HEADER_T *new_buffer;
-   PORT_USERDATA *pData = (PORT_USERDATA *)port->userdata;
+   struct iovec iov = { buf, len };
+   SendToAndroidV(sockFD, &iov, 1);
+}
 
-   if (pData)
-   {
-      if (buffer->length)
-      {
-         mmal_buffer_header_mem_lock(buffer);
+/* [type][len4][data] message besides the video, only the android_motion stream is typed, returns false in other modes */
+bool SendTypedToAndroid(RASPIVID_STATE *pState, ANDROID_DATA_TYPES type, const void* buf, uint32_t len)
+{
+   unsigned char dataType = type;
+   struct iovec iov[] = {{&dataType, 1}, {&len, 4}, {(void*)buf, len}};
 
-         //PrintDataType(pData, buffer);
+   if (pState->enc_cb_func != encoder_buffer_callback_android_motion)
+      return false;
+   SendToAndroidV(pState->callback_data.sockFD, iov, 3);
+   return true;
+}
+/// Motion events: pre-roll ring of the encoded stream, clip writer and publishing
+#define PREROLL_MAX_FRAMES  2048
 
-         if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG)
-         {
-            static char dimon_sps_buf[30];
-            static uint32_t dimon_sps_len = 0;
-            //sps/pps comes in 2 callbacks
-            if(dimon_sps_len == 0)//do not send a first part of sps/pps immediately
-            {//but store it temporarly
-               if(sizeof(dimon_sps_buf) < buffer->length)
-                  exit(__LINE__);
-               dimon_sps_len = buffer->length;
-               memcpy(dimon_sps_buf, buffer->data, dimon_sps_len);
-            }
-            else
-            {//wait for the second part and send both parts in one chunk
-               uint32_t uiTmp = dimon_sps_len;
-               dimon_sps_len += buffer->length;
-               SendToAndroid(pData->sockFD, &dimon_sps_len, 4);
-               SendToAndroid(pData->sockFD, &dimon_sps_buf, uiTmp);
-               SendToAndroid(pData->sockFD, buffer->data, buffer->length);
+typedef struct
+{
+   uint64_t pos;                        /// free running byte position in the ring
+   uint32_t len;
+   int64_t time_us;                     /// vcos_getmicrosecs64() when it came out of the encoder
+   bool bKey;
+} PREROLL_FRAME;
+
+static struct
+{
+   pthread_mutex_t lock;
+   pthread_cond_t cond;                 /// wakes the clip writer: new frame or new event
+   bool bEnabled;
+
+   unsigned char *data;                 /// the ring, NULL if clips are not written
+   uint64_t size;
+   uint64_t wr_pos;
+   PREROLL_FRAME f[PREROLL_MAX_FRAMES];
+   uint64_t f_rd, f_wr;                 /// free running frame indexes
+   unsigned char config[256];           /// SPS/PPS, every clip starts with it
+   uint32_t config_len;
+
+   bool bActive;                        /// an event is open
+   bool bWaitKey;                       /// the clip starts at the next IDR
+   uint64_t cursor;                     /// next frame for the clip writer
+   int64_t first_us, last_us;           /// first and last alarm of the open event
+   EVENT_RECORD rec;
+
+   bool bPublish;
+   EVENT_PUBLISHER pub;
+} gEvent = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void preroll_copy_in(uint64_t pos, const void *src, uint32_t len)
+{
+   uint64_t off = pos % gEvent.size;
+   uint32_t first = MIN(len, gEvent.size - off);
+
+   memcpy(gEvent.data + off, src, first);
+   memcpy(gEvent.data, (const unsigned char *)src + first, len - first);
+}
+
+static void preroll_copy_out(uint64_t pos, void *dst, uint32_t len)
+{
+   uint64_t off = pos % gEvent.size;
+   uint32_t first = MIN(len, gEvent.size - off);
+
+   memcpy(dst, gEvent.data + off, first);
+   memcpy((unsigned char *)dst + first, gEvent.data, len - first);
+}
+
+/* called by the encoder callback for every complete frame, the oldest frames are overwritten */
+static void event_push_frame(struct iovec *iov, int iovcnt, bool bKey)
+{
+   PREROLL_FRAME *fr;
+   uint32_t len = 0;
+   int i;
+
+   if (!gEvent.data)
+      return;
+   for (i = 0; i < iovcnt; i++)
+      len += iov[i].iov_len;
+   if (len > gEvent.size)
+      return;
+
+   pthread_mutex_lock(&gEvent.lock);
+   while ((gEvent.f_rd < gEvent.f_wr) &&
+          ((gEvent.f_wr - gEvent.f_rd == PREROLL_MAX_FRAMES) ||
+           (gEvent.wr_pos + len - gEvent.f[gEvent.f_rd % PREROLL_MAX_FRAMES].pos > gEvent.size)))
+      gEvent.f_rd++;
+   fr = &gEvent.f[gEvent.f_wr % PREROLL_MAX_FRAMES];
+   fr->pos = gEvent.wr_pos;
+   fr->len = len;
+   fr->time_us = vcos_getmicrosecs64();
+   fr->bKey = bKey;
+   for (i = 0; i < iovcnt; i++)
+   {
+      preroll_copy_in(gEvent.wr_pos, iov[i].iov_base, iov[i].iov_len);
+      gEvent.wr_pos += iov[i].iov_len;
+   }
+   gEvent.f_wr++;
+   if (gEvent.bActive)
+      pthread_cond_signal(&gEvent.cond);
+   pthread_mutex_unlock(&gEvent.lock);
+}
+
+static void event_push_config(const void *data, uint32_t len)
+{
+   if (!gEvent.data || len > sizeof(gEvent.config))
+      return;
+   pthread_mutex_lock(&gEvent.lock);
+   memcpy(gEvent.config, data, len);
+   gEvent.config_len = len;
+   pthread_mutex_unlock(&gEvent.lock);
+}
+
+/* motion above the alarm level: opens an event or keeps the open one going */
+static void event_alarm(RASPIVID_STATE *pState, INLINE_MOTION_VECTOR *imv, unsigned char mot)
+{
+   int64_t now = vcos_getmicrosecs64();
+   uint16_t zones;
+
+   if (!gEvent.bEnabled)
+      return;
+   zones = motion_zones(imv, pState->mbx, pState->mby, pState->motionAlarm);
+
+   pthread_mutex_lock(&gEvent.lock);
+   if (!gEvent.bActive)
+   {
+      struct timespec ts;
+
+      clock_gettime(CLOCK_REALTIME, &ts);
+      memset(&gEvent.rec, 0, sizeof(gEvent.rec));
+      gEvent.rec.time_us = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+      gEvent.first_us = now;
+      if (gEvent.data)
+      {
+         int64_t preroll_from = now - (int64_t)pState->preRoll * 1000000;
+         bool bFound = false;
+         uint64_t i;
+         struct tm tm;
+         char stamp[32];
+
+         strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime_r(&ts.tv_sec, &tm));
+         snprintf(gEvent.rec.clip, sizeof(gEvent.rec.clip), "%s/event-%s.h264", pState->eventDir, stamp);
+
+         //the last IDR at least preRoll before the alarm, or the oldest one we still have
+         gEvent.cursor = gEvent.f_wr;
+         for (i = gEvent.f_rd; i < gEvent.f_wr; i++)
+         {
+            PREROLL_FRAME *fr = &gEvent.f[i % PREROLL_MAX_FRAMES];
+
+            if (fr->bKey && (!bFound || fr->time_us <= preroll_from))
+            {
+               gEvent.cursor = i;
+               bFound = true;
+            }
+         }
+         gEvent.bWaitKey = !bFound;
+         //no IDR in the ring (e.g. --intra 0), the clip has no pre-roll but starts right away
+         if (!bFound && MMAL_SUCCESS != mmal_port_parameter_set_boolean(encoder_output_port, MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME, 1))
+            fprintf(stderr, "%d\n", __LINE__);
+      }
+      gEvent.bActive = true;
+      pthread_cond_signal(&gEvent.cond);
+      evlog_add(gEvLog, EVLOG_EVENT_OPEN, 0, mot, zones);
+   }
+   gEvent.last_us = now;
+   gEvent.rec.zones |= zones;
+   gEvent.rec.strength = MAX(gEvent.rec.strength, mot);
+   pthread_mutex_unlock(&gEvent.lock);
+}
+
+/* writes the clip while the event is open, closes and publishes it postRoll after the last alarm */
+static void *event_writer(void *arg)
+{
+   RASPIVID_STATE *pState = (RASPIVID_STATE *)arg;
+   int64_t postroll_us = (int64_t)pState->postRoll * 1000000;
+   unsigned char *frame = NULL;
+   uint32_t frame_cap = 0;
+   FILE *fp = NULL;
+
+   pthread_mutex_lock(&gEvent.lock);
+   for (;;)
+   {
+      struct timespec ts;
+
+      if (!gEvent.bActive)
+      {
+         pthread_cond_wait(&gEvent.cond, &gEvent.lock);
+         continue;
+      }
+
+      if (gEvent.data && !fp && gEvent.rec.clip[0])
+      {
+         unsigned char config[sizeof(gEvent.config)];
+         uint32_t config_len = gEvent.config_len;
+         char clip[sizeof(gEvent.rec.clip)];
+
+         memcpy(config, gEvent.config, config_len);
+         strcpy(clip, gEvent.rec.clip);
+         pthread_mutex_unlock(&gEvent.lock);
+         fp = fopen(clip, "wb");
+         if (!fp)
+            fprintf(stderr, "event: cannot create %s: %s\n", clip, strerror(errno));
+         else if (config_len != fwrite(config, 1, config_len, fp))
+            fprintf(stderr, "event: cannot write %s: %s\n", clip, strerror(errno));
+         pthread_mutex_lock(&gEvent.lock);
+         if (!fp)
+            gEvent.rec.clip[0] = 0;
+      }
+
+      while (fp && gEvent.cursor < gEvent.f_wr)
+      {
+         PREROLL_FRAME fr;
+
+         if (gEvent.cursor < gEvent.f_rd)
+         {
+            //the disk is slower than the encoder, skip to the next IDR
+            fprintf(stderr, "event: clip writer overrun, %llu frames lost\n", (unsigned long long)(gEvent.f_rd - gEvent.cursor));
+            gEvent.cursor = gEvent.f_rd;
+            gEvent.bWaitKey = true;
+         }
+         fr = gEvent.f[gEvent.cursor++ % PREROLL_MAX_FRAMES];
+         if (gEvent.bWaitKey && !fr.bKey)
+            continue;
+         gEvent.bWaitKey = false;
+         if (fr.len > frame_cap)
+         {
+            free(frame);
+            frame_cap = fr.len;
+            if (NULL == (frame = malloc(frame_cap)))
+               exit(__LINE__);
+         }
+         preroll_copy_out(fr.pos, frame, fr.len);
+         pthread_mutex_unlock(&gEvent.lock);
+         if (fr.len != fwrite(frame, 1, fr.len, fp))
+            fprintf(stderr, "event: write error %s\n", strerror(errno));
+         pthread_mutex_lock(&gEvent.lock);
+      }
+
+      if (vcos_getmicrosecs64() >= gEvent.last_us + postroll_us)
+      {
+         EVENT_RECORD rec = gEvent.rec;
+
+         rec.duration_ms = (gEvent.last_us + postroll_us - gEvent.first_us) / 1000;
+         gEvent.bActive = false;
+         pthread_mutex_unlock(&gEvent.lock);
+         evlog_add(gEvLog, EVLOG_EVENT_CLOSE, 0, rec.duration_ms, rec.zones);
+         if (fp)
+         {
+            fclose(fp);
+            fp = NULL;
+         }
+         if (gEvent.bPublish)
+            event_publish(&gEvent.pub, &rec);
+         if (pState->verbose)
+            fprintf(stderr, "event: %d ms, zones 0x%x, strength %u, clip '%s'\n", rec.duration_ms, rec.zones, rec.strength, rec.clip);
+         pthread_mutex_lock(&gEvent.lock);
+         continue;
+      }
+
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += 100000000;
+      if (ts.tv_nsec >= 1000000000)
+      {
+         ts.tv_sec++;
+         ts.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&gEvent.cond, &gEvent.lock, &ts);
+   }
+   return NULL;
+}
+
+/**
+ * Start the pre-roll ring, the clip writer and the publisher if -evdir or -evurl is given
+ *
+ * @param pState Pointer to state control struct
+ *
+ */
+static void event_setup(RASPIVID_STATE *pState)
+{
+   pthread_t thread;
+
+   if (!pState->eventDir && !pState->eventUrl)
+      return;
+   if (pState->enc_cb_func != encoder_buffer_callback_android_motion)
+      fprintf(stderr, "motion events need the motion alarm, use -m android_motion\n");
+
+   if (pState->eventUrl)
+   {
+      if (!event_publisher_start(&gEvent.pub, pState->eventUrl, pState->verbose))
+      {
+         fprintf(stderr, "'%s' is not mqtt://ip:port/topic or http://ip:port/path\n", pState->eventUrl);
+         exit(EX_USAGE);
+      }
+      gEvent.bPublish = true;
+   }
+
+   if (pState->eventDir)
+   {
+      //pre-roll plus some slack for a slow disk, at the stream bit rate (qp mode: assume 8 MBit/s)
+      gEvent.size = (uint64_t)(pState->preRoll + 2) * (pState->bitrate ? pState->bitrate : 8000000) / 8;
+      if (gEvent.size < (1 << 20))
+         gEvent.size = 1 << 20;
+      if (NULL == (gEvent.data = malloc(gEvent.size)))
+      {
+         fprintf(stderr, "no memory for %llu bytes of pre-roll\n", (unsigned long long)gEvent.size);
+         exit(__LINE__);
+      }
+   }
+
+   if (pthread_create(&thread, NULL, event_writer, pState))
+      exit(__LINE__);
+   pthread_detach(thread);
+   gEvent.bEnabled = true;
+}
+
+MMAL_BUFFER_HEADER_T* p_buf_partial_begin = NULL;
+
+static void encoder_buffer_callback_android_dimon(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+   MMAL_BUFFER_HEADER_T *new_buffer;
+   PORT_USERDATA *pData = (PORT_USERDATA *)port->userdata;
+
+   if (pData)
+   {
+      if (buffer->length && !pause_drop(buffer))
+      {
+         mmal_buffer_header_mem_lock(buffer);
+
+         //PrintDataType(pData, buffer);
+
+         if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG)
+         {
+            static char dimon_sps_buf[30];
+            static uint32_t dimon_sps_len = 0;
+            //sps/pps comes in 2 callbacks
+            if(dimon_sps_len == 0)//do not send a first part of sps/pps immediately
+            {//but store it temporarly
+               if(sizeof(dimon_sps_buf) < buffer->length)
+                  exit(__LINE__);
+               dimon_sps_len = buffer->length;
+               memcpy(dimon_sps_buf, buffer->data, dimon_sps_len);
+            }
+            else
+            {//wait for the second part and send both parts in one chunk
+               uint32_t uiTmp = dimon_sps_len;
+               dimon_sps_len += buffer->length;
+               struct iovec iov[] = {{&dimon_sps_len, 4}, {&dimon_sps_buf, uiTmp}, {buffer->data, buffer->length}};
+               SendToAndroidV(pData->sockFD, iov, 3);
             }
          }
          else
@@ -1318,9 +2223,10 @@ static void encoder_buffer_callback_android_dimon(MMAL_PORT_T *port, MMAL_BUFFER
                      uint32_t all_length = p_buf_partial_begin->length + buffer->length;
 
                      //printf("    partial, p_buf_partial_begin->length=%u, buffer->length=%u, all_length=0x%x\n", p_buf_partial_begin->length, buffer->length, all_length);
-                     SendToAndroid(pData->sockFD, &all_length,                      4);   //send first the length of a frame
-                     SendToAndroid(pData->sockFD, p_buf_partial_begin->data, p_buf_partial_begin->length);   //send the frame
-                     SendToAndroid(pData->sockFD, buffer->data,                    buffer->length);   //send the frame
+                     struct iovec iov[] = {{&all_length, 4},   //send first the length of a frame
+                                           {p_buf_partial_begin->data, p_buf_partial_begin->length},   //send the frame
+                                           {buffer->data, buffer->length}};
+                     SendToAndroidV(pData->sockFD, iov, 3);
                      mmal_buffer_header_mem_unlock(p_buf_partial_begin);
                      mmal_buffer_header_release(p_buf_partial_begin);
                      if (port->is_enabled)
@@ -1339,10 +2245,11 @@ static void encoder_buffer_callback_android_dimon(MMAL_PORT_T *port, MMAL_BUFFER
                   else
                   {
                      //printf("not buffer->length=%d, buffer->length=0x%x\n", buffer->length, buffer->length);
-                     SendToAndroid(pData->sockFD, &buffer->length, 4);   //send first the length of a frame
-                     SendToAndroid(pData->sockFD, buffer->data, buffer->length);   //send the frame
+                     struct iovec iov[] = {{&buffer->length, 4},   //send first the length of a frame
+                                           {buffer->data, buffer->length}};   //send the frame
+                     SendToAndroidV(pData->sockFD, iov, 2);
                   }
-                  handle_frame_end(pData);
+                  handle_frame_end(pData, buffer);
                }
             }
          }//if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG)
@@ -1381,7 +2288,7 @@ static void encoder_buffer_callback_android_motion(MMAL_PORT_T *port, MMAL_BUFFE
 
    if (pData)
    {
-      if (buffer->length)
+      if (buffer->length && !pause_drop(buffer))
       {
          uint8_t dataType;
          mmal_buffer_header_mem_lock(buffer);
@@ -1391,8 +2298,9 @@ static void encoder_buffer_callback_android_motion(MMAL_PORT_T *port, MMAL_BUFFE
          if ((!b_config_sent) && buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG)
          {
             b_config_sent = true;
-            SendToAndroid(pData->sockFD, &buffer->length, 4);
-            SendToAndroid(pData->sockFD, buffer->data, buffer->length);
+            struct iovec iov[] = {{&buffer->length, 4}, {buffer->data, buffer->length}};
+            SendToAndroidV(pData->sockFD, iov, 2);
+            event_push_config(buffer->data, buffer->length);
          }
          else
          {
@@ -1400,14 +2308,22 @@ static void encoder_buffer_callback_android_motion(MMAL_PORT_T *port, MMAL_BUFFE
             if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO)
             {   //motion vectors
                dataType = (uint8_t)MotionInFrame;
-               SendToAndroid(pData->sockFD, &dataType, 1);
                unsigned char mot = DetectMotion((INLINE_MOTION_VECTOR*) &buffer->data[0], pData->pstate);
-               SendToAndroid(pData->sockFD, &mot, 1);
+               struct iovec iov[] = {{&dataType, 1}, {&mot, 1}};
+               SendToAndroidV(pData->sockFD, iov, 2);
 
-               if((gMotionAlarm != 0) && ((int)mot) > gMotionAlarm)
+               if((pData->pstate->motionAlarm != 0) && ((int)mot) > pData->pstate->motionAlarm)
                {
                   dataType = (uint8_t)MotionAlarm;
                   SendToAndroid(pData->sockFD, &dataType, 1);
+                  event_alarm(pData->pstate, (INLINE_MOTION_VECTOR*) &buffer->data[0], mot);
+
+                  static int64_t last_alarm_log_us = 0;//the alarm fires every frame, log it once a second
+                  if (vcos_getmicrosecs64() - last_alarm_log_us >= 1000000)
+                  {
+                     last_alarm_log_us = vcos_getmicrosecs64();
+                     evlog_add(gEvLog, EVLOG_ALARM, 0, mot, 0);
+                  }
                }
             }
             else
@@ -1430,10 +2346,12 @@ static void encoder_buffer_callback_android_motion(MMAL_PORT_T *port, MMAL_BUFFE
 
                      //printf("    partial, p_buf_partial_begin->length=%u, buffer->length=%u, all_length=0x%x\n", p_buf_partial_begin->length, buffer->length, all_length);
 
-                     SendToAndroid(pData->sockFD, &dataType,                        1);
-                     SendToAndroid(pData->sockFD, &all_length,                      4);   //send first the length of a frame
-                     SendToAndroid(pData->sockFD, p_buf_partial_begin->data, p_buf_partial_begin->length);   //send the frame
-                     SendToAndroid(pData->sockFD, buffer->data,                    buffer->length);   //send the frame
+                     struct iovec iov[] = {{&dataType, 1},
+                                           {&all_length, 4},   //send first the length of a frame
+                                           {p_buf_partial_begin->data, p_buf_partial_begin->length},   //send the frame
+                                           {buffer->data, buffer->length}};
+                     SendToAndroidV(pData->sockFD, iov, 4);
+                     event_push_frame(&iov[2], 2, buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME);
                      mmal_buffer_header_mem_unlock(p_buf_partial_begin);
                      mmal_buffer_header_release(p_buf_partial_begin);
                      if (port->is_enabled)
@@ -1452,11 +2370,13 @@ static void encoder_buffer_callback_android_motion(MMAL_PORT_T *port, MMAL_BUFFE
                   else
                   {
                      //printf("not buffer->length=%d, buffer->length=0x%x\n", buffer->length, buffer->length);
-                     SendToAndroid(pData->sockFD, &dataType,                        1);
-                     SendToAndroid(pData->sockFD, &buffer->length, 4);   //send first the length of a frame
-                     SendToAndroid(pData->sockFD, buffer->data, buffer->length);   //send the frame
+                     struct iovec iov[] = {{&dataType, 1},
+                                           {&buffer->length, 4},   //send first the length of a frame
+                                           {buffer->data, buffer->length}};   //send the frame
+                     SendToAndroidV(pData->sockFD, iov, 3);
+                     event_push_frame(&iov[2], 1, buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME);
                   }
-                  handle_frame_end(pData);
+                  handle_frame_end(pData, buffer);
                }
             }
          }//if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG)
@@ -1495,7 +2415,7 @@ static void encoder_buffer_callback_android(MMAL_PORT_T *port, MMAL_BUFFER_HEADE
 
    if (pData)
    {
-      if (buffer->length)
+      if (buffer->length && !pause_drop(buffer))
       {
          mmal_buffer_header_mem_lock(buffer);
 
@@ -1503,8 +2423,8 @@ static void encoder_buffer_callback_android(MMAL_PORT_T *port, MMAL_BUFFER_HEADE
 
          if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG)
          {
-            SendToAndroid(pData->sockFD, &buffer->length, 4);
-            SendToAndroid(pData->sockFD, buffer->data, buffer->length);
+            struct iovec iov[] = {{&buffer->length, 4}, {buffer->data, buffer->length}};
+            SendToAndroidV(pData->sockFD, iov, 2);
          }
          else
          {
@@ -1512,6 +2432,20 @@ static void encoder_buffer_callback_android(MMAL_PORT_T *port, MMAL_BUFFER_HEADE
             if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO)
             {   //motion vectors
             }
+            else if (pData->pstate->sliceRows)
+            {   //H264 data, every slice right away, the length of all but the last one of a frame with ANDROID_LEN_SLICE
+               uint32_t len = buffer->length;
+
+               if (!pData->bMidFrame)
+                  enc_lat_slice(buffer);
+               pData->bMidFrame = !(buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END);
+               if (pData->bMidFrame)
+                  len |= ANDROID_LEN_SLICE;
+               struct iovec iov[] = {{&len, 4}, {buffer->data, buffer->length}};
+               SendToAndroidV(pData->sockFD, iov, 2);
+               if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)
+                  handle_frame_end(pData, buffer);
+            }
             else
             {   //H264 data
                if (0 == buffer->flags)
@@ -1530,9 +2464,10 @@ static void encoder_buffer_callback_android(MMAL_PORT_T *port, MMAL_BUFFER_HEADE
                      uint32_t all_length = p_buf_partial_begin->length + buffer->length;
 
                      //printf("    partial, p_buf_partial_begin->length=%u, buffer->length=%u, all_length=0x%x\n", p_buf_partial_begin->length, buffer->length, all_length);
-                     SendToAndroid(pData->sockFD, &all_length,                      4);   //send first the length of a frame
-                     SendToAndroid(pData->sockFD, p_buf_partial_begin->data, p_buf_partial_begin->length);   //send the frame
-                     SendToAndroid(pData->sockFD, buffer->data,                    buffer->length);   //send the frame
+                     struct iovec iov[] = {{&all_length, 4},   //send first the length of a frame
+                                           {p_buf_partial_begin->data, p_buf_partial_begin->length},   //send the frame
+                                           {buffer->data, buffer->length}};
+                     SendToAndroidV(pData->sockFD, iov, 3);
                      mmal_buffer_header_mem_unlock(p_buf_partial_begin);
                      mmal_buffer_header_release(p_buf_partial_begin);
                      if (port->is_enabled)
@@ -1551,10 +2486,11 @@ static void encoder_buffer_callback_android(MMAL_PORT_T *port, MMAL_BUFFER_HEADE
                   else
                   {
                      //printf("not buffer->length=%d, buffer->length=0x%x\n", buffer->length, buffer->length);
-                     SendToAndroid(pData->sockFD, &buffer->length, 4);   //send first the length of a frame
-                     SendToAndroid(pData->sockFD, buffer->data, buffer->length);   //send the frame
+                     struct iovec iov[] = {{&buffer->length, 4},   //send first the length of a frame
+                                           {buffer->data, buffer->length}};   //send the frame
+                     SendToAndroidV(pData->sockFD, iov, 2);
                   }
-                  handle_frame_end(pData);
+                  handle_frame_end(pData, buffer);
                }
             }
          }//if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG)
@@ -1593,7 +2529,7 @@ static void encoder_buffer_callback_empty(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_
 
    if (pData)
    {
-      if (buffer->length)
+      if (buffer->length && !pause_drop(buffer))
       {
          pData->ulValidCallbackCnt = 0;
          mmal_buffer_header_mem_lock(buffer);
@@ -1608,7 +2544,7 @@ static void encoder_buffer_callback_empty(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_
          {//H264 data
             if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)
             {
-               handle_frame_end(pData);
+               handle_frame_end(pData, buffer);
             }
             else
             {
@@ -1642,130 +2578,923 @@ static void encoder_buffer_callback_empty(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_
    }
 }
 
-static void encoder_buffer_callback_raw_tcp(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+/*
+ * Encrypted raw_tcp output. TCP gets one record per encoder buffer,
+ * [len 4][session][seq][ciphertext][tag], UDP one sealed packet per datagram
+ * with at most AEAD_DGRAM_PAYLOAD bytes of video, so nothing is IP fragmented
+ * and a lost datagram costs only its own bytes.
+ */
+static struct
 {
-   MMAL_BUFFER_HEADER_T *new_buffer;
-   PORT_USERDATA *pData = (PORT_USERDATA *)port->userdata;
+   bool bEnabled;
+   bool bDgram;
+   pthread_mutex_t lock;               /// the session changes under the encoder callback on a key rotation
+   AEAD_SESSION session;
+   uint8_t *buf;
+   size_t size;
+} gAead = { false, false, PTHREAD_MUTEX_INITIALIZER };
+
+static bool aead_new_session(const uint8_t *master)
+{
+   uint64_t id;
 
-   if (pData)
+   //a rotation continues above the current id, the receiver only takes newer ones
+   if (!aead_session_id(gAead.session.bStarted ? gAead.session.session : 0, &id))
+      return false;
+   aead_session_start(&gAead.session, master, id);
+   return true;
+}
+
+static void aead_setup(RASPIVID_STATE *pState)
+{
+   uint8_t master[AEAD_KEY_LEN];
+   int type = SOCK_STREAM;
+   socklen_t len = sizeof(type);
+
+   if (!pState->keyFile)
+      return;
+   if (!aead_load_key(pState->keyFile, master))
    {
-      if (buffer->length)
-      {
-         mmal_buffer_header_mem_lock(buffer);
+      fprintf(stderr, "%s: no key, 64 hex digits expected\n", pState->keyFile);
+      exit(EX_USAGE);
+   }
+   if (!aead_new_session(master))
+   {
+      fprintf(stderr, "No random numbers for the session id\n");
+      exit(EX_SOFTWARE);
+   }
+   getsockopt(pState->callback_data.sockFD, SOL_SOCKET, SO_TYPE, &type, &len);
+   gAead.bDgram = (SOCK_DGRAM == type);
+   gAead.bEnabled = true;
+}
 
-         //H264 data comes first, then comes motion vectors
-         if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO)
-         {//motion vectors
-         }
-         else
-         {//H264 data
-            if(buffer->length != send(pData->sockFD, buffer->data, buffer->length, MSG_NOSIGNAL))
-               exit(__LINE__);//TCP connection closed, stop program
-            if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)
-               handle_frame_end(pData);
-         }
+static bool aead_send(int sockFD, const uint8_t *data, uint32_t len)
+{
+   bool bOK = true;
 
-         mmal_buffer_header_mem_unlock(buffer);
+   pthread_mutex_lock(&gAead.lock);
+   if (gAead.size < (gAead.bDgram ? AEAD_DGRAM_PAYLOAD : len) + AEAD_OVERHEAD)
+   {
+      //grows to the biggest encoder buffer once, then stays
+      gAead.size = (gAead.bDgram ? AEAD_DGRAM_PAYLOAD : len) + AEAD_OVERHEAD;
+      gAead.buf = realloc(gAead.buf, gAead.size);
+      vcos_assert(gAead.buf);
+   }
+   if (gAead.bDgram)
+   {
+      while (bOK && len)
+      {
+         uint32_t chunk = (len < AEAD_DGRAM_PAYLOAD) ? len : AEAD_DGRAM_PAYLOAD;
+         size_t n = aead_packet_seal(&gAead.session, data, chunk, gAead.buf);
+
+         bOK = (n == rpi_tls_send(&gTls, gAead.buf, n, MSG_NOSIGNAL));
+         data += chunk;
+         len -= chunk;
       }
    }
    else
    {
-      vcos_log_error("Received a encoder buffer callback with no state");
-   }
+      uint32_t recLen = aead_packet_seal(&gAead.session, data, len, gAead.buf);
+      struct iovec iov[2] = { { &recLen, 4 }, { gAead.buf, recLen } };
+      struct msghdr msg = {};
 
-   // release buffer back to the pool
-   mmal_buffer_header_release(buffer);
+      msg.msg_iov = iov;
+      msg.msg_iovlen = 2;
+      bOK = (4 + recLen == rpi_tls_sendmsg(&gTls, &msg, MSG_NOSIGNAL));
+   }
+   pthread_mutex_unlock(&gAead.lock);
+   return bOK;
+}
 
-   // and send one back to the port (if still open)
-   if (port->is_enabled)
-   {
-      MMAL_STATUS_T status;
+/* the new key goes to the key file first, a restart must not fall back to the old one */
+static void aead_rotate_key(RASPIVID_STATE *pState, const char *hex)
+{
+   uint8_t key[AEAD_KEY_LEN];
 
-      new_buffer = mmal_queue_get(pData->pstate->encoder_pool->queue);
+   if (!gAead.bEnabled)
+      return;
+   pthread_mutex_lock(&gAead.lock);
+   if (strlen(hex) < AEAD_ROTATE_HEX_LEN || !aead_rotate_open(gAead.session.master, hex, key))
+      fprintf(stderr, "key rotation rejected\n");
+   else if (!aead_save_key(pState->keyFile, key))
+      fprintf(stderr, "%s: cannot save the new key, keeping the old one\n", pState->keyFile);
+   else if (!aead_new_session(key))
+      fprintf(stderr, "No random numbers for the session id\n");
+   else if (pState->verbose)
+      fprintf(stderr, "key rotated, session %016"PRIx64"\n", gAead.session.session);
+   pthread_mutex_unlock(&gAead.lock);
+}
 
-      if (new_buffer)
-         status = mmal_port_send_buffer(port, new_buffer);
+/*
+ * raw_tcp to a serial port or a telemetry radio (-o serial:///dev/ttyS0?baud=115200&mtu=200),
+ * see common/serial_link.h. The buffers of a frame are collected here and the
+ * whole frame goes to the sender thread, the SPS/PPS buffer with the IDR after it.
+ */
+static struct
+{
+   bool bEnabled;
+   unsigned baud, mtu;
+   SL_TX tx;
+   uint8_t *frame;
+   uint32_t len, size;
+   uint8_t flags;                       /// SL_FLAG_* of the frame so far
+} gSerial;
+
+static FILE *serial_open(const char *url)
+{
+   char path[256];
+   int fd;
 
-      if (!new_buffer || status != MMAL_SUCCESS)
-         vcos_log_error("Unable to return a buffer to the encoder port");
+   gSerial.baud = 115200;
+   gSerial.mtu = SL_DEFAULT_MTU;
+   if (!sl_parse_url(url, path, sizeof(path), &gSerial.baud, &gSerial.mtu) || !sl_baud(gSerial.baud))
+   {
+      fprintf(stderr, "%s is not a valid serial port, use something like serial:///dev/ttyS0?baud=115200&mtu=200 (mtu 16..%d)\n",
+              url, SL_MAX_MTU);
+      exit(EX_USAGE);
+   }
+   if ((fd = sl_open_tty(path, gSerial.baud, O_WRONLY)) < 0)
+   {
+      fprintf(stderr, "%s: %s\n", path, strerror(errno));
+      exit(EX_CANTCREAT);
    }
+   gSerial.bEnabled = true;
+   return fdopen(fd, "w");
 }
 
-char buf_prev[256000];
-int buf_len = 0;
-static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+/*
+ * a P frame was dropped for the link, the receiver waits for the next IDR.
+ * Called from the serial sender thread: a rebuild or a reconfiguration busy
+ * with the port asks for an IDR itself afterwards, nothing to do then
+ */
+static void serial_request_key(void *arg)
 {
-   MMAL_BUFFER_HEADER_T *new_buffer;
-   PORT_USERDATA *pData = (PORT_USERDATA *)port->userdata;
+   if (pthread_mutex_trylock(&gCameraReconfig))
+      return;
+   if (encoder_output_port &&
+       (MMAL_SUCCESS != mmal_port_parameter_set_boolean(encoder_output_port, MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME, 1)))
+      fprintf(stderr, "%d\n", __LINE__);
+   pthread_mutex_unlock(&gCameraReconfig);
+}
 
-   if (pData)
+static void serial_setup(RASPIVID_STATE *pState)
+{
+   if (!gSerial.bEnabled)
+      return;
+   if ((pState->enc_cb_func != encoder_buffer_callback_raw_tcp) || pState->keyFile || pState->tlsCert)
    {
-      if (buffer->length)
-      {
-         mmal_buffer_header_mem_lock(buffer);
+      fprintf(stderr, "serial:// needs -m raw_tcp and no -keyfile or -tlscert\n");
+      exit(EX_USAGE);
+   }
+   if (!sl_tx_start(&gSerial.tx, fileno(pState->callback_data.file_handle), gSerial.baud, gSerial.mtu))
+      exit(__LINE__);
+   gSerial.tx.request_key = serial_request_key;
+   if (pState->verbose)
+      fprintf(stderr, "output: serial, %u baud, %u bytes per packet, crc32c %s\n", gSerial.baud, gSerial.mtu, sl_crc32c_impl());
+}
 
-         static char bHeaderSaved = 0;
-         if ((buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG)&&(!bHeaderSaved))
-         {
-            if(buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)
-               bHeaderSaved = 1;
-            fwrite(buffer->data, 1, buffer->length, pData->file_handle);
-         }
+/* false once the port failed; mmal_flags of the encoder buffer, 0 for our own SEIs */
+static bool serial_send(const uint8_t *data, uint32_t len, uint32_t mmal_flags)
+{
+   bool bOK;
 
-         //H264 data comes first, then comes motion vectors
-         if (!(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG))
-         {
-            if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO)
-            {//motion vectors
-               if(!pData->lastFrameKeyFr)
-               {//detect motion only if it not a key frame
-                  pData->lastFrameMotion = DetectMotion((INLINE_MOTION_VECTOR*) &buffer->data[0], pData->pstate);
-                  fprintf(stderr, "motion=%d\n", (int) pData->lastFrameMotion);
-               }
-               else
-               {
-                  pData->lastFrameMotion = 0;
-                  fprintf(stderr, "no motion, key frame\n");
-               }
-            }
-            else
-            {//H264 data
+   if (gSerial.len + len > gSerial.size)
+   {
+      gSerial.size = gSerial.len + len;
+      gSerial.frame = realloc(gSerial.frame, gSerial.size);
+      vcos_assert(gSerial.frame);
+   }
+   memcpy(gSerial.frame + gSerial.len, data, len);
+   gSerial.len += len;
+   if (mmal_flags & MMAL_BUFFER_HEADER_FLAG_CONFIG)
+      gSerial.flags |= SL_FLAG_CONFIG;
+   if (mmal_flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME)
+      gSerial.flags |= SL_FLAG_KEY;
+   if (!(mmal_flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) || (mmal_flags & MMAL_BUFFER_HEADER_FLAG_CONFIG))
+      return true;
+   bOK = sl_tx_frame(&gSerial.tx, gSerial.frame, gSerial.len, gSerial.flags);
+   gSerial.len = 0;
+   gSerial.flags = 0;
+   return bOK;
+}
 
-               if ((!pData->lastFrameMotion)&&(buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END))
-                  buf_len = 0;
-               pData->lastFrameKeyFr = buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME;
+/* "serial" on the control connection */
+static void serial_reply(void)
+{
+   if (!gSerial.bEnabled)
+      return;
+   pthread_mutex_lock(&gSerial.tx.lock);
+   fprintf(stderr, "serial: frames=%llu dropped=%llu packets=%llu bytes=%llu queued=%u\n",
+           (unsigned long long)gSerial.tx.frames, (unsigned long long)gSerial.tx.dropped,
+           (unsigned long long)gSerial.tx.packets, (unsigned long long)gSerial.tx.bytes,
+           gSerial.tx.key.bytes + gSerial.tx.p.bytes);
+   pthread_mutex_unlock(&gSerial.tx.lock);
+}
 
-               if((pData->lastFrameMotion)&&(buf_len != 0))
-               {
-                  fwrite(buf_prev, 1, buf_len, pData->file_handle);
-                  fprintf(stderr, "saved %d bytes\n", buf_len);
-                  buf_len = 0;
-               }
-               else
-                  pData->pstate->i64FramesSkip++;
+/*
+ * raw_tcp over several links at once (-o multipath://192.168.1.2:5000?via=wlan0&via=wwan0),
+ * see common/multipath.h. The receiver is video -M 5000.
+ */
+static struct
+{
+   bool bEnabled;
+   MP_TX tx;
+} gMultipath;
 
-               if(buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME)
+static FILE *multipath_open(const char *url)
+{
+   if (!mp_tx_open(&gMultipath.tx, url))
+   {
+      fprintf(stderr, "%s is not a valid multipath output, use something like multipath://192.168.1.2:5000?via=wlan0&via=wwan0\n"
+              "(via an interface or a local IPv4 address, optionally @ip:port for a path to somewhere else)\n", url);
+      exit(EX_USAGE);
+   }
+   gMultipath.bEnabled = true;
+   //nothing writes to it, the paths have their own sockets
+   return fdopen(dup(gMultipath.tx.path[0].fd), "w");
+}
+
+static void multipath_setup(RASPIVID_STATE *pState)
+{
+   if (!gMultipath.bEnabled)
+      return;
+   if ((pState->enc_cb_func != encoder_buffer_callback_raw_tcp) || pState->keyFile || pState->tlsCert)
+   {
+      fprintf(stderr, "multipath:// needs -m raw_tcp and no -keyfile or -tlscert\n");
+      exit(EX_USAGE);
+   }
+   if (!mp_tx_start(&gMultipath.tx))
+      exit(__LINE__);
+   if (pState->verbose)
+      fprintf(stderr, "output: multipath, %d paths\n", gMultipath.tx.n);
+}
+
+/* mmal_flags of the encoder buffer, 0 for our own SEIs; IDR and SPS/PPS go twice */
+static bool multipath_send(const uint8_t *data, uint32_t len, uint32_t mmal_flags)
+{
+   return mp_tx_send(&gMultipath.tx, data, len,
+                     mmal_flags & (MMAL_BUFFER_HEADER_FLAG_KEYFRAME | MMAL_BUFFER_HEADER_FLAG_CONFIG));
+}
+
+/* "multipath" on the control connection */
+static void multipath_reply(void)
+{
+   if (gMultipath.bEnabled)
+      mp_tx_print(stderr, &gMultipath.tx);
+}
+
+/*
+ * raw_tcp to a file or a pipe (-o file.h264, -o -): no stdio, the encoder
+ * buffers go out by vmsplice/splice, see common/splice_sink.h. A pipe reader
+ * keeps the buffers it has not read yet, they go back to the encoder port from
+ * the next callback.
+ */
+static struct
+{
+   bool bEnabled;
+   SPLICE_SINK sink;
+} gSink;
+
+static void sink_acquire(void *holder)
+{
+   mmal_buffer_header_acquire((MMAL_BUFFER_HEADER_T *)holder);
+}
+
+static void sink_release(void *holder)
+{
+   mmal_buffer_header_release((MMAL_BUFFER_HEADER_T *)holder);
+}
+
+/* after the encoder pool exists: everything but one buffer may wait for a slow pipe reader */
+static void sink_setup(RASPIVID_STATE *pState)
+{
+   FILE *fp = pState->callback_data.file_handle;
+   struct stat st;
+
+   if ((pState->enc_cb_func != encoder_buffer_callback_raw_tcp) || !fp || fstat(fileno(fp), &st) || S_ISSOCK(st.st_mode) ||
+       gSerial.bEnabled || gMultipath.bEnabled)
+      return;
+   if (pState->keyFile || pState->tlsCert)
+   {
+      fprintf(stderr, "-keyfile and -tlscert need a tcp:// or udp:// output\n");
+      exit(EX_USAGE);
+   }
+   if (!splice_sink_open(&gSink.sink, fileno(fp), sink_acquire, sink_release, pState->encoder_pool->headers_num - 1))
+   {
+      fprintf(stderr, "%s: %s\n", pState->filename, strerror(errno));
+      exit(EX_CANTCREAT);
+   }
+   //a reader that went away shows up as EPIPE like a closed connection
+   signal(SIGPIPE, SIG_IGN);
+   gSink.bEnabled = true;
+   if (pState->verbose)
+      fprintf(stderr, "output: %s, %s\n", gSink.sink.bFifo ? "pipe" : "file", gSink.sink.bFallback ? "write()" : "vmsplice/splice");
+}
+
+static bool raw_tcp_send(const uint8_t *data, uint32_t len)
+{
+   if (gSink.bEnabled)
+      return splice_sink_write(&gSink.sink, data, len, NULL);
+   if (gSerial.bEnabled)
+      return serial_send(data, len, 0);
+   if (gMultipath.bEnabled)
+      return multipath_send(data, len, 0);
+   return gAead.bEnabled ? aead_send(gTls.fd, data, len) : (len == rpi_tls_send(&gTls, data, len, MSG_NOSIGNAL));
+}
+
+/* what one raw_tcp_send() puts into the socket, TLS records not counted */
+static uint32_t raw_tcp_wire_len(uint32_t len)
+{
+   return gAead.bEnabled ? 4 + AEAD_OVERHEAD + len : len;
+}
+
+/*
+ * -probe: filler NAL trains on the stream socket measure the bandwidth, see
+ * common/bw_probe.h. The encoder callback holds gProbe.lock while it sends a
+ * frame, so a train only goes in between two frames.
+ */
+#define PROBE_MIN_BITRATE 250000
+#define PROBE_RAMP_US 1500000
+#define PROBE_IDLE_WINDOW_US 2000000
+
+static struct
+{
+   bool bEnabled;
+   pthread_mutex_t lock;
+   uint64_t queued;                     /// bytes the encoder callback has written to the socket
+   BW_PROBE probe;
+   PORT_USERDATA *pData;
+   int ceiling;                         /// -b
+   int bitrate;                         /// what the encoder has been told
+} gProbe = { false, PTHREAD_MUTEX_INITIALIZER };
+
+static bool probe_boundary(void)
+{
+   return gProbe.pData->bAtBoundary;
+}
+
+/* 3/4 of the bandwidth, leaves room for IDR frames and other traffic */
+static int probe_bitrate(int64_t bps)
+{
+   int64_t b = bps * 3 / 4;
+   return (b > gProbe.ceiling) ? gProbe.ceiling : ((b < PROBE_MIN_BITRATE) ? PROBE_MIN_BITRATE : b);
+}
+
+static void *probe_thread(void *arg)
+{
+   RASPIVID_STATE *pState = (RASPIVID_STATE *)arg;
+
+   for (;;)
+   {
+      bool bIdle, bLower;
+      int64_t bps;
+      int target;
+      //about 100 ms of the stream, queued frames wait for it no longer than that
+      size_t len = gProbe.bitrate / 8 / 10;
+
+      sleep(pState->probe);
+      if (!encoder_output_port || capture_paused())
+         continue;
+      len = (len < BW_PROBE_MIN_TRAIN) ? BW_PROBE_MIN_TRAIN : ((len > 8 * BW_PROBE_MIN_TRAIN) ? 8 * BW_PROBE_MIN_TRAIN : len);
+      if ((bps = bw_probe_idle(&gProbe.probe, len, PROBE_IDLE_WINDOW_US, &bIdle, &bLower)) < 0)
+         return NULL;//the encoder callback notices the closed connection as well
+      if (!bIdle)
+         target = probe_bitrate(gProbe.bitrate);//the queue never drained, the link is slower than the stream
+      else if (bps)
+         target = probe_bitrate(bps);
+      else
+         continue;
+      if (bLower && (target < gProbe.bitrate))
+         continue;
+      //small changes are noise
+      if (abs(target - gProbe.bitrate) * 10 < gProbe.bitrate)
+         continue;
+      fprintf(stderr, "probe: %s, link budget %.2f -> %.2f Mbit/s\n", bIdle ? "idle" : "never idle", gProbe.bitrate / 1e6, target / 1e6);
+      gProbe.bitrate = target;
+      rate_apply(pState);
+   }
+   return NULL;
+}
+
+/* connect time ramp, before the encoder exists, so the first IDR is already at the new bitrate */
+static void probe_setup(RASPIVID_STATE *pState)
+{
+   int type = SOCK_DGRAM;
+   socklen_t len = sizeof(type);
+   pthread_t thread;
+   int64_t bps;
+
+   if (!pState->probe)
+      return;
+   getsockopt(pState->callback_data.sockFD, SOL_SOCKET, SO_TYPE, &type, &len);
+   if ((pState->enc_cb_func != encoder_buffer_callback_raw_tcp) || (SOCK_STREAM != type) || !pState->bitrate)
+   {
+      fprintf(stderr, "-probe needs -m raw_tcp, a tcp:// output and a bitrate, ignored\n");
+      pState->probe = 0;
+      return;
+   }
+
+   gProbe.probe.fd = pState->callback_data.sockFD;
+   gProbe.probe.send = raw_tcp_send;
+   gProbe.probe.bVerbose = pState->verbose;
+   gProbe.ceiling = gProbe.bitrate = pState->bitrate;
+   //create_encoder_component() cuts -b down to the level limit, never ask for more later
+   if (gProbe.ceiling > ((pState->level == MMAL_VIDEO_LEVEL_H264_4) ? MAX_BITRATE_LEVEL4 : MAX_BITRATE_LEVEL42))
+      gProbe.ceiling = (pState->level == MMAL_VIDEO_LEVEL_H264_4) ? MAX_BITRATE_LEVEL4 : MAX_BITRATE_LEVEL42;
+   //twice -b is enough to know that -b fits
+   if ((bps = bw_probe_ramp(&gProbe.probe, 2LL * pState->bitrate, PROBE_RAMP_US)) < 0)
+   {
+      evlog_add(gEvLog, EVLOG_DISCONNECT, 0, 0, 0);
+      exit(__LINE__);
+   }
+   if (bps)
+      gProbe.bitrate = pState->bitrate = probe_bitrate(bps);
+   fprintf(stderr, "probe: %.2f Mbit/s available, starting at %.2f Mbit/s\n", bps / 1e6, pState->bitrate / 1e6);
+
+   gProbe.pData = &pState->callback_data;
+   gProbe.probe.lock = &gProbe.lock;
+   gProbe.probe.queued = &gProbe.queued;
+   gProbe.probe.boundary = probe_boundary;
+   gProbe.bEnabled = true;
+   if (pthread_create(&thread, NULL, probe_thread, pState))
+      exit(__LINE__);
+   pthread_detach(thread);
+}
+
+/*
+ * -telemetry: a dark scene means high gain, sensor noise and a lot more bits for
+ * the same picture. The total gain is smoothed and extrapolated half a second
+ * ahead, so bitrate and min QP step down while the camera is still turning the
+ * gain up, before the encoder output and the send queue grow. Down is at once,
+ * back up only when the gain is clearly below the step again.
+ */
+#define TELEMETRY_TICK_US 200000
+#define TELEMETRY_LOOKAHEAD_S 0.5f
+#define TELEMETRY_HYSTERESIS 0.8f
+
+static const struct
+{
+   float gain;                          /// total gain (analog * digital) from which the level applies
+   int percent;                         /// of the bitrate budget (-b, or what -probe found)
+   int min_qp;                          /// 0 = the encoder's own
+} noise_levels[] =
+{
+   {  0.0f, 100,  0 },
+   {  4.0f,  90, 26 },
+   {  8.0f,  80, 30 },
+   { 12.0f,  70, 34 },
+};
+
+#define NOISE_LEVELS ((int)(sizeof(noise_levels) / sizeof(noise_levels[0])))
+
+static struct
+{
+   pthread_mutex_t lock;
+   int level;                           /// index into noise_levels
+   float gain, slope;                   /// smoothed total gain and its change per second
+   int bitrate;                         /// what the encoder has been told
+   int min_qp;                          /// the same for the min QP
+   int base_min_qp;                     /// the encoder's min QP before we touched it
+   bool bQpFailed;                      /// the encoder does not take QP bounds while running
+} gRate = { PTHREAD_MUTEX_INITIALIZER };
+
+/* the one place that changes bitrate and QP of the running encoder, for -probe and -telemetry */
+static void rate_apply(RASPIVID_STATE *pState)
+{
+   int budget = gProbe.bEnabled ? gProbe.bitrate : pState->bitrate;
+   int bitrate, min_qp;
+
+   if (!encoder_output_port)
+      return;
+   pthread_mutex_lock(&gRate.lock);
+   bitrate = (int)((int64_t)budget * noise_levels[gRate.level].percent / 100);
+   if (pState->bitrate && (bitrate != gRate.bitrate))
+   {
+      if (MMAL_SUCCESS == mmal_port_parameter_set_uint32(encoder_output_port, MMAL_PARAMETER_VIDEO_BIT_RATE, bitrate))
+         gRate.bitrate = bitrate;
+      else
+         fprintf(stderr, "%d\n", __LINE__);
+   }
+
+   //-qp: the one QP the encoder uses, moved up 2 per level, otherwise only the lower bound
+   if (pState->quantisationParameter)
+      min_qp = pState->quantisationParameter + 2 * gRate.level;
+   else
+      min_qp = (noise_levels[gRate.level].min_qp > gRate.base_min_qp) ? noise_levels[gRate.level].min_qp : gRate.base_min_qp;
+   if ((min_qp != gRate.min_qp) && !gRate.bQpFailed)
+   {
+      if ((MMAL_SUCCESS != mmal_port_parameter_set_uint32(encoder_output_port, MMAL_PARAMETER_VIDEO_ENCODE_MIN_QUANT, min_qp)) ||
+            (pState->quantisationParameter &&
+             (MMAL_SUCCESS != mmal_port_parameter_set_uint32(encoder_output_port, MMAL_PARAMETER_VIDEO_ENCODE_MAX_QUANT, min_qp))))
+      {
+         fprintf(stderr, "The encoder does not take QP bounds while running, only the bitrate follows the gain\n");
+         gRate.bQpFailed = true;
+      }
+      else
+         gRate.min_qp = min_qp;
+   }
+   pthread_mutex_unlock(&gRate.lock);
+}
+
+/* key=value like the control connection */
+static void telemetry_format(char *buf, size_t size)
+{
+   size_t n;
+
+   pthread_mutex_lock(&gCamSettings.lock);
+   pthread_mutex_lock(&gRate.lock);
+   snprintf(buf, size, "exposure_us=%u analog_gain=%.2f digital_gain=%.2f gain=%.2f gain_slope=%.2f awb_red=%.2f awb_blue=%.2f "
+            "noise_level=%d bitrate=%d min_qp=%d updates=%lu",
+            gCamSettings.exposure, gCamSettings.analog_gain, gCamSettings.digital_gain, gRate.gain, gRate.slope,
+            gCamSettings.awb_red, gCamSettings.awb_blue, gRate.level, gRate.bitrate, gRate.min_qp, gCamSettings.updates);
+   pthread_mutex_unlock(&gRate.lock);
+   pthread_mutex_unlock(&gCamSettings.lock);
+   n = strlen(buf);
+   if (n + 1 < size)
+   {
+      buf[n++] = ' ';
+      loss_format(buf + n, size - n);
+   }
+}
+
+/* "telemetry" on the control connection, in android_motion mode the line goes back as one Telemetry message */
+static void telemetry_reply(RASPIVID_STATE *pState)
+{
+   char line[384];
+
+   if (!gCamSettings.bValid)
+   {
+      fprintf(stderr, "telemetry: no camera settings, start with -telemetry <sec>\n");
+      return;
+   }
+   telemetry_format(line, sizeof(line));
+   if (pState->enc_cb_func == encoder_buffer_callback_android_motion)
+      SendTypedToAndroid(pState, Telemetry, line, strlen(line));
+   else
+      fprintf(stderr, "telemetry: %s\n", line);
+}
+
+/* key=value like the control connection */
+static void loss_format(char *buf, size_t size)
+{
+   pthread_mutex_lock(&gLoss.lock);
+   snprintf(buf, size, "frames=%llu encoder_skips=%llu sensor_drops=%llu paused_drops=%llu",
+            (unsigned long long)gLoss.frames, (unsigned long long)gLoss.encoder_skips,
+            (unsigned long long)gLoss.sensor_drops, (unsigned long long)gLoss.paused);
+   pthread_mutex_unlock(&gLoss.lock);
+}
+
+/* "frames" on the control connection, in android_motion mode the line goes back as one Telemetry message */
+static void loss_reply(RASPIVID_STATE *pState)
+{
+   char line[160];
+
+   strcpy(line, "frames: ");
+   loss_format(line + strlen(line), sizeof(line) - strlen(line));
+   if (!SendTypedToAndroid(pState, Telemetry, line, strlen(line)))
+      fprintf(stderr, "%s\n", line);
+}
+
+static void *telemetry_thread(void *arg)
+{
+   RASPIVID_STATE *pState = (RASPIVID_STATE *)arg;
+   int64_t next_print_us = 0;
+
+   for (;;)
+   {
+      int64_t now;
+      float gain, ahead;
+      int level;
+      bool bValid, bChanged;
+
+      usleep(TELEMETRY_TICK_US);
+      pthread_mutex_lock(&gCamSettings.lock);
+      bValid = gCamSettings.bValid;
+      gain = gCamSettings.analog_gain * gCamSettings.digital_gain;
+      pthread_mutex_unlock(&gCamSettings.lock);
+      if (!bValid)
+         continue;
+
+      pthread_mutex_lock(&gRate.lock);
+      if (!gRate.gain)
+         gRate.gain = gain;
+      else
+      {
+         float prev = gRate.gain;
+         gRate.gain += 0.3f * (gain - gRate.gain);
+         gRate.slope += 0.3f * ((gRate.gain - prev) * 1e6f / TELEMETRY_TICK_US - gRate.slope);
+      }
+      //only a rising gain is looked ahead at, a falling one has to get there first
+      ahead = gRate.gain + ((gRate.slope > 0) ? gRate.slope * TELEMETRY_LOOKAHEAD_S : 0);
+      level = gRate.level;
+      while ((level + 1 < NOISE_LEVELS) && (ahead >= noise_levels[level + 1].gain))
+         level++;
+      while ((level > 0) && (gRate.gain < noise_levels[level].gain * TELEMETRY_HYSTERESIS))
+         level--;
+      bChanged = (level != gRate.level);
+      if (bChanged)
+         fprintf(stderr, "telemetry: gain %.2f (%+.2f/s), noise level %d -> %d\n", gRate.gain, gRate.slope, gRate.level, level);
+      gRate.level = level;
+      pthread_mutex_unlock(&gRate.lock);
+      if (bChanged)
+         rate_apply(pState);
+
+      now = vcos_getmicrosecs64();
+      if (now >= next_print_us)
+      {
+         char line[384];
+
+         telemetry_format(line, sizeof(line));
+         fprintf(stderr, "telemetry: %s\n", line);
+         next_print_us = now + pState->telemetry * 1000000LL;
+      }
+   }
+   return NULL;
+}
+
+/* after the encoder is set up: what rate_apply() starts from, and -telemetry */
+static void rate_setup(RASPIVID_STATE *pState)
+{
+   uint32_t qp = 0;
+   pthread_t thread;
+
+   mmal_port_parameter_get_uint32(encoder_output_port, MMAL_PARAMETER_VIDEO_ENCODE_MIN_QUANT, &qp);
+   pthread_mutex_lock(&gRate.lock);
+   gRate.base_min_qp = qp;
+   gRate.min_qp = pState->quantisationParameter ? pState->quantisationParameter : (int)qp;
+   if (!gRate.bitrate)
+      gRate.bitrate = pState->bitrate;
+   pthread_mutex_unlock(&gRate.lock);
+
+   if (!pState->telemetry)
+      return;
+   if (pthread_create(&thread, NULL, telemetry_thread, pState))
+      exit(__LINE__);
+   pthread_detach(thread);
+}
+
+/*
+ * -lowlight: common/lowlight.h decides from exposure, gain and the frame
+ * intervals, this applies it. The sensor mode can only change with the camera
+ * component disabled, so a switch stops capture, disables every connection of
+ * the camera and the camera itself, sets mode and frame rate range and starts
+ * again with an IDR frame. Without a mode change only the range is set.
+ */
+static struct
+{
+   pthread_mutex_t lock;
+   LL_CONFIG cfg;
+   LL_STATE st;                         /// lowlight thread only
+   int64_t last_pts;                    /// us, 0 = none yet
+   int64_t interval_sum;                /// frame intervals since the last tick
+   int intervals;
+   MMAL_PARAMETER_FPS_RANGE_T day_range;/// of the video port before the first switch
+   bool bSeiPending;                    /// raw_tcp: a mode SEI goes in front of the next frame
+   bool bReset;                         /// the watchdog rebuilt the camera in the day mode, the policy starts over
+   uint64_t sei_value;
+   FILE *trace;
+} gLowLight = { PTHREAD_MUTEX_INITIALIZER };
+
+static void lowlight_frame(RASPIVID_STATE *pState, MMAL_BUFFER_HEADER_T *buffer)
+{
+   if (!pState->lowLightFps || (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG) || (buffer->pts == MMAL_TIME_UNKNOWN))
+      return;
+   pthread_mutex_lock(&gLowLight.lock);
+   //a gap over a second is a stopped pipeline, not a frame rate
+   if (gLowLight.last_pts && (buffer->pts > gLowLight.last_pts) && (buffer->pts - gLowLight.last_pts < 1000000))
+   {
+      gLowLight.interval_sum += buffer->pts - gLowLight.last_pts;
+      gLowLight.intervals++;
+   }
+   gLowLight.last_pts = buffer->pts;
+   pthread_mutex_unlock(&gLowLight.lock);
+}
+
+static void lowlight_switch(RASPIVID_STATE *pState, bool bNight)
+{
+   MMAL_CONNECTION_T *connections[] =
+      { pState->encoder_connection, pState->preview_connection, pState->splitter_connection, pState->still_connection };
+   MMAL_PARAMETER_FPS_RANGE_T range = gLowLight.day_range;
+   bool bModeChange = gLowLight.cfg.night_mode != gLowLight.cfg.day_mode;
+   int mode = bNight ? gLowLight.cfg.night_mode : gLowLight.cfg.day_mode;
+   int64_t start = vcos_getmicrosecs64();
+   char line[128];
+   int i, wait;
+
+   if (bNight)
+   {
+      range.fps_low.num = gLowLight.cfg.night_fps;
+      range.fps_low.den = 1;
+      range.fps_high.num = gLowLight.cfg.day_fps;
+      range.fps_high.den = VIDEO_FRAME_RATE_DEN;
+   }
+   //a snapshot in flight needs the still connection, give it a few seconds
+   for (wait = 0; (wait < 50) && snapshot_capturing(); wait++)
+      usleep(100000);
+
+   pthread_mutex_lock(&gCameraReconfig);
+   if (MMAL_SUCCESS != mmal_port_parameter_set_boolean(camera_video_port, MMAL_PARAMETER_CAPTURE, 0))
+      fprintf(stderr, "%d\n", __LINE__);
+   if (bModeChange)
+   {
+      for (i = 0; i < (int)(sizeof(connections) / sizeof(connections[0])); i++)
+         if (connections[i] && (MMAL_SUCCESS != mmal_connection_disable(connections[i])))
+            fprintf(stderr, "%d\n", __LINE__);
+      if (MMAL_SUCCESS != mmal_component_disable(pState->camera_component))
+         fprintf(stderr, "%d\n", __LINE__);
+      if (MMAL_SUCCESS != mmal_port_parameter_set_uint32(pState->camera_component->control, MMAL_PARAMETER_CAMERA_CUSTOM_SENSOR_CONFIG, mode))
+         fprintf(stderr, "lowlight: sensor mode %d not taken\n", mode);
+   }
+   if ((MMAL_SUCCESS != mmal_port_parameter_set(camera_video_port, &range.hdr)) ||
+       (MMAL_SUCCESS != mmal_port_parameter_set(camera_preview_port, &range.hdr)))
+      fprintf(stderr, "lowlight: frame rate range not taken\n");
+   if (bModeChange)
+   {
+      if (MMAL_SUCCESS != mmal_component_enable(pState->camera_component))
+         fprintf(stderr, "%d\n", __LINE__);
+      for (i = (int)(sizeof(connections) / sizeof(connections[0])) - 1; i >= 0; i--)
+         if (connections[i] && (MMAL_SUCCESS != mmal_connection_enable(connections[i])))
+            fprintf(stderr, "%d\n", __LINE__);
+   }
+   if (MMAL_SUCCESS != mmal_port_parameter_set_boolean(camera_video_port, MMAL_PARAMETER_CAPTURE, !capture_paused()))
+      fprintf(stderr, "%d\n", __LINE__);
+   if (MMAL_SUCCESS != mmal_port_parameter_set_boolean(encoder_output_port, MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME, 1))
+      fprintf(stderr, "%d\n", __LINE__);
+   pthread_mutex_unlock(&gCameraReconfig);
+
+   loss_reset();
+   pthread_mutex_lock(&gLowLight.lock);
+   gLowLight.last_pts = 0;
+   gLowLight.interval_sum = gLowLight.intervals = 0;
+   gLowLight.sei_value = h264_mode_sei_value(bNight, mode, range.fps_low.num * 100 / (range.fps_low.den ? range.fps_low.den : 1),
+                                             range.fps_high.num * 100 / (range.fps_high.den ? range.fps_high.den : 1));
+   gLowLight.bSeiPending = true;
+   if (gLowLight.trace)
+      fprintf(gLowLight.trace, "#%s\n", bNight ? "night" : "day");
+   pthread_mutex_unlock(&gLowLight.lock);
+
+   snprintf(line, sizeof(line), "%s mode=%d fps=%.2f-%.2f", bNight ? "night" : "day", mode,
+            range.fps_low.den ? (double)range.fps_low.num / range.fps_low.den : 0,
+            range.fps_high.den ? (double)range.fps_high.num / range.fps_high.den : 0);
+   fprintf(stderr, "lowlight: %s, switched in %lld ms\n", line, (long long)(vcos_getmicrosecs64() - start) / 1000);
+   evlog_add(gEvLog, EVLOG_CAMERA_MODE, 0, bNight, gLowLight.sei_value);
+   if (pState->enc_cb_func == encoder_buffer_callback_android_motion)
+      SendTypedToAndroid(pState, CameraMode, line, strlen(line));
+}
+
+static void *lowlight_thread(void *arg)
+{
+   RASPIVID_STATE *pState = (RASPIVID_STATE *)arg;
+
+   for (;;)
+   {
+      LL_SAMPLE sample;
+      LL_ACTION action;
+      float analog, digital;
+      int64_t now;
+      bool bValid;
+
+      usleep(LL_TICK_US);
+      now = vcos_getmicrosecs64();
+      pthread_mutex_lock(&gCamSettings.lock);
+      bValid = gCamSettings.bValid;
+      sample.exposure_us = gCamSettings.exposure;
+      analog = gCamSettings.analog_gain;
+      digital = gCamSettings.digital_gain;
+      pthread_mutex_unlock(&gCamSettings.lock);
+      sample.gain = analog * digital;
+
+      pthread_mutex_lock(&gLowLight.lock);
+      if (gLowLight.bReset)
+      {
+         lowlight_reset(&gLowLight.st);
+         gLowLight.bReset = false;
+      }
+      sample.frame_interval_us = gLowLight.intervals ? gLowLight.interval_sum / gLowLight.intervals : 0;
+      gLowLight.interval_sum = gLowLight.intervals = 0;
+      if (bValid && gLowLight.trace)
+         fprintf(gLowLight.trace, "%lld,%lld,%.3f,%.3f,%lld\n", (long long)now, (long long)sample.exposure_us, analog, digital,
+                 (long long)sample.frame_interval_us);
+      pthread_mutex_unlock(&gLowLight.lock);
+      if (!bValid)
+         continue;
+
+      action = lowlight_step(&gLowLight.cfg, &gLowLight.st, now, &sample);
+      if (LL_NONE != action)
+         lowlight_switch(pState, LL_TO_NIGHT == action);
+   }
+   return NULL;
+}
+
+/* once capture runs: the day frame rate range to come back to, and the policy thread */
+static void lowlight_setup(RASPIVID_STATE *pState)
+{
+   MMAL_PARAMETER_FPS_RANGE_T range = {{MMAL_PARAMETER_FPS_RANGE, sizeof(range)}, {0, 1}, {0, 1}};
+   pthread_t thread;
+
+   if (!pState->lowLightFps)
+      return;
+   if (!pState->framerate || (pState->lowLightFps >= pState->framerate))
+   {
+      fprintf(stderr, "lowlight: needs -fps above %d, off\n", pState->lowLightFps);
+      pState->lowLightFps = 0;
+      return;
+   }
+   if (MMAL_SUCCESS != mmal_port_parameter_get(camera_video_port, &range.hdr) || !range.fps_high.num)
+   {
+      range.fps_low.num = range.fps_high.num = pState->framerate;
+      range.fps_low.den = range.fps_high.den = VIDEO_FRAME_RATE_DEN;
+   }
+   gLowLight.day_range = range;
+   lowlight_default(&gLowLight.cfg, pState->sensor_mode, pState->framerate, pState->lowLightMode, pState->lowLightFps);
+   if (pState->lowLightSens > 0)
+      gLowLight.cfg.night_sens = pState->lowLightSens;
+   lowlight_reset(&gLowLight.st);
+   if (pState->lowLightTrace)
+   {
+      if (!(gLowLight.trace = fopen(pState->lowLightTrace, "w")))
+         fprintf(stderr, "lowlight: can't write %s\n", pState->lowLightTrace);
+      else
+      {
+         setvbuf(gLowLight.trace, NULL, _IOLBF, 0);
+         fprintf(gLowLight.trace, "#time_us,exposure_us,analog_gain,digital_gain,frame_interval_us day_mode=%d night_mode=%d day_fps=%d night_fps=%d\n",
+                 gLowLight.cfg.day_mode, gLowLight.cfg.night_mode, gLowLight.cfg.day_fps, gLowLight.cfg.night_fps);
+      }
+   }
+   if (pthread_create(&thread, NULL, lowlight_thread, pState))
+      exit(__LINE__);
+   pthread_detach(thread);
+}
+
+static void encoder_buffer_callback_raw_tcp(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+   MMAL_BUFFER_HEADER_T *new_buffer;
+   PORT_USERDATA *pData = (PORT_USERDATA *)port->userdata;
+
+   if (pData)
+   {
+      if (buffer->length && !pause_drop(buffer))
+      {
+         mmal_buffer_header_mem_lock(buffer);
+
+         //H264 data comes first, then comes motion vectors
+         if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO)
+         {//motion vectors
+         }
+         else
+         {//H264 data
+            bool bOK = true;
+
+            if (gProbe.bEnabled)
+               pthread_mutex_lock(&gProbe.lock);
+            if (!(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG))
+            {
+               if (pData->pstate->timeSei && !pData->bMidFrame)
                {
-                  fwrite(buffer->data, 1, buffer->length, pData->file_handle);
-                  buf_len = 0;
-                  fprintf(stderr, "saved keyframe %d bytes\n", buffer->length);
+                  uint8_t sei[H264_TIME_SEI_LEN];
+                  struct timespec ts;
+                  uint32_t n;
+
+                  clock_gettime(CLOCK_REALTIME, &ts);
+                  n = h264_make_time_sei(sei, (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+                  bOK = raw_tcp_send(sei, n);
+                  gProbe.queued += raw_tcp_wire_len(n);
                }
-               else
+               if (pData->pstate->lowLightFps && !pData->bMidFrame)
                {
-                  if(buf_len >= 256000)
+                  uint8_t sei[H264_HEX_SEI_LEN];
+                  uint32_t n = 0;
+
+                  pthread_mutex_lock(&gLowLight.lock);
+                  if (gLowLight.bSeiPending)
+                     n = h264_make_hex_sei(sei, h264_mode_sei_uuid, gLowLight.sei_value);
+                  gLowLight.bSeiPending = false;
+                  pthread_mutex_unlock(&gLowLight.lock);
+                  if (n && bOK)
                   {
-                     fprintf(stderr, "pizdec\n");
-                     exit(123);
+                     bOK = raw_tcp_send(sei, n);
+                     gProbe.queued += raw_tcp_wire_len(n);
                   }
-                  memcpy(buf_prev + buf_len, buffer->data, buffer->length);
-                  buf_len += buffer->length;
                }
-
-               //fwrite(buffer->data, 1, buffer->length, pData->file_handle);
-
-               if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)
-                  handle_frame_end(pData);
+               if (pData->pstate->sliceRows && !pData->bMidFrame)
+                  enc_lat_slice(buffer);
+               pData->bMidFrame = !(buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END);
+            }
+            //the file/pipe sink may keep the buffer until a pipe reader got it
+            if (!bOK || !(gSink.bEnabled ? splice_sink_write(&gSink.sink, buffer->data, buffer->length, buffer)
+                          : gSerial.bEnabled ? serial_send(buffer->data, buffer->length, buffer->flags)
+                          : gMultipath.bEnabled ? multipath_send(buffer->data, buffer->length, buffer->flags)
+                                                : raw_tcp_send(buffer->data, buffer->length)))
+            {
+               evlog_add(gEvLog, EVLOG_DISCONNECT, 0, 0, 0);
+               exit(__LINE__);//TCP connection closed, stop program
             }
+            gProbe.queued += raw_tcp_wire_len(buffer->length);
+            pData->bAtBoundary = !(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG) && (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END);
+            if (gProbe.bEnabled)
+               pthread_mutex_unlock(&gProbe.lock);
+            if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)
+               handle_frame_end(pData, buffer);
          }
 
          mmal_buffer_header_mem_unlock(buffer);
@@ -1780,7 +3509,14 @@ static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
    mmal_buffer_header_release(buffer);
 
    // and send one back to the port (if still open)
-   if (port->is_enabled)
+   if (port->is_enabled && gSink.bEnabled)
+   {
+      //the held ones that came back since, the pool may also be empty now
+      while ((new_buffer = mmal_queue_get(pData->pstate->encoder_pool->queue)))
+         if (mmal_port_send_buffer(port, new_buffer) != MMAL_SUCCESS)
+            vcos_log_error("Unable to return a buffer to the encoder port");
+   }
+   else if (port->is_enabled)
    {
       MMAL_STATUS_T status;
 
@@ -1794,14 +3530,16 @@ static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
    }
 }
 
-static void encoder_buffer_callback_ok(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+char buf_prev[256000];
+int buf_len = 0;
+static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
 {
    MMAL_BUFFER_HEADER_T *new_buffer;
    PORT_USERDATA *pData = (PORT_USERDATA *)port->userdata;
 
    if (pData)
    {
-      if (buffer->length)
+      if (buffer->length && !pause_drop(buffer))
       {
          mmal_buffer_header_mem_lock(buffer);
 
@@ -1813,20 +3551,121 @@ static void encoder_buffer_callback_ok(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *
             fwrite(buffer->data, 1, buffer->length, pData->file_handle);
          }
 
+         //H264 data comes first, then comes motion vectors
          if (!(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG))
          {
             if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO)
             {//motion vectors
-               pData->lastFrameMotion = DetectMotion((INLINE_MOTION_VECTOR*) &buffer->data[0], pData->pstate);
-               fprintf(stderr, "motion=%d ", (int) pData->lastFrameMotion);
+               if(!pData->lastFrameKeyFr)
+               {//detect motion only if it not a key frame
+                  pData->lastFrameMotion = DetectMotion((INLINE_MOTION_VECTOR*) &buffer->data[0], pData->pstate);
+                  fprintf(stderr, "motion=%d\n", (int) pData->lastFrameMotion);
+               }
+               else
+               {
+                  pData->lastFrameMotion = 0;
+                  fprintf(stderr, "no motion, key frame\n");
+               }
             }
             else
             {//H264 data
 
-               fwrite(buffer->data, 1, buffer->length, pData->file_handle);
+               if ((!pData->lastFrameMotion)&&(buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END))
+                  buf_len = 0;
+               pData->lastFrameKeyFr = buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME;
+
+               if((pData->lastFrameMotion)&&(buf_len != 0))
+               {
+                  fwrite(buf_prev, 1, buf_len, pData->file_handle);
+                  fprintf(stderr, "saved %d bytes\n", buf_len);
+                  buf_len = 0;
+               }
+               else
+                  pData->pstate->i64FramesSkip++;
+
+               if(buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME)
+               {
+                  fwrite(buffer->data, 1, buffer->length, pData->file_handle);
+                  buf_len = 0;
+                  fprintf(stderr, "saved keyframe %d bytes\n", buffer->length);
+               }
+               else
+               {
+                  if(buf_len >= 256000)
+                  {
+                     fprintf(stderr, "pizdec\n");
+                     exit(123);
+                  }
+                  memcpy(buf_prev + buf_len, buffer->data, buffer->length);
+                  buf_len += buffer->length;
+               }
+
+               //fwrite(buffer->data, 1, buffer->length, pData->file_handle);
+
+               if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)
+                  handle_frame_end(pData, buffer);
+            }
+         }
+
+         mmal_buffer_header_mem_unlock(buffer);
+      }
+   }
+   else
+   {
+      vcos_log_error("Received a encoder buffer callback with no state");
+   }
+
+   // release buffer back to the pool
+   mmal_buffer_header_release(buffer);
+
+   // and send one back to the port (if still open)
+   if (port->is_enabled)
+   {
+      MMAL_STATUS_T status;
+
+      new_buffer = mmal_queue_get(pData->pstate->encoder_pool->queue);
+
+      if (new_buffer)
+         status = mmal_port_send_buffer(port, new_buffer);
+
+      if (!new_buffer || status != MMAL_SUCCESS)
+         vcos_log_error("Unable to return a buffer to the encoder port");
+   }
+}
+
+static void encoder_buffer_callback_ok(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+   MMAL_BUFFER_HEADER_T *new_buffer;
+   PORT_USERDATA *pData = (PORT_USERDATA *)port->userdata;
+
+   if (pData)
+   {
+      if (buffer->length && !pause_drop(buffer))
+      {
+         mmal_buffer_header_mem_lock(buffer);
+
+         static char bHeaderSaved = 0;
+         if ((buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG)&&(!bHeaderSaved))
+         {
+            if(buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)
+               bHeaderSaved = 1;
+            fwrite(buffer->data, 1, buffer->length, pData->file_handle);
+         }
+
+         if (!(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG))
+         {
+            if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO)
+            {//motion vectors
+               pData->lastFrameMotion = DetectMotion((INLINE_MOTION_VECTOR*) &buffer->data[0], pData->pstate);
+               fprintf(stderr, "motion=%d ", (int) pData->lastFrameMotion);
+            }
+            else
+            {//H264 data
+
+               fwrite(buffer->data, 1, buffer->length, pData->file_handle);
 
                if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)
-                  handle_frame_end(pData);
+                  handle_frame_end(pData, buffer);
             }
          }
 
@@ -1920,483 +3759,1357 @@ static MMAL_STATUS_T create_camera_component(RASPIVID_STATE *state)
    video_port = camera->output[MMAL_CAMERA_VIDEO_PORT];
    still_port = camera->output[MMAL_CAMERA_CAPTURE_PORT];
 
-   if (state->settings)
-   {
-      MMAL_PARAMETER_CHANGE_EVENT_REQUEST_T change_event_request =
-         {{MMAL_PARAMETER_CHANGE_EVENT_REQUEST, sizeof(MMAL_PARAMETER_CHANGE_EVENT_REQUEST_T)},
-          MMAL_PARAMETER_CAMERA_SETTINGS, 1};
-      //works : MMAL_PARAMETER_CAMERA_NUM, MMAL_PARAMETER_FOCUS_STATUS, MMAL_PARAMETER_CAPTURE_STATUS, MMAL_PARAMETER_FIELD_OF_VIEW, MMAL_PARAMETER_CAMERA_SETTINGS
+   if (state->settings || state->telemetry || state->lowLightFps)
+   {
+      MMAL_PARAMETER_CHANGE_EVENT_REQUEST_T change_event_request =
+         {{MMAL_PARAMETER_CHANGE_EVENT_REQUEST, sizeof(MMAL_PARAMETER_CHANGE_EVENT_REQUEST_T)},
+          MMAL_PARAMETER_CAMERA_SETTINGS, 1};
+      //works : MMAL_PARAMETER_CAMERA_NUM, MMAL_PARAMETER_FOCUS_STATUS, MMAL_PARAMETER_CAPTURE_STATUS, MMAL_PARAMETER_FIELD_OF_VIEW, MMAL_PARAMETER_CAMERA_SETTINGS
+
+      status = mmal_port_parameter_set(camera->control, &change_event_request.hdr);
+      if ( status != MMAL_SUCCESS )
+      {
+         vcos_log_error("No camera settings events");
+      }
+      gCamSettings.bPrint = state->settings;
+   }
+
+   // Enable the camera, and tell it its control callback function
+   status = mmal_port_enable(camera->control, camera_control_callback);
+
+   if (status != MMAL_SUCCESS)
+   {
+      vcos_log_error("Unable to enable control port : error %d", status);
+      goto error;
+   }
+
+   //  set up the camera configuration
+   {
+      MMAL_PARAMETER_CAMERA_CONFIG_T cam_config =
+      {
+         { MMAL_PARAMETER_CAMERA_CONFIG, sizeof(cam_config) },
+         .max_stills_w = state->snapshotWidth,
+         .max_stills_h = state->snapshotHeight,
+         .stills_yuv422 = 0,
+         .one_shot_stills = 0,
+         .max_preview_video_w = state->width,
+         .max_preview_video_h = state->height,
+         .num_preview_video_frames = 3 + vcos_max(0, (state->framerate-30)/10),
+         .stills_capture_circular_buffer_height = 0,
+         .fast_preview_resume = 0,
+         .use_stc_timestamp = MMAL_PARAM_TIMESTAMP_MODE_RAW_STC
+      };
+      mmal_port_parameter_set(camera->control, &cam_config.hdr);
+   }
+
+   // Now set up the port formats
+
+   // Set the encode format on the Preview port
+   // HW limitations mean we need the preview to be the same size as the required recorded output
+
+   format = preview_port->format;
+
+   format->encoding = MMAL_ENCODING_OPAQUE;
+   format->encoding_variant = MMAL_ENCODING_I420;
+
+   if(state->camera_parameters.shutter_speed > 6000000)
+   {
+        MMAL_PARAMETER_FPS_RANGE_T fps_range = {{MMAL_PARAMETER_FPS_RANGE, sizeof(fps_range)},
+                                                     { 50, 1000 }, {166, 1000}};
+        mmal_port_parameter_set(preview_port, &fps_range.hdr);
+   }
+   else if(state->camera_parameters.shutter_speed > 1000000)
+   {
+        MMAL_PARAMETER_FPS_RANGE_T fps_range = {{MMAL_PARAMETER_FPS_RANGE, sizeof(fps_range)},
+                                                     { 166, 1000 }, {999, 1000}};
+        mmal_port_parameter_set(preview_port, &fps_range.hdr);
+   }
+
+   //enable dynamic framerate if necessary
+   if (state->camera_parameters.shutter_speed)
+   {
+      if (state->framerate > 1000000./state->camera_parameters.shutter_speed)
+      {
+         state->framerate=0;
+         if (state->verbose)
+            fprintf(stderr, "Enable dynamic frame rate to fulfil shutter speed requirement\n");
+      }
+   }
+
+   format->encoding = MMAL_ENCODING_OPAQUE;
+   format->es->video.width = VCOS_ALIGN_UP(state->width, 32);
+   format->es->video.height = VCOS_ALIGN_UP(state->height, 16);
+   format->es->video.crop.x = 0;
+   format->es->video.crop.y = 0;
+   format->es->video.crop.width = state->width;
+   format->es->video.crop.height = state->height;
+   format->es->video.frame_rate.num = PREVIEW_FRAME_RATE_NUM;
+   format->es->video.frame_rate.den = PREVIEW_FRAME_RATE_DEN;
+
+   status = mmal_port_format_commit(preview_port);
+
+   if (status != MMAL_SUCCESS)
+   {
+      vcos_log_error("camera viewfinder format couldn't be set");
+      goto error;
+   }
+
+   // Set the encode format on the video  port
+
+   format = video_port->format;
+   format->encoding_variant = MMAL_ENCODING_I420;
+
+   if(state->camera_parameters.shutter_speed > 6000000)
+   {
+        MMAL_PARAMETER_FPS_RANGE_T fps_range = {{MMAL_PARAMETER_FPS_RANGE, sizeof(fps_range)},
+                                                     { 50, 1000 }, {166, 1000}};
+        mmal_port_parameter_set(video_port, &fps_range.hdr);
+   }
+   else if(state->camera_parameters.shutter_speed > 1000000)
+   {
+        MMAL_PARAMETER_FPS_RANGE_T fps_range = {{MMAL_PARAMETER_FPS_RANGE, sizeof(fps_range)},
+                                                     { 167, 1000 }, {999, 1000}};
+        mmal_port_parameter_set(video_port, &fps_range.hdr);
+   }
+
+   format->encoding = MMAL_ENCODING_OPAQUE;
+   format->es->video.width = VCOS_ALIGN_UP(state->width, 32);
+   format->es->video.height = VCOS_ALIGN_UP(state->height, 16);
+   format->es->video.crop.x = 0;
+   format->es->video.crop.y = 0;
+   format->es->video.crop.width = state->width;
+   format->es->video.crop.height = state->height;
+   format->es->video.frame_rate.num = state->framerate;
+   format->es->video.frame_rate.den = VIDEO_FRAME_RATE_DEN;
+
+   status = mmal_port_format_commit(video_port);
+
+   if (status != MMAL_SUCCESS)
+   {
+      vcos_log_error("camera video format couldn't be set");
+      goto error;
+   }
+
+   // Ensure there are enough buffers to avoid dropping frames
+   if (video_port->buffer_num < VIDEO_OUTPUT_BUFFERS_NUM)
+      video_port->buffer_num = VIDEO_OUTPUT_BUFFERS_NUM;
+
+
+   // Set the encode format on the still  port
+
+   format = still_port->format;
+
+   format->encoding = MMAL_ENCODING_OPAQUE;
+   format->encoding_variant = MMAL_ENCODING_I420;
+
+   format->es->video.width = VCOS_ALIGN_UP(state->snapshotWidth, 32);
+   format->es->video.height = VCOS_ALIGN_UP(state->snapshotHeight, 16);
+   format->es->video.crop.x = 0;
+   format->es->video.crop.y = 0;
+   format->es->video.crop.width = state->snapshotWidth;
+   format->es->video.crop.height = state->snapshotHeight;
+   format->es->video.frame_rate.num = 0;
+   format->es->video.frame_rate.den = 1;
+
+   status = mmal_port_format_commit(still_port);
+
+   if (status != MMAL_SUCCESS)
+   {
+      vcos_log_error("camera still format couldn't be set");
+      goto error;
+   }
+
+   /* Ensure there are enough buffers to avoid dropping frames */
+   if (still_port->buffer_num < VIDEO_OUTPUT_BUFFERS_NUM)
+      still_port->buffer_num = VIDEO_OUTPUT_BUFFERS_NUM;
+
+   /* Enable component */
+   status = mmal_component_enable(camera);
+
+   if (status != MMAL_SUCCESS)
+   {
+      vcos_log_error("camera component couldn't be enabled");
+      goto error;
+   }
+
+   raspicamcontrol_set_all_parameters(camera, &state->camera_parameters);
+
+   state->camera_component = camera;
+
+   return status;
+
+error:
+
+   if (camera)
+      mmal_component_destroy(camera);
+
+   return status;
+}
+
+/**
+ * Destroy the camera component
+ *
+ * @param state Pointer to state control struct
+ *
+ */
+static void destroy_camera_component(RASPIVID_STATE *state)
+{
+   if (state->camera_component)
+   {
+      mmal_component_destroy(state->camera_component);
+      state->camera_component = NULL;
+   }
+}
+
+
+
+/**
+ * Create the encoder component, set up its ports
+ *
+ * @param state Pointer to state control struct
+ *
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ *
+ */
+
+static MMAL_STATUS_T create_encoder_component(RASPIVID_STATE *state)
+{
+   MMAL_COMPONENT_T *encoder = 0;
+   MMAL_PORT_T *encoder_input = NULL, *encoder_output = NULL;
+   MMAL_STATUS_T status;
+   MMAL_POOL_T *pool;
+
+   status = mmal_component_create(MMAL_COMPONENT_DEFAULT_VIDEO_ENCODER, &encoder);
+
+   if (status != MMAL_SUCCESS)
+   {
+      vcos_log_error("Unable to create video encoder component");
+      goto error;
+   }
+
+   if (!encoder->input_num || !encoder->output_num)
+   {
+      status = MMAL_ENOSYS;
+      vcos_log_error("Video encoder doesn't have input/output ports");
+      goto error;
+   }
+
+   encoder_input = encoder->input[0];
+   g_encoder_output = encoder_output = encoder->output[0];
+
+   // We want same format on input and output
+   mmal_format_copy(encoder_output->format, encoder_input->format);
+
+   // Only supporting H264 at the moment
+   encoder_output->format->encoding = MMAL_ENCODING_H264;
+
+   if (state->level == MMAL_VIDEO_LEVEL_H264_4)
+   {
+      if (state->bitrate > MAX_BITRATE_LEVEL4)
+      {
+         fprintf(stderr, "Bitrate too high: Reducing to 25MBit/s\n");
+         state->bitrate = MAX_BITRATE_LEVEL4;
+      }
+   }
+   else
+   {
+      if (state->bitrate > MAX_BITRATE_LEVEL42)
+      {
+         fprintf(stderr, "Bitrate too high: Reducing to 62.5MBit/s\n");
+         state->bitrate = MAX_BITRATE_LEVEL42;
+      }
+   }
+
+   encoder_output->format->bitrate = state->bitrate;
+   encoder_output->buffer_size = 1024*1024;//encoder_output->buffer_size_recommended;//encoder_output->buffer_size_min
+   encoder_output->buffer_num = 2; //encoder_output->buffer_num_recommended;//encoder_output->buffer_num_min
+
+   //fprintf(stderr, "encoder_output->buffer_size=%d, encoder_output->buffer_num=%d\n", encoder_output->buffer_size , encoder_output->buffer_num);exit(1);
+
+   // We need to set the frame rate on output to 0, to ensure it gets
+   // updated correctly from the input framerate when port connected
+   encoder_output->format->es->video.frame_rate.num = 0;
+   encoder_output->format->es->video.frame_rate.den = 1;
+
+   // Commit the port changes to the output port
+   status = mmal_port_format_commit(encoder_output);
+
+   if (status != MMAL_SUCCESS)
+   {
+      vcos_log_error("Unable to set format on video encoder output port");
+      goto error;
+   }
+
+   // Set the rate control parameter
+   //if (0)
+   {
+      MMAL_PARAMETER_VIDEO_RATECONTROL_T param = {{ MMAL_PARAMETER_RATECONTROL, sizeof(param)}, state->rateControl};
+      status = mmal_port_parameter_set(encoder_output, &param.hdr);
+      if (status != MMAL_SUCCESS)
+      {
+         vcos_log_error("Unable to set ratecontrol");
+         goto error;
+      }
+   }
+
+   if (state->intraperiod != -1)
+   {
+      MMAL_PARAMETER_UINT32_T param = {{ MMAL_PARAMETER_INTRAPERIOD, sizeof(param)}, state->intraperiod};
+      status = mmal_port_parameter_set(encoder_output, &param.hdr);
+      if (status != MMAL_SUCCESS)
+      {
+         vcos_log_error("Unable to set intraperiod");
+         goto error;
+      }
+   }
+
+   if (state->quantisationParameter)
+   {
+      MMAL_PARAMETER_UINT32_T param = {{ MMAL_PARAMETER_VIDEO_ENCODE_INITIAL_QUANT, sizeof(param)}, state->quantisationParameter};
+      status = mmal_port_parameter_set(encoder_output, &param.hdr);
+      if (status != MMAL_SUCCESS)
+      {
+         vcos_log_error("Unable to set initial QP");
+         goto error;
+      }
+
+      MMAL_PARAMETER_UINT32_T param2 = {{ MMAL_PARAMETER_VIDEO_ENCODE_MIN_QUANT, sizeof(param)}, state->quantisationParameter};
+      status = mmal_port_parameter_set(encoder_output, &param2.hdr);
+      if (status != MMAL_SUCCESS)
+      {
+         vcos_log_error("Unable to set min QP");
+         goto error;
+      }
+
+      MMAL_PARAMETER_UINT32_T param3 = {{ MMAL_PARAMETER_VIDEO_ENCODE_MAX_QUANT, sizeof(param)}, state->quantisationParameter};
+      status = mmal_port_parameter_set(encoder_output, &param3.hdr);
+      if (status != MMAL_SUCCESS)
+      {
+         vcos_log_error("Unable to set max QP");
+         goto error;
+      }
+   }
+
+   MMAL_PARAMETER_VIDEO_PROFILE_T param;
+   param.hdr.id = MMAL_PARAMETER_PROFILE;
+   param.hdr.size = sizeof(param);
+
+   param.profile[0].profile = state->profile;
+
+   if ((VCOS_ALIGN_UP(state->width,16) >> 4) * (VCOS_ALIGN_UP(state->height,16) >> 4) * state->framerate > 245760)
+   {
+      if ((VCOS_ALIGN_UP(state->width,16) >> 4) * (VCOS_ALIGN_UP(state->height,16) >> 4) * state->framerate <= 522240)
+      {
+         fprintf(stderr, "Too many macroblocks/s: Increasing H264 Level to 4.2\n");
+         state->level = MMAL_VIDEO_LEVEL_H264_42;
+      }
+      else
+      {
+         vcos_log_error("Too many macroblocks/s requested");
+         goto error;
+      }
+   }
+
+   param.profile[0].level = state->level;
+
+   status = mmal_port_parameter_set(encoder_output, &param.hdr);
+   if (status != MMAL_SUCCESS)
+   {
+      vcos_log_error("Unable to set H264 profile");
+      goto error;
+   }
+
+   if (mmal_port_parameter_set_boolean(encoder_input, MMAL_PARAMETER_VIDEO_IMMUTABLE_INPUT, 1) != MMAL_SUCCESS)
+   {
+      vcos_log_error("Unable to set immutable input flag");
+      // Continue rather than abort..
+   }
+
+   //set INLINE HEADER flag to generate SPS and PPS for every IDR if requested
+   if (mmal_port_parameter_set_boolean(encoder_output, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_HEADER, state->bInlineHeaders) != MMAL_SUCCESS)
+   {
+      vcos_log_error("failed to set INLINE HEADER FLAG parameters");
+      // Continue rather than abort..
+   }
+
+   // Adaptive intra refresh settings
+   if (state->intra_refresh_type != -1)
+   {
+      MMAL_PARAMETER_VIDEO_INTRA_REFRESH_T  param;
+      param.hdr.id = MMAL_PARAMETER_VIDEO_INTRA_REFRESH;
+      param.hdr.size = sizeof(param);
+
+      // Get first so we don't overwrite anything unexpectedly
+      status = mmal_port_parameter_get(encoder_output, &param.hdr);
+      if (status != MMAL_SUCCESS)
+      {
+         vcos_log_warn("Unable to get existing H264 intra-refresh values. Please update your firmware");
+         // Set some defaults, don't just pass random stack data
+         param.air_mbs = param.air_ref = param.cir_mbs = param.pir_mbs = 0;
+      }
+
+      param.refresh_mode = state->intra_refresh_type;
+
+      //if (state->intra_refresh_type == MMAL_VIDEO_INTRA_REFRESH_CYCLIC_MROWS)
+      //   param.cir_mbs = 10;
+
+      status = mmal_port_parameter_set(encoder_output, &param.hdr);
+      if (status != MMAL_SUCCESS)
+      {
+         vcos_log_error("Unable to set H264 intra-refresh values");
+         goto error;
+      }
+   }
+
+   if (state->sliceRows &&
+       (mmal_port_parameter_set_uint32(encoder_output, MMAL_PARAMETER_MB_ROWS_PER_SLICE, state->sliceRows) != MMAL_SUCCESS))
+   {
+      vcos_log_error("Unable to set %d macroblock rows per slice", state->sliceRows);
+      goto error;
+   }
+
+   //printf("motion_on=%d\n", mmal_port_parameter_set_boolean(g_encoder_output, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_VECTORS, 1));
+   //  Enable component
+   status = mmal_component_enable(encoder);
+
+   if (status != MMAL_SUCCESS)
+   {
+      vcos_log_error("Unable to enable video encoder component");
+      goto error;
+   }
+
+   /* Create pool of buffer headers for the output port to consume */
+   pool = mmal_port_pool_create(encoder_output, encoder_output->buffer_num, encoder_output->buffer_size);
+
+   if (!pool)
+   {
+      vcos_log_error("Failed to create buffer header pool for encoder output port %s", encoder_output->name);
+   }
+
+   state->encoder_pool = pool;
+   state->encoder_component = encoder;
+
+   return status;
+
+   error:
+   if (encoder)
+      mmal_component_destroy(encoder);
+
+   state->encoder_component = NULL;
+
+   return status;
+}
+
+/**
+ * Destroy the encoder component
+ *
+ * @param state Pointer to state control struct
+ *
+ */
+static void destroy_encoder_component(RASPIVID_STATE *state)
+{
+   // Get rid of any port buffers first
+   if (state->encoder_pool)
+   {
+      mmal_port_pool_destroy(state->encoder_component->output[0], state->encoder_pool);
+      state->encoder_pool = NULL;
+   }
+
+   if (state->encoder_component)
+   {
+      mmal_component_destroy(state->encoder_component);
+      state->encoder_component = NULL;
+   }
+}
+
+/**
+ * Connect two specific ports together
+ *
+ * @param output_port Pointer the output port
+ * @param input_port Pointer the input port
+ * @param Pointer to a mmal connection pointer, reassigned if function successful
+ * @return Returns a MMAL_STATUS_T giving result of operation
+ *
+ */
+static MMAL_STATUS_T connect_ports(MMAL_PORT_T *output_port, MMAL_PORT_T *input_port, MMAL_CONNECTION_T **connection)
+{
+   MMAL_STATUS_T status;
+
+   status =  mmal_connection_create(connection, output_port, input_port, MMAL_CONNECTION_FLAG_TUNNELLING | MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT);
+
+   if (status == MMAL_SUCCESS)
+   {
+      status =  mmal_connection_enable(*connection);
+      if (status != MMAL_SUCCESS)
+         mmal_connection_destroy(*connection);
+   }
+
+   return status;
+}
+
+/// JPEG snapshots from the still port, taken while the video keeps running
+#define SNAPSHOT_BUFFERS      2
+#define SNAPSHOT_JPEG_QUALITY 85
+
+typedef enum
+{
+   SNAPSHOT_FREE = 0,
+   SNAPSHOT_CAPTURING,                  /// filled by the JPEG encoder callback
+   SNAPSHOT_READY                       /// complete, waiting for the writer thread
+} SNAPSHOT_STATE;
+
+typedef struct
+{
+   SNAPSHOT_STATE st;
+   unsigned char *data;                 /// allocated on first use and kept, a snapshot never mallocs again
+   size_t len;
+   size_t cap;
+   bool bOverflow;
+   char path[256];                      /// empty = send it over the connection
+} SNAPSHOT_BUFFER;
+
+static struct
+{
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   bool bWriterStarted;
+   SNAPSHOT_BUFFER buf[SNAPSHOT_BUFFERS];
+} gSnapshot = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static SNAPSHOT_BUFFER *snapshot_find(SNAPSHOT_STATE st)
+{
+   int i;
+
+   for (i = 0; i < SNAPSHOT_BUFFERS; i++)
+      if (gSnapshot.buf[i].st == st)
+         return &gSnapshot.buf[i];
+   return NULL;
+}
+
+/* writes to disk or to the socket off the MMAL callback thread, the video callback never waits for a JPEG */
+static bool snapshot_capturing(void)
+{
+   bool bCapturing;
 
-      status = mmal_port_parameter_set(camera->control, &change_event_request.hdr);
-      if ( status != MMAL_SUCCESS )
-      {
-         vcos_log_error("No camera settings events");
-      }
-   }
+   pthread_mutex_lock(&gSnapshot.lock);
+   bCapturing = snapshot_find(SNAPSHOT_CAPTURING) != NULL;
+   pthread_mutex_unlock(&gSnapshot.lock);
+   return bCapturing;
+}
 
-   // Enable the camera, and tell it its control callback function
-   status = mmal_port_enable(camera->control, camera_control_callback);
+static void *snapshot_writer(void *arg)
+{
+   RASPIVID_STATE *pState = (RASPIVID_STATE *)arg;
+   SNAPSHOT_BUFFER *snap;
 
-   if (status != MMAL_SUCCESS)
+   pthread_mutex_lock(&gSnapshot.lock);
+   for (;;)
    {
-      vcos_log_error("Unable to enable control port : error %d", status);
-      goto error;
-   }
+      while (!(snap = snapshot_find(SNAPSHOT_READY)))
+         pthread_cond_wait(&gSnapshot.cond, &gSnapshot.lock);
+      pthread_mutex_unlock(&gSnapshot.lock);
 
-   //  set up the camera configuration
-   {
-      MMAL_PARAMETER_CAMERA_CONFIG_T cam_config =
+      if (snap->path[0])
       {
-         { MMAL_PARAMETER_CAMERA_CONFIG, sizeof(cam_config) },
-         .max_stills_w = state->width,
-         .max_stills_h = state->height,
-         .stills_yuv422 = 0,
-         .one_shot_stills = 0,
-         .max_preview_video_w = state->width,
-         .max_preview_video_h = state->height,
-         .num_preview_video_frames = 3 + vcos_max(0, (state->framerate-30)/10),
-         .stills_capture_circular_buffer_height = 0,
-         .fast_preview_resume = 0,
-         .use_stc_timestamp = MMAL_PARAM_TIMESTAMP_MODE_RAW_STC
-      };
-      mmal_port_parameter_set(camera->control, &cam_config.hdr);
-   }
-
-   // Now set up the port formats
+         //write to a temp name and rename, whoever picks up the file never sees half a JPEG
+         char tmp[sizeof(snap->path) + 4];
+         FILE *fp;
+
+         snprintf(tmp, sizeof(tmp), "%s.tmp", snap->path);
+         fp = fopen(tmp, "wb");
+         if (!fp || snap->len != fwrite(snap->data, 1, snap->len, fp))
+            fprintf(stderr, "snapshot: cannot write %s: %s\n", tmp, strerror(errno));
+         if (fp && !fclose(fp) && rename(tmp, snap->path))
+            fprintf(stderr, "snapshot: cannot rename %s: %s\n", tmp, strerror(errno));
+      }
+      else
+         SendTypedToAndroid(pState, Snapshot, snap->data, snap->len);
 
-   // Set the encode format on the Preview port
-   // HW limitations mean we need the preview to be the same size as the required recorded output
+      evlog_add(gEvLog, EVLOG_SNAPSHOT, 0, snap->len, 0);
+      if (pState->verbose)
+         fprintf(stderr, "snapshot: %zu bytes -> %s\n", snap->len, snap->path[0] ? snap->path : "connection");
 
-   format = preview_port->format;
+      pthread_mutex_lock(&gSnapshot.lock);
+      snap->st = SNAPSHOT_FREE;
+   }
+   return NULL;
+}
 
-   format->encoding = MMAL_ENCODING_OPAQUE;
-   format->encoding_variant = MMAL_ENCODING_I420;
+/**
+ * Take one JPEG from the still port, the video stream is not interrupted
+ *
+ * @param pState Pointer to state control struct
+ * @param path File to write, empty string to send it over the connection (android_motion mode only)
+ *
+ */
+static void snapshot_request(RASPIVID_STATE *pState, const char *path)
+{
+   SNAPSHOT_BUFFER *snap;
 
-   if(state->camera_parameters.shutter_speed > 6000000)
+   if (!pState->image_encoder_component)
    {
-        MMAL_PARAMETER_FPS_RANGE_T fps_range = {{MMAL_PARAMETER_FPS_RANGE, sizeof(fps_range)},
-                                                     { 50, 1000 }, {166, 1000}};
-        mmal_port_parameter_set(preview_port, &fps_range.hdr);
+      fprintf(stderr, "snapshot: not available\n");
+      return;
    }
-   else if(state->camera_parameters.shutter_speed > 1000000)
+   if (!path[0] && pState->enc_cb_func != encoder_buffer_callback_android_motion)
    {
-        MMAL_PARAMETER_FPS_RANGE_T fps_range = {{MMAL_PARAMETER_FPS_RANGE, sizeof(fps_range)},
-                                                     { 166, 1000 }, {999, 1000}};
-        mmal_port_parameter_set(preview_port, &fps_range.hdr);
+      fprintf(stderr, "snapshot: only android_motion mode can send it over the connection, use snapshot=/path/file.jpg\n");
+      return;
    }
 
-   //enable dynamic framerate if necessary
-   if (state->camera_parameters.shutter_speed)
+   pthread_mutex_lock(&gSnapshot.lock);
+   //one capture at a time, the second buffer lets the next one start while the previous one is still written
+   if (snapshot_find(SNAPSHOT_CAPTURING) || !(snap = snapshot_find(SNAPSHOT_FREE)))
    {
-      if (state->framerate > 1000000./state->camera_parameters.shutter_speed)
+      pthread_mutex_unlock(&gSnapshot.lock);
+      fprintf(stderr, "snapshot: busy\n");
+      return;
+   }
+   if (!snap->data)
+   {
+      //a JPEG is never bigger than the raw I420 frame
+      snap->cap = (size_t)pState->snapshotWidth * pState->snapshotHeight * 3 / 2;
+      snap->data = malloc(snap->cap);
+      if (!snap->data)
       {
-         state->framerate=0;
-         if (state->verbose)
-            fprintf(stderr, "Enable dynamic frame rate to fulfil shutter speed requirement\n");
+         pthread_mutex_unlock(&gSnapshot.lock);
+         fprintf(stderr, "snapshot: out of memory\n");
+         return;
       }
    }
+   snap->len = 0;
+   snap->bOverflow = false;
+   strncpy(snap->path, path, sizeof(snap->path) - 1);
+   snap->path[sizeof(snap->path) - 1] = 0;
+   snap->st = SNAPSHOT_CAPTURING;
 
-   format->encoding = MMAL_ENCODING_OPAQUE;
-   format->es->video.width = VCOS_ALIGN_UP(state->width, 32);
-   format->es->video.height = VCOS_ALIGN_UP(state->height, 16);
-   format->es->video.crop.x = 0;
-   format->es->video.crop.y = 0;
-   format->es->video.crop.width = state->width;
-   format->es->video.crop.height = state->height;
-   format->es->video.frame_rate.num = PREVIEW_FRAME_RATE_NUM;
-   format->es->video.frame_rate.den = PREVIEW_FRAME_RATE_DEN;
+   if (!gSnapshot.bWriterStarted)
+   {
+      pthread_t thread;
 
-   status = mmal_port_format_commit(preview_port);
+      if (pthread_create(&thread, NULL, snapshot_writer, pState))
+         exit(__LINE__);
+      pthread_detach(thread);
+      gSnapshot.bWriterStarted = true;
+   }
+   pthread_mutex_unlock(&gSnapshot.lock);
 
-   if (status != MMAL_SUCCESS)
+   if (MMAL_SUCCESS != mmal_port_parameter_set_boolean(camera_still_port, MMAL_PARAMETER_CAPTURE, 1))
    {
-      vcos_log_error("camera viewfinder format couldn't be set");
-      goto error;
+      fprintf(stderr, "%d\n", __LINE__);
+      pthread_mutex_lock(&gSnapshot.lock);
+      snap->st = SNAPSHOT_FREE;
+      pthread_mutex_unlock(&gSnapshot.lock);
    }
+}
 
-   // Set the encode format on the video  port
+/**
+ *  buffer header callback function for the JPEG encoder
+ *
+ * @param port Pointer to port from which callback originated
+ * @param buffer mmal buffer header pointer
+ */
+static void image_encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+   RASPIVID_STATE *pState = (RASPIVID_STATE *)port->userdata;
+   SNAPSHOT_BUFFER *snap;
 
-   format = video_port->format;
-   format->encoding_variant = MMAL_ENCODING_I420;
+   pthread_mutex_lock(&gSnapshot.lock);
+   snap = snapshot_find(SNAPSHOT_CAPTURING);
+   pthread_mutex_unlock(&gSnapshot.lock);
 
-   if(state->camera_parameters.shutter_speed > 6000000)
+   if (snap)
    {
-        MMAL_PARAMETER_FPS_RANGE_T fps_range = {{MMAL_PARAMETER_FPS_RANGE, sizeof(fps_range)},
-                                                     { 50, 1000 }, {166, 1000}};
-        mmal_port_parameter_set(video_port, &fps_range.hdr);
+      if (buffer->length)
+      {
+         if (snap->len + buffer->length <= snap->cap)
+         {
+            mmal_buffer_header_mem_lock(buffer);
+            memcpy(snap->data + snap->len, buffer->data + buffer->offset, buffer->length);
+            mmal_buffer_header_mem_unlock(buffer);
+            snap->len += buffer->length;
+         }
+         else
+            snap->bOverflow = true;
+      }
+
+      if (buffer->flags & (MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED))
+      {
+         pthread_mutex_lock(&gSnapshot.lock);
+         if (snap->bOverflow || (buffer->flags & MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED))
+         {
+            fprintf(stderr, "snapshot: failed\n");
+            snap->st = SNAPSHOT_FREE;
+         }
+         else
+         {
+            snap->st = SNAPSHOT_READY;
+            pthread_cond_signal(&gSnapshot.cond);
+         }
+         pthread_mutex_unlock(&gSnapshot.lock);
+      }
    }
-   else if(state->camera_parameters.shutter_speed > 1000000)
+
+   mmal_buffer_header_release(buffer);
+
+   if (port->is_enabled)
    {
-        MMAL_PARAMETER_FPS_RANGE_T fps_range = {{MMAL_PARAMETER_FPS_RANGE, sizeof(fps_range)},
-                                                     { 167, 1000 }, {999, 1000}};
-        mmal_port_parameter_set(video_port, &fps_range.hdr);
+      MMAL_STATUS_T status = MMAL_SUCCESS;
+      MMAL_BUFFER_HEADER_T *new_buffer = mmal_queue_get(pState->image_encoder_pool->queue);
+
+      if (new_buffer)
+         status = mmal_port_send_buffer(port, new_buffer);
+
+      if (!new_buffer || status != MMAL_SUCCESS)
+         vcos_log_error("Unable to return a buffer to the JPEG encoder port");
    }
+}
 
-   format->encoding = MMAL_ENCODING_OPAQUE;
-   format->es->video.width = VCOS_ALIGN_UP(state->width, 32);
-   format->es->video.height = VCOS_ALIGN_UP(state->height, 16);
-   format->es->video.crop.x = 0;
-   format->es->video.crop.y = 0;
-   format->es->video.crop.width = state->width;
-   format->es->video.crop.height = state->height;
-   format->es->video.frame_rate.num = state->framerate;
-   format->es->video.frame_rate.den = VIDEO_FRAME_RATE_DEN;
+/**
+ * Create the JPEG encoder component for snapshots, set up its ports
+ *
+ * @param state Pointer to state control struct
+ *
+ * @return MMAL_SUCCESS if all OK, something else otherwise
+ *
+ */
+static MMAL_STATUS_T create_image_encoder_component(RASPIVID_STATE *state)
+{
+   MMAL_COMPONENT_T *encoder = 0;
+   MMAL_PORT_T *encoder_input = NULL, *encoder_output = NULL;
+   MMAL_STATUS_T status;
+   MMAL_POOL_T *pool;
 
-   status = mmal_port_format_commit(video_port);
+   status = mmal_component_create(MMAL_COMPONENT_DEFAULT_IMAGE_ENCODER, &encoder);
 
    if (status != MMAL_SUCCESS)
    {
-      vcos_log_error("camera video format couldn't be set");
+      vcos_log_error("Unable to create JPEG encoder component");
       goto error;
    }
 
-   // Ensure there are enough buffers to avoid dropping frames
-   if (video_port->buffer_num < VIDEO_OUTPUT_BUFFERS_NUM)
-      video_port->buffer_num = VIDEO_OUTPUT_BUFFERS_NUM;
+   encoder_input = encoder->input[0];
+   encoder_output = encoder->output[0];
 
+   // We want same format on input and output
+   mmal_format_copy(encoder_output->format, encoder_input->format);
 
-   // Set the encode format on the still  port
+   encoder_output->format->encoding = MMAL_ENCODING_JPEG;
 
-   format = still_port->format;
+   encoder_output->buffer_size = encoder_output->buffer_size_recommended;
 
-   format->encoding = MMAL_ENCODING_OPAQUE;
-   format->encoding_variant = MMAL_ENCODING_I420;
+   if (encoder_output->buffer_size < encoder_output->buffer_size_min)
+      encoder_output->buffer_size = encoder_output->buffer_size_min;
 
-   format->es->video.width = VCOS_ALIGN_UP(state->width, 32);
-   format->es->video.height = VCOS_ALIGN_UP(state->height, 16);
-   format->es->video.crop.x = 0;
-   format->es->video.crop.y = 0;
-   format->es->video.crop.width = state->width;
-   format->es->video.crop.height = state->height;
-   format->es->video.frame_rate.num = 0;
-   format->es->video.frame_rate.den = 1;
+   encoder_output->buffer_num = encoder_output->buffer_num_recommended;
 
-   status = mmal_port_format_commit(still_port);
+   if (encoder_output->buffer_num < encoder_output->buffer_num_min)
+      encoder_output->buffer_num = encoder_output->buffer_num_min;
+
+   status = mmal_port_format_commit(encoder_output);
 
    if (status != MMAL_SUCCESS)
    {
-      vcos_log_error("camera still format couldn't be set");
+      vcos_log_error("Unable to set format on JPEG encoder output port");
       goto error;
    }
 
-   /* Ensure there are enough buffers to avoid dropping frames */
-   if (still_port->buffer_num < VIDEO_OUTPUT_BUFFERS_NUM)
-      still_port->buffer_num = VIDEO_OUTPUT_BUFFERS_NUM;
+   status = mmal_port_parameter_set_uint32(encoder_output, MMAL_PARAMETER_JPEG_Q_FACTOR, SNAPSHOT_JPEG_QUALITY);
 
-   /* Enable component */
-   status = mmal_component_enable(camera);
+   if (status != MMAL_SUCCESS)
+   {
+      vcos_log_error("Unable to set JPEG quality");
+      goto error;
+   }
+
+   status = mmal_component_enable(encoder);
 
    if (status != MMAL_SUCCESS)
    {
-      vcos_log_error("camera component couldn't be enabled");
+      vcos_log_error("Unable to enable JPEG encoder component");
       goto error;
    }
 
-   raspicamcontrol_set_all_parameters(camera, &state->camera_parameters);
+   pool = mmal_port_pool_create(encoder_output, encoder_output->buffer_num, encoder_output->buffer_size);
 
-   state->camera_component = camera;
+   if (!pool)
+   {
+      vcos_log_error("Failed to create buffer header pool for JPEG encoder output port %s", encoder_output->name);
+      status = MMAL_ENOMEM;
+      goto error;
+   }
+
+   state->image_encoder_pool = pool;
+   state->image_encoder_component = encoder;
 
    return status;
 
-error:
+   error:
+   if (encoder)
+      mmal_component_destroy(encoder);
 
-   if (camera)
-      mmal_component_destroy(camera);
+   state->image_encoder_component = NULL;
 
    return status;
 }
 
 /**
- * Destroy the camera component
+ * Destroy the JPEG encoder component
  *
  * @param state Pointer to state control struct
  *
  */
-static void destroy_camera_component(RASPIVID_STATE *state)
+static void destroy_image_encoder_component(RASPIVID_STATE *state)
 {
-   if (state->camera_component)
+   if (state->image_encoder_pool)
    {
-      mmal_component_destroy(state->camera_component);
-      state->camera_component = NULL;
+      mmal_port_pool_destroy(state->image_encoder_component->output[0], state->image_encoder_pool);
+      state->image_encoder_pool = NULL;
    }
-}
-
 
+   if (state->image_encoder_component)
+   {
+      mmal_component_disable(state->image_encoder_component);
+      mmal_component_destroy(state->image_encoder_component);
+      state->image_encoder_component = NULL;
+   }
+}
 
 /**
- * Create the encoder component, set up its ports
+ * Connect the still port to a JPEG encoder, streaming goes on without snapshots if it fails
  *
  * @param state Pointer to state control struct
  *
- * @return MMAL_SUCCESS if all OK, something else otherwise
- *
  */
-
-static MMAL_STATUS_T create_encoder_component(RASPIVID_STATE *state)
+static void setup_snapshots(RASPIVID_STATE *state)
 {
-   MMAL_COMPONENT_T *encoder = 0;
-   MMAL_PORT_T *encoder_input = NULL, *encoder_output = NULL;
-   MMAL_STATUS_T status;
-   MMAL_POOL_T *pool;
+   MMAL_PORT_T *output;
+   int num, q;
 
-   status = mmal_component_create(MMAL_COMPONENT_DEFAULT_VIDEO_ENCODER, &encoder);
+   if (create_image_encoder_component(state) != MMAL_SUCCESS)
+      goto error;
 
-   if (status != MMAL_SUCCESS)
+   if (connect_ports(camera_still_port, state->image_encoder_component->input[0], &state->still_connection) != MMAL_SUCCESS)
    {
-      vcos_log_error("Unable to create video encoder component");
+      state->still_connection = NULL;
+      vcos_log_error("%s: Failed to connect camera still port to JPEG encoder input", __func__);
       goto error;
    }
 
-   if (!encoder->input_num || !encoder->output_num)
+   output = state->image_encoder_component->output[0];
+   output->userdata = (struct MMAL_PORT_USERDATA_T *)state;
+   if (mmal_port_enable(output, image_encoder_buffer_callback) != MMAL_SUCCESS)
    {
-      status = MMAL_ENOSYS;
-      vcos_log_error("Video encoder doesn't have input/output ports");
+      vcos_log_error("Failed to setup JPEG encoder output");
       goto error;
    }
 
-   encoder_input = encoder->input[0];
-   g_encoder_output = encoder_output = encoder->output[0];
+   num = mmal_queue_length(state->image_encoder_pool->queue);
+   for (q = 0; q < num; q++)
+   {
+      MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(state->image_encoder_pool->queue);
+
+      if (!buffer || mmal_port_send_buffer(output, buffer) != MMAL_SUCCESS)
+         vcos_log_error("Unable to send a buffer to JPEG encoder output port (%d)", q);
+   }
+   return;
+
+   error:
+   fprintf(stderr, "snapshots disabled\n");
+   if (state->still_connection)
+   {
+      mmal_connection_destroy(state->still_connection);
+      state->still_connection = NULL;
+   }
+   destroy_image_encoder_component(state);
+}
+
+/*
+ * -watchdog: when the encoder stops delivering frames (firmware hiccup, pool
+ * run dry) the camera, the encoder and their connections are torn down and
+ * built again in-process with the same settings, the way main() does it. The
+ * output connection stays, the client just sees an IDR frame after the gap.
+ * A pipeline stopped on purpose holds gCameraReconfig, that is no stall.
+ * Every encoder buffer counts, stamped when the callback is entered and left:
+ * a callback blocked in a send to a slow client or pipe reader is the
+ * client's stall, not the encoder's, and the port is not disabled under it.
+ * Recovery time (rebuild to the first frame) goes to stderr, the event log
+ * and the "watchdog" command.
+ */
+#define WATCHDOG_TICK_US 250000
+#define WATCHDOG_MAX_FAILURES 5         /// rebuilds in a row without a frame, then exit and let a supervisor restart us
+
+static struct
+{
+   pthread_mutex_t lock;
+   int64_t last_frame_us;               /// monotonic_us() of the last encoder callback entry or exit
+   bool bInCallback;                    /// the encoder callback runs (may block in a send)
+   int64_t rebuild_us;                  /// when the last rebuild started, 0 = none waiting for its first frame
+   int64_t recovered_us;                /// the first frame after it
+   int64_t stalled_ms;                  /// without frames before the rebuild
+   unsigned stalls, recoveries, failures;
+   int64_t last_ms, max_ms;             /// recovery times
+} gWatchdog = { PTHREAD_MUTEX_INITIALIZER };
+
+static void watchdog_stamp(bool bIn)
+{
+   int64_t now = monotonic_us();
+
+   pthread_mutex_lock(&gWatchdog.lock);
+   gWatchdog.last_frame_us = now;
+   gWatchdog.bInCallback = bIn;
+   if (bIn && gWatchdog.rebuild_us && !gWatchdog.recovered_us)
+      gWatchdog.recovered_us = now;
+   pthread_mutex_unlock(&gWatchdog.lock);
+}
+
+/* -watchdog: the mode's callback between the stamps */
+static void watchdog_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+   PORT_USERDATA *pData = (PORT_USERDATA *)port->userdata;
+
+   watchdog_stamp(true);
+   pData->pstate->enc_cb_func(port, buffer);
+   watchdog_stamp(false);
+}
+
+/* what the encoder output port is enabled with */
+static MMAL_PORT_BH_CB_T encoder_callback(RASPIVID_STATE *pState)
+{
+   return pState->watchdog ? watchdog_callback : pState->enc_cb_func;
+}
+
+static void watchdog_format(char *buf, size_t size)
+{
+   pthread_mutex_lock(&gWatchdog.lock);
+   snprintf(buf, size, "stalls=%u recoveries=%u failures=%u last_recovery_ms=%lld max_recovery_ms=%lld",
+            gWatchdog.stalls, gWatchdog.recoveries, gWatchdog.failures, (long long)gWatchdog.last_ms, (long long)gWatchdog.max_ms);
+   pthread_mutex_unlock(&gWatchdog.lock);
+}
+
+/* "watchdog" on the control connection, in android_motion mode the line goes back as one Telemetry message */
+static void watchdog_reply(RASPIVID_STATE *pState)
+{
+   char line[160];
+
+   if (!pState->watchdog)
+   {
+      fprintf(stderr, "watchdog: off, start with -watchdog <sec>\n");
+      return;
+   }
+   strcpy(line, "watchdog: ");
+   watchdog_format(line + strlen(line), sizeof(line) - strlen(line));
+   if (!SendTypedToAndroid(pState, Telemetry, line, strlen(line)))
+      fprintf(stderr, "%s\n", line);
+}
 
-   // We want same format on input and output
-   mmal_format_copy(encoder_output->format, encoder_input->format);
+/* everything main() builds behind the camera, in the same order; false leaves it half built for the next try */
+static bool watchdog_rebuild(RASPIVID_STATE *pState)
+{
+   MMAL_BOOL_T bVectors = 0;
+   int i, num, q;
 
-   // Only supporting H264 at the moment
-   encoder_output->format->encoding = MMAL_ENCODING_H264;
+   //a snapshot in flight needs the still connection, give it a few seconds
+   for (i = 0; (i < 50) && snapshot_capturing(); i++)
+      usleep(100000);
 
-   if (state->level == MMAL_VIDEO_LEVEL_H264_4)
+   if (encoder_output_port)
    {
-      if (state->bitrate > MAX_BITRATE_LEVEL4)
-      {
-         fprintf(stderr, "Bitrate too high: Reducing to 25MBit/s\n");
-         state->bitrate = MAX_BITRATE_LEVEL4;
-      }
+      mmal_port_parameter_get_boolean(encoder_output_port, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_VECTORS, &bVectors);
+      mmal_port_parameter_set_boolean(camera_video_port, MMAL_PARAMETER_CAPTURE, 0);
+      mmal_port_disable(encoder_output_port);
    }
-   else
+   //a pipe reader still has pages of the old pool, it gets them before the pool goes
+   if (gSink.bEnabled)
+      splice_sink_close(&gSink.sink);
+   //the first half of a frame the callback holds back, the client never got it
+   if (p_buf_partial_begin)
    {
-      if (state->bitrate > MAX_BITRATE_LEVEL42)
-      {
-         fprintf(stderr, "Bitrate too high: Reducing to 62.5MBit/s\n");
-         state->bitrate = MAX_BITRATE_LEVEL42;
-      }
+      mmal_buffer_header_mem_unlock(p_buf_partial_begin);
+      mmal_buffer_header_release(p_buf_partial_begin);
+      p_buf_partial_begin = NULL;
    }
-
-   encoder_output->format->bitrate = state->bitrate;
-   encoder_output->buffer_size = 1024*1024;//encoder_output->buffer_size_recommended;//encoder_output->buffer_size_min
-   encoder_output->buffer_num = 2; //encoder_output->buffer_num_recommended;//encoder_output->buffer_num_min
-
-   //fprintf(stderr, "encoder_output->buffer_size=%d, encoder_output->buffer_num=%d\n", encoder_output->buffer_size , encoder_output->buffer_num);exit(1);
-
-   // We need to set the frame rate on output to 0, to ensure it gets
-   // updated correctly from the input framerate when port connected
-   encoder_output->format->es->video.frame_rate.num = 0;
-   encoder_output->format->es->video.frame_rate.den = 1;
-
-   // Commit the port changes to the output port
-   status = mmal_port_format_commit(encoder_output);
-
-   if (status != MMAL_SUCCESS)
+   if (pState->image_encoder_component)
+      mmal_port_disable(pState->image_encoder_component->output[0]);
+   if (pState->still_connection)
    {
-      vcos_log_error("Unable to set format on video encoder output port");
-      goto error;
+      mmal_connection_destroy(pState->still_connection);
+      pState->still_connection = NULL;
+   }
+   if (pState->encoder_connection)
+   {
+      mmal_connection_destroy(pState->encoder_connection);
+      pState->encoder_connection = NULL;
+   }
+   if (pState->encoder_component)
+      mmal_component_disable(pState->encoder_component);
+   if (pState->camera_component)
+      mmal_component_disable(pState->camera_component);
+   destroy_image_encoder_component(pState);
+   destroy_encoder_component(pState);
+   destroy_camera_component(pState);
+   camera_preview_port = camera_video_port = camera_still_port = NULL;
+   encoder_input_port = encoder_output_port = g_encoder_output = NULL;
+
+   pthread_mutex_lock(&gSnapshot.lock);
+   for (i = 0; i < SNAPSHOT_BUFFERS; i++)
+      if (SNAPSHOT_CAPTURING == gSnapshot.buf[i].st)
+         gSnapshot.buf[i].st = SNAPSHOT_FREE;
+   pthread_mutex_unlock(&gSnapshot.lock);
+   pState->callback_data.bMidFrame = false;
+   pState->callback_data.bAtBoundary = false;
+
+   if (create_camera_component(pState) != MMAL_SUCCESS)
+   {
+      vcos_log_error("%s: Failed to create camera component", __func__);
+      return false;
+   }
+   if (create_encoder_component(pState) != MMAL_SUCCESS)
+   {
+      vcos_log_error("%s: Failed to create encode component", __func__);
+      return false;
+   }
+   if (gSink.bEnabled &&
+       !splice_sink_open(&gSink.sink, gSink.sink.fd, sink_acquire, sink_release, pState->encoder_pool->headers_num - 1))
+   {
+      vcos_log_error("%s: Failed to reopen the output", __func__);
+      return false;
+   }
+   camera_preview_port = pState->camera_component->output[MMAL_CAMERA_PREVIEW_PORT];
+   camera_video_port   = pState->camera_component->output[MMAL_CAMERA_VIDEO_PORT];
+   camera_still_port   = pState->camera_component->output[MMAL_CAMERA_CAPTURE_PORT];
+   encoder_input_port  = pState->encoder_component->input[0];
+   encoder_output_port = pState->encoder_component->output[0];
+   if (connect_ports(camera_video_port, encoder_input_port, &pState->encoder_connection) != MMAL_SUCCESS)
+   {
+      pState->encoder_connection = NULL;
+      vcos_log_error("%s: Failed to connect camera video port to encoder input", __func__);
+      return false;
    }
 
-   // Set the rate control parameter
-   //if (0)
+   encoder_output_port->userdata = (struct MMAL_PORT_USERDATA_T *)&pState->callback_data;
+   if (bVectors && (MMAL_SUCCESS != mmal_port_parameter_set_boolean(encoder_output_port, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_VECTORS, 1)))
+      fprintf(stderr, "%d\n", __LINE__);
+   if (mmal_port_enable(encoder_output_port, encoder_callback(pState)) != MMAL_SUCCESS)
    {
-      MMAL_PARAMETER_VIDEO_RATECONTROL_T param = {{ MMAL_PARAMETER_RATECONTROL, sizeof(param)}, MMAL_VIDEO_RATECONTROL_VARIABLE_SKIP_FRAMES};
-      status = mmal_port_parameter_set(encoder_output, &param.hdr);
-      if (status != MMAL_SUCCESS)
-      {
-         vcos_log_error("Unable to set ratecontrol");
-         goto error;
-      }
+      vcos_log_error("Failed to setup encoder output");
+      return false;
    }
+   num = mmal_queue_length(pState->encoder_pool->queue);
+   for (q = 0; q < num; q++)
+   {
+      MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(pState->encoder_pool->queue);
 
-   if (state->intraperiod != -1)
+      if (!buffer || (mmal_port_send_buffer(encoder_output_port, buffer) != MMAL_SUCCESS))
+         vcos_log_error("Unable to send a buffer to encoder output port (%d)", q);
+   }
+   setup_snapshots(pState);
+   loss_reset();
+
+   //the new encoder starts from -b and its own QP, give it what -probe and -telemetry had set
+   pthread_mutex_lock(&gRate.lock);
+   gRate.bitrate = pState->bitrate;
+   gRate.min_qp = pState->quantisationParameter ? pState->quantisationParameter : gRate.base_min_qp;
+   pthread_mutex_unlock(&gRate.lock);
+   rate_apply(pState);
+   if (pState->lowLightFps)
    {
-      MMAL_PARAMETER_UINT32_T param = {{ MMAL_PARAMETER_INTRAPERIOD, sizeof(param)}, state->intraperiod};
-      status = mmal_port_parameter_set(encoder_output, &param.hdr);
-      if (status != MMAL_SUCCESS)
-      {
-         vcos_log_error("Unable to set intraperiod");
-         goto error;
-      }
+      pthread_mutex_lock(&gLowLight.lock);
+      gLowLight.bReset = true;
+      gLowLight.last_pts = 0;
+      gLowLight.interval_sum = gLowLight.intervals = 0;
+      pthread_mutex_unlock(&gLowLight.lock);
    }
 
-   if (state->quantisationParameter)
+   if (MMAL_SUCCESS != mmal_port_parameter_set_boolean(camera_video_port, MMAL_PARAMETER_CAPTURE, !capture_paused()))
+      fprintf(stderr, "%d\n", __LINE__);
+   if (MMAL_SUCCESS != mmal_port_parameter_set_boolean(encoder_output_port, MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME, 1))
+      fprintf(stderr, "%d\n", __LINE__);
+   return true;
+}
+
+static void *watchdog_thread(void *arg)
+{
+   RASPIVID_STATE *pState = (RASPIVID_STATE *)arg;
+   int64_t limit_us = pState->watchdog * 1000000LL;
+
+   for (;;)
    {
-      MMAL_PARAMETER_UINT32_T param = {{ MMAL_PARAMETER_VIDEO_ENCODE_INITIAL_QUANT, sizeof(param)}, state->quantisationParameter};
-      status = mmal_port_parameter_set(encoder_output, &param.hdr);
-      if (status != MMAL_SUCCESS)
-      {
-         vcos_log_error("Unable to set initial QP");
-         goto error;
-      }
+      int64_t now, start, rebuild_us = 0, recovered_us = 0, stalled_ms = 0;
+      bool bStalled, bRebuilt;
 
-      MMAL_PARAMETER_UINT32_T param2 = {{ MMAL_PARAMETER_VIDEO_ENCODE_MIN_QUANT, sizeof(param)}, state->quantisationParameter};
-      status = mmal_port_parameter_set(encoder_output, &param2.hdr);
-      if (status != MMAL_SUCCESS)
+      usleep(WATCHDOG_TICK_US);
+      now = monotonic_us();
+      pthread_mutex_lock(&gWatchdog.lock);
+      if (gWatchdog.rebuild_us && gWatchdog.recovered_us)
       {
-         vcos_log_error("Unable to set min QP");
-         goto error;
+         rebuild_us = gWatchdog.rebuild_us;
+         recovered_us = gWatchdog.recovered_us;
+         stalled_ms = gWatchdog.stalled_ms;
+         gWatchdog.last_ms = (recovered_us - rebuild_us) / 1000;
+         if (gWatchdog.last_ms > gWatchdog.max_ms)
+            gWatchdog.max_ms = gWatchdog.last_ms;
+         gWatchdog.recoveries++;
+         gWatchdog.failures = 0;
+         gWatchdog.rebuild_us = gWatchdog.recovered_us = 0;
       }
+      //no frames is what a pause is for
+      if (capture_paused())
+         gWatchdog.last_frame_us = now;
+      bStalled = !gWatchdog.bInCallback && (now - gWatchdog.last_frame_us > limit_us);
+      pthread_mutex_unlock(&gWatchdog.lock);
 
-      MMAL_PARAMETER_UINT32_T param3 = {{ MMAL_PARAMETER_VIDEO_ENCODE_MAX_QUANT, sizeof(param)}, state->quantisationParameter};
-      status = mmal_port_parameter_set(encoder_output, &param3.hdr);
-      if (status != MMAL_SUCCESS)
+      if (recovered_us)
       {
-         vcos_log_error("Unable to set max QP");
-         goto error;
-      }
-   }
-
-   MMAL_PARAMETER_VIDEO_PROFILE_T param;
-   param.hdr.id = MMAL_PARAMETER_PROFILE;
-   param.hdr.size = sizeof(param);
+         char line[128];
 
-   param.profile[0].profile = state->profile;
+         snprintf(line, sizeof(line), "watchdog: no frame for %lld ms, recovered in %lld ms",
+                  (long long)stalled_ms, (long long)(recovered_us - rebuild_us) / 1000);
+         fprintf(stderr, "%s\n", line);
+         evlog_add(gEvLog, EVLOG_RECOVERY, 0, (uint32_t)((recovered_us - rebuild_us) / 1000), stalled_ms);
+         SendTypedToAndroid(pState, Telemetry, line, strlen(line));
+      }
+      if (!bStalled)
+         continue;
 
-   if ((VCOS_ALIGN_UP(state->width,16) >> 4) * (VCOS_ALIGN_UP(state->height,16) >> 4) * state->framerate > 245760)
-   {
-      if ((VCOS_ALIGN_UP(state->width,16) >> 4) * (VCOS_ALIGN_UP(state->height,16) >> 4) * state->framerate <= 522240)
+      //a motion vector or low-light switch stops the frames itself
+      if (pthread_mutex_trylock(&gCameraReconfig))
       {
-         fprintf(stderr, "Too many macroblocks/s: Increasing H264 Level to 4.2\n");
-         state->level = MMAL_VIDEO_LEVEL_H264_42;
+         pthread_mutex_lock(&gWatchdog.lock);
+         gWatchdog.last_frame_us = now;
+         pthread_mutex_unlock(&gWatchdog.lock);
+         continue;
       }
+
+      pthread_mutex_lock(&gWatchdog.lock);
+      if (gWatchdog.rebuild_us)
+         gWatchdog.failures++;
       else
+         gWatchdog.stalls++;
+      if (gWatchdog.failures >= WATCHDOG_MAX_FAILURES)
       {
-         vcos_log_error("Too many macroblocks/s requested");
-         goto error;
+         fprintf(stderr, "watchdog: no frame after %d rebuilds, giving up\n", WATCHDOG_MAX_FAILURES);
+         exit(EX_SOFTWARE);
       }
+      gWatchdog.stalled_ms = (now - gWatchdog.last_frame_us) / 1000;
+      fprintf(stderr, "watchdog: no frame for %lld ms, rebuilding camera and encoder\n", (long long)gWatchdog.stalled_ms);
+      pthread_mutex_unlock(&gWatchdog.lock);
+
+      start = monotonic_us();
+      bRebuilt = watchdog_rebuild(pState);
+      pthread_mutex_unlock(&gCameraReconfig);
+
+      //the next try is limit_us after this one, failed or not
+      pthread_mutex_lock(&gWatchdog.lock);
+      gWatchdog.rebuild_us = start;
+      gWatchdog.recovered_us = 0;
+      gWatchdog.last_frame_us = monotonic_us();
+      pthread_mutex_unlock(&gWatchdog.lock);
+      fprintf(stderr, "watchdog: %s in %lld ms\n", bRebuilt ? "rebuilt" : "rebuild failed", (long long)(monotonic_us() - start) / 1000);
    }
+   return NULL;
+}
 
-   param.profile[0].level = state->level;
+/* once capture runs, the first frame has the limit to come */
+static void watchdog_setup(RASPIVID_STATE *pState)
+{
+   pthread_t thread;
 
-   status = mmal_port_parameter_set(encoder_output, &param.hdr);
-   if (status != MMAL_SUCCESS)
+   if (!pState->watchdog)
+      return;
+   pthread_mutex_lock(&gWatchdog.lock);
+   gWatchdog.last_frame_us = monotonic_us();
+   pthread_mutex_unlock(&gWatchdog.lock);
+   if (pthread_create(&thread, NULL, watchdog_thread, pState))
+      exit(__LINE__);
+   pthread_detach(thread);
+}
+
+/* the one place that pauses and resumes, for the wait methods and the pause/resume commands */
+static void capture_pause(RASPIVID_STATE *pState, bool bPause)
+{
+   char line[128];
+   int64_t now = vcos_getmicrosecs64();
+
+   pthread_mutex_lock(&gCameraReconfig);
+   pthread_mutex_lock(&gPause.lock);
+   if (bPause == gPause.bPaused)
    {
-      vcos_log_error("Unable to set H264 profile");
-      goto error;
+      pthread_mutex_unlock(&gPause.lock);
+      pthread_mutex_unlock(&gCameraReconfig);
+      return;
    }
-
-   if (mmal_port_parameter_set_boolean(encoder_input, MMAL_PARAMETER_VIDEO_IMMUTABLE_INPUT, 1) != MMAL_SUCCESS)
+   gPause.bPaused = bPause;
+   if (bPause)
    {
-      vcos_log_error("Unable to set immutable input flag");
-      // Continue rather than abort..
+      gPause.since_us = now;
+      gPause.resume_us = 0;
+      gPause.pauses++;
    }
-
-   //set INLINE HEADER flag to generate SPS and PPS for every IDR if requested
-   if (mmal_port_parameter_set_boolean(encoder_output, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_HEADER, state->bInlineHeaders) != MMAL_SUCCESS)
+   else
    {
-      vcos_log_error("failed to set INLINE HEADER FLAG parameters");
-      // Continue rather than abort..
+      gPause.paused_us += now - gPause.since_us;
+      gPause.resume_us = now;
    }
+   snprintf(line, sizeof(line), "pause: %s, %u pauses, %.1f s paused in total", bPause ? "paused" : "resumed", gPause.pauses,
+            gPause.paused_us / 1e6);
+   pthread_mutex_unlock(&gPause.lock);
+
+   loss_reset();
+   //the IDR request first, so the first frame after the resume is the IDR
+   if (!bPause && encoder_output_port &&
+       (MMAL_SUCCESS != mmal_port_parameter_set_boolean(encoder_output_port, MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME, 1)))
+      fprintf(stderr, "%d\n", __LINE__);
+   if (camera_video_port && (MMAL_SUCCESS != mmal_port_parameter_set_boolean(camera_video_port, MMAL_PARAMETER_CAPTURE, !bPause)))
+      fprintf(stderr, "%d\n", __LINE__);
+   pthread_mutex_unlock(&gCameraReconfig);
 
-   // Adaptive intra refresh settings
-   if (state->intra_refresh_type != -1)
-   {
-      MMAL_PARAMETER_VIDEO_INTRA_REFRESH_T  param;
-      param.hdr.id = MMAL_PARAMETER_VIDEO_INTRA_REFRESH;
-      param.hdr.size = sizeof(param);
+   fprintf(stderr, "%s\n", line);
+   SendTypedToAndroid(pState, Telemetry, line, strlen(line));
+}
 
-      // Get first so we don't overwrite anything unexpectedly
-      status = mmal_port_parameter_get(encoder_output, &param.hdr);
-      if (status != MMAL_SUCCESS)
-      {
-         vcos_log_warn("Unable to get existing H264 intra-refresh values. Please update your firmware");
-         // Set some defaults, don't just pass random stack data
-         param.air_mbs = param.air_ref = param.cir_mbs = param.pir_mbs = 0;
-      }
+static sem_t gPauseSignal;
 
-      param.refresh_mode = state->intra_refresh_type;
+static void pause_signal_handler(int signum)
+{
+   (void)signum;
+   sem_post(&gPauseSignal);
+}
 
-      //if (state->intra_refresh_type == MMAL_VIDEO_INTRA_REFRESH_CYCLIC_MROWS)
-      //   param.cir_mbs = 10;
+/* -timed on,off, -signal (SIGUSR1) and -keypress (ENTER) */
+static void *pause_thread(void *arg)
+{
+   RASPIVID_STATE *pState = (RASPIVID_STATE *)arg;
 
-      status = mmal_port_parameter_set(encoder_output, &param.hdr);
-      if (status != MMAL_SUCCESS)
+   for (;;)
+   {
+      switch (pState->waitMethod)
       {
-         vcos_log_error("Unable to set H264 intra-refresh values");
-         goto error;
+         case WAIT_METHOD_TIMED:
+            usleep((capture_paused() ? pState->offTime : pState->onTime) * 1000);
+            break;
+         case WAIT_METHOD_SIGNAL:
+            while (sem_wait(&gPauseSignal) && (EINTR == errno))
+               ;
+            break;
+         case WAIT_METHOD_KEYPRESS:
+         {
+            int c;
+
+            while (((c = getchar()) != EOF) && (c != '\n'))
+               ;
+            if (EOF == c)
+               return NULL;
+            break;
+         }
+         default:
+            return NULL;
       }
+      capture_pause(pState, !capture_paused());
    }
+   return NULL;
+}
 
-   //printf("motion_on=%d\n", mmal_port_parameter_set_boolean(g_encoder_output, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_VECTORS, 1));
-   //  Enable component
-   status = mmal_component_enable(encoder);
+/* before capture starts: -initial pause, and the thread of the wait method */
+static void pause_setup(RASPIVID_STATE *pState)
+{
+   pthread_t thread;
 
-   if (status != MMAL_SUCCESS)
+   if (!pState->bCapturing)
    {
-      vcos_log_error("Unable to enable video encoder component");
-      goto error;
+      pthread_mutex_lock(&gPause.lock);
+      gPause.bPaused = true;
+      gPause.since_us = vcos_getmicrosecs64();
+      gPause.pauses++;
+      pthread_mutex_unlock(&gPause.lock);
+      fprintf(stderr, "pause: starting paused\n");
    }
-
-   /* Create pool of buffer headers for the output port to consume */
-   pool = mmal_port_pool_create(encoder_output, encoder_output->buffer_num, encoder_output->buffer_size);
-
-   if (!pool)
+   if (WAIT_METHOD_SIGNAL == pState->waitMethod)
    {
-      vcos_log_error("Failed to create buffer header pool for encoder output port %s", encoder_output->name);
+      sem_init(&gPauseSignal, 0, 0);
+      signal(SIGUSR1, pause_signal_handler);
    }
+   //with -o - the commands come from stdin, ENTER is an empty command line then
+   if ((WAIT_METHOD_KEYPRESS == pState->waitMethod) && (STDIN_FILENO == pState->callback_data.sockFD))
+      return;
+   if ((WAIT_METHOD_TIMED != pState->waitMethod) && (WAIT_METHOD_SIGNAL != pState->waitMethod) && (WAIT_METHOD_KEYPRESS != pState->waitMethod))
+      return;
+   if (pthread_create(&thread, NULL, pause_thread, pState))
+      exit(__LINE__);
+   pthread_detach(thread);
+}
 
-   state->encoder_pool = pool;
-   state->encoder_component = encoder;
-
-   return status;
-
-   error:
-   if (encoder)
-      mmal_component_destroy(encoder);
+/// Most exits are exit(__LINE__) from deep inside, write out what is still queued
+static void evlog_at_exit(void)
+{
+   evlog_add(gEvLog, EVLOG_STOP, 0, 0, 0);
+   evlog_flush(gEvLog);
+}
 
-   state->encoder_component = NULL;
+#define EVLOG_REPLY_MAX 4096
 
-   return status;
-}
+typedef struct
+{
+   EVLOG_RECORD *r;                     /// NULL: print to stderr
+   int n;
+} EVLOG_REPLY;
 
-/**
- * Destroy the encoder component
- *
- * @param state Pointer to state control struct
- *
- */
-static void destroy_encoder_component(RASPIVID_STATE *state)
+static bool evlog_reply_record(const EVLOG_RECORD *r, void *ctx)
 {
-   // Get rid of any port buffers first
-   if (state->encoder_pool)
-   {
-      mmal_port_pool_destroy(state->encoder_component->output[0], state->encoder_pool);
-   }
+   EVLOG_REPLY *reply = (EVLOG_REPLY *)ctx;
 
-   if (state->encoder_component)
+   if (!reply->r)
    {
-      mmal_component_destroy(state->encoder_component);
-      state->encoder_component = NULL;
+      char line[160];
+
+      evlog_format(r, line, sizeof(line));
+      fputs(line, stderr);
+      return true;
    }
+   reply->r[reply->n++] = *r;
+   return reply->n < EVLOG_REPLY_MAX;
 }
 
 /**
- * Connect two specific ports together
+ * evlog=<from>,<to>[,type,...] control command: records of the event log in that range
  *
- * @param output_port Pointer the output port
- * @param input_port Pointer the input port
- * @param Pointer to a mmal connection pointer, reassigned if function successful
- * @return Returns a MMAL_STATUS_T giving result of operation
+ * In android_motion mode they go back as one EventLog message [len4][EVLOG_RECORD...],
+ * at most EVLOG_REPLY_MAX of them, ask again from the time of the last one for more.
+ * The other modes have no room for it in the stream, they get a text dump on stderr.
  *
+ * @param pState Pointer to state control struct
+ * @param args Command arguments, times as YYYYmmdd-HHMMSS, HH:MM:SS or seconds since the epoch
  */
-static MMAL_STATUS_T connect_ports(MMAL_PORT_T *output_port, MMAL_PORT_T *input_port, MMAL_CONNECTION_T **connection)
+static void evlog_reply(RASPIVID_STATE *pState, char *args)
 {
-   MMAL_STATUS_T status;
-
-   status =  mmal_connection_create(connection, output_port, input_port, MMAL_CONNECTION_FLAG_TUNNELLING | MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT);
+   char from[32], to[32], types[128] = "";
+   int64_t from_us, to_us;
+   uint32_t type_mask = 0;
+   EVLOG_REPLY reply = { NULL, 0 };
 
-   if (status == MMAL_SUCCESS)
+   if (!gEvLog)
    {
-      status =  mmal_connection_enable(*connection);
-      if (status != MMAL_SUCCESS)
-         mmal_connection_destroy(*connection);
+      fprintf(stderr, "evlog: no event log, start with -evlog <file>\n");
+      return;
+   }
+   if ((sscanf(args, "%31[^,],%31[^,\n],%127[^\n]", from, to, types) < 2) ||
+         ((from_us = evlog_parse_time(from)) < 0) || ((to_us = evlog_parse_time(to)) < 0) ||
+         !evlog_parse_types(types, &type_mask))
+   {
+      fprintf(stderr, "evlog: use evlog=<from>,<to>[,type,...]\n");
+      return;
    }
 
-   return status;
+   //the answer should include what happened just now
+   evlog_flush(gEvLog);
+   if (pState->enc_cb_func == encoder_buffer_callback_android_motion &&
+         NULL == (reply.r = malloc(EVLOG_REPLY_MAX * sizeof(EVLOG_RECORD))))
+      return;
+   if (evlog_query(pState->eventLog, from_us, to_us, type_mask, evlog_reply_record, &reply) < 0)
+      fprintf(stderr, "evlog: cannot read %s\n", pState->eventLog);
+   else if (reply.r)
+      SendTypedToAndroid(pState, EventLog, reply.r, reply.n * sizeof(EVLOG_RECORD));
+   free(reply.r);
 }
 
 int main(int argc, const char **argv)
@@ -2421,6 +5134,30 @@ int main(int argc, const char **argv)
       exit(EX_USAGE);
    }
 
+   if (!state.snapshotWidth)
+   {
+      // same size as the video, so a snapshot never makes the sensor switch mode
+      state.snapshotWidth = state.width;
+      state.snapshotHeight = state.height;
+   }
+
+   if (state.sliceRows && ((state.enc_cb_func == encoder_buffer_callback_android_motion) ||
+                           (state.enc_cb_func == encoder_buffer_callback_android_dimon)))
+   {
+      fprintf(stderr, "-slices: android_motion and android_dimon send whole frames, use -m android or raw_tcp\n");
+      exit(EX_USAGE);
+   }
+
+   if (state.eventLog)
+   {
+      if (NULL == (gEvLog = evlog_open(state.eventLog)))
+         exit(EX_USAGE);
+      evlog_add(gEvLog, EVLOG_START, 0, getpid(), 0);
+      atexit(evlog_at_exit);
+   }
+
+   event_setup(&state);
+
    if (state.filename)
    {
       state.callback_data.file_handle = open_filename(&state, state.filename, &state.callback_data.sockFD);
@@ -2431,6 +5168,14 @@ int main(int argc, const char **argv)
          vcos_log_error("%s: Error opening output file: %s\nNo output file will be generated\n", __func__, state.filename);
          exit(1);
       }
+      gTls.fd = state.callback_data.sockFD;
+      if (state.tlsCert && (!state.tlsKey || !rpi_tls_accept(&gTls, gTls.fd, state.tlsCert, state.tlsKey, state.verbose)))
+      {
+         evlog_add(gEvLog, EVLOG_DISCONNECT, 0, 0, 0);
+         exit(EX_PROTOCOL);
+      }
+      aead_setup(&state);
+      probe_setup(&state);
    }
 
    // OK, we have a nice set of parameters. Now set up our components
@@ -2458,7 +5203,7 @@ int main(int argc, const char **argv)
    {
       camera_preview_port = state.camera_component->output[MMAL_CAMERA_PREVIEW_PORT];
       camera_video_port   = state.camera_component->output[MMAL_CAMERA_VIDEO_PORT];
-      //camera_still_port   = state.camera_component->output[MMAL_CAMERA_CAPTURE_PORT];
+      camera_still_port   = state.camera_component->output[MMAL_CAMERA_CAPTURE_PORT];
       preview_input_port  = state.preview_parameters.preview_component->input[0];
       encoder_input_port  = state.encoder_component->input[0];
       encoder_output_port = state.encoder_component->output[0];
@@ -2496,7 +5241,7 @@ int main(int argc, const char **argv)
 
 
          // Enable the encoder output port and tell it its callback function
-         status = mmal_port_enable(encoder_output_port, state.enc_cb_func);
+         status = mmal_port_enable(encoder_output_port, encoder_callback(&state));
          if (status != MMAL_SUCCESS)
          {
             vcos_log_error("Failed to setup encoder output");
@@ -2516,9 +5261,16 @@ int main(int argc, const char **argv)
             if (mmal_port_send_buffer(encoder_output_port, buffer) != MMAL_SUCCESS)
                vcos_log_error("Unable to send a buffer to encoder output port (%d)", q);
          }
-         mmal_port_parameter_set_boolean(camera_video_port, MMAL_PARAMETER_CAPTURE, 1);
-
+         serial_setup(&state);
+         multipath_setup(&state);
+         sink_setup(&state);
+         rate_setup(&state);
+         pause_setup(&state);
+         mmal_port_parameter_set_boolean(camera_video_port, MMAL_PARAMETER_CAPTURE, !capture_paused());
+         lowlight_setup(&state);
 
+         setup_snapshots(&state);
+         watchdog_setup(&state);
 
          receive_commands(&state);
             /*
@@ -2537,6 +5289,11 @@ error:
 
       // Disable all our ports that are not handled by connections
       mmal_port_disable(encoder_output_port);
+      if (state.image_encoder_component)
+         mmal_port_disable(state.image_encoder_component->output[0]);
+
+      if (state.still_connection)
+         mmal_connection_destroy(state.still_connection);
 
       if (state.preview_parameters.wantPreview && state.preview_connection)
          mmal_connection_destroy(state.preview_connection);
@@ -2560,6 +5317,7 @@ error:
       if (state.camera_component)
          mmal_component_disable(state.camera_component);
 
+      destroy_image_encoder_component(&state);
       destroy_encoder_component(&state);
       raspipreview_destroy(&state.preview_parameters);
       destroy_camera_component(&state);
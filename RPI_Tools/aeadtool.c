@@ -0,0 +1,154 @@
+/*
+ * Keys and a benchmark for the encrypted stream (raspivid -keyfile, video -k).
+ *
+ * gcc -O2 -o aeadtool aeadtool.c
+ * aeadtool gen cam.key                     new random key, copy it to both ends
+ * aeadtool rotate cam.key new.key          prints the key= command for the control channel
+ *                                          and replaces cam.key with new.key once sent
+ * aeadtool bench                           CPU cost of the encryption on this CPU
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../common/aead.h"
+
+static void
+show_usage_and_exit (const char* name)
+{
+   fprintf(stderr, "Usage: %s gen keyfile\n"
+           "       %s rotate keyfile newkeyfile\n"
+           "       %s bench [seconds]\n", name, name, name);
+   exit(1);
+}
+
+static double
+cpu_seconds (void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* "model name" on x86, "Hardware"/"CPU part" on the Pi, and whether AES instructions would be there */
+static void
+print_cpu (void)
+{
+   char line[512], model[256] = "unknown", part[64] = "", feat[16] = "no";
+   FILE* fp = fopen("/proc/cpuinfo", "r");
+
+   while (fp && fgets(line, sizeof(line), fp))
+   {
+      char* v = strchr(line, ':');
+      if (!v)
+         continue;
+      v += 2;
+      v[strcspn(v, "\n")] = 0;
+      if (!strncmp(line, "model name", 10) || !strncmp(line, "Model", 5) || !strncmp(line, "Hardware", 8))
+         snprintf(model, sizeof(model), "%s", v);
+      else if (!strncmp(line, "CPU part", 8))
+         snprintf(part, sizeof(part), " (CPU part %s)", v);
+      else if ((!strncmp(line, "flags", 5) || !strncmp(line, "Features", 8)) && (strstr(v, " aes") || !strncmp(v, "aes", 3)))
+         strcpy(feat, "yes");
+   }
+   if (fp)
+      fclose(fp);
+   printf("cpu: %s%s, AES instructions: %s\n", model, part, feat);
+}
+
+/* CPU microseconds to seal (or open) one megabit of video cut into payloads of len bytes */
+static double
+bench_one (size_t len, bool bOpen, double seconds)
+{
+   AEAD_SESSION s;
+   uint8_t key[AEAD_KEY_LEN] = { 1 };
+   uint8_t* in = calloc(1, len);
+   uint8_t* pkt = malloc(len + AEAD_OVERHEAD);
+   uint8_t* out = malloc(len);
+   double start, used;
+   unsigned long n = 0;
+   int i;
+
+   aead_session_start(&s, key, 1);
+   aead_packet_seal(&s, in, len, pkt);
+   start = cpu_seconds();
+   do
+   {
+      for (i = 0; i < 64; i++, n++)
+      {
+         if (bOpen)
+         {
+            if (!aead_packet_open(&s, pkt, len + AEAD_OVERHEAD, out))
+               exit(2);
+         }
+         else
+         {
+            s.seq = 0;
+            aead_packet_seal(&s, in, len, pkt);
+         }
+      }
+   } while ((used = cpu_seconds() - start) < seconds);
+   free(in);
+   free(pkt);
+   free(out);
+   return used * 1e6 / (n * len * 8 / 1e6);
+}
+
+static void
+bench (double seconds)
+{
+   //one UDP datagram, a P frame at 8 Mbit/s 30 fps, an IDR frame
+   static const size_t sizes[] = { AEAD_DGRAM_PAYLOAD, 32768, 262144 };
+   unsigned i;
+
+   print_cpu();
+   printf("%8s %9s %14s %14s %9s %9s %9s\n", "payload", "wire +%", "seal us/Mbit", "open us/Mbit",
+          "2Mbit/s", "8Mbit/s", "17Mbit/s");
+   for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+   {
+      double seal = bench_one(sizes[i], false, seconds);
+      double open = bench_one(sizes[i], true, seconds);
+
+      //% of one core for the sender at typical bitrates
+      printf("%8zu %8.2f%% %14.1f %14.1f %8.2f%% %8.2f%% %8.2f%%\n", sizes[i], 100.0 * AEAD_OVERHEAD / sizes[i],
+             seal, open, seal * 2 / 1e4, seal * 8 / 1e4, seal * 17 / 1e4);
+   }
+}
+
+int
+main (int argc, char** argv)
+{
+   uint8_t key[AEAD_KEY_LEN], newkey[AEAD_KEY_LEN];
+   char cmd[AEAD_ROTATE_HEX_LEN + 1];
+
+   if ((argc == 3) && !strcmp(argv[1], "gen"))
+   {
+      if (!aead_random(key, sizeof(key)) || !aead_save_key(argv[2], key))
+      {
+         fprintf(stderr, "%s: cannot write the key\n", argv[2]);
+         return 1;
+      }
+   }
+   else if ((argc == 4) && !strcmp(argv[1], "rotate"))
+   {
+      if (!aead_load_key(argv[2], key))
+      {
+         fprintf(stderr, "%s: no key, 64 hex digits expected\n", argv[2]);
+         return 1;
+      }
+      if (!aead_load_key(argv[3], newkey) && (!aead_random(newkey, sizeof(newkey)) || !aead_save_key(argv[3], newkey)))
+      {
+         fprintf(stderr, "%s: cannot write the key\n", argv[3]);
+         return 1;
+      }
+      if (!aead_rotate_seal(key, newkey, cmd))
+         return 1;
+      printf("key=%s\n", cmd);
+   }
+   else if ((argc >= 2) && (argc <= 3) && !strcmp(argv[1], "bench"))
+      bench((argc == 3) ? atof(argv[2]) : 1.0);
+   else
+      show_usage_and_exit(argv[0]);
+   return 0;
+}
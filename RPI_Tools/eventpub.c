@@ -0,0 +1,418 @@
+/*
+ * The motion event publisher of common/rpi_event.h on its own: publishes test
+ * records to a broker or webhook, and tests the publisher against a fake
+ * MQTT broker and a fake HTTP server on loopback.
+ *
+ * gcc -O2 -pthread -o eventpub eventpub.c
+ * eventpub [-n count] [-v] mqtt://192.168.1.2:1883/cam/front/motion
+ * eventpub [-n count] [-v] http://192.168.1.2:8080/motion
+ * eventpub -t
+ *
+ * Without -t the records go out like raspivid -evurl sends them, retried
+ * until the broker took all of them. The self test checks the CONNECT,
+ * PUBLISH and DISCONNECT bytes on the wire, the retry after the broker
+ * dropped the connection before its PUBACK (and an HTTP 503), and that a
+ * queue full while the broker is away keeps the newest records.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "../common/rpi_event.h"
+
+#define TEST_TOPIC       "cam/front/motion"
+#define TEST_PATH        "/motion"
+#define TEST_MAX_CONNS   64
+#define TEST_TIMEOUT_SEC 10
+
+/* a record whose JSON is longer than 127 bytes, the remaining length needs two bytes */
+static void
+make_record (EVENT_RECORD* ev, int n)
+{
+   memset(ev, 0, sizeof(*ev));
+   ev->time_us = 1714572192345000LL + n * 1000000LL;
+   ev->duration_ms = n;
+   ev->zones = 0x13;
+   ev->strength = 42;
+   snprintf(ev->clip, sizeof(ev->clip), "/srv/events/event-20240501-1603%02d.h264", n % 60);
+}
+
+typedef struct
+{
+   int fd;                              /// listening socket on 127.0.0.1
+   struct sockaddr_in saddr;
+   int conns;                           /// connections to serve, then the thread ends
+   int drop;                            /// the first ones fail: MQTT closed without PUBACK, HTTP 503
+   bool bHttp;
+   char client_id[32];
+
+   int served;
+   int bad;                             /// packets that are not what was expected
+   uint16_t ids[TEST_MAX_CONNS];        /// MQTT packet id of every PUBLISH
+   char json[TEST_MAX_CONNS][768];      /// payload of every PUBLISH or POST
+} FAKE_SERVER;
+
+/* bound, listening only if bListen: until then a connect() is refused */
+static bool
+fake_open (FAKE_SERVER* s, bool bListen)
+{
+   struct timeval tv = { TEST_TIMEOUT_SEC, 0 };
+   socklen_t len = sizeof(s->saddr);
+
+   memset(&s->saddr, 0, sizeof(s->saddr));
+   s->saddr.sin_family = AF_INET;
+   s->saddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if ((s->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+      return false;
+   //accept() gives up too, a publisher that never comes does not hang the test
+   setsockopt(s->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+   if (bind(s->fd, (struct sockaddr*) &s->saddr, sizeof(s->saddr)) ||
+       getsockname(s->fd, (struct sockaddr*) &s->saddr, &len))
+      return false;
+   return !bListen || !listen(s->fd, 8);
+}
+
+/* one MQTT control packet: type, remaining length (at most 4 bytes), body */
+static int
+fake_mqtt_packet (int fd, unsigned char* pkt, int size, uint32_t* body_len, int* hdr_len)
+{
+   uint32_t len = 0;
+   int n = 1, shift = 0;
+
+   if (!event_recv_all(fd, pkt, 1))
+      return -1;
+   do
+   {
+      if ((n > 4) || !event_recv_all(fd, pkt + n, 1))
+         return -1;
+      len |= (pkt[n] & 0x7F) << shift;
+      shift += 7;
+   } while (pkt[n++] & 0x80);
+   if ((n + len > (uint32_t) size) || !event_recv_all(fd, pkt + n, len))
+      return -1;
+   *body_len = len;
+   *hdr_len = n;
+   return n + len;
+}
+
+/* remaining length written out by hand, not with the publisher's event_mqtt_varint() */
+static int
+fake_mqtt_header (unsigned char* p, unsigned char type, uint32_t len)
+{
+   p[0] = type;
+   if (len < 128)
+   {
+      p[1] = len;
+      return 2;
+   }
+   p[1] = 0x80 | (len & 0x7F);
+   p[2] = len >> 7;
+   return 3;
+}
+
+static void
+fake_mqtt_conn (FAKE_SERVER* s, int fd, bool bDrop)
+{
+   static const unsigned char connack[4] = { 0x20, 2, 0, 0 };
+   static const unsigned char disconnect[2] = { 0xE0, 0 };
+   unsigned char pkt[1024], want[1024];
+   size_t id_len = strlen(s->client_id), topic_len = strlen(TEST_TOPIC);
+   uint32_t body_len;
+   int n, hdr, w, i = s->served;
+
+   //CONNECT: "MQTT", level 4, clean session, keep alive 60, client id
+   w = fake_mqtt_header(want, 0x10, 10 + 2 + id_len);
+   memcpy(want + w, "\0\4MQTT\4\2\0\74", 10);
+   w += 10;
+   want[w++] = id_len >> 8;
+   want[w++] = id_len & 0xFF;
+   memcpy(want + w, s->client_id, id_len);
+   w += id_len;
+   n = fake_mqtt_packet(fd, pkt, sizeof(pkt), &body_len, &hdr);
+   if ((n != w) || memcmp(pkt, want, w))
+   {
+      fprintf(stderr, "CONNECT %d: not the expected %d bytes\n", i, w);
+      s->bad++;
+      return;
+   }
+   event_send_all(fd, connack, sizeof(connack));
+
+   //PUBLISH QoS 1: topic, packet id, the JSON; the header is checked against its own body
+   n = fake_mqtt_packet(fd, pkt, sizeof(pkt), &body_len, &hdr);
+   if ((n < 0) || (body_len < 2 + topic_len + 2) || (pkt[hdr] != 0) || (pkt[hdr + 1] != topic_len) ||
+       memcmp(pkt + hdr + 2, TEST_TOPIC, topic_len) || (fake_mqtt_header(want, 0x32, body_len) != hdr) ||
+       memcmp(pkt, want, hdr) || (body_len - 4 - topic_len >= sizeof(s->json[i])))
+   {
+      fprintf(stderr, "PUBLISH %d: wrong packet\n", i);
+      s->bad++;
+      return;
+   }
+   s->ids[i] = (pkt[hdr + 2 + topic_len] << 8) | pkt[hdr + 3 + topic_len];
+   memcpy(s->json[i], pkt + hdr + 4 + topic_len, body_len - 4 - topic_len);
+   s->json[i][body_len - 4 - topic_len] = 0;
+   s->served++;
+   if (bDrop)
+      return;
+
+   want[0] = 0x40;
+   want[1] = 2;
+   want[2] = s->ids[i] >> 8;
+   want[3] = s->ids[i] & 0xFF;
+   event_send_all(fd, want, 4);
+   if ((2 != fake_mqtt_packet(fd, pkt, sizeof(pkt), &body_len, &hdr)) || memcmp(pkt, disconnect, 2))
+   {
+      fprintf(stderr, "DISCONNECT %d: missing\n", i);
+      s->bad++;
+   }
+}
+
+static void
+fake_http_conn (FAKE_SERVER* s, int fd, bool bFail)
+{
+   char req[2048], want[256], *body = NULL, *cl;
+   const char* resp = bFail ? "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n" :
+                              "HTTP/1.1 204 No Content\r\n\r\n";
+   int len = 0, content_len = -1, i = s->served;
+   ssize_t n;
+
+   //the publisher waits for the status line, the request is complete once the body is in
+   while ((len < (int) sizeof(req) - 1) && ((n = recv(fd, req + len, sizeof(req) - 1 - len, 0)) > 0))
+   {
+      len += n;
+      req[len] = 0;
+      body = strstr(req, "\r\n\r\n");
+      cl = strstr(req, "\r\nContent-Length: ");
+      if (body && cl && (1 == sscanf(cl, "\r\nContent-Length: %d", &content_len)) && (req + len - body - 4 >= content_len))
+         break;
+   }
+   req[len] = 0;
+   snprintf(want, sizeof(want), "POST %s HTTP/1.1\r\nHost: 127.0.0.1:%u\r\nContent-Type: application/json\r\n",
+            TEST_PATH, ntohs(s->saddr.sin_port));
+   body = strstr(req, "\r\n\r\n");
+   if (strncmp(req, want, strlen(want)) || !body || (content_len != (int) strlen(body + 4)) ||
+       (content_len >= (int) sizeof(s->json[i])))
+   {
+      fprintf(stderr, "POST %d: wrong request\n", i);
+      s->bad++;
+      return;
+   }
+   strcpy(s->json[i], body + 4);
+   s->served++;
+   event_send_all(fd, resp, strlen(resp));
+}
+
+static void*
+fake_server_thread (void* arg)
+{
+   FAKE_SERVER* s = (FAKE_SERVER*) arg;
+   struct timeval tv = { TEST_TIMEOUT_SEC, 0 };
+   int c;
+
+   for (c = 0; c < s->conns; c++)
+   {
+      int fd = accept(s->fd, NULL, NULL);
+
+      if (fd < 0)
+      {
+         fprintf(stderr, "connection %d: none\n", c);
+         s->bad++;
+         break;
+      }
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+      if (s->bHttp)
+         fake_http_conn(s, fd, c < s->drop);
+      else
+         fake_mqtt_conn(s, fd, c < s->drop);
+      close(fd);
+   }
+   close(s->fd);
+   return NULL;
+}
+
+static bool
+test_start (EVENT_PUBLISHER* pub, FAKE_SERVER* s)
+{
+   char url[128];
+
+   snprintf(url, sizeof(url), "%s://127.0.0.1:%u%s", s->bHttp ? "http" : "mqtt", ntohs(s->saddr.sin_port),
+            s->bHttp ? TEST_PATH : "/" TEST_TOPIC);
+   if (!event_publisher_start(pub, url, false))
+      return false;
+   strcpy(s->client_id, pub->client_id);
+   return true;
+}
+
+/* the payloads s got: record first, first + step, ... (step 0: all the same one, retried) */
+static bool
+test_payloads (FAKE_SERVER* s, int first, int step, const char* name)
+{
+   char json[768];
+   EVENT_RECORD ev;
+   int i;
+
+   for (i = 0; i < s->served; i++)
+   {
+      make_record(&ev, first + i * step);
+      event_format_json(&ev, json, sizeof(json));
+      if (strcmp(json, s->json[i]))
+      {
+         fprintf(stderr, "%s: payload %d is %s\n", name, i, s->json[i]);
+         return false;
+      }
+   }
+   return true;
+}
+
+/* one record, the first connection is dropped before the PUBACK: published again with the next packet id */
+static bool
+test_mqtt_retry (void)
+{
+   static EVENT_PUBLISHER pub;
+   static FAKE_SERVER s = { .conns = 2, .drop = 1 };
+   EVENT_RECORD ev;
+   pthread_t thread;
+   bool bOK;
+
+   if (!fake_open(&s, true) || !test_start(&pub, &s) || pthread_create(&thread, NULL, fake_server_thread, &s))
+      return false;
+   make_record(&ev, 0);
+   event_publish(&pub, &ev);
+   pthread_join(thread, NULL);
+   //both the same record, the second one acknowledged
+   bOK = !s.bad && (2 == s.served) && (1 == s.ids[0]) && (2 == s.ids[1]) && test_payloads(&s, 0, 0, "mqtt") &&
+         (0 == pub.ulDropped);
+   printf("mqtt: CONNECT, PUBLISH, PUBACK, DISCONNECT bytes, retry after a dropped connection: %s\n", bOK ? "ok" : "WRONG");
+   return bOK;
+}
+
+/* the broker refuses connections while EVENT_QUEUE_LEN + 8 records come in: the 8 oldest are gone */
+static bool
+test_queue_full (void)
+{
+   static EVENT_PUBLISHER pub;
+   static FAKE_SERVER s = { .conns = EVENT_QUEUE_LEN };
+   EVENT_RECORD ev;
+   pthread_t thread;
+   int i;
+   bool bOK;
+
+   if (!fake_open(&s, false) || !test_start(&pub, &s))
+      return false;
+   for (i = 0; i < EVENT_QUEUE_LEN + 8; i++)
+   {
+      make_record(&ev, i);
+      event_publish(&pub, &ev);
+   }
+   if (listen(s.fd, 8) || pthread_create(&thread, NULL, fake_server_thread, &s))
+      return false;
+   pthread_join(thread, NULL);
+   bOK = !s.bad && (EVENT_QUEUE_LEN == s.served) && (8 == pub.ulDropped) && test_payloads(&s, 8, 1, "queue");
+   printf("queue: %d of %d records kept, the %lu oldest dropped: %s\n", s.served, EVENT_QUEUE_LEN + 8, pub.ulDropped,
+          bOK ? "ok" : "WRONG");
+   return bOK;
+}
+
+/* a 503 is retried like a refused connection */
+static bool
+test_http_retry (void)
+{
+   static EVENT_PUBLISHER pub;
+   static FAKE_SERVER s = { .conns = 2, .drop = 1, .bHttp = true };
+   EVENT_RECORD ev;
+   pthread_t thread;
+   bool bOK;
+
+   if (!fake_open(&s, true) || !test_start(&pub, &s) || pthread_create(&thread, NULL, fake_server_thread, &s))
+      return false;
+   make_record(&ev, 0);
+   event_publish(&pub, &ev);
+   pthread_join(thread, NULL);
+   bOK = !s.bad && (2 == s.served) && test_payloads(&s, 0, 0, "http");
+   printf("http: POST request, retry after a 503: %s\n", bOK ? "ok" : "WRONG");
+   return bOK;
+}
+
+static int
+self_test (void)
+{
+   int bad = 0;
+
+   if (!test_mqtt_retry())
+      bad++;
+   if (!test_queue_full())
+      bad++;
+   if (!test_http_retry())
+      bad++;
+   printf("self test %s\n", bad ? "FAILED" : "passed");
+   return bad ? 1 : 0;
+}
+
+/* publishes count records and waits until all of them went out */
+static int
+publish (const char* url, int count, bool bVerbose)
+{
+   static EVENT_PUBLISHER pub;
+   struct timespec now, wait = { 0, 100000000 };
+   EVENT_RECORD ev;
+   int i;
+   bool bDone = false;
+
+   if (!event_publisher_start(&pub, url, bVerbose))
+   {
+      fprintf(stderr, "not a mqtt://ip:port/topic or http://ip:port/path URL: %s\n", url);
+      return 2;
+   }
+   for (i = 0; i < count; i++)
+   {
+      clock_gettime(CLOCK_REALTIME, &now);
+      memset(&ev, 0, sizeof(ev));
+      ev.time_us = now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+      ev.duration_ms = 1000;
+      ev.zones = 1 << (i % 9);
+      ev.strength = i;
+      snprintf(ev.clip, sizeof(ev.clip), "eventpub-test-%d", i);
+      event_publish(&pub, &ev);
+   }
+   while (!bDone)
+   {
+      nanosleep(&wait, NULL);
+      pthread_mutex_lock(&pub.lock);
+      bDone = pub.q_rd == pub.q_wr;
+      pthread_mutex_unlock(&pub.lock);
+   }
+   fprintf(stderr, "%d published, %lu dropped\n", count - (int) pub.ulDropped, pub.ulDropped);
+   return 0;
+}
+
+int
+main (int argc, char** argv)
+{
+   bool bVerbose = false;
+   int count = 1, opt;
+
+   while ((opt = getopt(argc, argv, "n:vt")) != -1)
+   {
+      switch (opt)
+      {
+         case 'n':
+            count = atoi(optarg);
+            break;
+         case 'v':
+            bVerbose = true;
+            break;
+         case 't':
+            return self_test();
+         default:
+            count = 0;
+            break;
+      }
+   }
+   if ((count > 0) && (optind == argc - 1))
+      return publish(argv[optind], count, bVerbose);
+   fprintf(stderr, "Usage: %s [-n count] [-v] mqtt://ip:port/topic | http://ip:port/path | -t\n", argv[0]);
+   return 2;
+}
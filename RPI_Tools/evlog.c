@@ -0,0 +1,96 @@
+/*
+ * Dump or filter an event log written by raspivid -evlog or relay -e.
+ *
+ * gcc -O2 -o evlog evlog.c -lpthread
+ * evlog -f 20240501-220000 -t 20240502-070000 -y alarm,event_open cam.evl
+ * evlog -c -f 22:00:00 cam.evl              counts per type
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "../common/event_log.h"
+
+static bool bCount = false;
+static unsigned long counts[EVLOG_TYPE_MAX];
+
+static bool
+print_record (const EVLOG_RECORD* r, void* ctx)
+{
+   char line[160];
+   if (bCount)
+   {
+      if (r->type < EVLOG_TYPE_MAX)
+         counts[r->type]++;
+      return true;
+   }
+   evlog_format(r, line, sizeof(line));
+   fputs(line, stdout);
+   return true;
+}
+
+static void
+show_usage_and_exit (const char* name)
+{
+   fprintf(stderr, "Usage: %s [-f from] [-t to] [-y type[,type..]] [-c] file\n"
+           "   -f, -t  YYYYmmdd-HHMMSS, HH:MM:SS (today) or seconds since the epoch\n"
+           "   -y      only these types\n"
+           "   -c      count per type instead of listing\n", name);
+   exit(1);
+}
+
+int
+main (int argc, char** argv)
+{
+   int64_t from_us = 0, to_us = INT64_MAX;
+   uint32_t type_mask = 0;
+   long n;
+   int opt, i;
+
+   while ((opt = getopt(argc, argv, "f:t:y:c")) != -1)
+   {
+      switch (opt)
+      {
+         case 'f':
+            if ((from_us = evlog_parse_time(optarg)) < 0)
+               show_usage_and_exit(argv[0]);
+            break;
+         case 't':
+            if ((to_us = evlog_parse_time(optarg)) < 0)
+               show_usage_and_exit(argv[0]);
+            break;
+         case 'y':
+            if (!evlog_parse_types(optarg, &type_mask))
+            {
+               fprintf(stderr, "unknown type, use:");
+               for (i = 1; i < EVLOG_TYPE_MAX; i++)
+                  fprintf(stderr, " %s", evlog_type_names[i]);
+               fprintf(stderr, "\n");
+               return 1;
+            }
+            break;
+         case 'c':
+            bCount = true;
+            break;
+         default:
+            show_usage_and_exit(argv[0]);
+      }
+   }
+   if (optind != argc - 1)
+      show_usage_and_exit(argv[0]);
+
+   if ((n = evlog_query(argv[optind], from_us, to_us, type_mask, print_record, NULL)) < 0)
+   {
+      fprintf(stderr, "%s: cannot read the event log\n", argv[optind]);
+      return 1;
+   }
+   if (bCount)
+   {
+      for (i = 1; i < EVLOG_TYPE_MAX; i++)
+         if (counts[i])
+            printf("%-15s %lu\n", evlog_type_names[i], counts[i]);
+      printf("%-15s %ld\n", "total", n);
+   }
+   return 0;
+}
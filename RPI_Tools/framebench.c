@@ -0,0 +1,423 @@
+/*
+ * One stream to 1 and 8 sinks with the frames of common/frame.h: a copy per
+ * sink against shared references to a heap frame, to slab blocks, and to the
+ * encoder buffers themselves. Memory traffic and peak RSS of each.
+ *
+ * gcc -O2 -pthread -o framebench framebench.c
+ * framebench [-d sec] [-s sinks,..] [-b encoder_buffers] [-t]
+ *    -d   seconds per run, default 2
+ *    -s   sink counts, default 1,8
+ *    -b   64 KB encoder buffers for held frames, default 16
+ *    -t   self test: fragments, pool accounting and release from many threads
+ *
+ * The "encoder" writes every frame (IDR 150 KB, P 20 KB, GOP 30) into 64 KB
+ * buffers of its own, as MMAL does. copy: every sink gets its own malloc()
+ * copy. heap/slab: one copy into a frame, the sinks share it. held: the
+ * encoder buffers are the frame until the last sink is done, nothing is
+ * copied but the encoder waits for buffers. A sink reads every byte once
+ * (like send() into the socket buffer) from its own thread and queue of 64
+ * frames, the encoder waits for the slowest. Every run is a child process,
+ * peak RSS is its own.
+ */
+#ifndef _GNU_SOURCE
+   #define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "../common/frame.h"
+
+#define MAX_SINKS   64
+#define SINK_QUEUE  64
+#define ENC_BUF     (64 * 1024)
+#define SLAB_BLOCK  (16 * 1024)
+#define SLAB_BLOCKS 8192                 /// 128 MB, more than 8 full queues need
+
+typedef enum { MODE_COPY = 0, MODE_HEAP, MODE_SLAB, MODE_HELD } MODE;
+static const char* mode_names[] = { "copy", "heap", "slab", "held" };
+
+typedef struct
+{
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   FRAME* q[SINK_QUEUE];
+   unsigned rd, wr;
+   bool bStop;
+   uint64_t bytes, sum;
+} SINK;
+
+/* the encoder's output buffers, given back by the release of held frames */
+static struct
+{
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   uint8_t** free;
+   int free_cnt, cnt;
+} enc = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static SINK sinks[MAX_SINKS];
+
+static double
+now_sec (void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t
+xorshift (uint32_t* x)
+{
+   *x ^= *x << 13;
+   *x ^= *x >> 17;
+   *x ^= *x << 5;
+   return *x;
+}
+
+static uint8_t*
+enc_get (void)
+{
+   uint8_t* b;
+
+   pthread_mutex_lock(&enc.lock);
+   while (!enc.free_cnt)
+      pthread_cond_wait(&enc.cond, &enc.lock);
+   b = enc.free[--enc.free_cnt];
+   pthread_mutex_unlock(&enc.lock);
+   return b;
+}
+
+static void
+enc_release (void* holder)
+{
+   pthread_mutex_lock(&enc.lock);
+   enc.free[enc.free_cnt++] = holder;
+   pthread_cond_signal(&enc.cond);
+   pthread_mutex_unlock(&enc.lock);
+}
+
+static void
+sink_push (SINK* s, FRAME* f)
+{
+   pthread_mutex_lock(&s->lock);
+   while (s->wr - s->rd >= SINK_QUEUE)
+      pthread_cond_wait(&s->cond, &s->lock);
+   s->q[s->wr++ % SINK_QUEUE] = f;
+   pthread_cond_broadcast(&s->cond);
+   pthread_mutex_unlock(&s->lock);
+}
+
+static void*
+sink_thread (void* arg)
+{
+   SINK* s = arg;
+
+   for (;;)
+   {
+      FRAME* f;
+      int i;
+
+      pthread_mutex_lock(&s->lock);
+      while ((s->rd == s->wr) && !s->bStop)
+         pthread_cond_wait(&s->cond, &s->lock);
+      if (s->rd == s->wr)
+      {
+         pthread_mutex_unlock(&s->lock);
+         return NULL;
+      }
+      f = s->q[s->rd++ % SINK_QUEUE];
+      pthread_cond_broadcast(&s->cond);
+      pthread_mutex_unlock(&s->lock);
+
+      for (i = 0; i < f->nfrags; i++)
+      {
+         const uint64_t* p = (const uint64_t*) f->frag[i].data;
+         uint32_t k, n = f->frag[i].len / 8;
+         uint64_t sum = 0;
+
+         for (k = 0; k < n; k++)
+            sum += p[k];
+         s->sum += sum;
+      }
+      s->bytes += f->len;
+      frame_unref(f);
+   }
+}
+
+/* one run in this process: stream MB/s, copied MB/s */
+static void
+run (MODE mode, int n, double seconds, double* stream_mbs, double* copied_mbs)
+{
+   static FRAME_POOL pool;
+   uint8_t* bufs[MAX_SINKS * SINK_QUEUE];
+   uint64_t bytes = 0, copied = 0, frame = 0;
+   uint32_t rnd = 12345;
+   double t0, t;
+   int i;
+
+   if ((MODE_SLAB == mode) && !frame_pool_init(&pool, SLAB_BLOCK, SLAB_BLOCKS))
+      exit(1);
+   enc.free = malloc(enc.cnt * sizeof(uint8_t*));
+   for (enc.free_cnt = 0; enc.free_cnt < enc.cnt; enc.free_cnt++)
+      enc.free[enc.free_cnt] = malloc(ENC_BUF);
+   for (i = 0; i < n; i++)
+   {
+      pthread_mutex_init(&sinks[i].lock, NULL);
+      pthread_cond_init(&sinks[i].cond, NULL);
+      pthread_create(&sinks[i].thread, NULL, sink_thread, &sinks[i]);
+   }
+
+   t0 = now_sec();
+   do
+   {
+      uint32_t len = ((frame % 30) ? 20000 : 150000) * (3 + xorshift(&rnd) % 3) / 4;
+      uint32_t nbufs = (len + ENC_BUF - 1) / ENC_BUF, k;
+      FRAME* f = NULL;
+
+      //the encoder writes the frame into its buffers
+      for (k = 0; k < nbufs; k++)
+      {
+         bufs[k] = enc_get();
+         memset(bufs[k], (uint8_t)(frame + k), (k + 1 < nbufs) ? ENC_BUF : len - k * ENC_BUF);
+      }
+      if (MODE_HELD == mode)
+      {
+         f = frame_held(enc_release);
+         for (k = 0; k < nbufs; k++)
+            frame_hold(f, bufs[k], (k + 1 < nbufs) ? ENC_BUF : len - k * ENC_BUF, bufs[k]);
+      }
+      else
+      {
+         int copies = (MODE_COPY == mode) ? n : 1, c;
+         for (c = 0; c < copies; c++)
+         {
+            FRAME* g = frame_alloc((MODE_SLAB == mode) ? &pool : NULL, len);
+
+            for (k = 0; k < nbufs; k++)
+               frame_write(g, k * ENC_BUF, bufs[k], (k + 1 < nbufs) ? ENC_BUF : len - k * ENC_BUF);
+            copied += len;
+            if (MODE_COPY == mode)
+               sink_push(&sinks[c], g);
+            else
+               f = g;
+         }
+         for (k = 0; k < nbufs; k++)
+            enc_release(bufs[k]);
+      }
+      if (f)
+      {
+         for (i = 0; i < n; i++)
+            sink_push(&sinks[i], (i + 1 < n) ? frame_ref(f) : f);
+      }
+      bytes += len;
+      frame++;
+      t = now_sec();
+   } while (t - t0 < seconds);
+
+   for (i = 0; i < n; i++)
+   {
+      pthread_mutex_lock(&sinks[i].lock);
+      sinks[i].bStop = true;
+      pthread_cond_broadcast(&sinks[i].cond);
+      pthread_mutex_unlock(&sinks[i].lock);
+      pthread_join(sinks[i].thread, NULL);
+      if (sinks[i].bytes != bytes)
+      {
+         fprintf(stderr, "sink %d got %llu of %llu bytes\n", i, (unsigned long long) sinks[i].bytes, (unsigned long long) bytes);
+         exit(1);
+      }
+   }
+   t = now_sec() - t0;
+   *stream_mbs = bytes / t / 1e6;
+   *copied_mbs = copied / t / 1e6;
+}
+
+/* the run in a child, for a peak RSS of its own */
+static void
+bench (MODE mode, int n, double seconds)
+{
+   int pfd[2];
+   double r[2] = { 0, 0 };
+   struct rusage ru;
+   int status;
+   pid_t pid;
+
+   if (pipe(pfd))
+      exit(1);
+   if (!(pid = fork()))
+   {
+      run(mode, n, seconds, &r[0], &r[1]);
+      if (sizeof(r) != write(pfd[1], r, sizeof(r)))
+         _exit(1);
+      _exit(0);
+   }
+   close(pfd[1]);
+   if ((sizeof(r) != read(pfd[0], r, sizeof(r))) || (wait4(pid, &status, 0, &ru) != pid) || status)
+   {
+      fprintf(stderr, "%s with %d sinks failed\n", mode_names[mode], n);
+      exit(1);
+   }
+   close(pfd[0]);
+   //encoder writes + copies (read and write) + every sink reading the stream
+   printf("%-5s %5d %10.0f %10.0f %12.0f %10ld\n", mode_names[mode], n, r[0], r[1], r[0] + 2 * r[1] + n * r[0],
+          ru.ru_maxrss / 1024);
+}
+
+/******************************* self test *******************************/
+
+static int held_released;
+
+static void
+test_release (void* holder)
+{
+   __atomic_add_fetch(&held_released, 1, __ATOMIC_RELAXED);
+   free(holder);
+}
+
+static FRAME* test_frames[256];
+
+static void*
+test_unref_thread (void* arg)
+{
+   int k = (int)(intptr_t) arg, i;
+
+   //every thread drops its reference of every frame, in its own order
+   for (i = 0; i < 256; i++)
+      frame_unref(test_frames[(i * 7 + k * 31) % 256]);
+   return NULL;
+}
+
+static int
+self_test (void)
+{
+   static uint8_t in[FRAME_MAX_FRAGS * 1024 + 4096], out[sizeof(in)];
+   FRAME_POOL pool;
+   uint32_t x = 1, i, bad = 0, len;
+   pthread_t th[8];
+   int k;
+
+   if (!frame_pool_init(&pool, 1024, 512))
+      return 1;
+   for (i = 0; i < sizeof(in); i++)
+      in[i] = xorshift(&x);
+
+   //every length around the block size and up to more than a frame takes
+   for (len = 0; len < sizeof(in); len += (len < 3000) ? 1 : 97)
+   {
+      FRAME* f = frame_alloc(&pool, len);
+      struct iovec iov[FRAME_MAX_FRAGS];
+      uint32_t off = 0, half = len / 3;
+      int n;
+
+      frame_write(f, 0, in, half);
+      frame_write(f, half, in + half, len - half);
+      n = frame_iov(f, iov, FRAME_MAX_FRAGS);
+      for (k = 0; k < n; k++)
+      {
+         memcpy(out + off, iov[k].iov_base, iov[k].iov_len);
+         off += iov[k].iov_len;
+      }
+      if ((off != len) || (f->len != len) || memcmp(in, out, len) ||
+          ((len > FRAME_MAX_FRAGS * 1024) != (FRAME_HEAP == f->backing)) || ((n == 1) != (NULL != frame_contig(f))))
+         bad++;
+      frame_unref(f);
+   }
+   printf("fragments: %s, %llu allocations, %llu from the heap\n", bad ? "WRONG" : "ok", (unsigned long long) pool.allocs,
+          (unsigned long long) pool.fallbacks);
+
+   //an empty pool sends frames to the heap, its blocks come back
+   {
+      FRAME* f[17];
+      for (k = 0; k < 17; k++)
+         f[k] = frame_alloc(&pool, 32 * 1024);
+      if ((FRAME_SLAB != f[15]->backing) || (FRAME_HEAP != f[16]->backing) || pool.free_cnt)
+         bad++;
+      for (k = 0; k < 17; k++)
+         frame_unref(f[k]);
+      if (pool.in_use || (pool.free_cnt != pool.blocks) || (pool.peak != pool.blocks))
+         bad++;
+   }
+   printf("pool accounting: %s\n", bad ? "WRONG" : "ok");
+
+   //frames of all three kinds with 9 references each, dropped by 8 threads and here
+   for (i = 0; i < 256; i++)
+   {
+      if (i % 3 == 0)
+         test_frames[i] = frame_alloc(&pool, 1 + i * 100);
+      else if (i % 3 == 1)
+         test_frames[i] = frame_alloc(NULL, 1 + i * 100);
+      else
+      {
+         test_frames[i] = frame_held(test_release);
+         for (k = 0; k < 3; k++)
+         {
+            uint8_t* b = malloc(64);
+            frame_hold(test_frames[i], b, 64, b);
+         }
+      }
+      for (k = 0; k < 8; k++)
+         frame_ref(test_frames[i]);
+   }
+   held_released = 0;
+   for (k = 0; k < 8; k++)
+      pthread_create(&th[k], NULL, test_unref_thread, (void*)(intptr_t) k);
+   for (i = 0; i < 256; i++)
+      frame_unref(test_frames[i]);
+   for (k = 0; k < 8; k++)
+      pthread_join(th[k], NULL);
+   if (pool.in_use || (pool.free_cnt != pool.blocks) || (held_released != 85 * 3))
+      bad++;
+   printf("release from 9 threads: %s (%d held buffers back)\n", bad ? "WRONG" : "ok", held_released);
+   frame_pool_free(&pool);
+   printf("self test %s\n", bad ? "FAILED" : "passed");
+   return bad ? 1 : 0;
+}
+
+int
+main (int argc, char** argv)
+{
+   int counts[8] = { 1, 8 }, ncounts = 2, opt, i, m;
+   double seconds = 2;
+   char* p;
+
+   enc.cnt = 16;
+   while ((opt = getopt(argc, argv, "d:s:b:t")) != -1)
+   {
+      switch (opt)
+      {
+         case 'd':
+            seconds = atof(optarg);
+            break;
+         case 's':
+            for (ncounts = 0, p = strtok(optarg, ","); p && (ncounts < 8); p = strtok(NULL, ","))
+               if (((counts[ncounts] = atoi(p)) > 0) && (counts[ncounts] <= MAX_SINKS))
+                  ncounts++;
+            break;
+         case 'b':
+            enc.cnt = atoi(optarg);
+            break;
+         case 't':
+            return self_test();
+         default:
+            ncounts = 0;
+            break;
+      }
+   }
+   if (!ncounts || (enc.cnt < 3))
+   {
+      fprintf(stderr, "Usage: %s [-d sec] [-s sinks,..(1..%d)] [-b encoder_buffers (3..)] [-t]\n", argv[0], MAX_SINKS);
+      return 2;
+   }
+   printf("mode  sinks   stream MB/s  copied MB/s  memory MB/s  peak RSS MB\n");
+   for (i = 0; i < ncounts; i++)
+      for (m = MODE_COPY; m <= MODE_HELD; m++)
+         bench(m, counts[i], seconds);
+   return 0;
+}
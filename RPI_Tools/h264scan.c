@@ -0,0 +1,782 @@
+/*
+ * Offline analyzer for captured streams: raw_tcp (Annex-B, also the relay's
+ * .h264 segments), android ([len 4][frame]) and android_motion (typed
+ * messages with motion bytes).
+ *
+ * gcc -O2 -o h264scan h264scan.c
+ * h264scan [-f raw|android|android_motion] [-r fps] [-w sec] [-b] [-v] [-n max] capture
+ *    -f   format, guessed from the first bytes by default
+ *    -r   frame rate for the time axis when the frames carry no time SEI (raspivid -timesei), default 30
+ *    -w   bitrate window in seconds, default 1; -b prints every window
+ *    -v   one line per frame (and every telemetry/camera mode message)
+ *    -n   anomalies printed, the rest are only counted, default 20
+ * h264scan -t                                self test and scan speed
+ *
+ * The capture is mmap()ed and scanned once, start codes with
+ * h264_find_start_code() which skips 16 bytes at a time, so the disk is
+ * the limit. Reports frame sizes (I and P), NAL types, GOP lengths, bitrate
+ * over time, motion bytes and anomalies: size spikes, irregular GOPs, gaps in
+ * the sender's time stamps, missing SPS/PPS, broken NAL headers, truncation.
+ */
+#ifndef _GNU_SOURCE
+   #define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../common/h264_nal.h"
+
+//android_motion message types, as in RaspiVid.c
+enum { CurrentResolution = 0, RegularFrame, MotionInFrame, MotionAlarm, Snapshot, EventLog, Telemetry, CameraMode, TypeCount };
+static const char* const type_names[] = { "config", "frame", "motion", "alarm", "snapshot", "event_log", "telemetry", "camera_mode" };
+
+typedef enum { FMT_AUTO = 0, FMT_RAW, FMT_ANDROID, FMT_ANDROID_MOTION } FORMAT;
+static const char* const format_names[] = { "auto", "raw", "android", "android_motion" };
+
+#define MAX_GOP 4096
+
+typedef struct
+{
+   uint64_t offset;                     /// in the capture
+   uint32_t len;
+   uint32_t nals;                       /// bit per NAL type
+   int64_t time_us;                     /// sender time (time SEI), 0 = none
+   char kind;                           /// 'I' IDR, 'P' other slices, 'C' SPS/PPS only, '-' no slice
+} FRAME;
+
+typedef struct
+{
+   //options
+   FORMAT format;
+   int fps;
+   double window;
+   bool bWindows, bVerbose;
+   int max_anomalies;
+   //what was found
+   FRAME* frames;
+   size_t n_frames, cap_frames;
+   uint64_t nal_count[32];
+   uint64_t motion_n, motion_sum, alarms, typed[TypeCount];
+   unsigned motion_max, motion_hist[8];  /// by the top 3 bits
+   bool bSpsSeen, bPpsSeen, bVclSeen;
+   uint64_t anomalies;
+   uint64_t truncated;                   /// bytes at the end that are no complete message
+} SCAN;
+
+static void
+anomaly (SCAN* s, size_t frame, uint64_t offset, const char* fmt, ...)
+{
+   va_list ap;
+
+   if (s->anomalies++ >= (uint64_t) s->max_anomalies)
+      return;
+   printf("anomaly at %llu (frame %zu): ", (unsigned long long) offset, frame);
+   va_start(ap, fmt);
+   vprintf(fmt, ap);
+   va_end(ap);
+   printf("\n");
+}
+
+/* one access unit / android frame: its NAL types, time SEI and kind */
+static void
+add_frame (SCAN* s, const uint8_t* base, const uint8_t* p, size_t len)
+{
+   const uint8_t* end = p + len;
+   const uint8_t* sc = h264_find_start_code(p, end);
+   FRAME f = { (uint64_t)(p - base), (uint32_t) len, 0, 0, '-' };
+   uint64_t mode;
+
+   if ((sc != p) && (sc != p + 1))
+      anomaly(s, s->n_frames, f.offset, "%zu bytes before the first start code", (size_t)(sc - p));
+   for (; sc + 3 < end; sc = h264_find_start_code(sc + 3, end))
+   {
+      int type = NAL_TYPE(sc[3]);
+
+      f.nals |= 1u << type;
+      s->nal_count[type]++;
+      if (sc[3] & 0x80)
+         anomaly(s, s->n_frames, sc - base, "forbidden_zero_bit set");
+      if ((0 == type) || (type > 23))
+         anomaly(s, s->n_frames, sc - base, "NAL type %d", type);
+      if (NAL_TYPE_SPS == type)
+         s->bSpsSeen = true;
+      else if (NAL_TYPE_PPS == type)
+         s->bPpsSeen = true;
+      else if ((NAL_TYPE_SLICE == type) || (NAL_TYPE_IDR == type))
+      {
+         if (!s->bVclSeen && (!s->bSpsSeen || !s->bPpsSeen))
+            anomaly(s, s->n_frames, sc - base, "slice before SPS/PPS");
+         if (!s->bVclSeen && (NAL_TYPE_IDR != type))
+            anomaly(s, s->n_frames, sc - base, "the stream starts with a non-IDR slice");
+         s->bVclSeen = true;
+         if (NAL_TYPE_IDR == type)
+            f.kind = 'I';
+         else if ('I' != f.kind)
+            f.kind = 'P';
+      }
+      else if (NAL_TYPE_SEI == type)
+      {
+         size_t n = (end - sc > H264_HEX_SEI_LEN) ? H264_HEX_SEI_LEN : end - sc;
+         int64_t t;
+
+         if (h264_find_time_sei(sc, n, &t))
+            f.time_us = t;
+         else if (h264_find_hex_sei(sc, n, h264_mode_sei_uuid, &mode) && s->bVerbose)
+            printf("%10zu camera: %s, sensor mode %u, %.2f-%.2f fps\n", s->n_frames, (mode >> 56) ? "low light" : "day",
+                   (unsigned)(mode >> 48) & 0xff, ((mode >> 0) & 0xffff) / 100.0, ((mode >> 16) & 0xffff) / 100.0);
+      }
+   }
+   if (('-' == f.kind) && (f.nals & ((1u << NAL_TYPE_SPS) | (1u << NAL_TYPE_PPS))))
+      f.kind = 'C';
+   else if (('-' == f.kind) && !(f.nals & (1u << NAL_TYPE_FILLER)) && (FMT_RAW != s->format))
+      anomaly(s, s->n_frames, f.offset, "frame without a slice");
+
+   if (s->n_frames == s->cap_frames)
+   {
+      s->cap_frames = s->cap_frames ? 2 * s->cap_frames : 65536;
+      if (NULL == (s->frames = realloc(s->frames, s->cap_frames * sizeof(FRAME))))
+      {
+         fprintf(stderr, "out of memory\n");
+         exit(2);
+      }
+   }
+   s->frames[s->n_frames++] = f;
+}
+
+/* Annex-B: a new access unit starts at AUD/SPS/PPS/SEI or at a first slice (first_mb_in_slice 0) after a slice */
+static void
+scan_raw (SCAN* s, const uint8_t* base, size_t len)
+{
+   const uint8_t* end = base + len;
+   const uint8_t* au = base;
+   const uint8_t* sc = h264_find_start_code(base, end);
+   bool bVcl = false;
+
+   for (; sc + 3 < end; sc = h264_find_start_code(sc + 3, end))
+   {
+      int type = NAL_TYPE(sc[3]);
+      const uint8_t* nal = (sc > base) && !sc[-1] ? sc - 1 : sc;
+      bool bSlice = (NAL_TYPE_SLICE == type) || (NAL_TYPE_IDR == type);
+
+      if (bVcl && (((NAL_TYPE_AUD == type) || (NAL_TYPE_SPS == type) || (NAL_TYPE_PPS == type) || (NAL_TYPE_SEI == type)) ||
+                   (bSlice && (sc + 4 < end) && (sc[4] & 0x80))))
+      {
+         add_frame(s, base, au, nal - au);
+         au = nal;
+         bVcl = false;
+      }
+      bVcl |= bSlice;
+   }
+   if (end > au)
+      add_frame(s, base, au, end - au);
+}
+
+static void
+scan_android (SCAN* s, const uint8_t* base, size_t len, bool bMotion)
+{
+   const uint8_t* p = base;
+   const uint8_t* end = base + len;
+   bool bFirst = true;
+
+   while (p < end)
+   {
+      uint32_t n;
+      int type = RegularFrame;
+
+      //the first message (SPS/PPS) has no type byte, android has none at all
+      if (bMotion && !bFirst)
+      {
+         type = *p++;
+         if (MotionInFrame == type)
+         {
+            unsigned m;
+            if (p >= end)
+               break;
+            m = *p++;
+            s->motion_n++;
+            s->motion_sum += m;
+            s->motion_hist[m >> 5]++;
+            if (m > s->motion_max)
+               s->motion_max = m;
+            s->typed[type]++;
+            continue;
+         }
+         if (MotionAlarm == type)
+         {
+            s->alarms++;
+            s->typed[type]++;
+            continue;
+         }
+         if (type >= TypeCount)
+         {
+            anomaly(s, s->n_frames, p - 1 - base, "unknown message type %d, giving up", type);
+            s->truncated = end - (p - 1);
+            return;
+         }
+      }
+      if (end - p < 4)
+         break;
+      memcpy(&n, p, 4);
+      p += 4;
+      if (n > (uint64_t)(end - p))
+      {
+         p -= 4 + (bMotion && !bFirst);
+         break;
+      }
+      s->typed[bFirst ? CurrentResolution : type]++;
+      if (RegularFrame == type)
+         add_frame(s, base, p, n);
+      else if (s->bVerbose && ((Telemetry == type) || (CameraMode == type)))
+         printf("%10zu %s: %.*s\n", s->n_frames, type_names[type], (int) n, (const char*) p);
+      p += n;
+      bFirst = false;
+   }
+   if (p < end)
+   {
+      s->truncated = end - p;
+      anomaly(s, s->n_frames, p - base, "the last %llu bytes are no complete message", (unsigned long long) s->truncated);
+   }
+}
+
+static FORMAT
+guess_format (const uint8_t* p, size_t len)
+{
+   uint32_t n;
+
+   if ((len >= 4) && !p[0] && !p[1] && ((1 == p[2]) || (!p[2] && (1 == p[3]))))
+      return FMT_RAW;
+   if (len < 9)
+      return FMT_RAW;
+   //config with a length in front, then a length (android) or a type byte (android_motion)
+   memcpy(&n, p, 4);
+   if ((n > len - 4) || (4 + n + 5 > len))
+      return FMT_RAW;
+   p += 4 + n;
+   if (!p[4] && !p[5] && ((1 == p[6]) || (!p[6] && (1 == p[7]))))
+      return FMT_ANDROID;
+   return FMT_ANDROID_MOTION;
+}
+
+static int
+u32_cmp (const void* a, const void* b)
+{
+   uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+   return (x > y) - (x < y);
+}
+
+static int
+i64_cmp (const void* a, const void* b)
+{
+   int64_t x = *(const int64_t*) a, y = *(const int64_t*) b;
+   return (x > y) - (x < y);
+}
+
+static void
+size_stats (const char* name, uint32_t* v, size_t n)
+{
+   uint64_t sum = 0;
+   size_t i;
+
+   if (!n)
+      return;
+   qsort(v, n, sizeof(v[0]), u32_cmp);
+   for (i = 0; i < n; i++)
+      sum += v[i];
+   printf("%-7s %8zu frames, bytes avg %8.0f p50 %8u p95 %8u p99 %8u max %8u\n", name, n, (double) sum / n, v[n / 2],
+          v[n * 95 / 100], v[n * 99 / 100], v[n - 1]);
+}
+
+/* the median of positive values, 0 if none */
+static int64_t
+median_i64 (const int64_t* v, size_t n)
+{
+   int64_t* c = malloc(n * sizeof(*c));
+   size_t i, k = 0;
+   int64_t m = 0;
+
+   for (i = 0; c && (i < n); i++)
+      if (v[i] > 0)
+         c[k++] = v[i];
+   if (k)
+   {
+      qsort(c, k, sizeof(c[0]), i64_cmp);
+      m = c[k / 2];
+   }
+   free(c);
+   return m;
+}
+
+static void
+report (SCAN* s, size_t capture_len)
+{
+   uint32_t* sizes = malloc((s->n_frames + 1) * sizeof(uint32_t));
+   int64_t* gaps = malloc((s->n_frames + 1) * sizeof(int64_t));
+   unsigned gop_hist[MAX_GOP + 1] = { 0 };
+   size_t i, n, windows = 0, timed = 0, idr = 0, gop_n = 0, gop_min = SIZE_MAX, gop_max = 0, gop_sum = 0, last_idr = SIZE_MAX;
+   int64_t t0 = 0, median_gap, window_us = (int64_t)(s->window * 1e6), w_start = 0;
+   uint64_t w_bytes = 0, w_cnt = 0;
+   double w_min = 1e30, w_max = 0, w_sum = 0;
+   unsigned gop_mode = 0, stalls = 0;
+   uint32_t median_p = 0;
+
+   if (!sizes || !gaps)
+      exit(2);
+   printf("%s, %zu frames, %llu bytes\n", format_names[s->format], s->n_frames, (unsigned long long) capture_len);
+
+   //sizes by kind
+   for (n = 0, i = 0; i < s->n_frames; i++)
+      if ('I' == s->frames[i].kind)
+         sizes[n++] = s->frames[i].len;
+   size_stats("I", sizes, n);
+   for (n = 0, i = 0; i < s->n_frames; i++)
+      if ('P' == s->frames[i].kind)
+         sizes[n++] = s->frames[i].len;
+   size_stats("P", sizes, n);
+   median_p = n ? sizes[n / 2] : 0;
+   printf("NAL units:");
+   for (i = 0; i < 32; i++)
+      if (s->nal_count[i])
+         printf(" type %zu: %llu", i, (unsigned long long) s->nal_count[i]);
+   printf("\n");
+
+   //GOPs: frames from one IDR to the next
+   for (i = 0; i < s->n_frames; i++)
+   {
+      if ('I' != s->frames[i].kind)
+         continue;
+      idr++;
+      if (SIZE_MAX != last_idr)
+      {
+         size_t g = i - last_idr;
+         gop_hist[(g > MAX_GOP) ? MAX_GOP : g]++;
+         gop_n++;
+         gop_sum += g;
+         if (g < gop_min)
+            gop_min = g;
+         if (g > gop_max)
+            gop_max = g;
+      }
+      last_idr = i;
+   }
+   for (i = 1; i <= MAX_GOP; i++)
+      if (gop_hist[i] > gop_hist[gop_mode])
+         gop_mode = i;
+   if (gop_n)
+   {
+      printf("GOP     %8zu complete, frames min %zu avg %.1f max %zu, mostly %u", gop_n, gop_min, (double) gop_sum / gop_n, gop_max, gop_mode);
+      printf(" (%u of them)\n", gop_hist[gop_mode]);
+   }
+   else
+      printf("GOP     %zu IDR frames, no complete GOP\n", idr);
+   if (gop_n)
+   {
+      last_idr = SIZE_MAX;
+      for (i = 0; i < s->n_frames; i++)
+      {
+         if ('I' != s->frames[i].kind)
+            continue;
+         if ((SIZE_MAX != last_idr) && (i - last_idr != gop_mode))
+            anomaly(s, i, s->frames[i].offset, "GOP of %zu frames, most are %u", i - last_idr, gop_mode);
+         last_idr = i;
+      }
+   }
+
+   //time: the sender's stamps if the frames have them, the frame rate otherwise
+   for (i = 0; i < s->n_frames; i++)
+   {
+      gaps[i] = 0;
+      if (s->frames[i].time_us)
+      {
+         if (!t0)
+            t0 = s->frames[i].time_us;
+         if (timed && (i > 0) && s->frames[i - 1].time_us)
+            gaps[i] = s->frames[i].time_us - s->frames[i - 1].time_us;
+         timed++;
+      }
+   }
+   median_gap = median_i64(gaps, s->n_frames);
+   if (timed)
+   {
+      for (i = 0; i < s->n_frames; i++)
+         stalls += median_gap && (gaps[i] > 3 * median_gap);
+      printf("time    %zu frames with a time SEI, median interval %.2f ms, %u gaps over 3x that\n", timed, median_gap / 1000.0, stalls);
+      for (i = 0; stalls && (i < s->n_frames); i++)
+         if (median_gap && (gaps[i] > 3 * median_gap))
+            anomaly(s, i, s->frames[i].offset, "%.1f ms after the frame before, %.1f ms is normal", gaps[i] / 1000.0, median_gap / 1000.0);
+   }
+
+   //bitrate over time
+   for (i = 0; i <= s->n_frames; i++)
+   {
+      int64_t t = 0;
+      if (i < s->n_frames)
+         t = (timed && s->frames[i].time_us) ? s->frames[i].time_us - t0 : (int64_t) i * 1000000 / s->fps;
+      if ((i == s->n_frames) || (t - w_start >= window_us))
+      {
+         if (w_cnt)
+         {
+            double kbit = w_bytes * 8 / 1000.0 / s->window;
+            if (s->bWindows)
+               printf("%9.1f s %9.1f kbit/s %5llu frames\n", w_start / 1e6, kbit, (unsigned long long) w_cnt);
+            //the last window is short, it only counts if it is the only one
+            if ((i < s->n_frames) || !windows)
+            {
+               if (kbit < w_min)
+                  w_min = kbit;
+               if (kbit > w_max)
+                  w_max = kbit;
+               w_sum += kbit;
+               windows++;
+            }
+         }
+         if (i == s->n_frames)
+            break;
+         w_start += ((t - w_start) / window_us) * window_us;
+         w_bytes = w_cnt = 0;
+      }
+      w_bytes += s->frames[i].len;
+      w_cnt++;
+   }
+   if (windows)
+      printf("bitrate kbit/s per %.1f s: min %.1f avg %.1f max %.1f\n", s->window, w_min, w_sum / windows, w_max);
+
+   //size spikes: P frames much bigger than usual
+   for (i = 0; median_p && (i < s->n_frames); i++)
+      if (('P' == s->frames[i].kind) && (s->frames[i].len > 4 * median_p))
+         anomaly(s, i, s->frames[i].offset, "P frame of %u bytes, %.1fx the median", s->frames[i].len, (double) s->frames[i].len / median_p);
+
+   if (FMT_ANDROID_MOTION == s->format)
+   {
+      printf("messages:");
+      for (i = 0; i < TypeCount; i++)
+         if (s->typed[i])
+            printf(" %s %llu", type_names[i], (unsigned long long) s->typed[i]);
+      printf("\n");
+      if (s->motion_n)
+      {
+         printf("motion  %llu values avg %.1f max %u, by 32s:", (unsigned long long) s->motion_n, (double) s->motion_sum / s->motion_n, s->motion_max);
+         for (i = 0; i < 8; i++)
+            printf(" %u", s->motion_hist[i]);
+         printf(", %llu alarms\n", (unsigned long long) s->alarms);
+      }
+   }
+   printf("%llu anomalies%s\n", (unsigned long long) s->anomalies,
+          (s->anomalies > (uint64_t) s->max_anomalies) ? " (the first ones printed, see -n)" : "");
+   free(sizes);
+   free(gaps);
+}
+
+static void
+scan_init (SCAN* s)
+{
+   memset(s, 0, sizeof(*s));
+   s->fps = 30;
+   s->window = 1.0;
+   s->max_anomalies = 20;
+}
+
+static void
+scan (SCAN* s, const uint8_t* p, size_t len)
+{
+   if (FMT_AUTO == s->format)
+      s->format = guess_format(p, len);
+   if (FMT_RAW == s->format)
+      scan_raw(s, p, len);
+   else
+      scan_android(s, p, len, FMT_ANDROID_MOTION == s->format);
+}
+
+static void
+print_frames (const SCAN* s)
+{
+   size_t i;
+   int k;
+
+   printf("     frame     offset    bytes kind time_ms    NAL types\n");
+   for (i = 0; i < s->n_frames; i++)
+   {
+      const FRAME* f = &s->frames[i];
+      printf("%10zu %10llu %8u  %c  %10.1f  ", i, (unsigned long long) f->offset, f->len, f->kind,
+             f->time_us ? (f->time_us - s->frames[0].time_us) / 1000.0 : 0.0);
+      for (k = 0; k < 32; k++)
+         if (f->nals & (1u << k))
+            printf(" %d", k);
+      printf("\n");
+   }
+}
+
+/*************************************** self test ***************************************/
+
+static double
+now_sec (void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const uint8_t*
+scalar_start_code (const uint8_t* p, const uint8_t* end)
+{
+   while (p + 3 <= end)
+   {
+      if (p[2] > 1)
+         p += 3;
+      else if (p[2] == 0)
+         p++;
+      else if ((p[0] == 0) && (p[1] == 0))
+         return p;
+      else
+         p += 3;
+   }
+   return end;
+}
+
+/* appends a NAL with payload bytes that never make a start code */
+static size_t
+put_nal (uint8_t* out, int type, size_t len, unsigned* seed)
+{
+   size_t i;
+
+   memcpy(out, "\0\0\0\1", 4);
+   out[4] = 0x60 | type;
+   for (i = 5; i < len; i++)
+   {
+      *seed = *seed * 1103515245 + 12345;
+      out[i] = (*seed >> 16) & 0xff;
+      if (!out[i] && !out[i - 1])
+         out[i] = 3;
+   }
+   if ((NAL_TYPE_SLICE == type) || (NAL_TYPE_IDR == type))
+      out[5] = 0x88;                     //first_mb_in_slice 0
+   return len;
+}
+
+/*
+ * 300 frames, GOP 30, a time SEI in front of every frame at 30 fps, frame 100
+ * ten times the usual size, a 200 ms gap before frame 200.
+ */
+static size_t
+make_capture (uint8_t* out, FORMAT fmt, unsigned* seed)
+{
+   size_t len = 0, n;
+   uint8_t frame[512 * 1024];
+   uint32_t l;
+   int i;
+
+   n = put_nal(frame, NAL_TYPE_SPS, 12, seed);
+   n += put_nal(frame + n, NAL_TYPE_PPS, 8, seed);
+   if (FMT_RAW != fmt)
+   {
+      l = n;
+      memcpy(out + len, &l, 4);
+      len += 4;
+   }
+   memcpy(out + len, frame, n);
+   len += n;
+   for (i = 0; i < 300; i++)
+   {
+      int64_t t = 1700000000000000LL + i * 33333 + ((i >= 200) ? 200000 : 0);
+
+      n = h264_make_time_sei(frame, t);
+      if (i && !(i % 30) && (FMT_RAW == fmt))
+      {
+         n += put_nal(frame + n, NAL_TYPE_SPS, 12, seed);
+         n += put_nal(frame + n, NAL_TYPE_PPS, 8, seed);
+      }
+      n += put_nal(frame + n, (i % 30) ? NAL_TYPE_SLICE : NAL_TYPE_IDR, (i % 30) ? ((100 == i) ? 40000 : 4000) : 20000, seed);
+      if (FMT_ANDROID_MOTION == fmt)
+         out[len++] = RegularFrame;
+      if (FMT_RAW != fmt)
+      {
+         l = n;
+         memcpy(out + len, &l, 4);
+         len += 4;
+      }
+      memcpy(out + len, frame, n);
+      len += n;
+      if (FMT_ANDROID_MOTION == fmt)
+      {
+         out[len++] = MotionInFrame;
+         out[len++] = i % 200;
+         if (150 == i)
+            out[len++] = MotionAlarm;
+      }
+   }
+   return len;
+}
+
+static int
+self_test (void)
+{
+   static uint8_t buf[1 << 24];
+   unsigned seed = 1;
+   long bad = 0;
+   bool bOk = true;
+   double t;
+   size_t len, i;
+   int it, f;
+
+   //the vector scan against the byte loop, many zeros and ones
+   for (it = 0; it < 200000; it++)
+   {
+      size_t n = seed % 300, start;
+      seed = seed * 1103515245 + 12345;
+      for (i = 0; i < n; i++)
+      {
+         unsigned r;
+         seed = seed * 1103515245 + 12345;
+         r = (seed >> 16) % 16;
+         buf[i] = (r < 4) ? 0 : ((r < 6) ? 1 : (seed >> 8) & 0xff);
+      }
+      for (start = 0; (start < n) && (start < 20); start += 3)
+         bad += h264_find_start_code(buf + start, buf + n) != scalar_start_code(buf + start, buf + n);
+   }
+   printf("start code scan: %ld mismatches\n", bad);
+   bOk &= !bad;
+
+   for (f = FMT_RAW; f <= FMT_ANDROID_MOTION; f++)
+   {
+      SCAN s;
+      size_t idr = 0;
+
+      scan_init(&s);
+      len = make_capture(buf, (FORMAT) f, &seed);
+      printf("--- %s\n", format_names[f]);
+      scan(&s, buf, len);
+      report(&s, len);
+      for (i = 0; i < s.n_frames; i++)
+         idr += 'I' == s.frames[i].kind;
+      //raw: SPS/PPS go with the IDR, android: the config is a frame of its own
+      if ((s.format != (FORMAT) f) || (s.n_frames != 300u + (FMT_RAW != f)) || (10 != idr) || (2 != s.anomalies) ||
+          ((FMT_ANDROID_MOTION == f) && ((300 != s.motion_n) || (1 != s.alarms))))
+      {
+         printf("%s: FAILED\n", format_names[f]);
+         bOk = false;
+      }
+      free(s.frames);
+   }
+
+   //speed: 16 MB of 100 KB slices, scanned 16 times
+   for (len = 0; len + 100000 < sizeof(buf); )
+      len += put_nal(buf + len, NAL_TYPE_SLICE, 100000, &seed);
+   t = now_sec();
+   for (it = 0, i = 0; it < 16; it++)
+   {
+      const uint8_t* p = buf;
+      while ((p = h264_find_start_code(p, buf + len)) + 3 < buf + len)
+      {
+         i++;
+         p += 3;
+      }
+   }
+   t = now_sec() - t;
+   printf("start code scan %.0f MB/s (%zu NAL units)\n", 16 * len / t / 1e6, i);
+   t = now_sec();
+   for (it = 0; it < 4; it++)
+   {
+      const uint8_t* p = buf;
+      while ((p = scalar_start_code(p, buf + len)) + 3 < buf + len)
+         p += 3;
+   }
+   t = now_sec() - t;
+   printf("byte loop       %.0f MB/s\n", 4 * len / t / 1e6);
+
+   printf("%s\n", bOk ? "OK" : "FAILED");
+   return bOk ? 0 : 3;
+}
+
+static void
+show_usage_and_exit (const char* name)
+{
+   fprintf(stderr, "Usage: %s [-f raw|android|android_motion] [-r fps] [-w sec] [-b] [-v] [-n max] capture\n"
+           "       %s -t\n", name, name);
+   exit(2);
+}
+
+int
+main (int argc, char** argv)
+{
+   SCAN s;
+   bool bTest = false;
+   struct stat st;
+   const uint8_t* p;
+   double t;
+   int c, fd;
+
+   scan_init(&s);
+   while ((c = getopt(argc, argv, "f:r:w:bvn:t")) != -1)
+   {
+      switch (c)
+      {
+         case 'f':
+            for (s.format = FMT_RAW; (s.format <= FMT_ANDROID_MOTION) && strcmp(optarg, format_names[s.format]); s.format++)
+               ;
+            if (s.format > FMT_ANDROID_MOTION)
+               show_usage_and_exit(argv[0]);
+            break;
+         case 'r':
+            if ((s.fps = atoi(optarg)) <= 0)
+               show_usage_and_exit(argv[0]);
+            break;
+         case 'w':
+            if ((s.window = atof(optarg)) <= 0)
+               show_usage_and_exit(argv[0]);
+            break;
+         case 'b':
+            s.bWindows = true;
+            break;
+         case 'v':
+            s.bVerbose = true;
+            break;
+         case 'n':
+            s.max_anomalies = atoi(optarg);
+            break;
+         case 't':
+            bTest = true;
+            break;
+         default:
+            show_usage_and_exit(argv[0]);
+      }
+   }
+   if (bTest)
+      return self_test();
+   if (optind + 1 != argc)
+      show_usage_and_exit(argv[0]);
+
+   if (((fd = open(argv[optind], O_RDONLY)) < 0) || fstat(fd, &st))
+   {
+      perror(argv[optind]);
+      return 2;
+   }
+   if (!st.st_size)
+   {
+      printf("%s is empty\n", argv[optind]);
+      return 0;
+   }
+   p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   if (MAP_FAILED == p)
+   {
+      perror("mmap");
+      return 2;
+   }
+   madvise((void*) p, st.st_size, MADV_SEQUENTIAL);
+   t = now_sec();
+   scan(&s, p, st.st_size);
+   t = now_sec() - t;
+   if (s.bVerbose)
+      print_frames(&s);
+   report(&s, st.st_size);
+   printf("scanned in %.3f s, %.0f MB/s\n", t, st.st_size / t / 1e6);
+   munmap((void*) p, st.st_size);
+   close(fd);
+   return s.anomalies ? 1 : 0;
+}
@@ -0,0 +1,509 @@
+/*
+ * Bandwidth limiting TCP shim for testing raspivid -probe without a real bad link.
+ *
+ * gcc -O2 -pthread -o impair impair.c
+ * impair -r 4000 7000 127.0.0.1:5001      video connects to :7000, impair connects to raspivid -l on :5001
+ * impair -r 8000,2000 -s 20 7000 ...      8 Mbit/s and 2 Mbit/s, switching every 20 s (idle re-probes)
+ * impair -t [-r 1000,4000,16000]          self test: the probe of common/bw_probe.h through the shim
+ *                                         on loopback, estimate against every rate in -r (the idle
+ *                                         probes by their median), prints why a rate FAILED
+ * impair -u -r 3000 -d 40 -l 2 7001 10.9.0.2:5000
+ *                                         UDP (one path of raspivid -o multipath://): datagrams
+ *                                         to :7001 go on at 3 Mbit/s, 40 ms later, 2% of them lost
+ *
+ * The stream from the PI is read no faster than the rate allows and the socket
+ * towards the PI has a small receive buffer, so its ACKs are paced like behind
+ * a slow link. The way back (commands) is not limited. With -u the datagrams
+ * wait behind each other at the rate in a queue of 200 ms, what does not fit
+ * is dropped like by a router; the way back gets the delay only.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "../common/bw_probe.h"
+
+#define MAX_RATES 16
+#define UDP_QUEUE 4096
+#define TEST_IDLE_PROBES 3
+
+static int rates[MAX_RATES] = { 4000 };         /// kbit/s
+static int nrates = 1;
+static int step_sec = 10;
+static int rcvbuf = 4096;
+static int delay_ms, loss_pct;
+static bool bQuiet;
+
+static void
+show_usage_and_exit (const char* name)
+{
+   fprintf(stderr, "Usage: %s [-r kbit/s[,kbit/s...]] [-s sec] [-b rcvbuf] listen_port ip:port\n"
+           "       %s -u [-r kbit/s[,kbit/s...]] [-s sec] [-d delay_ms] [-l loss%%] listen_port ip:port\n"
+           "       %s -t [-r kbit/s[,kbit/s...]]\n", name, name, name);
+   exit(1);
+}
+
+static int
+listen_on (uint16_t port, uint16_t* pPort)
+{
+   struct sockaddr_in a = { AF_INET, htons(port), { htonl(INADDR_LOOPBACK) } };
+   socklen_t len = sizeof(a);
+   int fd = socket(AF_INET, SOCK_STREAM, 0), one = 1;
+
+   if (port)
+      a.sin_addr.s_addr = htonl(INADDR_ANY);
+   setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+   if ((fd < 0) || bind(fd, (struct sockaddr*) &a, sizeof(a)) || listen(fd, 1))
+   {
+      perror("listen");
+      exit(2);
+   }
+   if (pPort)
+   {
+      getsockname(fd, (struct sockaddr*) &a, &len);
+      *pPort = ntohs(a.sin_port);
+   }
+   return fd;
+}
+
+static int
+connect_to (struct sockaddr_in* a, int bufsize)
+{
+   int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+   //before connect(), the window scale is agreed on in the handshake
+   if (bufsize)
+      setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+   if ((fd < 0) || connect(fd, (struct sockaddr*) a, sizeof(*a)))
+   {
+      perror("connect");
+      exit(2);
+   }
+   return fd;
+}
+
+/* forwards up -> down at the current rate and down -> up as is, until one side closes */
+static void
+shim (int up, int down)
+{
+   static uint8_t buf[65536];
+   int64_t start = bw_probe_now_us(), last = start, tokens = 0;
+   int idx = -1;
+
+   for (;;)
+   {
+      struct pollfd pfd[2] = { { up, POLLIN }, { down, POLLIN } };
+      int64_t now = bw_probe_now_us();
+      int cur = (int)(((now - start) / 1000000 / step_sec) % nrates);
+      ssize_t n;
+
+      if (cur != idx)
+      {
+         idx = cur;
+         if (!bQuiet)
+            fprintf(stderr, "impair: %d kbit/s\n", rates[idx]);
+      }
+      //a burst of 2 ms, at least two full segments
+      tokens += (now - last) * rates[idx] / 8000;
+      if (tokens > ((rates[idx] / 4 > 2896) ? rates[idx] / 4 : 2896))
+         tokens = (rates[idx] / 4 > 2896) ? rates[idx] / 4 : 2896;
+      last = now;
+      if (tokens < 1448)
+         pfd[0].events = 0;
+      if (poll(pfd, 2, 1) < 0)
+         continue;
+      if (pfd[0].revents)
+      {
+         n = recv(up, buf, (tokens < (int64_t)sizeof(buf)) ? tokens : sizeof(buf), MSG_DONTWAIT);
+         if (!n || ((n < 0) && (EAGAIN != errno)) || ((n > 0) && (send(down, buf, n, MSG_NOSIGNAL) != n)))
+            return;
+         if (n > 0)
+            tokens -= n;
+      }
+      if (pfd[1].revents)
+      {
+         n = recv(down, buf, sizeof(buf), MSG_DONTWAIT);
+         if (!n || ((n < 0) && (EAGAIN != errno)) || ((n > 0) && (send(up, buf, n, MSG_NOSIGNAL) != n)))
+            return;
+      }
+   }
+}
+
+/* datagrams waiting for their time, in the order they are due */
+typedef struct
+{
+   int64_t due;
+   uint16_t len;
+   uint8_t data[1500];
+} UDP_PKT;
+
+static void
+udp_enqueue (UDP_PKT* q, unsigned* tail, unsigned head, const uint8_t* data, ssize_t len, int64_t due)
+{
+   UDP_PKT* p;
+
+   if ((*tail - head >= UDP_QUEUE) || (len > (ssize_t) sizeof(p->data)))
+      return;
+   p = &q[(*tail)++ % UDP_QUEUE];
+   p->due = due;
+   p->len = len;
+   memcpy(p->data, data, len);
+}
+
+/* datagrams to ls go to dst at the current rate with delay and loss, the answers back to their sender with the delay */
+static void
+udp_shim (int ls, struct sockaddr_in* dst)
+{
+   static UDP_PKT fwd[UDP_QUEUE], back[UDP_QUEUE];
+   unsigned fh = 0, ft = 0, bh = 0, bt = 0;
+   struct sockaddr_in from;
+   bool bFrom = false;
+   int64_t start = bw_probe_now_us(), link_free = 0;
+   uint64_t dropped = 0, lost = 0, passed = 0;
+   uint32_t rnd = 2463534242u;
+   uint8_t buf[2048];
+   int out = socket(AF_INET, SOCK_DGRAM, 0), idx = -1;
+
+   if ((out < 0) || connect(out, (struct sockaddr*) dst, sizeof(*dst)))
+   {
+      perror("connect");
+      exit(2);
+   }
+   for (;;)
+   {
+      struct pollfd pfd[2] = { { ls, POLLIN }, { out, POLLIN } };
+      int64_t now = bw_probe_now_us();
+      int cur = (int)(((now - start) / 1000000 / step_sec) % nrates);
+      ssize_t n;
+
+      if (cur != idx)
+      {
+         idx = cur;
+         fprintf(stderr, "impair: %d kbit/s, %d ms, %d%% loss (passed %llu, lost %llu, queue full %llu)\n", rates[idx],
+                 delay_ms, loss_pct, (unsigned long long) passed, (unsigned long long) lost, (unsigned long long) dropped);
+      }
+      poll(pfd, 2, 1);
+      now = bw_probe_now_us();
+      if (pfd[0].revents)
+      {
+         socklen_t len = sizeof(from);
+
+         if ((n = recvfrom(ls, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr*) &from, &len)) > 0)
+         {
+            int64_t at = (link_free > now) ? link_free : now;
+
+            bFrom = true;
+            rnd ^= rnd << 13;
+            rnd ^= rnd >> 17;
+            rnd ^= rnd << 5;
+            if (at - now > 200000)
+               dropped++;
+            else if ((int)(rnd % 100) < loss_pct)
+               lost++;
+            else
+            {
+               link_free = at + n * 8000LL / rates[idx];
+               udp_enqueue(fwd, &ft, fh, buf, n, link_free + delay_ms * 1000LL);
+               passed++;
+            }
+         }
+      }
+      if (pfd[1].revents && ((n = recv(out, buf, sizeof(buf), MSG_DONTWAIT)) > 0))
+         udp_enqueue(back, &bt, bh, buf, n, now + delay_ms * 1000LL);
+      for (; (fh != ft) && (fwd[fh % UDP_QUEUE].due <= now); fh++)
+         send(out, fwd[fh % UDP_QUEUE].data, fwd[fh % UDP_QUEUE].len, MSG_DONTWAIT);
+      for (; (bh != bt) && (back[bh % UDP_QUEUE].due <= now); bh++)
+         if (bFrom)
+            sendto(ls, back[bh % UDP_QUEUE].data, back[bh % UDP_QUEUE].len, MSG_DONTWAIT, (struct sockaddr*) &from, sizeof(from));
+   }
+}
+
+/* self test: sender (listening like raspivid -l) <- shim <- sink */
+static int test_up_port;
+static int test_sink;
+
+static void*
+test_shim (void* arg)
+{
+   uint16_t port = 0;
+   int ls = listen_on(0, &port), down, up;
+   struct sockaddr_in a = { AF_INET, htons(test_up_port), { htonl(INADDR_LOOPBACK) } };
+
+   *(uint16_t*) arg = port;
+   down = accept(ls, NULL, NULL);
+   up = connect_to(&a, rcvbuf);
+   close(ls);
+   shim(up, down);
+   close(up);
+   close(down);
+   return NULL;
+}
+
+static void*
+test_sink_thread (void* arg)
+{
+   static uint8_t buf[65536];
+
+   while (recv(test_sink, buf, sizeof(buf), 0) > 0)
+      ;
+   return NULL;
+}
+
+static int test_fd;
+
+static bool
+test_send (const uint8_t* data, uint32_t len)
+{
+   return send(test_fd, data, len, MSG_NOSIGNAL) == (ssize_t) len;
+}
+
+/* a 30 fps stream at test_kbps next to the idle probes, every frame in two sends like the encoder does */
+static pthread_mutex_t test_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t test_queued;
+static bool test_bMidFrame, test_bStop;
+static int test_kbps;
+
+static bool
+test_boundary (void)
+{
+   return !test_bMidFrame;
+}
+
+static void*
+test_stream_thread (void* arg)
+{
+   static uint8_t frame[1 << 20];
+   size_t len = test_kbps * 1000 / 8 / 30;
+   int64_t next = bw_probe_now_us();
+
+   bw_probe_filler(frame, len);
+   while (!test_bStop)
+   {
+      int half;
+      for (half = 0; half < 2; half++)
+      {
+         size_t n = half ? len - len / 2 : len / 2;
+
+         pthread_mutex_lock(&test_lock);
+         test_bMidFrame = !half;
+         if (test_send(frame + (half ? len / 2 : 0), n))
+            test_queued += n;
+         pthread_mutex_unlock(&test_lock);
+      }
+      next += 33333;
+      if (next > bw_probe_now_us())
+         usleep(next - bw_probe_now_us());
+   }
+   return NULL;
+}
+
+/* est in bit/s within a quarter of kbps, otherwise says by how much not */
+static bool
+test_within (int kbps, int64_t est, const char* what)
+{
+   if ((est >= kbps * 750LL) && (est <= kbps * 1250LL))
+      return true;
+   printf("FAILED: shim %d kbit/s, %s %.0f kbit/s is %+.0f%% off, at most 25%% allowed\n", kbps, what, est / 1000.0,
+          100.0 * (est / 1000.0 - kbps) / kbps);
+   return false;
+}
+
+/* of n estimates, sorted in place; the mean of the middle two for an even n */
+static int64_t
+test_median (int64_t* v, int n)
+{
+   int i, k;
+
+   for (i = 1; i < n; i++)
+      for (k = i; (k > 0) && (v[k - 1] > v[k]); k--)
+      {
+         int64_t t = v[k];
+         v[k] = v[k - 1];
+         v[k - 1] = t;
+      }
+   return (n & 1) ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+static int
+self_test (void)
+{
+   int i, n = nrates, all[MAX_RATES], bad = 0;
+
+   memcpy(all, rates, sizeof(all));
+   for (i = 0; i < n; i++)
+   {
+      volatile uint16_t shim_port = 0;
+      uint16_t port;
+      int ls = listen_on(0, &port);
+      pthread_t ts, tk;
+      struct sockaddr_in a = { AF_INET, 0, { htonl(INADDR_LOOPBACK) } };
+      BW_PROBE probe = { 0, test_send, NULL, NULL, NULL, true };
+      int64_t est, start;
+
+      rates[0] = all[i];
+      nrates = 1;
+      test_up_port = port;
+      pthread_create(&ts, NULL, test_shim, (void*) &shim_port);
+      while (!shim_port)
+         usleep(1000);
+      a.sin_port = htons(shim_port);
+      test_sink = connect_to(&a, 0);
+      pthread_create(&tk, NULL, test_sink_thread, NULL);
+      probe.fd = test_fd = accept(ls, NULL, NULL);
+      close(ls);
+
+      start = bw_probe_now_us();
+      est = bw_probe_ramp(&probe, INT64_MAX, 1500000);
+      printf("shim %6d kbit/s: estimate %8.0f kbit/s (%+.0f%%) in %lld ms\n", all[i], est / 1000.0,
+             100.0 * (est / 1000.0 - all[i]) / all[i], (long long)(bw_probe_now_us() - start) / 1000);
+      //within a quarter is good enough to pick a starting bitrate
+      if (!test_within(all[i], est, "ramp estimate"))
+         bad++;
+
+      //then a stream at half the rate and probes in between its frames
+      {
+         BW_PROBE idle = { test_fd, test_send, &test_lock, &test_queued, test_boundary, true };
+         pthread_t tv;
+         int64_t got[TEST_IDLE_PROBES];
+         int k, n_got = 0;
+
+         test_kbps = all[i] / 2;
+         test_bStop = false;
+         pthread_create(&tv, NULL, test_stream_thread, NULL);
+         for (k = 0; k < TEST_IDLE_PROBES; k++)
+         {
+            bool bIdle, bLower;
+
+            sleep(1);
+            est = bw_probe_idle(&idle, 65536, 2000000, &bIdle, &bLower);
+            printf("shim %6d kbit/s, stream %6d kbit/s: idle probe %8.0f kbit/s%s\n", all[i], test_kbps, est / 1000.0,
+                   !bIdle ? " (never idle)" : (bLower ? " or more" : ""));
+            if (bIdle && !bLower)
+               got[n_got++] = est;
+         }
+         test_bStop = true;
+         pthread_join(tv, NULL);
+         //a single train on a busy host is easily a third off, the median of the probes is what counts
+         if (n_got <= TEST_IDLE_PROBES / 2)
+         {
+            printf("FAILED: shim %d kbit/s, only %d of %d idle probes gave an estimate\n", all[i], n_got, TEST_IDLE_PROBES);
+            bad++;
+         }
+         else if (!test_within(all[i], test_median(got, n_got), "idle probe median"))
+            bad++;
+      }
+      shutdown(test_fd, SHUT_RDWR);
+      close(test_fd);
+      pthread_join(ts, NULL);
+      shutdown(test_sink, SHUT_RDWR);
+      pthread_join(tk, NULL);
+      close(test_sink);
+   }
+   printf("self test %s\n", bad ? "FAILED" : "passed");
+   return bad ? 3 : 0;
+}
+
+int
+main (int argc, char** argv)
+{
+   bool bTest = false, bRates = false, bUdp = false;
+   char* p;
+   int c;
+
+   while ((c = getopt(argc, argv, "tur:s:b:d:l:")) != -1)
+   {
+      switch (c)
+      {
+         case 't':
+            bTest = true;
+            break;
+         case 'r':
+            for (nrates = 0, p = strtok(optarg, ","); p && (nrates < MAX_RATES); p = strtok(NULL, ","))
+               if ((rates[nrates] = atoi(p)) > 0)
+                  nrates++;
+            if (!nrates)
+               show_usage_and_exit(argv[0]);
+            bRates = true;
+            break;
+         case 's':
+            if ((step_sec = atoi(optarg)) <= 0)
+               show_usage_and_exit(argv[0]);
+            break;
+         case 'b':
+            rcvbuf = atoi(optarg);
+            break;
+         case 'u':
+            bUdp = true;
+            break;
+         case 'd':
+            delay_ms = atoi(optarg);
+            break;
+         case 'l':
+            loss_pct = atoi(optarg);
+            break;
+         default:
+            show_usage_and_exit(argv[0]);
+      }
+   }
+
+   if (bTest)
+   {
+      if (optind != argc)
+         show_usage_and_exit(argv[0]);
+      if (!bRates)
+      {
+         static const int def[] = { 1000, 4000, 16000, 50000 };
+         memcpy(rates, def, sizeof(def));
+         nrates = sizeof(def) / sizeof(def[0]);
+      }
+      bQuiet = true;
+      return self_test();
+   }
+
+   if (optind + 2 != argc)
+      show_usage_and_exit(argv[0]);
+   {
+      struct sockaddr_in a = { AF_INET };
+      char* colon = strchr(argv[optind + 1], ':');
+      int ls;
+
+      if (!colon || !(*colon = 0, inet_aton(argv[optind + 1], &a.sin_addr)))
+         show_usage_and_exit(argv[0]);
+      a.sin_port = htons(atoi(colon + 1));
+      if (bUdp)
+      {
+         struct sockaddr_in l = { AF_INET, htons(atoi(argv[optind])), { htonl(INADDR_ANY) } };
+
+         if (((ls = socket(AF_INET, SOCK_DGRAM, 0)) < 0) || bind(ls, (struct sockaddr*) &l, sizeof(l)))
+         {
+            perror("bind");
+            exit(2);
+         }
+         udp_shim(ls, &a);
+      }
+      ls = listen_on(atoi(argv[optind]), NULL);
+      for (;;)
+      {
+         int down = accept(ls, NULL, NULL), up;
+
+         if (down < 0)
+            continue;
+         fprintf(stderr, "impair: viewer connected, connecting to the PI\n");
+         up = connect_to(&a, rcvbuf);
+         shim(up, down);
+         fprintf(stderr, "impair: connection closed\n");
+         close(up);
+         close(down);
+      }
+   }
+   return 0;
+}
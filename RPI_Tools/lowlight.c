@@ -0,0 +1,231 @@
+/*
+ * Replays exposure traces (raspivid -lowlight ... -lltrace file.csv) through the
+ * low-light policy of common/lowlight.h and prints when it would switch.
+ *
+ * gcc -O2 -o lowlight lowlight.c -lm
+ * lowlight dusk.csv                      switches with the settings in the trace header
+ * lowlight -f 25 -n 5 -s 2 dusk.csv      other day/night frame rates, night mode sensitivity
+ * lowlight -t                            self test: a synthetic dusk, night with a passing
+ *                                        headlight and dawn, exactly one switch each way
+ *
+ * A trace is what the camera did with the switches raspivid made while
+ * recording ("#night"/"#day" lines), a replay with other settings only shows
+ * where the policy would have decided differently on the same light.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+
+#include "../common/lowlight.h"
+
+static void
+show_usage_and_exit (const char* name)
+{
+   fprintf(stderr, "Usage: %s [-f day_fps] [-n night_fps] [-m day_mode,night_mode] [-s night_sens] [-v] trace.csv\n"
+           "       %s -t [-v]\n", name, name);
+   exit(1);
+}
+
+static const char*
+action_name (LL_ACTION a)
+{
+   return (LL_TO_NIGHT == a) ? "night" : "day";
+}
+
+static int
+replay (const char* path, LL_CONFIG* cfg, bool bOverride[3], bool bVerbose)
+{
+   FILE* fp = fopen(path, "r");
+   char line[512];
+   int64_t t0 = 0, last = 0;
+   LL_STATE st;
+   int switches = 0;
+
+   if (!fp)
+   {
+      perror(path);
+      return 2;
+   }
+   lowlight_reset(&st);
+   while (fgets(line, sizeof(line), fp))
+   {
+      long long t, exposure, interval;
+      float analog, digital;
+      LL_SAMPLE s;
+      LL_ACTION a;
+      char* p;
+
+      if ('#' == line[0])
+      {
+         //the header has the settings of the recording, the options win
+         if ((p = strstr(line, "day_mode=")) && !bOverride[2])
+            cfg->day_mode = atoi(p + 9);
+         if ((p = strstr(line, "night_mode=")) && !bOverride[2])
+            cfg->night_mode = atoi(p + 11);
+         if ((p = strstr(line, "day_fps=")) && !bOverride[0])
+            cfg->day_fps = atoi(p + 8);
+         if ((p = strstr(line, "night_fps=")) && !bOverride[1])
+            cfg->night_fps = atoi(p + 10);
+         if (!strncmp(line, "#night", 6) || !strncmp(line, "#day", 4))
+            printf("%8.1f s  recorded switch to %s", t0 ? (last - t0) / 1e6 : 0.0, line + 1);
+         continue;
+      }
+      if (sscanf(line, "%lld,%lld,%f,%f,%lld", &t, &exposure, &analog, &digital, &interval) != 5)
+         continue;
+      if (!t0)
+         t0 = t;
+      last = t;
+      if (cfg->day_fps <= 0)
+      {
+         fprintf(stderr, "%s: no day_fps in the trace, use -f\n", path);
+         fclose(fp);
+         return 1;
+      }
+      s.exposure_us = exposure;
+      s.gain = analog * digital;
+      s.frame_interval_us = interval;
+      a = lowlight_step(cfg, &st, t, &s);
+      if (bVerbose)
+         printf("%8.1f s  exposure %6lld us gain %5.2f %5.2f fps%s\n", (t - t0) / 1e6, exposure, s.gain, st.fps,
+                st.since_us ? " *" : "");
+      if (LL_NONE != a)
+      {
+         printf("%8.1f s  switch to %s (exposure %lld us, gain %.2f)\n", (t - t0) / 1e6, action_name(a), exposure, s.gain);
+         switches++;
+      }
+   }
+   fclose(fp);
+   printf("%d switches\n", switches);
+   return 0;
+}
+
+/*
+ * A camera that runs its AE on a scene needing `need` us * gain at the day
+ * frame rate: exposure up to the frame period, then gain up to 16. At night the
+ * frame period may stretch to 1/night_fps and the binned mode needs night_sens
+ * times less.
+ */
+static void
+sim_camera (const LL_CONFIG* cfg, bool bNight, double need, LL_SAMPLE* s)
+{
+   double period = 1e6 / cfg->day_fps, max_exp = 0.95 * period;
+
+   if (bNight)
+   {
+      need /= cfg->night_sens;
+      max_exp = 0.95 * 1e6 / cfg->night_fps;
+   }
+   s->exposure_us = (int64_t)((need < max_exp) ? need : max_exp);
+   if (s->exposure_us < 10)
+      s->exposure_us = 10;
+   s->gain = (float)(need / s->exposure_us);
+   if (s->gain < 1)
+      s->gain = 1;
+   if (s->gain > 16)
+      s->gain = 16;
+   s->frame_interval_us = (int64_t)((s->exposure_us > period) ? s->exposure_us / 0.95 : period);
+}
+
+static int
+self_test (bool bVerbose)
+{
+   const int64_t tick = LL_TICK_US, minute = 60000000;
+   LL_CONFIG cfg;
+   LL_STATE st;
+   int64_t t;
+   int to_night = 0, to_day = 0, bad = 0;
+   unsigned seed = 1;
+
+   lowlight_default(&cfg, 1, 30, 4, 5);
+   cfg.night_sens = 2;
+   lowlight_reset(&st);
+   //10 min dusk, 10 min night with a headlight passing, 10 min dawn
+   for (t = tick; t < 30 * minute; t += tick)
+   {
+      double light, noise;
+      LL_SAMPLE s;
+      LL_ACTION a;
+
+      if (t < 10 * minute)
+         light = pow(1000.0, 1.0 - (double) t / (10 * minute));
+      else if (t < 20 * minute)
+         light = ((t > 15 * minute) && (t < 15 * minute + 2000000)) ? 50 : 1;
+      else
+         light = pow(1000.0, (double)(t - 20 * minute) / (10 * minute));
+      seed = seed * 1103515245 + 12345;
+      noise = 0.85 + 0.3 * ((seed >> 16) & 0x7fff) / 32767.0;
+      sim_camera(&cfg, st.bNight, 2e6 / light * noise, &s);
+      a = lowlight_step(&cfg, &st, t, &s);
+      if (bVerbose || (LL_NONE != a))
+         printf("%7.1f s  light %7.2f exposure %6lld us gain %5.2f fps %5.2f%s%s\n", t / 1e6, light, (long long) s.exposure_us,
+                s.gain, st.fps, (LL_NONE != a) ? "  switch to " : "", (LL_NONE != a) ? action_name(a) : "");
+      if (LL_TO_NIGHT == a)
+      {
+         to_night++;
+         if ((t < 5 * minute) || (t > 10 * minute))
+            bad++;
+      }
+      else if (LL_TO_DAY == a)
+      {
+         to_day++;
+         if (t < 20 * minute)
+            bad++;
+      }
+   }
+   printf("%d to night, %d to day\n", to_night, to_day);
+   if ((1 != to_night) || (1 != to_day) || bad || st.bNight)
+   {
+      printf("FAILED\n");
+      return 3;
+   }
+   printf("OK\n");
+   return 0;
+}
+
+int
+main (int argc, char** argv)
+{
+   bool bTest = false, bVerbose = false, bOverride[3] = { false };
+   LL_CONFIG cfg;
+   int c;
+
+   lowlight_default(&cfg, 0, 0, 0, 0);
+   while ((c = getopt(argc, argv, "tvf:n:m:s:")) != -1)
+   {
+      switch (c)
+      {
+         case 't':
+            bTest = true;
+            break;
+         case 'v':
+            bVerbose = true;
+            break;
+         case 'f':
+            cfg.day_fps = atoi(optarg);
+            bOverride[0] = true;
+            break;
+         case 'n':
+            cfg.night_fps = atoi(optarg);
+            bOverride[1] = true;
+            break;
+         case 'm':
+            if (sscanf(optarg, "%d,%d", &cfg.day_mode, &cfg.night_mode) != 2)
+               show_usage_and_exit(argv[0]);
+            bOverride[2] = true;
+            break;
+         case 's':
+            if ((cfg.night_sens = atof(optarg)) <= 0)
+               show_usage_and_exit(argv[0]);
+            break;
+         default:
+            show_usage_and_exit(argv[0]);
+      }
+   }
+   if (bTest)
+      return (optind == argc) ? self_test(bVerbose) : (show_usage_and_exit(argv[0]), 1);
+   if (optind + 1 != argc)
+      show_usage_and_exit(argv[0]);
+   return replay(argv[optind], &cfg, bOverride, bVerbose);
+}
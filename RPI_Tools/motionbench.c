@@ -0,0 +1,369 @@
+/*
+ * Streams per core of the motion analysis (common/motion.h) on the thread pool
+ * of common/work_pool.h, with synthetic motion vector fields.
+ *
+ * gcc -O2 -pthread -o motionbench motionbench.c -lm
+ * motionbench [-n streams] [-s WxH] [-r fps] [-d sec] [-w workers] [-p] [-t]
+ *    -n   streams, default 32
+ *    -s   video size, default 1280x720
+ *    -r   frame rate of a stream for the streams per core, default 30
+ *    -d   seconds per run, default 2
+ *    -w   only this many workers, default 1, 2, 4 .. CPUs
+ *    -p   pin worker i to CPU i
+ *    -t   self test: the pool gives the results of a single thread, in order
+ *
+ * Every stream has 16 fields made up front: noise of up to 2 pixels per
+ * macroblock and two objects moving across at their own speed. The main
+ * thread submits frames of all streams as fast as the pool takes them and
+ * collects the results, a stream's frame is reused once its result is back.
+ */
+#ifndef _GNU_SOURCE
+   #define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "../common/motion.h"
+#include "../common/work_pool.h"
+
+#define FIELDS      16
+#define MAX_STREAMS 1024
+
+typedef struct
+{
+   int stream;
+   uint64_t seq;
+   MOTION_RESULT r;
+} BENCH_RESULT;
+
+typedef struct
+{
+   MOTION_STATE m;
+   MOTION_VECTOR* field[FIELDS];
+   uint64_t seq;                       /// next frame to submit
+   uint64_t done;                      /// results back
+   uint64_t in_flight;
+   uint64_t job_seq[WP_STREAM_JOBS];   /// frame number of each queued job, the job is a pointer into it
+   uint64_t order_errors;
+} BENCH_STREAM;
+
+static unsigned mbx = 80, mby = 45;
+static BENCH_STREAM* streams;
+
+static double
+now_sec (void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t
+xorshift (uint32_t* x)
+{
+   *x ^= *x << 13;
+   *x ^= *x >> 17;
+   *x ^= *x << 5;
+   return *x;
+}
+
+/* noise and two rectangles moving by their speed per frame, wrapping around */
+static void
+make_field (MOTION_VECTOR* f, int stream, int frame)
+{
+   uint32_t rnd = 2463534242u ^ (stream * 7919 + frame * 104729 + 1);
+   int k, x, j;
+
+   for (j = 0; j < (int) mby; j++)
+   {
+      for (x = 0; x <= (int) mbx; x++)
+      {
+         MOTION_VECTOR* v = &f[j * (mbx + 1) + x];
+         v->x_vector = (int)(xorshift(&rnd) % 5) - 2;
+         v->y_vector = (int)(xorshift(&rnd) % 5) - 2;
+         v->sad = xorshift(&rnd) & 0x3ff;
+      }
+   }
+   for (k = 0; k < 2; k++)
+   {
+      int w = mbx / (6 + 4 * k), h = mby / (5 + 3 * k);
+      int speed = 1 + k + stream % 3;
+      int x0 = (stream * 13 + k * mbx / 2 + frame * speed) % mbx;
+      int y0 = (stream * 5 + k * mby / 3) % (mby - h);
+
+      for (j = y0; j < y0 + h; j++)
+      {
+         for (x = x0; (x < x0 + w) && (x < (int) mbx); x++)
+         {
+            MOTION_VECTOR* v = &f[j * (mbx + 1) + x];
+            v->x_vector = -4 * speed;
+            v->y_vector = (int)(xorshift(&rnd) % 3) - 1;
+         }
+      }
+   }
+}
+
+static void
+analyze (WP_STREAM* s, void* job, void* result)
+{
+   BENCH_STREAM* bs = s->ctx;
+   BENCH_RESULT* res = result;
+
+   res->stream = s->id;
+   res->seq = *(uint64_t*) job;
+   motion_analyze(&bs->m, bs->field[res->seq % FIELDS], &res->r);
+}
+
+static void
+init_streams (int n, int level)
+{
+   MOTION_CONFIG cfg = { mbx, mby, level, 4 };
+   int i;
+
+   for (i = 0; i < n; i++)
+   {
+      BENCH_STREAM* bs = &streams[i];
+      bs->seq = bs->done = bs->in_flight = bs->order_errors = 0;
+      motion_init(&bs->m, &cfg);
+   }
+}
+
+static void
+collect (WP_POOL* pool, BENCH_RESULT* res, uint64_t* n)
+{
+   while (wp_result(pool, res))
+   {
+      BENCH_STREAM* bs = &streams[res->stream];
+
+      if (res->seq != bs->done)
+         bs->order_errors++;
+      bs->done = res->seq + 1;
+      bs->in_flight--;
+      (*n)++;
+   }
+}
+
+/* frames per second of n streams on workers threads */
+static double
+bench (int n, int workers, double seconds, bool bPin, uint64_t* steals, uint64_t* errors)
+{
+   WP_POOL* pool = wp_create(workers, n, analyze, sizeof(BENCH_RESULT), 4096, bPin);
+   BENCH_RESULT res;
+   uint64_t frames = 0;
+   double t0, t;
+   int i;
+
+   if (!pool)
+   {
+      fprintf(stderr, "wp_create failed\n");
+      exit(1);
+   }
+   init_streams(n, 10);
+   for (i = 0; i < n; i++)
+      wp_add_stream(pool, &streams[i]);
+   t0 = now_sec();
+   do
+   {
+      for (i = 0; i < n; i++)
+      {
+         BENCH_STREAM* bs = &streams[i];
+
+         //keep 8 frames of every stream queued
+         while (bs->in_flight < 8)
+         {
+            uint64_t* job = &bs->job_seq[bs->seq % WP_STREAM_JOBS];
+            *job = bs->seq;
+            if (!wp_submit(&pool->streams[i], job))
+               break;
+            bs->seq++;
+            bs->in_flight++;
+         }
+      }
+      collect(pool, &res, &frames);
+      t = now_sec();
+   } while (t - t0 < seconds);
+
+   //the rest is not timed, it only has to come back
+   for (;;)
+   {
+      uint64_t left = 0;
+      for (i = 0; i < n; i++)
+         left += streams[i].in_flight;
+      if (!left)
+         break;
+      collect(pool, &res, &frames);
+   }
+   wp_stop(pool);
+   *steals = *errors = 0;
+   for (i = 0; i < workers; i++)
+      *steals += pool->w[i].steals;
+   for (i = 0; i < n; i++)
+      *errors += streams[i].order_errors;
+   wp_free(pool);
+   return frames / (t - t0);
+}
+
+/* the same frames through the pool and on this thread must give the same results */
+static int
+self_test (int n)
+{
+   const int frames = 200;
+   static BENCH_RESULT single[MAX_STREAMS][200];
+   WP_POOL* pool;
+   BENCH_RESULT res;
+   uint64_t got = 0, mismatches = 0, order = 0, tracked = 0, i;
+   int k, workers;
+   MOTION_VECTOR* f;
+   MOTION_STATE m;
+   MOTION_CONFIG cfg = { mbx, mby, 10, 4 };
+
+   init_streams(n, 10);
+   for (k = 0; k < n; k++)
+   {
+      for (i = 0; i < (uint64_t) frames; i++)
+      {
+         single[k][i].stream = k;
+         single[k][i].seq = i;
+         motion_analyze(&streams[k].m, streams[k].field[i % FIELDS], &single[k][i].r);
+         if (single[k][i].r.bTrack && (single[k][i].r.track_dx > 0.5))
+            tracked++;
+      }
+   }
+
+   //the old per-function results are what motion_analyze() has to agree with
+   motion_init(&m, &cfg);
+   for (k = 0; k < FIELDS; k++)
+   {
+      MOTION_RESULT r;
+      f = streams[0].field[k];
+      motion_analyze(&m, f, &r);
+      if ((r.strength != motion_strength(f, mbx, mby)) || (r.zones != motion_zones(f, mbx, mby, 10)))
+         mismatches++;
+   }
+
+   for (workers = 1; workers <= 8; workers *= 2)
+   {
+      pool = wp_create(workers, n, analyze, sizeof(BENCH_RESULT), 64, false);
+      init_streams(n, 10);
+      for (k = 0; k < n; k++)
+         wp_add_stream(pool, &streams[k]);
+      got = 0;
+      while (got < (uint64_t) n * frames)
+      {
+         for (k = 0; k < n; k++)
+         {
+            BENCH_STREAM* bs = &streams[k];
+            while ((bs->seq < (uint64_t) frames) && (bs->in_flight < WP_STREAM_JOBS))
+            {
+               uint64_t* job = &bs->job_seq[bs->seq % WP_STREAM_JOBS];
+               *job = bs->seq;
+               if (!wp_submit(&pool->streams[k], job))
+                  break;
+               bs->seq++;
+               bs->in_flight++;
+            }
+         }
+         while (wp_result(pool, &res))
+         {
+            BENCH_STREAM* bs = &streams[res.stream];
+            MOTION_RESULT* r = &single[res.stream][res.seq].r;
+
+            if (res.seq != bs->done)
+               order++;
+            bs->done = res.seq + 1;
+            bs->in_flight--;
+            got++;
+            if ((r->strength != res.r.strength) || (r->zones != res.r.zones) || (r->active != res.r.active) ||
+                (r->hot != res.r.hot) || (r->n_blobs != res.r.n_blobs) || (r->bTrack != res.r.bTrack) ||
+                (r->n_blobs && memcmp(&r->blob[0], &res.r.blob[0], sizeof(r->blob[0]))))
+               mismatches++;
+         }
+      }
+      wp_stop(pool);
+      printf("self test %d workers: %llu results, %llu mismatches, %llu out of order\n", workers,
+             (unsigned long long) got, (unsigned long long) mismatches, (unsigned long long) order);
+      wp_free(pool);
+   }
+   printf("self test tracker: %llu of %d frames follow the objects to the right\n",
+          (unsigned long long) tracked, n * frames);
+   return (mismatches || order || (tracked < (uint64_t) n * frames / 2)) ? 1 : 0;
+}
+
+int
+main (int argc, char** argv)
+{
+   int n = 32, fps = 30, only = 0, cpus = sysconf(_SC_NPROCESSORS_ONLN);
+   unsigned w = 1280, h = 720;
+   double seconds = 2;
+   bool bPin = false, bTest = false;
+   int opt, i, k;
+
+   while ((opt = getopt(argc, argv, "n:s:r:d:w:pt")) != -1)
+   {
+      switch (opt)
+      {
+         case 'n':
+            n = atoi(optarg);
+            break;
+         case 's':
+            sscanf(optarg, "%ux%u", &w, &h);
+            break;
+         case 'r':
+            fps = atoi(optarg);
+            break;
+         case 'd':
+            seconds = atof(optarg);
+            break;
+         case 'w':
+            only = atoi(optarg);
+            break;
+         case 'p':
+            bPin = true;
+            break;
+         case 't':
+            bTest = true;
+            break;
+         default:
+            fprintf(stderr, "Usage: %s [-n streams] [-s WxH] [-r fps] [-d sec] [-w workers] [-p] [-t]\n", argv[0]);
+            return 2;
+      }
+   }
+   mbx = (w + 15) / 16;
+   mby = (h + 15) / 16;
+   if ((n < 1) || (n > MAX_STREAMS) || (fps < 1) || (mbx * mby > MOTION_MAX_MB) || (mby < 4))
+   {
+      fprintf(stderr, "1..%d streams, fps > 0 and at most 1920x1088\n", MAX_STREAMS);
+      return 2;
+   }
+   if (cpus < 1)
+      cpus = 1;
+
+   streams = calloc(n, sizeof(streams[0]));
+   for (i = 0; i < n; i++)
+   {
+      for (k = 0; k < FIELDS; k++)
+      {
+         streams[i].field[k] = malloc((mbx + 1) * mby * sizeof(MOTION_VECTOR));
+         make_field(streams[i].field[k], i, k);
+      }
+   }
+   if (bTest)
+      return self_test(n);
+
+   printf("%d streams of %ux%u (%ux%u macroblocks), %d CPUs%s\n", n, w, h, mbx, mby, cpus, bPin ? ", pinned" : "");
+   printf("workers   frames/s   streams@%dfps   per core   steals   order errors\n", fps);
+   //1, 2, 4 .. and the number of CPUs
+   for (i = only ? only : 1; i; i = only ? 0 : (i == cpus) ? 0 : (i * 2 < cpus) ? i * 2 : cpus)
+   {
+      uint64_t steals, errors;
+      double rate = bench(n, i, seconds, bPin, &steals, &errors);
+
+      printf("%7d %10.0f %15.1f %10.1f %8llu %14llu\n", i, rate, rate / fps, rate / fps / ((i < cpus) ? i : cpus),
+             (unsigned long long) steals, (unsigned long long) errors);
+   }
+   return 0;
+}
@@ -0,0 +1,464 @@
+/*
+ * The multipath link of common/multipath.h without a car: sends a raw H.264
+ * capture like raspivid -o multipath://..., receives like video -M, and tests
+ * the scheduler through two impaired paths on loopback.
+ *
+ * gcc -O2 -pthread -o multipath multipath.c
+ * multipath -o 192.168.1.2:5000?via=wlan0&via=wwan0 [-r fps] [-v] capture.h264
+ * multipath -i 5000 [-R reorder_ms] [-v] > out.h264
+ * multipath -t
+ *
+ * On one machine, two veth pairs into a network namespace and impair -u on
+ * each path make a Wi-Fi and an LTE link (see README). -r sends the capture
+ * at its frame rate (default 30), -v prints the paths every 5 s. The self
+ * test relays both paths through threads with their own delay, loss and rate
+ * and takes one of them away for two seconds.
+ */
+#ifndef _GNU_SOURCE
+   #define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../common/h264_nal.h"
+#include "../common/multipath.h"
+
+/* the access unit from p: up to the first AUD, SEI, SPS or slice after a slice */
+static const uint8_t*
+next_unit (const uint8_t* p, const uint8_t* end, bool* bKey)
+{
+   const uint8_t* sc = h264_find_start_code(p, end);
+   bool bSlice = false;
+
+   *bKey = false;
+   while (sc + 3 < end)
+   {
+      int type = NAL_TYPE(sc[3]);
+
+      if (bSlice && ((type == NAL_TYPE_SLICE) || (type == NAL_TYPE_IDR) || (type == NAL_TYPE_SEI) ||
+                     (type == NAL_TYPE_SPS) || (type == NAL_TYPE_AUD)))
+         return ((sc > p) && !sc[-1]) ? sc - 1 : sc;
+      if ((type == NAL_TYPE_SLICE) || (type == NAL_TYPE_IDR))
+         bSlice = true;
+      if ((type == NAL_TYPE_IDR) || (type == NAL_TYPE_SPS) || (type == NAL_TYPE_PPS))
+         *bKey = true;
+      sc = h264_find_start_code(sc + 3, end);
+   }
+   return end;
+}
+
+static void
+sleep_until (struct timespec* t, long ns)
+{
+   t->tv_nsec += ns;
+   while (t->tv_nsec >= 1000000000)
+   {
+      t->tv_nsec -= 1000000000;
+      t->tv_sec++;
+   }
+   clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, t, NULL);
+}
+
+static int
+send_file (const char* url, const char* file, int fps, bool bVerbose)
+{
+   const uint8_t *p, *end;
+   struct timespec t;
+   struct stat st;
+   time_t last = time(NULL);
+   MP_TX tx;
+   int in;
+
+   if ((in = open(file, O_RDONLY)) < 0 || fstat(in, &st) || !st.st_size ||
+       (MAP_FAILED == (p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in, 0))))
+   {
+      perror(file);
+      return 1;
+   }
+   if (!mp_tx_open(&tx, url) || !mp_tx_start(&tx))
+      return 1;
+   end = p + st.st_size;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   while (p < end)
+   {
+      bool bKey;
+      const uint8_t* next = next_unit(p, end, &bKey);
+
+      mp_tx_send(&tx, p, next - p, bKey);
+      p = next;
+      if (fps)
+         sleep_until(&t, 1000000000L / fps);
+      if (bVerbose && (time(NULL) - last >= 5))
+      {
+         last = time(NULL);
+         mp_tx_print(stderr, &tx);
+      }
+   }
+   mp_tx_print(stderr, &tx);
+   mp_tx_stop(&tx);
+   return 0;
+}
+
+static int
+receive (unsigned short port, int reorder_ms, bool bVerbose)
+{
+   const uint8_t* data;
+   uint32_t len;
+   time_t last = time(NULL);
+   MP_RX rx;
+
+   if (!mp_rx_open(&rx, port, reorder_ms))
+   {
+      perror("multipath");
+      return 1;
+   }
+   while ((data = mp_rx_next(&rx, &len)))
+   {
+      if (len != fwrite(data, 1, len, stdout))
+         break;
+      fflush(stdout);
+      if (bVerbose && (time(NULL) - last >= 5))
+      {
+         last = time(NULL);
+         mp_rx_print(stderr, &rx);
+      }
+   }
+   mp_rx_print(stderr, &rx);
+   mp_rx_close(&rx);
+   return 0;
+}
+
+/******************************* self test *******************************/
+
+#define TEST_SECONDS 6
+#define TEST_GOP     15
+#define TEST_QUEUE   4096
+
+static uint32_t
+xorshift (uint32_t* x)
+{
+   *x ^= *x << 13;
+   *x ^= *x >> 17;
+   *x ^= *x << 5;
+   return *x;
+}
+
+typedef struct
+{
+   int64_t due_us;
+   uint16_t len;
+   uint8_t data[MP_HDR_LEN + MP_PAYLOAD];
+} TEST_PKT;
+
+typedef struct
+{
+   TEST_PKT* q;
+   unsigned head, tail;
+} TEST_QUEUE_T;
+
+/* one path: sender -> in_fd -> delay, loss, rate -> out_fd -> receiver, and back with the delay */
+typedef struct
+{
+   int in_fd, out_fd;
+   unsigned short port;
+   int delay_ms, loss_pct, kbps;
+   int64_t cut_from_us, cut_to_us;     /// nothing gets through in between, from the start
+   struct sockaddr_in sender;
+   bool bSender, bStop;
+   int64_t link_free_us;
+   TEST_QUEUE_T fwd, back;
+   uint64_t dropped;
+   pthread_t thread;
+} TEST_PATH;
+
+static int64_t test_start;
+
+static void
+test_enqueue (TEST_QUEUE_T* q, const uint8_t* data, size_t len, int64_t due)
+{
+   TEST_PKT* p;
+
+   if (q->tail - q->head >= TEST_QUEUE)
+      return;
+   p = &q->q[q->tail++ % TEST_QUEUE];
+   p->due_us = due;
+   p->len = len;
+   memcpy(p->data, data, len);
+}
+
+static void*
+test_path_thread (void* arg)
+{
+   TEST_PATH* tp = arg;
+   uint8_t buf[2048];
+   uint32_t rnd = 0x9e3779b9u ^ tp->port;
+
+   while (!tp->bStop)
+   {
+      struct pollfd pfd[2] = { { tp->in_fd, POLLIN }, { tp->out_fd, POLLIN } };
+      int64_t now;
+      ssize_t n;
+
+      poll(pfd, 2, 1);
+      now = mp_now_us();
+      if (pfd[0].revents)
+      {
+         socklen_t len = sizeof(tp->sender);
+
+         if ((n = recvfrom(tp->in_fd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr*) &tp->sender, &len)) > 0)
+         {
+            int64_t t = now - test_start, start = (tp->link_free_us > now) ? tp->link_free_us : now;
+
+            tp->bSender = true;
+            //a bottleneck with 200 ms of buffer, random loss and the outage
+            if ((start - now > 200000) || ((int)(xorshift(&rnd) % 100) < tp->loss_pct) ||
+                ((t >= tp->cut_from_us) && (t < tp->cut_to_us)))
+               tp->dropped++;
+            else
+            {
+               tp->link_free_us = start + n * 8000LL / tp->kbps;
+               test_enqueue(&tp->fwd, buf, n, tp->link_free_us + tp->delay_ms * 1000LL);
+            }
+         }
+      }
+      if (pfd[1].revents && ((n = recv(tp->out_fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0))
+      {
+         int64_t t = now - test_start;
+         if ((t < tp->cut_from_us) || (t >= tp->cut_to_us))
+            test_enqueue(&tp->back, buf, n, now + tp->delay_ms * 1000LL);
+      }
+      for (; (tp->fwd.head != tp->fwd.tail) && (tp->fwd.q[tp->fwd.head % TEST_QUEUE].due_us <= now); tp->fwd.head++)
+         send(tp->out_fd, tp->fwd.q[tp->fwd.head % TEST_QUEUE].data, tp->fwd.q[tp->fwd.head % TEST_QUEUE].len, MSG_DONTWAIT);
+      for (; (tp->back.head != tp->back.tail) && (tp->back.q[tp->back.head % TEST_QUEUE].due_us <= now); tp->back.head++)
+         if (tp->bSender)
+            sendto(tp->in_fd, tp->back.q[tp->back.head % TEST_QUEUE].data, tp->back.q[tp->back.head % TEST_QUEUE].len,
+                   MSG_DONTWAIT, (struct sockaddr*) &tp->sender, sizeof(tp->sender));
+   }
+   return NULL;
+}
+
+static bool
+test_path_start (TEST_PATH* tp, unsigned short rx_port)
+{
+   struct sockaddr_in a = { AF_INET, 0, { htonl(INADDR_LOOPBACK) } };
+   socklen_t len = sizeof(a);
+
+   tp->fwd.q = calloc(TEST_QUEUE, sizeof(TEST_PKT));
+   tp->back.q = calloc(TEST_QUEUE, sizeof(TEST_PKT));
+   tp->in_fd = socket(AF_INET, SOCK_DGRAM, 0);
+   tp->out_fd = socket(AF_INET, SOCK_DGRAM, 0);
+   if (!tp->fwd.q || !tp->back.q || (tp->in_fd < 0) || (tp->out_fd < 0) || bind(tp->in_fd, (struct sockaddr*) &a, len) ||
+       getsockname(tp->in_fd, (struct sockaddr*) &a, &len))
+      return false;
+   tp->port = ntohs(a.sin_port);
+   a.sin_port = htons(rx_port);
+   return !connect(tp->out_fd, (struct sockaddr*) &a, sizeof(a)) &&
+          !pthread_create(&tp->thread, NULL, test_path_thread, tp);
+}
+
+static void
+test_path_stop (TEST_PATH* tp)
+{
+   tp->bStop = true;
+   pthread_join(tp->thread, NULL);
+   close(tp->in_fd);
+   close(tp->out_fd);
+   free(tp->fwd.q);
+   free(tp->back.q);
+}
+
+/*
+ * Every mp_tx_send() of the test is one packet: counter, key, send time and
+ * bytes made from the counter, the receiver checks order and content.
+ */
+typedef struct
+{
+   MP_RX rx;
+   uint32_t expected, got, missing, corrupt, reordered, key_missing;
+   double latency_sum, latency_max;
+   bool bStop;
+} TEST_RCV;
+
+static void
+test_chunk (uint32_t n, bool bKey, uint8_t* out)
+{
+   uint32_t x = n * 2654435761u + 1, i;
+
+   mp_put32(out, n);
+   out[4] = bKey;
+   mp_put32(out + 5, (uint32_t) mp_now_us());
+   for (i = 9; i < MP_PAYLOAD; i++)
+      out[i] = xorshift(&x);
+}
+
+static void*
+test_receive_thread (void* arg)
+{
+   TEST_RCV* r = arg;
+   uint8_t ref[MP_PAYLOAD];
+   const uint8_t* data;
+   uint32_t len;
+
+   while (!r->bStop && (data = mp_rx_next(&r->rx, &len)))
+   {
+      uint32_t n = mp_get32(data), lat = (uint32_t) mp_now_us() - mp_get32(data + 5);
+
+      if (len != MP_PAYLOAD)
+      {
+         r->corrupt++;
+         continue;
+      }
+      //a key chunk is every chunk of every TEST_GOP-th frame, frames are 14 chunks
+      if (n < r->expected)
+         r->reordered++;
+      for (; r->expected < n; r->expected++)
+      {
+         r->missing++;
+         r->key_missing += !((r->expected / 14) % TEST_GOP);
+      }
+      r->expected = n + 1;
+      test_chunk(n, data[4], ref);
+      if (memcmp(data + 9, ref + 9, MP_PAYLOAD - 9) || (data[4] != !((n / 14) % TEST_GOP)))
+         r->corrupt++;
+      r->got++;
+      r->latency_sum += lat / 1000.0;
+      if (lat / 1000.0 > r->latency_max)
+         r->latency_max = lat / 1000.0;
+   }
+   return NULL;
+}
+
+/*
+ * A 30 fps stream of 14 chunks a frame (4 Mbit/s), every 15th frame key,
+ * over A and B, more than either of them takes.
+ */
+static bool
+test_run (const char* name, int kbps_a, int kbps_b, int loss_b, int64_t cut_a_from, int64_t cut_a_to, double max_missing)
+{
+   TEST_PATH a = { .delay_ms = 15, .loss_pct = 0, .kbps = kbps_a, .cut_from_us = cut_a_from, .cut_to_us = cut_a_to };
+   TEST_PATH b = { .delay_ms = 50, .loss_pct = loss_b, .kbps = kbps_b };
+   TEST_RCV rcv = { .expected = 0 };
+   struct sockaddr_in ra = { AF_INET };
+   socklen_t len = sizeof(ra);
+   pthread_t rt;
+   MP_TX tx;
+   char url[128];
+   struct timespec t;
+   uint32_t frame, chunk = 0;
+   bool bOK;
+
+   if (!mp_rx_open(&rcv.rx, 0, 0) || getsockname(rcv.rx.fd, (struct sockaddr*) &ra, &len) ||
+       !test_path_start(&a, ntohs(ra.sin_port)) || !test_path_start(&b, ntohs(ra.sin_port)))
+   {
+      perror("self test");
+      return false;
+   }
+   snprintf(url, sizeof(url), "127.0.0.1:%u?via=127.0.0.1@127.0.0.1:%u&via=127.0.0.1@127.0.0.1:%u", ntohs(ra.sin_port),
+            a.port, b.port);
+   if (!mp_tx_open(&tx, url) || !mp_tx_start(&tx))
+      return false;
+   pthread_create(&rt, NULL, test_receive_thread, &rcv);
+
+   test_start = mp_now_us();
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   for (frame = 0; frame < TEST_SECONDS * 30; frame++)
+   {
+      int k;
+      for (k = 0; k < 14; k++, chunk++)
+      {
+         uint8_t buf[MP_PAYLOAD];
+         test_chunk(chunk, !(frame % TEST_GOP), buf);
+         mp_tx_send(&tx, buf, sizeof(buf), !(frame % TEST_GOP));
+      }
+      sleep_until(&t, 1000000000L / 30);
+   }
+   usleep(500000);
+   rcv.bStop = true;
+   //one more packet to wake the receiver
+   {
+      uint8_t buf[MP_PAYLOAD];
+      test_chunk(chunk, !((chunk / 14) % TEST_GOP), buf);
+      mp_tx_send(&tx, buf, sizeof(buf), buf[4]);
+   }
+   pthread_join(rt, NULL);
+   printf("%s:\n", name);
+   mp_tx_print(stdout, &tx);
+   mp_rx_print(stdout, &rcv.rx);
+   printf("dropped on the way A %llu B %llu, chunks %u, got %u, missing %u (%u of key frames), corrupt %u, out of order %u, "
+          "latency %.1f ms avg %.1f ms max\n", (unsigned long long) a.dropped, (unsigned long long) b.dropped, chunk, rcv.got, rcv.missing, rcv.key_missing, rcv.corrupt, rcv.reordered,
+          rcv.got ? rcv.latency_sum / rcv.got : 0, rcv.latency_max);
+
+   bOK = !rcv.corrupt && !rcv.reordered && (rcv.missing <= max_missing * chunk) && (tx.path[0].packets > chunk / 10) &&
+         (tx.path[1].packets > chunk / 10);
+   //with loss only on B, the second copy on A carries every key chunk
+   if (cut_a_from == cut_a_to)
+      bOK = bOK && !rcv.key_missing && tx.path[0].dups + tx.path[1].dups;
+   mp_tx_stop(&tx);
+   test_path_stop(&a);
+   test_path_stop(&b);
+   mp_rx_close(&rcv.rx);
+   return bOK;
+}
+
+static int
+self_test (void)
+{
+   int bad = 0;
+
+   bad += !test_run("A 3 Mbit/s 15 ms, B 3 Mbit/s 50 ms", 3000, 3000, 0, 0, 0, 0.005);
+   bad += !test_run("A 3 Mbit/s 15 ms, B 3 Mbit/s 50 ms 3% loss", 3000, 3000, 3, 0, 0, 0.05);
+   bad += !test_run("A 5 Mbit/s 15 ms gone from 2 s to 4 s, B 5 Mbit/s 50 ms", 5000, 5000, 0, 2000000, 4000000, 0.05);
+   printf("self test %s\n", bad ? "FAILED" : "passed");
+   return bad ? 1 : 0;
+}
+
+int
+main (int argc, char** argv)
+{
+   const char* out = NULL;
+   bool bVerbose = false;
+   int fps = 30, port = 0, reorder = 0, opt;
+
+   while ((opt = getopt(argc, argv, "o:i:r:R:vt")) != -1)
+   {
+      switch (opt)
+      {
+         case 'o':
+            out = optarg;
+            break;
+         case 'i':
+            port = atoi(optarg);
+            break;
+         case 'r':
+            fps = atoi(optarg);
+            break;
+         case 'R':
+            reorder = atoi(optarg);
+            break;
+         case 'v':
+            bVerbose = true;
+            break;
+         case 't':
+            return self_test();
+         default:
+            out = NULL;
+            port = 0;
+            optind = argc + 1;
+            break;
+      }
+   }
+   if (out && (optind == argc - 1))
+      return send_file(out, argv[optind], fps, bVerbose);
+   if ((port > 0) && !out)
+      return receive(port, reorder, bVerbose);
+   fprintf(stderr, "Usage: %s -o ip:port?via=<if|ip>[@ip:port]&via=... [-r fps] [-v] capture.h264 | -i port [-R reorder_ms] [-v] | -t\n",
+           argv[0]);
+   return 2;
+}
@@ -0,0 +1,113 @@
+/*
+ * Just enough of OpenMAX IL and ilclient to compile RPI_Client/video.c on a box
+ * without VideoCore, for RPI_Tools/recvbench.c. The functions are defined by
+ * whoever includes video.c, nothing here talks to a decoder.
+ */
+#ifndef OMX_STUB_H
+#define OMX_STUB_H
+
+#include <stdint.h>
+
+typedef uint32_t OMX_U32;
+typedef uint8_t OMX_U8;
+typedef int32_t OMX_S32;
+typedef void* OMX_HANDLETYPE;
+typedef void* OMX_PTR;
+
+typedef enum
+{
+   OMX_ErrorNone = 0, OMX_ErrorInsufficientResources, OMX_ErrorUndefined, OMX_ErrorInvalidComponentName,
+   OMX_ErrorComponentNotFound, OMX_ErrorInvalidComponent, OMX_ErrorBadParameter, OMX_ErrorNotImplemented,
+   OMX_ErrorUnderflow, OMX_ErrorOverflow, OMX_ErrorHardware, OMX_ErrorInvalidState, OMX_ErrorStreamCorrupt,
+   OMX_ErrorPortsNotCompatible, OMX_ErrorResourcesLost, OMX_ErrorNoMore, OMX_ErrorVersionMismatch,
+   OMX_ErrorNotReady, OMX_ErrorTimeout, OMX_ErrorSameState, OMX_ErrorResourcesPreempted,
+   OMX_ErrorPortUnresponsiveDuringAllocation, OMX_ErrorPortUnresponsiveDuringDeallocation,
+   OMX_ErrorPortUnresponsiveDuringStop, OMX_ErrorIncorrectStateTransition, OMX_ErrorIncorrectStateOperation,
+   OMX_ErrorUnsupportedSetting, OMX_ErrorUnsupportedIndex, OMX_ErrorBadPortIndex, OMX_ErrorPortUnpopulated,
+   OMX_ErrorComponentSuspended, OMX_ErrorDynamicResourcesUnavailable, OMX_ErrorMbErrorsInFrame,
+   OMX_ErrorFormatNotDetected, OMX_ErrorContentPipeOpenFailed, OMX_ErrorContentPipeCreationFailed,
+   OMX_ErrorSeperateTablesUsed, OMX_ErrorTunnelingUnsupported
+} OMX_ERRORTYPE;
+
+typedef enum
+{
+   OMX_StateInvalid, OMX_StateLoaded, OMX_StateIdle, OMX_StateExecuting, OMX_StatePause, OMX_StateWaitForResources
+} OMX_STATETYPE;
+
+typedef enum { OMX_IndexParamVideoPortFormat, OMX_IndexParamPortDefinition } OMX_INDEXTYPE;
+typedef enum { OMX_CommandPortEnable } OMX_COMMANDTYPE;
+typedef enum { OMX_EventPortSettingsChanged, OMX_EventBufferFlag } OMX_EVENTTYPE;
+typedef enum { OMX_VIDEO_CodingAVC } OMX_VIDEO_CODINGTYPE;
+typedef union { OMX_U32 nVersion; } OMX_VERSIONTYPE;
+
+#define OMX_VERSION 0
+#define OMX_BUFFERFLAG_EOS 1
+#define OMX_BUFFERFLAG_ENDOFFRAME 0x10
+
+typedef struct
+{
+   OMX_U32 nSize;
+   OMX_VERSIONTYPE nVersion;
+   OMX_U8* pBuffer;
+   OMX_U32 nAllocLen, nFilledLen, nOffset;
+   OMX_PTR pAppPrivate;
+   OMX_U32 nFlags;
+} OMX_BUFFERHEADERTYPE;
+
+typedef struct
+{
+   OMX_U32 nSize;
+   OMX_VERSIONTYPE nVersion;
+   OMX_U32 nPortIndex;
+   OMX_U32 nIndex;
+   OMX_VIDEO_CODINGTYPE eCompressionFormat;
+} OMX_VIDEO_PARAM_PORTFORMATTYPE;
+
+typedef struct
+{
+   OMX_U32 nSize;
+   OMX_VERSIONTYPE nVersion;
+   OMX_U32 nPortIndex;
+   OMX_U32 nBufferCountActual, nBufferCountMin, nBufferSize;
+} OMX_PARAM_PORTDEFINITIONTYPE;
+
+OMX_ERRORTYPE OMX_Init (void);
+OMX_ERRORTYPE OMX_GetState (OMX_HANDLETYPE, OMX_STATETYPE*);
+OMX_ERRORTYPE OMX_SetParameter (OMX_HANDLETYPE, OMX_INDEXTYPE, OMX_PTR);
+OMX_ERRORTYPE OMX_GetParameter (OMX_HANDLETYPE, OMX_INDEXTYPE, OMX_PTR);
+OMX_ERRORTYPE OMX_EmptyThisBuffer (OMX_HANDLETYPE, OMX_BUFFERHEADERTYPE*);
+OMX_ERRORTYPE OMX_SetupTunnel (OMX_HANDLETYPE, OMX_U32, OMX_HANDLETYPE, OMX_U32);
+OMX_ERRORTYPE OMX_SendCommand (OMX_HANDLETYPE, OMX_COMMANDTYPE, OMX_U32, OMX_PTR);
+
+//ilclient
+typedef struct ILCLIENT_T ILCLIENT_T;
+typedef struct COMPONENT_T COMPONENT_T;
+typedef void (*ILCLIENT_CALLBACK_T)(void*, COMPONENT_T*, OMX_U32);
+typedef void (*ILCLIENT_BUFFER_CALLBACK_T)(void*, COMPONENT_T*);
+
+#define ILCLIENT_DISABLE_ALL_PORTS     1
+#define ILCLIENT_ENABLE_INPUT_BUFFERS  2
+#define ILCLIENT_ENABLE_OUTPUT_BUFFERS 4
+#define ILCLIENT_EVENT_ERROR           8
+#define ILCLIENT_PARAMETER_CHANGED     16
+#define ILCLIENT_BUFFER_FLAG_EOS       32
+
+ILCLIENT_T* ilclient_init (void);
+void ilclient_destroy (ILCLIENT_T*);
+OMX_HANDLETYPE ilclient_get_handle (COMPONENT_T*);
+int ilclient_create_component (ILCLIENT_T*, COMPONENT_T**, char*, int);
+int ilclient_change_component_state (COMPONENT_T*, OMX_STATETYPE);
+void ilclient_set_error_callback (ILCLIENT_T*, ILCLIENT_CALLBACK_T, void*);
+void ilclient_set_eos_callback (ILCLIENT_T*, ILCLIENT_CALLBACK_T, void*);
+void ilclient_set_empty_buffer_done_callback (ILCLIENT_T*, ILCLIENT_BUFFER_CALLBACK_T, void*);
+int ilclient_enable_port_buffers (COMPONENT_T*, int, void*, void*, void*);
+void ilclient_disable_port_buffers (COMPONENT_T*, int, void*, void*, void*);
+void ilclient_enable_port (COMPONENT_T*, int);
+void ilclient_disable_port (COMPONENT_T*, int);
+OMX_BUFFERHEADERTYPE* ilclient_get_input_buffer (COMPONENT_T*, int, int);
+int ilclient_remove_event (COMPONENT_T*, OMX_EVENTTYPE, OMX_U32, int, OMX_U32, int);
+int ilclient_wait_for_event (COMPONENT_T*, OMX_EVENTTYPE, OMX_U32, int, OMX_U32, int, int, int);
+
+void bcm_host_init (void);
+
+#endif
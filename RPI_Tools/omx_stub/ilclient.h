@@ -0,0 +1,2 @@
+/* see OMX_Core.h */
+#include "OMX_Core.h"
@@ -0,0 +1,417 @@
+/*
+ * Verifies recordings of the relay (relay -H / -K) against their hash chain,
+ * common/rec_hash.h. One sequential pass over every segment, nothing is parsed.
+ *
+ * gcc -O2 -o rechash rechash.c
+ * rechash [-k seal_key] [-v] /srv/rec/front-*.h264     segments of one stream in order
+ * rechash -t                                           self test
+ *
+ * Reports GOPs whose link does not match, bytes no GOP covers, a chain that
+ * does not continue from the segment given before, and with -k seals that do
+ * not match or a tail after the last seal. A segment still being recorded
+ * ends with an uncovered GOP, that is only a warning. The exit code is 1 if
+ * anything did not match.
+ */
+#ifndef _GNU_SOURCE
+   #define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <time.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../common/rec_hash.h"
+#include "../common/aead.h"
+
+#define READ_CHUNK (1024 * 1024)
+
+static uint8_t buf[READ_CHUNK];
+
+typedef struct
+{
+   uint64_t bytes;                      /// read from segments
+   int gops, seals;
+   int bad;                             /// mismatches
+} STATS;
+
+static void
+show_usage_and_exit (const char* name)
+{
+   fprintf(stderr, "Usage: %s [-k seal_key] [-v] segment.h264 [segment.h264 ...]\n"
+           "       %s -t [-v]\n", name, name);
+   exit(2);
+}
+
+static double
+now_sec (void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+print_hex (const char* what, const uint8_t* p)
+{
+   int i;
+   printf("%s", what);
+   for (i = 0; i < 32; i++)
+      printf("%02x", p[i]);
+   printf("\n");
+}
+
+/* hashes len bytes from fd into h (NULL: skips them), false if the file ends before */
+static bool
+hash_bytes (int fd, BLAKE3* h, uint64_t len, STATS* s)
+{
+   while (len)
+   {
+      ssize_t n = read(fd, buf, (len > READ_CHUNK) ? READ_CHUNK : len);
+      if (n <= 0)
+         return false;
+      if (h)
+         blake3_update(h, buf, n);
+      s->bytes += n;
+      len -= n;
+   }
+   return true;
+}
+
+/*
+ * One segment, link: where the chain stands before it (NULL for the first one
+ * given) and after it. prev_name: the segment before it.
+ */
+static void
+verify_segment (const char* path, uint8_t link[32], bool bFirst, const char* prev_name, const uint8_t* key, bool bVerbose, STATS* s)
+{
+   char hsh[4096];
+   REC_HASH_HEADER hdr;
+   REC_HASH_RECORD rec;
+   uint64_t pos = 0, size, sealed = 0;
+   int gops = 0, seals = 0, bad = 0;
+   FILE* fp;
+   int fd;
+
+   snprintf(hsh, sizeof(hsh), "%s", path);
+   if ((strlen(hsh) < 5) || strcmp(hsh + strlen(hsh) - 5, ".h264"))
+   {
+      printf("%s: not a .h264 segment\n", path);
+      s->bad++;
+      return;
+   }
+   strcpy(hsh + strlen(hsh) - 5, ".hsh");
+   if ((fd = open(path, O_RDONLY)) < 0)
+   {
+      perror(path);
+      s->bad++;
+      return;
+   }
+   posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+   size = lseek(fd, 0, SEEK_END);
+   lseek(fd, 0, SEEK_SET);
+   if ((NULL == (fp = fopen(hsh, "rb"))) || (1 != fread(&hdr, sizeof(hdr), 1, fp)) || memcmp(hdr.magic, REC_HASH_MAGIC, sizeof(hdr.magic)))
+   {
+      printf("%s: no hash file %s\n", path, hsh);
+      if (fp)
+         fclose(fp);
+      close(fd);
+      s->bad++;
+      return;
+   }
+   hdr.prev_name[sizeof(hdr.prev_name) - 1] = 0;
+   if (bFirst)
+   {
+      memcpy(link, hdr.prev, 32);
+      if (bVerbose)
+         printf("%s: chain starts %s%s\n", path, hdr.prev_name[0] ? "after " : "here", hdr.prev_name);
+   }
+   else if (memcmp(link, hdr.prev, 32))
+   {
+      printf("%s: chain broken, does not continue from %s but from '%s'\n", path, prev_name, hdr.prev_name);
+      memcpy(link, hdr.prev, 32);
+      bad++;
+   }
+
+   while (1 == fread(&rec, sizeof(rec), 1, fp))
+   {
+      if (REC_HASH_GOP == rec.type)
+      {
+         uint8_t digest[32], expect[32];
+         BLAKE3 h;
+
+         if (rec.offset < pos)
+         {
+            printf("%s: GOP at %llu overlaps the one before\n", path, (unsigned long long) rec.offset);
+            bad++;
+            break;
+         }
+         if (rec.offset > pos)
+         {
+            printf("%s: %llu bytes at %llu not covered\n", path, (unsigned long long)(rec.offset - pos), (unsigned long long) pos);
+            bad++;
+            hash_bytes(fd, NULL, rec.offset - pos, s);
+         }
+         blake3_init(&h);
+         if (!hash_bytes(fd, &h, rec.len, s))
+         {
+            printf("%s: ends inside the GOP at %llu, truncated\n", path, (unsigned long long) rec.offset);
+            pos = size;
+            bad++;
+            break;
+         }
+         pos = rec.offset + rec.len;
+         blake3_final(&h, digest);
+         rec_hash_link(link, rec.offset, rec.len, rec.time_us, digest, expect);
+         if (memcmp(expect, rec.hash, 32))
+         {
+            printf("%s: GOP at %llu (%llu bytes) does not match\n", path, (unsigned long long) rec.offset, (unsigned long long) rec.len);
+            bad++;
+         }
+         else if (bVerbose)
+            printf("%s: GOP at %llu, %llu bytes ok\n", path, (unsigned long long) rec.offset, (unsigned long long) rec.len);
+         //the recorded link, one bad GOP must not make all after it fail too
+         memcpy(link, rec.hash, 32);
+         gops++;
+      }
+      else if (REC_HASH_SEAL == rec.type)
+      {
+         uint8_t expect[32];
+
+         seals++;
+         if (!key)
+            continue;
+         rec_hash_seal(key, link, rec.offset, rec.time_us, expect);
+         if (memcmp(expect, rec.hash, 32) || (rec.offset != pos))
+         {
+            printf("%s: seal at %llu does not match\n", path, (unsigned long long) rec.offset);
+            bad++;
+         }
+         else
+            sealed = pos;
+      }
+   }
+   fclose(fp);
+   close(fd);
+
+   if (size > pos)
+      printf("%s: warning, the last %llu bytes are not covered (still recording?)\n", path, (unsigned long long)(size - pos));
+   if (key && (sealed < pos))
+      printf("%s: warning, %llu bytes after the last seal are not sealed\n", path, (unsigned long long)(pos - sealed));
+   printf("%s: %d GOPs, %d seals%s, %s\n", path, gops, seals, key ? "" : " (not checked, no key)", bad ? "FAILED" : "ok");
+   s->gops += gops;
+   s->seals += seals;
+   s->bad += bad;
+}
+
+static int
+verify (int n, char** paths, const uint8_t* key, bool bVerbose, bool bQuiet)
+{
+   uint8_t link[32];
+   STATS s = { 0, 0, 0, 0 };
+   double t0 = now_sec(), t;
+   int i;
+
+   for (i = 0; i < n; i++)
+      verify_segment(paths[i], link, !i, i ? paths[i - 1] : NULL, key, bVerbose, &s);
+   t = now_sec() - t0;
+   if (bVerbose)
+      print_hex("last link ", link);
+   if (!bQuiet)
+      printf("%d segments, %d GOPs, %d seals, %.1f MB in %.2f s, %.0f MB/s: %s\n", n, s.gops, s.seals, s.bytes / 1e6, t,
+             t ? s.bytes / 1e6 / t : 0.0, s.bad ? "FAILED" : "ok");
+   return s.bad ? 1 : 0;
+}
+
+/*************************************** self test ***************************************/
+
+static bool
+check_hex (const char* what, const uint8_t* p, const char* hex)
+{
+   uint8_t want[32];
+
+   aead_from_hex(hex, want, 32);
+   if (!memcmp(p, want, 32))
+      return true;
+   printf("%s: wrong BLAKE3\n", what);
+   return false;
+}
+
+/* what the relay does: GOPs of random sizes, a seal every 4th GOP and at the end of a segment */
+static void
+write_segment (const char* path, REC_HASH* h, const char* prev_name, const uint8_t key[32], unsigned* seed)
+{
+   char hsh[512];
+   REC_HASH_RECORD rec;
+   FILE* fp = fopen(path, "wb"), *hfp;
+   uint64_t offset = 0;
+   int g, i;
+
+   snprintf(hsh, sizeof(hsh), "%s", path);
+   strcpy(hsh + strlen(hsh) - 5, ".hsh");
+   hfp = fopen(hsh, "wb");
+   if (!fp || !hfp)
+      exit(2);
+   rec_hash_write_header(hfp, h->link, prev_name);
+   for (g = 0; g < 10; g++)
+   {
+      rec_hash_begin(h, offset, 1700000000000000LL + g * 1000000);
+      for (i = 0; i < 30; i++)
+      {
+         size_t len, k;
+
+         *seed = *seed * 1103515245 + 12345;
+         len = 100 + (*seed >> 8) % 20000;
+         for (k = 0; k < len; k++)
+            buf[k] = (uint8_t)(*seed >> (k & 15));
+         fwrite(buf, 1, len, fp);
+         rec_hash_update(h, buf, len);
+         offset += len;
+      }
+      rec_hash_end(h, &rec);
+      rec_hash_append(hfp, &rec);
+      if ((3 == g % 4) || (9 == g))
+      {
+         rec.type = REC_HASH_SEAL;
+         rec.offset += rec.len;
+         rec.len = 0;
+         rec_hash_seal(key, h->link, rec.offset, rec.time_us, rec.hash);
+         rec_hash_append(hfp, &rec);
+      }
+   }
+   fclose(fp);
+   fclose(hfp);
+}
+
+static bool
+expect (const char* what, int n, char** paths, const uint8_t* key, bool bVerbose, int want)
+{
+   int got;
+
+   if (bVerbose)
+      printf("--- %s\n", what);
+   got = verify(n, paths, key, bVerbose, !bVerbose);
+   if (got == want)
+      return true;
+   printf("%s: %s, expected %s\n", what, got ? "FAILED" : "ok", want ? "FAILED" : "ok");
+   return false;
+}
+
+static int
+self_test (bool bVerbose)
+{
+   char names[3][64], dir[] = "/tmp/rechash-XXXXXX", *paths[3];
+   uint8_t key[32], other[32], out[32];
+   REC_HASH h;
+   unsigned seed = 1;
+   bool bOk = true;
+   FILE* fp;
+   int i;
+
+   //known answers, the last two go through the 4 lane path
+   for (i = 0; i < 32; i++)
+   {
+      key[i] = i;
+      other[i] = i + 1;
+   }
+   for (i = 0; i < 100000; i++)
+      buf[i] = i % 251;
+   blake3(buf, 0, out);
+   bOk &= check_hex("empty", out, "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262");
+   blake3(buf, 100000, out);
+   bOk &= check_hex("100000 bytes", out, "d93c23eedaf165a7e0be908ba86f1a7a520d568d2d13cde787c8580c5c72cc54");
+   {
+      BLAKE3 b;
+      blake3_init_keyed(&b, key);
+      for (i = 0; i < 100000; i += 777)
+         blake3_update(&b, buf + i, (100000 - i < 777) ? 100000 - i : 777);
+      blake3_final(&b, out);
+      bOk &= check_hex("keyed, 100000 bytes in pieces", out, "4389bac55bc43c5254f0010c83a2a134dd19c22c3602e3654e3fad46af5edbaf");
+   }
+
+   if (!mkdtemp(dir))
+      return 2;
+   rec_hash_init(&h, NULL);
+   for (i = 0; i < 3; i++)
+   {
+      snprintf(names[i], sizeof(names[i]), "%s/t-2024010%d-120000.h264", dir, i + 1);
+      write_segment(names[i], &h, i ? basename(names[i - 1]) : "", key, &seed);
+      paths[i] = names[i];
+   }
+
+   bOk &= expect("intact", 3, paths, key, bVerbose, 0);
+   bOk &= expect("wrong key", 3, paths, other, bVerbose, 1);
+   paths[1] = names[2];
+   bOk &= expect("middle segment missing", 2, paths, key, bVerbose, 1);
+   paths[1] = names[1];
+   //one flipped byte in the second segment
+   if ((fp = fopen(names[1], "r+b")))
+   {
+      fseek(fp, 123456, SEEK_SET);
+      i = fgetc(fp);
+      fseek(fp, 123456, SEEK_SET);
+      fputc(i ^ 1, fp);
+      fclose(fp);
+   }
+   bOk &= expect("one byte changed", 3, paths, NULL, bVerbose, 1);
+   if ((fp = fopen(names[1], "r+b")))
+   {
+      fseek(fp, 123456, SEEK_SET);
+      fputc(i, fp);
+      fclose(fp);
+   }
+   bOk &= expect("byte restored", 3, paths, key, bVerbose, 0);
+   if (truncate(names[2], 1000))
+      bOk = false;
+   bOk &= expect("last segment truncated", 3, paths, key, bVerbose, 1);
+
+   for (i = 0; i < 3; i++)
+   {
+      unlink(names[i]);
+      strcpy(names[i] + strlen(names[i]) - 5, ".hsh");
+      unlink(names[i]);
+   }
+   rmdir(dir);
+   printf("%s\n", bOk ? "OK" : "FAILED");
+   return bOk ? 0 : 3;
+}
+
+int
+main (int argc, char** argv)
+{
+   bool bTest = false, bVerbose = false;
+   uint8_t key[32];
+   const uint8_t* pKey = NULL;
+   int c;
+
+   while ((c = getopt(argc, argv, "tvk:")) != -1)
+   {
+      switch (c)
+      {
+         case 't':
+            bTest = true;
+            break;
+         case 'v':
+            bVerbose = true;
+            break;
+         case 'k':
+            if (!aead_load_key(optarg, key))
+            {
+               fprintf(stderr, "can't read a 64 hex digit key from %s\n", optarg);
+               return 2;
+            }
+            pKey = key;
+            break;
+         default:
+            show_usage_and_exit(argv[0]);
+      }
+   }
+   if (bTest)
+      return (optind == argc) ? self_test(bVerbose) : (show_usage_and_exit(argv[0]), 2);
+   if (optind == argc)
+      show_usage_and_exit(argv[0]);
+   return verify(argc - optind, argv + optind, pKey, bVerbose, false);
+}
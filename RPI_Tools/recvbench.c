@@ -0,0 +1,350 @@
+/*
+ * Receive path of the client (RPI_Client/video.c) without a decoder: video.c
+ * itself is compiled in with OpenMAX stubbed (omx_stub/), its input buffers
+ * come from here and a "decoder" that gives every buffer back right away.
+ * A sender thread writes frames to it over loopback TCP (or a socketpair).
+ *
+ * gcc -O2 -pthread -Iomx_stub -o recvbench recvbench.c
+ * recvbench [-d sec] [-x] [-s] [-q count|auto[,size_kb]]
+ *    -d   seconds per run, default 2
+ *    -x   AF_UNIX socketpair instead of loopback TCP
+ *    -s   with the -s path of video (recvmsg and kernel time stamps)
+ *    -q   the decoder input buffers like video -q, default 20 of 80 KB
+ *
+ * Every frame is a time SEI and a slice of the given size. Runs go through
+ * frame sizes and rates, 0 fps is as fast as it goes. Per run: frames and
+ * Mbit/s received, recv() calls per frame (one per buffer), CPU of the
+ * receiving thread per Mbit and, for paced runs, latency percentiles from
+ * the send() of a frame to its last byte in a decoder buffer.
+ */
+#ifndef _GNU_SOURCE
+   #define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
+
+#define main video_main
+#include "../RPI_Client/video.c"
+#undef main
+
+#define MAX_BUFFERS   64
+#define MAX_FRAMES    (1 << 20)
+
+/******************************* the OMX decoder, stubbed *******************************/
+
+static struct
+{
+   OMX_PARAM_PORTDEFINITIONTYPE portdef;
+   OMX_BUFFERHEADERTYPE hdr[MAX_BUFFERS];
+   OMX_BUFFERHEADERTYPE* free_list[MAX_BUFFERS];
+   int n_free;
+   ILCLIENT_BUFFER_CALLBACK_T empty_done;
+   uint64_t bytes, buffers;
+} dec;
+
+static struct
+{
+   uint32_t frame_len;
+   volatile uint64_t n_total;           /// frames the sender will have sent, 0 while it runs
+   int64_t* sent_us;                    /// per frame, written before it is sent
+   float* lat_ms;
+   uint64_t n_lat;
+   uint64_t done;                       /// frames complete
+} run;
+
+OMX_ERRORTYPE OMX_Init (void) { return OMX_ErrorNone; }
+OMX_ERRORTYPE OMX_GetState (OMX_HANDLETYPE h, OMX_STATETYPE* s) { *s = OMX_StateIdle; return OMX_ErrorNone; }
+OMX_ERRORTYPE OMX_SetupTunnel (OMX_HANDLETYPE a, OMX_U32 b, OMX_HANDLETYPE c, OMX_U32 d) { return OMX_ErrorNone; }
+OMX_ERRORTYPE OMX_SendCommand (OMX_HANDLETYPE h, OMX_COMMANDTYPE c, OMX_U32 p, OMX_PTR d) { return OMX_ErrorNone; }
+ILCLIENT_T* ilclient_init (void) { return NULL; }
+void ilclient_destroy (ILCLIENT_T* h) { }
+OMX_HANDLETYPE ilclient_get_handle (COMPONENT_T* c) { return NULL; }
+int ilclient_create_component (ILCLIENT_T* h, COMPONENT_T** c, char* n, int f) { return 0; }
+int ilclient_change_component_state (COMPONENT_T* c, OMX_STATETYPE s) { return 0; }
+void ilclient_set_error_callback (ILCLIENT_T* h, ILCLIENT_CALLBACK_T f, void* u) { }
+void ilclient_set_eos_callback (ILCLIENT_T* h, ILCLIENT_CALLBACK_T f, void* u) { }
+void ilclient_disable_port_buffers (COMPONENT_T* c, int p, void* a, void* b, void* d) { }
+void ilclient_enable_port (COMPONENT_T* c, int p) { }
+void ilclient_disable_port (COMPONENT_T* c, int p) { }
+int ilclient_remove_event (COMPONENT_T* c, OMX_EVENTTYPE e, OMX_U32 a, int b, OMX_U32 d, int f) { return -1; }
+int ilclient_wait_for_event (COMPONENT_T* c, OMX_EVENTTYPE e, OMX_U32 a, int b, OMX_U32 d, int f, int g, int t) { return -1; }
+void bcm_host_init (void) { }
+
+void
+ilclient_set_empty_buffer_done_callback (ILCLIENT_T* h, ILCLIENT_BUFFER_CALLBACK_T f, void* u)
+{
+   dec.empty_done = f;
+}
+
+OMX_ERRORTYPE
+OMX_GetParameter (OMX_HANDLETYPE h, OMX_INDEXTYPE index, OMX_PTR p)
+{
+   if (OMX_IndexParamPortDefinition == index)
+      *(OMX_PARAM_PORTDEFINITIONTYPE*) p = dec.portdef;
+   return OMX_ErrorNone;
+}
+
+OMX_ERRORTYPE
+OMX_SetParameter (OMX_HANDLETYPE h, OMX_INDEXTYPE index, OMX_PTR p)
+{
+   if (OMX_IndexParamPortDefinition == index)
+   {
+      OMX_PARAM_PORTDEFINITIONTYPE* def = p;
+      if ((def->nBufferCountActual > MAX_BUFFERS) || (def->nBufferSize < 1024))
+         return OMX_ErrorBadParameter;
+      dec.portdef = *def;
+   }
+   return OMX_ErrorNone;
+}
+
+int
+ilclient_enable_port_buffers (COMPONENT_T* c, int port, void* a, void* b, void* d)
+{
+   unsigned i;
+
+   dec.n_free = 0;
+   for (i = 0; i < dec.portdef.nBufferCountActual; i++)
+   {
+      free(dec.hdr[i].pBuffer);
+      memset(&dec.hdr[i], 0, sizeof(dec.hdr[i]));
+      dec.hdr[i].pBuffer = malloc(dec.portdef.nBufferSize);
+      dec.hdr[i].nAllocLen = dec.portdef.nBufferSize;
+      dec.free_list[dec.n_free++] = &dec.hdr[i];
+   }
+   return 0;
+}
+
+OMX_BUFFERHEADERTYPE*
+ilclient_get_input_buffer (COMPONENT_T* c, int port, int block)
+{
+   return dec.n_free ? dec.free_list[--dec.n_free] : NULL;
+}
+
+/* the decoder: a frame whose last byte is in is done, the buffer goes back at once */
+OMX_ERRORTYPE
+OMX_EmptyThisBuffer (OMX_HANDLETYPE h, OMX_BUFFERHEADERTYPE* b)
+{
+   int64_t now = 0;
+
+   dec.bytes += b->nFilledLen;
+   dec.buffers++;
+   while (dec.bytes >= (run.done + 1) * run.frame_len)
+   {
+      if (!now)
+         now = now_us();
+      if ((run.n_lat < MAX_FRAMES) && run.sent_us[run.done])
+         run.lat_ms[run.n_lat++] = (now - run.sent_us[run.done]) / 1000.0f;
+      run.done++;
+   }
+   dec.free_list[dec.n_free++] = b;
+   if (dec.empty_done)
+      dec.empty_done(NULL, NULL);
+   return OMX_ErrorNone;
+}
+
+/*************************************** sender ***************************************/
+
+typedef struct
+{
+   int fd;
+   int fps;                             /// 0 = as fast as the socket takes it
+   double seconds;
+} SENDER;
+
+static bool
+send_all (int fd, const uint8_t* p, size_t len)
+{
+   while (len)
+   {
+      ssize_t n = send(fd, p, len, 0);
+      if ((n < 0) && (EINTR == errno))
+         continue;
+      if (n <= 0)
+         return false;
+      p += n;
+      len -= n;
+   }
+   return true;
+}
+
+static void*
+sender_thread (void* arg)
+{
+   SENDER* s = arg;
+   uint8_t* frame = malloc(run.frame_len);
+   int64_t start = now_us(), next = start, period = s->fps ? 1000000 / s->fps : 0;
+   uint64_t i;
+   size_t k;
+
+   //time SEI, then a slice NAL without zero bytes, the SEI scans see no start codes in it
+   for (k = H264_TIME_SEI_LEN; k < run.frame_len; k++)
+      frame[k] = 1 + (k * 131) % 255;
+   memcpy(frame + H264_TIME_SEI_LEN, "\0\0\0\1\x41", 5);
+   for (i = 0; i < MAX_FRAMES; i++)
+   {
+      int64_t now = now_us();
+
+      if (period)
+      {
+         if (next > now)
+         {
+            struct timespec ts = { (next - now) / 1000000, ((next - now) % 1000000) * 1000 };
+            nanosleep(&ts, NULL);
+         }
+         next += period;
+         now = now_us();
+      }
+      if ((now - start >= s->seconds * 1e6) || (i + 1 == MAX_FRAMES))
+         run.n_total = i + 1;              //this is the last one
+      run.sent_us[i] = period ? now : 0;
+      h264_make_time_sei(frame, now);
+      if (!send_all(s->fd, frame, run.frame_len))
+         break;
+      if (run.n_total)
+         break;
+   }
+   free(frame);
+   return NULL;
+}
+
+/*************************************** runs ***************************************/
+
+static double
+thread_cpu_sec (void)
+{
+   struct rusage ru;
+   getrusage(RUSAGE_THREAD, &ru);
+   return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static int
+float_cmp (const void* a, const void* b)
+{
+   float d = *(const float*) a - *(const float*) b;
+   return (d > 0) - (d < 0);
+}
+
+static bool
+connect_pair (bool bUnix, int fds[2])
+{
+   struct sockaddr_in addr = { AF_INET, 0, { htonl(INADDR_LOOPBACK) } };
+   socklen_t len = sizeof(addr);
+   int lfd;
+
+   if (bUnix)
+      return 0 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+   if (((lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) || bind(lfd, (struct sockaddr*) &addr, sizeof(addr)) ||
+       listen(lfd, 1) || getsockname(lfd, (struct sockaddr*) &addr, &len) || ((fds[1] = socket(AF_INET, SOCK_STREAM, 0)) < 0) ||
+       connect(fds[1], (struct sockaddr*) &addr, sizeof(addr)) || ((fds[0] = accept(lfd, NULL, NULL)) < 0))
+   {
+      perror("loopback");
+      return false;
+   }
+   close(lfd);
+   return true;
+}
+
+static void
+bench (uint32_t frame_len, int fps, double seconds, bool bUnix)
+{
+   SENDER s = { -1, fps, seconds };
+   pthread_t thread;
+   int fds[2];
+   uint64_t frames;
+   double t0, c0, t, c;
+
+   if (!connect_pair(bUnix, fds))
+      exit(2);
+   sockfd = tls.fd = fds[0];
+   s.fd = fds[1];
+   if (lat.interval)
+      timestamps_enable(sockfd, false);
+   run.frame_len = frame_len;
+   run.n_total = run.done = run.n_lat = 0;
+   memset(run.sent_us, 0, MAX_FRAMES * sizeof(run.sent_us[0]));
+   dec.bytes = dec.buffers = 0;
+
+   t0 = now_us() / 1e6;
+   c0 = thread_cpu_sec();
+   pthread_create(&thread, NULL, sender_thread, &s);
+   //the main loop of video
+   while (!run.n_total || (run.done < run.n_total))
+   {
+      OMX_BUFFERHEADERTYPE* buff_header = get_input_buffer(NULL);
+      if (buff_header != NULL)
+         read_into_buffer_and_empty(NULL, buff_header);
+   }
+   c = thread_cpu_sec() - c0;
+   t = now_us() / 1e6 - t0;
+   pthread_join(thread, NULL);
+   close(fds[0]);
+   close(fds[1]);
+
+   frames = run.done;
+   printf("%7.1f KB %4d fps: %7.0f fps %8.1f Mbit/s %5.2f recv/frame %7.2f us CPU/Mbit", frame_len / 1024.0, fps,
+          frames / t, dec.bytes * 8 / t / 1e6, (double) dec.buffers / frames, c * 1e6 / (dec.bytes * 8 / 1e6));
+   if (run.n_lat)
+   {
+      qsort(run.lat_ms, run.n_lat, sizeof(run.lat_ms[0]), float_cmp);
+      printf("  latency ms p50/p95/p99/max %.3f/%.3f/%.3f/%.3f", run.lat_ms[run.n_lat / 2], run.lat_ms[run.n_lat * 95 / 100],
+             run.lat_ms[run.n_lat * 99 / 100], run.lat_ms[run.n_lat - 1]);
+   }
+   printf("\n");
+}
+
+int
+main (int argc, char** argv)
+{
+   static const uint32_t sizes[] = { 2 * 1024, 16 * 1024, 64 * 1024, 256 * 1024 };
+   static const int rates[] = { 30, 120, 0 };
+   double seconds = 2;
+   bool bUnix = false;
+   unsigned i, k;
+   int opt;
+
+   while ((opt = getopt(argc, argv, "d:xsq:")) != -1)
+   {
+      switch (opt)
+      {
+         case 'd':
+            seconds = atof(optarg);
+            break;
+         case 'x':
+            bUnix = true;
+            break;
+         case 's':
+            //collects like video -s, but never gets to print
+            lat.interval = 1000000;
+            break;
+         case 'q':
+            inq.bAuto = !strncmp(optarg, "auto", 4);
+            if (!inq.bAuto && (1 != sscanf(optarg, "%u", &inq.count)))
+               inq.count = 0;
+            if (strchr(optarg, ','))
+               sscanf(strchr(optarg, ',') + 1, "%u", &inq.size);
+            inq.size *= 1024;
+            break;
+         default:
+            fprintf(stderr, "Usage: %s [-d sec] [-x] [-s] [-q count|auto[,size_kb]]\n", argv[0]);
+            return 2;
+      }
+   }
+   signal(SIGPIPE, SIG_IGN);
+   run.sent_us = calloc(MAX_FRAMES, sizeof(run.sent_us[0]));
+   run.lat_ms = calloc(MAX_FRAMES, sizeof(run.lat_ms[0]));
+
+   //what video_decode has by default
+   dec.portdef.nBufferCountActual = 20;
+   dec.portdef.nBufferCountMin = 1;
+   dec.portdef.nBufferSize = 80 * 1024;
+   ilclient_set_empty_buffer_done_callback(NULL, empty_buffer_done_callback, NULL);
+   set_video_decoder_input_buffers(NULL, true);
+   ilclient_enable_port_buffers(NULL, VIDEO_DECODE_PORT, NULL, NULL, NULL);
+   printf("%s, %s\n", bUnix ? "socketpair" : "loopback TCP", lat.interval ? "recvmsg with time stamps" : "recv");
+
+   for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+      for (k = 0; k < sizeof(rates) / sizeof(rates[0]); k++)
+         bench(sizes[i], rates[k], seconds, bUnix);
+   return 0;
+}
@@ -0,0 +1,418 @@
+/*
+ * The serial link of common/serial_link.h without a radio: sends a raw H.264
+ * capture like raspivid -o serial://..., receives like video -S, and tests
+ * the whole thing over pty pairs.
+ *
+ * gcc -O2 -msse4.2 -pthread -o seriallink seriallink.c        (x86, -march=armv8-a+crc on a 64 bit Pi)
+ * seriallink -o /dev/ttyUSB0?baud=115200[&mtu=200] [-r fps] capture.h264
+ * seriallink -i /dev/ttyUSB0?baud=115200 [-v] > out.h264
+ * seriallink -t
+ *
+ * Without hardware, socat makes a pty pair that passes bytes both ways:
+ *    socat -d -d pty,raw,echo=0 pty,raw,echo=0          (prints /dev/pts/N and /dev/pts/M)
+ *    seriallink -i /dev/pts/M > out.h264 & seriallink -o /dev/pts/N cam.h264
+ * -r sends the capture at its frame rate (default 30), 0 as fast as the link
+ * takes it. The self test runs the link through a thread between two pty
+ * pairs that flips bytes on the way.
+ */
+#ifndef _GNU_SOURCE
+   #define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../common/h264_nal.h"
+#include "../common/serial_link.h"
+
+/* the access unit from p: up to the first AUD, SEI, SPS or slice after a slice */
+static const uint8_t*
+next_unit (const uint8_t* p, const uint8_t* end, uint8_t* flags)
+{
+   const uint8_t* sc = h264_find_start_code(p, end);
+   bool bSlice = false;
+
+   *flags = 0;
+   while (sc + 3 < end)
+   {
+      int type = NAL_TYPE(sc[3]);
+
+      if (bSlice && ((type == NAL_TYPE_SLICE) || (type == NAL_TYPE_IDR) || (type == NAL_TYPE_SEI) ||
+                     (type == NAL_TYPE_SPS) || (type == NAL_TYPE_AUD)))
+         return ((sc > p) && !sc[-1]) ? sc - 1 : sc;
+      if ((type == NAL_TYPE_SLICE) || (type == NAL_TYPE_IDR))
+         bSlice = true;
+      if (type == NAL_TYPE_IDR)
+         *flags |= SL_FLAG_KEY;
+      if (type == NAL_TYPE_SPS)
+         *flags |= SL_FLAG_CONFIG;
+      sc = h264_find_start_code(sc + 3, end);
+   }
+   return end;
+}
+
+static void
+sleep_until (struct timespec* t, long ns)
+{
+   t->tv_nsec += ns;
+   while (t->tv_nsec >= 1000000000)
+   {
+      t->tv_nsec -= 1000000000;
+      t->tv_sec++;
+   }
+   clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, t, NULL);
+}
+
+static int
+send_file (const char* url, const char* file, int fps)
+{
+   char path[256];
+   unsigned baud = 115200, mtu = SL_DEFAULT_MTU;
+   const uint8_t *p, *end;
+   struct timespec t;
+   struct stat st;
+   SL_TX tx;
+   int fd, in;
+
+   if (!sl_parse_url(url, path, sizeof(path), &baud, &mtu))
+   {
+      fprintf(stderr, "%s: expected /dev/tty...?baud=<n>[&mtu=16..%d]\n", url, SL_MAX_MTU);
+      return 2;
+   }
+   if ((in = open(file, O_RDONLY)) < 0 || fstat(in, &st) || !st.st_size ||
+       (MAP_FAILED == (p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in, 0))))
+   {
+      perror(file);
+      return 1;
+   }
+   if ((fd = sl_open_tty(path, baud, O_WRONLY)) < 0)
+   {
+      perror(path);
+      return 1;
+   }
+   if (!sl_tx_start(&tx, fd, baud, mtu))
+      return 1;
+   end = p + st.st_size;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   while (p < end)
+   {
+      uint8_t flags;
+      const uint8_t* next = next_unit(p, end, &flags);
+
+      if (!sl_tx_frame(&tx, p, next - p, flags))
+      {
+         fprintf(stderr, "%s: write failed\n", path);
+         return 1;
+      }
+      p = next;
+      if (fps)
+         sleep_until(&t, 1000000000L / fps);
+   }
+   sl_tx_drain(&tx);
+   fprintf(stderr, "serial: frames=%llu dropped=%llu packets=%llu bytes=%llu crc=%s\n", (unsigned long long) tx.frames,
+           (unsigned long long) tx.dropped, (unsigned long long) tx.packets, (unsigned long long) tx.bytes, sl_crc32c_impl());
+   sl_tx_stop(&tx);
+   return 0;
+}
+
+static int
+receive (const char* url, bool bVerbose)
+{
+   char path[256];
+   unsigned baud = 115200, mtu = SL_DEFAULT_MTU;
+   const uint8_t* frame;
+   uint32_t len;
+   uint8_t flags;
+   time_t last = time(NULL);
+   SL_RX rx;
+   int fd;
+
+   if (!sl_parse_url(url, path, sizeof(path), &baud, &mtu))
+   {
+      fprintf(stderr, "%s: expected /dev/tty...?baud=<n>\n", url);
+      return 2;
+   }
+   if ((fd = sl_open_tty(path, baud, O_RDONLY)) < 0)
+   {
+      perror(path);
+      return 1;
+   }
+   sl_rx_init(&rx, fd);
+   while ((frame = sl_rx_frame(&rx, &len, &flags)))
+   {
+      if (len != fwrite(frame, 1, len, stdout))
+         break;
+      fflush(stdout);
+      if (bVerbose && (time(NULL) - last >= 5))
+      {
+         last = time(NULL);
+         sl_rx_print(stderr, &rx);
+      }
+   }
+   sl_rx_print(stderr, &rx);
+   sl_rx_free(&rx);
+   return 0;
+}
+
+/******************************* self test *******************************/
+
+#define TEST_FRAMES 300
+#define TEST_GOP    15
+
+static uint32_t
+xorshift (uint32_t* x)
+{
+   *x ^= *x << 13;
+   *x ^= *x >> 17;
+   *x ^= *x << 5;
+   return *x;
+}
+
+/* frame n: its number, then bytes from a generator seeded with it, about one in 8 a 0 */
+static uint32_t
+test_frame (uint32_t n, uint8_t* out)
+{
+   uint32_t x = n * 2654435761u + 1, len = 100 + xorshift(&x) % ((n % TEST_GOP) ? 4000 : 12000), i;
+
+   memcpy(out, &n, 4);
+   for (i = 4; i < len; i++)
+   {
+      uint32_t r = xorshift(&x);
+      out[i] = (r & 7) ? (uint8_t)(r >> 8) : 0;
+   }
+   return len;
+}
+
+static int
+open_pty (int* master, int* slave)
+{
+   if (((*master = posix_openpt(O_RDWR | O_NOCTTY)) < 0) || grantpt(*master) || unlockpt(*master))
+      return -1;
+   *slave = sl_open_tty(ptsname(*master), 115200, O_RDWR);
+   return *slave;
+}
+
+static struct
+{
+   int from, to;                       /// master of the sender's pair, master of the receiver's pair
+   uint32_t error_every;               /// one byte in about that many is flipped, 0 none
+   uint64_t bytes, flipped;
+} relay;
+
+static void*
+relay_thread (void* arg)
+{
+   uint8_t buf[4096];
+   uint32_t x = 12345;
+   ssize_t n, i;
+
+   while ((n = read(relay.from, buf, sizeof(buf))) > 0)
+   {
+      for (i = 0; relay.error_every && (i < n); i++)
+      {
+         if (!(xorshift(&x) % relay.error_every))
+         {
+            buf[i] ^= 1 << (xorshift(&x) & 7);
+            relay.flipped++;
+         }
+      }
+      relay.bytes += n;
+      if (n != write(relay.to, buf, n))
+         break;
+   }
+   close(relay.to);
+   return NULL;
+}
+
+static struct
+{
+   int fd;
+   uint64_t frames, keys, corrupt, gaps;
+   SL_RX rx;
+} rcv;
+
+static void*
+receive_thread (void* arg)
+{
+   static uint8_t expect[16384];
+   const uint8_t* frame;
+   uint32_t len, n, last = ~0u;
+   uint8_t flags;
+
+   sl_rx_init(&rcv.rx, rcv.fd);
+   while ((frame = sl_rx_frame(&rcv.rx, &len, &flags)))
+   {
+      memcpy(&n, frame, 4);
+      if ((len < 4) || (n >= TEST_FRAMES) || (len != test_frame(n, expect)) || memcmp(frame, expect, len) ||
+          (!(n % TEST_GOP) != !!(flags & SL_FLAG_KEY)))
+      {
+         rcv.corrupt++;
+         continue;
+      }
+      //a P frame only right after the one before it
+      if ((n % TEST_GOP) && (n != last + 1))
+         rcv.gaps++;
+      rcv.keys += !(n % TEST_GOP);
+      rcv.frames++;
+      last = n;
+   }
+   return NULL;
+}
+
+/* one run over the pty pairs; bPaced waits for every frame to go out, otherwise the budget drops P frames */
+static bool
+test_link (uint32_t error_every, bool bPaced, unsigned mtu)
+{
+   static uint8_t frame[16384];
+   int ma, sa, mb, sb;
+   pthread_t rt, ct;
+   SL_TX tx;
+   uint32_t i;
+   bool bOK;
+
+   if ((open_pty(&ma, &sa) < 0) || (open_pty(&mb, &sb) < 0))
+   {
+      perror("pty");
+      return false;
+   }
+   memset(&relay, 0, sizeof(relay));
+   memset(&rcv, 0, sizeof(rcv));
+   relay.from = ma;
+   relay.to = mb;
+   relay.error_every = error_every;
+   rcv.fd = sb;
+   pthread_create(&rt, NULL, relay_thread, NULL);
+   pthread_create(&ct, NULL, receive_thread, NULL);
+   sl_tx_start(&tx, sa, 115200, mtu);
+
+   for (i = 0; i < TEST_FRAMES; i++)
+   {
+      uint32_t len = test_frame(i, frame);
+      sl_tx_frame(&tx, frame, len, (i % TEST_GOP) ? 0 : SL_FLAG_KEY | SL_FLAG_CONFIG);
+      if (bPaced)
+         sl_tx_drain(&tx);
+   }
+   sl_tx_drain(&tx);
+   //the relay gets EIO once the sender's side is gone, closes the receiver's and that one ends
+   usleep(200000);
+   sl_tx_stop(&tx);
+   close(sa);
+   pthread_join(rt, NULL);
+   pthread_join(ct, NULL);
+   close(ma);
+   close(sb);
+
+   printf("mtu %4u, %s, 1 in %6u bytes flipped: sent %llu dropped %llu, got %llu (%llu key) corrupt %llu gaps %llu, "
+          "lost %llu skipped %llu crc_errors %llu bad %llu\n", mtu, bPaced ? "paced" : "burst ", error_every,
+          (unsigned long long) tx.frames, (unsigned long long) tx.dropped, (unsigned long long) rcv.frames,
+          (unsigned long long) rcv.keys, (unsigned long long) rcv.corrupt, (unsigned long long) rcv.gaps,
+          (unsigned long long) rcv.rx.lost, (unsigned long long) rcv.rx.skipped,
+          (unsigned long long) rcv.rx.crc_errors, (unsigned long long) rcv.rx.bad);
+   bOK = !rcv.corrupt && !rcv.gaps;
+   if (!error_every && bPaced)
+      bOK = bOK && (rcv.frames == TEST_FRAMES);
+   if (!error_every)
+      bOK = bOK && (rcv.keys == TEST_FRAMES / TEST_GOP) && (rcv.frames == tx.frames);
+   else
+      bOK = bOK && relay.flipped && rcv.rx.crc_errors + rcv.rx.bad && rcv.frames;
+   sl_rx_free(&rcv.rx);
+   return bOK;
+}
+
+static int
+self_test (void)
+{
+   static uint8_t in[2048], enc[2048 + 16], dec[2048];
+   uint32_t x = 1, i, len, bad = 0;
+   struct timespec t0, t1;
+   double sec;
+
+   if (sl_crc32c(0, (const uint8_t*) "123456789", 9) != 0xe3069283)
+      bad++;
+   for (i = 0; i < 1000; i++)
+   {
+      uint32_t k;
+      len = xorshift(&x) % sizeof(in);
+      for (k = 0; k < len; k++)
+         in[k] = xorshift(&x);
+      if (sl_crc32c(0, in, len) != sl_crc32c_sw(0, in, len))
+         bad++;
+   }
+   printf("crc32c (%s): %s\n", sl_crc32c_impl(), bad ? "WRONG" : "ok");
+
+   //runs of non-zero bytes around the 254 of a COBS block, all zeros and random bytes with zeros
+   for (len = 0; len < 700; len++)
+   {
+      int pattern;
+      for (pattern = 0; pattern < 3; pattern++)
+      {
+         uint32_t k;
+         size_t n;
+         for (k = 0; k < len; k++)
+            in[k] = (pattern == 0) ? 1 + k % 255 : (pattern == 1) ? 0 : ((xorshift(&x) & 3) ? (uint8_t) x : 0);
+         n = sl_cobs_encode(in, len, enc);
+         if ((n > SL_WIRE_LEN(len) - 1) || memchr(enc, 0, n) || (sl_cobs_decode(enc, n, dec, sizeof(dec)) != len) ||
+             memcmp(in, dec, len))
+            bad++;
+      }
+   }
+   printf("cobs: %s\n", bad ? "WRONG" : "ok");
+
+   clock_gettime(CLOCK_MONOTONIC, &t0);
+   for (i = 0, x = 0; i < 100000; i++)
+      x += sl_crc32c(x, in, 1024);
+   clock_gettime(CLOCK_MONOTONIC, &t1);
+   sec = t1.tv_sec - t0.tv_sec + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+   printf("crc32c: %.0f MB/s (%08x)\n", 100000 * 1024 / sec / 1e6, x);
+
+   if (!test_link(0, true, SL_DEFAULT_MTU) || !test_link(0, false, SL_DEFAULT_MTU) ||
+       !test_link(20000, true, SL_DEFAULT_MTU) || !test_link(5000, true, 64) || !test_link(20000, false, 1000))
+      bad++;
+   printf("self test %s\n", bad ? "FAILED" : "passed");
+   return bad ? 1 : 0;
+}
+
+int
+main (int argc, char** argv)
+{
+   const char *out = NULL, *in = NULL;
+   bool bVerbose = false;
+   int fps = 30, opt;
+
+   while ((opt = getopt(argc, argv, "o:i:r:vt")) != -1)
+   {
+      switch (opt)
+      {
+         case 'o':
+            out = optarg;
+            break;
+         case 'i':
+            in = optarg;
+            break;
+         case 'r':
+            fps = atoi(optarg);
+            break;
+         case 'v':
+            bVerbose = true;
+            break;
+         case 't':
+            return self_test();
+         default:
+            out = in = NULL;
+            optind = argc + 1;
+            break;
+      }
+   }
+   if (out && (optind == argc - 1))
+      return send_file(out, argv[optind], fps);
+   if (in && !out)
+      return receive(in, bVerbose);
+   fprintf(stderr, "Usage: %s -o /dev/tty..?baud=<n>[&mtu=<n>] [-r fps] capture.h264 | -i /dev/tty..?baud=<n> [-v] | -t\n", argv[0]);
+   return 2;
+}
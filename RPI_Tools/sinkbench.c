@@ -0,0 +1,210 @@
+/*
+ * CPU per megabit of the file and pipe sinks: fwrite() as raspivid did,
+ * write(), and vmsplice/splice of common/splice_sink.h.
+ *
+ * gcc -O2 -o sinkbench sinkbench.c
+ * sinkbench [MB] [dir]
+ *
+ * Frames of 2..120 KB come from a pool of 8 buffers that is refilled as soon
+ * as a buffer is free again, like the encoder pool. The pipe reader is another
+ * process that read()s and checks every byte, so a buffer refilled while the
+ * pipe still referenced it shows up as corrupt. The file is checked the same
+ * way afterwards. CPU is user + system time of the writer only.
+ */
+#ifndef _GNU_SOURCE
+   #define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "../common/splice_sink.h"
+
+#define POOL 8
+#define MAX_FRAME (120 * 1024)
+#define MIN_FRAME (2 * 1024)
+
+typedef enum { SINK_FWRITE, SINK_WRITE, SINK_SPLICE } SINK_KIND;
+static const char* const kind_names[] = { "fwrite", "write", "splice" };
+
+static uint8_t* pool[POOL];
+static int refs[POOL];
+
+static double
+now_sec (void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+cpu_sec (int who)
+{
+   struct rusage ru;
+   getrusage(who, &ru);
+   return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static void
+ref_acquire (void* holder)
+{
+   refs[(uint8_t**) holder - pool]++;
+}
+
+static void
+ref_release (void* holder)
+{
+   refs[(uint8_t**) holder - pool]--;
+}
+
+/* the same sizes and contents on both ends: every byte of frame i is its low byte */
+static size_t
+frame_len (uint32_t* seed)
+{
+   *seed = *seed * 1103515245 + 12345;
+   return MIN_FRAME + (*seed >> 8) % (MAX_FRAME - MIN_FRAME);
+}
+
+/* reads everything from fd and checks it, returns the number of bad frames */
+static long
+check (int fd, uint64_t total)
+{
+   static uint8_t buf[MAX_FRAME];
+   uint32_t seed = 1;
+   uint64_t i, done = 0;
+   long bad = 0;
+
+   for (i = 0; done < total; i++)
+   {
+      size_t len = frame_len(&seed), got = 0, k;
+
+      while (got < len)
+      {
+         ssize_t n = read(fd, buf + got, len - got);
+         if (n <= 0)
+            return bad + 1;
+         got += n;
+      }
+      for (k = 0; k < len; k++)
+         if (buf[k] != (uint8_t) i)
+            break;
+      bad += (k != len);
+      done += len;
+   }
+   return bad;
+}
+
+static void
+run (SINK_KIND kind, bool bPipe, uint64_t total, const char* dir)
+{
+   char path[512];
+   int fds[2] = { -1, -1 }, fd;
+   FILE* fp = NULL;
+   SPLICE_SINK sink;
+   uint32_t seed = 1;
+   uint64_t i, done = 0;
+   double t0, c0, t, c;
+   long bad = 0, reused = 0;
+   pid_t reader = 0;
+
+   snprintf(path, sizeof(path), "%s/sinkbench-%d.h264", dir, getpid());
+   fflush(stdout);
+   if (bPipe)
+   {
+      if (pipe(fds))
+         exit(2);
+      if (!(reader = fork()))
+      {
+         close(fds[1]);
+         exit(check(fds[0], total) ? 1 : 0);
+      }
+      close(fds[0]);
+      fd = fds[1];
+   }
+   else if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+   {
+      perror(path);
+      exit(2);
+   }
+   if (SINK_FWRITE == kind)
+      fp = fdopen(fd, "w");
+   else if (SINK_SPLICE == kind)
+      splice_sink_open(&sink, fd, ref_acquire, ref_release, POOL - 1);
+
+   t0 = now_sec();
+   c0 = cpu_sec(RUSAGE_SELF);
+   for (i = 0; done < total; i++)
+   {
+      int slot = i % POOL;
+      size_t len = frame_len(&seed);
+      bool bOK;
+
+      //the encoder only gets buffers nobody holds
+      if (refs[slot])
+         reused++;
+      memset(pool[slot], (uint8_t) i, len);
+      refs[slot]++;
+      if (SINK_FWRITE == kind)
+         bOK = fwrite(pool[slot], 1, len, fp) == len;
+      else if (SINK_WRITE == kind)
+         bOK = splice_sink_write_all(fd, pool[slot], len);
+      else
+         bOK = splice_sink_write(&sink, pool[slot], len, &pool[slot]);
+      refs[slot]--;
+      if (!bOK)
+      {
+         perror("write");
+         exit(2);
+      }
+      done += len;
+   }
+   if (fp)
+      fflush(fp);
+   if (SINK_SPLICE == kind)
+      splice_sink_close(&sink);
+   t = now_sec() - t0;
+   c = cpu_sec(RUSAGE_SELF) - c0;
+   if (fp)
+      fclose(fp);
+   else
+      close(fd);
+
+   if (bPipe)
+   {
+      int status;
+      waitpid(reader, &status, 0);
+      bad = !WIFEXITED(status) || WEXITSTATUS(status);
+   }
+   else
+   {
+      fd = open(path, O_RDONLY);
+      bad = check(fd, done);
+      close(fd);
+      unlink(path);
+   }
+   printf("%-6s to a %-4s: %7.1f MB/s, %6.1f us CPU per Mbit%s%s\n", kind_names[kind], bPipe ? "pipe" : "file",
+          done / t / 1e6, c * 1e6 / (done * 8 / 1e6), bad ? ", CORRUPT" : "", reused ? ", buffer reused while held" : "");
+   if (SINK_SPLICE == kind)
+      printf("               %llu bytes spliced, %llu copied\n", (unsigned long long) sink.spliced, (unsigned long long) sink.copied);
+}
+
+int
+main (int argc, char** argv)
+{
+   uint64_t total = (argc > 1 ? atoi(argv[1]) : 256) * 1000000ULL;
+   const char* dir = (argc > 2) ? argv[2] : "/tmp";
+   int i, k;
+
+   for (i = 0; i < POOL; i++)
+      if (NULL == (pool[i] = malloc(MAX_FRAME)))
+         return 2;
+   for (k = 0; k < 2; k++)
+      for (i = SINK_FWRITE; i <= SINK_SPLICE; i++)
+         run((SINK_KIND) i, k, total, dir);
+   return 0;
+}
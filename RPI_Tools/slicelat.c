@@ -0,0 +1,341 @@
+/*
+ * What raspivid -m android -slices saves over whole frames, without a camera:
+ * frames go over loopback TCP in the android framing, through a link paced at
+ * a given rate, from an encoder that hands out every frame in slices spread
+ * over its encode time. The receiver reads like video -A and takes the time
+ * from capture until the last part of a frame is in, the moment the decoder
+ * can start on it. The last slice is out of the encoder when the whole frame
+ * would be, slices save the time the link carries the others while the
+ * encoder is still busy: up to all but one slice's share of the transfer
+ * time, at most the encode time. On the Pi, raspivid -enclat with -slices
+ * shows how early the first slice of the real encoder is out.
+ *
+ * gcc -O2 -pthread -o slicelat slicelat.c
+ * slicelat [-f fps] [-e encode_ms] [-n slices] [-r kbit/s] [-s I_KB,P_KB] [-g gop] [-d sec] [-t]
+ *    defaults: 30 fps, 25 ms to encode a frame, 4 slices, 8000 kbit/s,
+ *    IDR 120 KB and P 20 KB, GOP 30, 5 s per mode
+ *    -t   self test: parts of random frames put together right, slices ahead on a slow link
+ */
+#ifndef _GNU_SOURCE
+   #define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "../common/lat_hist.h"
+
+#define ANDROID_LEN_SLICE 0x80000000u   /// raspivid -m android -slices: more of this frame follows
+#define MAX_FRAME (4 * 1024 * 1024)
+#define LINK_CHUNK 1400                 /// bytes the paced link puts out at once
+
+typedef struct
+{
+   int fps, encode_ms, slices, gop;
+   int kbps;
+   uint32_t i_len, p_len;
+   double seconds;
+} SETUP;
+
+typedef struct
+{
+   int fd;
+   LAT_HIST hist[2];                    /// [0] P frames, [1] IDR
+   uint64_t frames, parts, bytes;
+} RECEIVER;
+
+static int64_t
+now_us (void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+sleep_until_us (int64_t t)
+{
+   struct timespec ts = { t / 1000000, (t % 1000000) * 1000 };
+   while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+      ;
+}
+
+static bool
+read_full (int fd, void* buf, size_t len)
+{
+   uint8_t* p = buf;
+   ssize_t n;
+
+   while (len)
+   {
+      if ((n = recv(fd, p, len, 0)) <= 0)
+         return false;
+      p += n;
+      len -= n;
+   }
+   return true;
+}
+
+/* one part like video -A reads it: its length, bEnd if it ends a frame; false at the end of the stream */
+static bool
+part_read (int fd, uint8_t* buf, uint32_t cap, uint32_t* len, bool* bEnd)
+{
+   uint32_t hdr;
+
+   if (!read_full(fd, &hdr, 4))
+      return false;
+   *bEnd = !(hdr & ANDROID_LEN_SLICE);
+   *len = hdr & ~ANDROID_LEN_SLICE;
+   return (*len <= cap) && read_full(fd, buf, *len);
+}
+
+/*
+ * A frame starts with its capture time and IDR flag, the receiver puts the
+ * parts together and takes the time when the last one is in.
+ */
+static void*
+receiver_thread (void* arg)
+{
+   RECEIVER* rx = arg;
+   static uint8_t frame[MAX_FRAME];
+   uint32_t have = 0, len;
+   bool bEnd;
+
+   while (part_read(rx->fd, frame + have, MAX_FRAME - have, &len, &bEnd))
+   {
+      have += len;
+      rx->parts++;
+      if (!bEnd)
+         continue;
+      if (have >= 9)
+      {
+         int64_t t_cap;
+
+         memcpy(&t_cap, frame, 8);
+         lat_hist_add(&rx->hist[!!frame[8]], now_us() - t_cap);
+         rx->frames++;
+         rx->bytes += have;
+      }
+      have = 0;
+   }
+   return NULL;
+}
+
+/* the link: LINK_CHUNK bytes at a time, each when the ones before it are out at kbps */
+static bool
+link_send (int fd, const uint8_t* p, uint32_t len, int kbps, int64_t* link_free_us)
+{
+   while (len)
+   {
+      uint32_t n = (len < LINK_CHUNK) ? len : LINK_CHUNK;
+
+      if (kbps)
+      {
+         sleep_until_us(*link_free_us);
+         *link_free_us += (int64_t) n * 8000 / kbps;
+      }
+      if (send(fd, p, n, MSG_NOSIGNAL) != (ssize_t) n)
+         return false;
+      p += n;
+      len -= n;
+   }
+   return true;
+}
+
+/* one mode, slices = 1 is whole frames */
+static void
+run (const SETUP* su, int slices, RECEIVER* rx)
+{
+   static uint8_t frame[MAX_FRAME];
+   struct sockaddr_in addr = { AF_INET, 0, { htonl(INADDR_LOOPBACK) } };
+   socklen_t alen = sizeof(addr);
+   int ls = socket(AF_INET, SOCK_STREAM, 0), fd = socket(AF_INET, SOCK_STREAM, 0), on = 1, i;
+   int64_t period_us = 1000000 / su->fps, start, link_free_us = 0;
+   pthread_t th;
+
+   if ((ls < 0) || (fd < 0) || bind(ls, (struct sockaddr*) &addr, sizeof(addr)) || listen(ls, 1) ||
+       getsockname(ls, (struct sockaddr*) &addr, &alen) || connect(fd, (struct sockaddr*) &addr, sizeof(addr)) ||
+       ((rx->fd = accept(ls, NULL, NULL)) < 0))
+   {
+      perror("loopback");
+      exit(1);
+   }
+   close(ls);
+   setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+   pthread_create(&th, NULL, receiver_thread, rx);
+
+   start = now_us() + 10000;
+   for (i = 0; i < su->seconds * su->fps; i++)
+   {
+      int64_t t_cap = start + i * period_us;
+      uint32_t len = (i % su->gop) ? su->p_len : su->i_len, off = 0;
+      int k;
+
+      memset(frame, 0x5a, len);
+      memcpy(frame, &t_cap, 8);
+      frame[8] = !(i % su->gop);
+      //part k is out of the encoder at k+1 slices' share of the encode time
+      for (k = 0; k < slices; k++)
+      {
+         uint32_t end = (uint64_t) len * (k + 1) / slices;
+         uint32_t hdr = (end - off) | ((k + 1 < slices) ? ANDROID_LEN_SLICE : 0);
+         int64_t ready = t_cap + (int64_t) su->encode_ms * 1000 * (k + 1) / slices;
+
+         if (link_free_us < ready)
+            link_free_us = ready;
+         if (!link_send(fd, (uint8_t*) &hdr, 4, su->kbps, &link_free_us) ||
+             !link_send(fd, frame + off, end - off, su->kbps, &link_free_us))
+         {
+            fprintf(stderr, "send failed\n");
+            exit(1);
+         }
+         off = end;
+      }
+   }
+   shutdown(fd, SHUT_WR);
+   pthread_join(th, NULL);
+   close(fd);
+   close(rx->fd);
+}
+
+static void
+report (const char* name, RECEIVER* rx)
+{
+   char line[64];
+
+   snprintf(line, sizeof(line), "%s I", name);
+   lat_hist_print(stdout, line, &rx->hist[1], false);
+   snprintf(line, sizeof(line), "%s P", name);
+   lat_hist_print(stdout, line, &rx->hist[0], false);
+}
+
+/******************************* self test *******************************/
+
+static int
+self_test (void)
+{
+   static uint8_t sent[1 << 16], got[1 << 16];
+   SETUP su = { 30, 25, 4, 10, 8000, 60 * 1024, 20 * 1024, 1.0 };
+   static RECEIVER full, sliced;
+   uint32_t x = 7, len, have, plen;
+   int sv[2], f, bad = 0;
+   bool bEnd;
+
+   //random frames in random parts over a socketpair
+   if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+      return 1;
+   for (f = 0; (f < 200) && !bad; f++)
+   {
+      int parts, k;
+      uint32_t off = 0;
+
+      x = x * 1103515245 + 12345;
+      len = 1 + (x >> 8) % (sizeof(sent) - 1);
+      parts = 1 + (x >> 4) % 8;
+      for (k = 0; k < (int) len; k++)
+         sent[k] = (uint8_t)(k * 31 + f);
+      for (k = 0; k < parts; k++)
+      {
+         uint32_t end = (uint64_t) len * (k + 1) / parts;
+         uint32_t hdr = (end - off) | ((k + 1 < parts) ? ANDROID_LEN_SLICE : 0);
+
+         if ((write(sv[0], &hdr, 4) != 4) || (write(sv[0], sent + off, end - off) != (ssize_t)(end - off)))
+            return 1;
+         off = end;
+      }
+      for (have = 0, k = 0; (k < parts) && !bad; k++)
+      {
+         if (!part_read(sv[1], got + have, sizeof(got) - have, &plen, &bEnd) || (bEnd != (k + 1 == parts)))
+            bad++;
+         have += plen;
+      }
+      if ((have != len) || memcmp(sent, got, len))
+         bad++;
+   }
+   close(sv[0]);
+   close(sv[1]);
+   printf("parts of %d frames: %s\n", f, bad ? "WRONG" : "ok");
+
+   //a P frame takes 20 ms on the link, 3 of its 4 slices go while the encoder works: about 15 ms saved
+   run(&su, 1, &full);
+   run(&su, su.slices, &sliced);
+   report("whole frames", &full);
+   report("4 slices    ", &sliced);
+   if ((full.frames != sliced.frames) || (full.frames != su.seconds * su.fps) ||
+       (sliced.hist[0].sum_us / sliced.hist[0].n + 10000 > full.hist[0].sum_us / full.hist[0].n))
+      bad++;
+   printf("self test %s\n", bad ? "FAILED" : "passed");
+   return bad ? 1 : 0;
+}
+
+int
+main (int argc, char** argv)
+{
+   SETUP su = { 30, 25, 4, 30, 8000, 120 * 1024, 20 * 1024, 5 };
+   static RECEIVER full, sliced;
+   char name[32];
+   int opt;
+
+   while ((opt = getopt(argc, argv, "f:e:n:r:s:g:d:t")) != -1)
+   {
+      switch (opt)
+      {
+         case 'f':
+            su.fps = atoi(optarg);
+            break;
+         case 'e':
+            su.encode_ms = atoi(optarg);
+            break;
+         case 'n':
+            su.slices = atoi(optarg);
+            break;
+         case 'r':
+            su.kbps = atoi(optarg);
+            break;
+         case 's':
+            if (2 != sscanf(optarg, "%u,%u", &su.i_len, &su.p_len))
+               su.i_len = 0;
+            su.i_len *= 1024;
+            su.p_len *= 1024;
+            break;
+         case 'g':
+            su.gop = atoi(optarg);
+            break;
+         case 'd':
+            su.seconds = atof(optarg);
+            break;
+         case 't':
+            return self_test();
+         default:
+            su.fps = 0;
+            break;
+      }
+   }
+   if ((su.fps <= 0) || (su.encode_ms < 0) || (su.slices < 1) || (su.kbps < 0) || (su.gop < 1) || (su.seconds <= 0) ||
+       (su.i_len < 16) || (su.p_len < 16) || (su.i_len > MAX_FRAME) || (su.p_len > MAX_FRAME))
+   {
+      fprintf(stderr, "Usage: %s [-f fps] [-e encode_ms] [-n slices] [-r kbit/s (0: no limit)] [-s I_KB,P_KB] [-g gop] [-d sec] [-t]\n",
+              argv[0]);
+      return 2;
+   }
+   printf("%d fps, %d ms encode, %d kbit/s, IDR %u KB, P %u KB every %d: capture until the last part of a frame is in\n",
+          su.fps, su.encode_ms, su.kbps, su.i_len / 1024, su.p_len / 1024, su.gop);
+   run(&su, 1, &full);
+   run(&su, su.slices, &sliced);
+   report("whole frames", &full);
+   snprintf(name, sizeof(name), "%d slices", su.slices);
+   report(name, &sliced);
+   if (full.hist[0].n && sliced.hist[0].n && full.hist[1].n && sliced.hist[1].n)
+      printf("slices save I %.2f ms, P %.2f ms on average\n",
+             (full.hist[1].sum_us / (double) full.hist[1].n - sliced.hist[1].sum_us / (double) sliced.hist[1].n) / 1000,
+             (full.hist[0].sum_us / (double) full.hist[0].n - sliced.hist[0].sum_us / (double) sliced.hist[0].n) / 1000);
+   return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * Loopback throughput of the TLS stream against plaintext: send() and
+ * sendfile() with kTLS, with TLS in user space and without TLS.
+ *
+ * gcc -O2 -DRPI_WITH_TLS -o tlsbench tlsbench.c -lssl -lcrypto -lpthread
+ * tlsbench [MB]
+ *
+ * CPU is user + system time of both ends, so it includes the decryption on
+ * the receiving side.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include "../common/rpi_net.h"
+#include "../common/rpi_tls.h"
+
+#define CHUNK (64 * 1024)
+
+static char cert_path[] = "/tmp/tlsbench-cert.pem";
+static char key_path[] = "/tmp/tlsbench-key.pem";
+static char file_path[] = "/tmp/tlsbench-data.h264";
+
+/* throw away self signed P-256 certificate */
+static bool
+make_cert (void)
+{
+   EVP_PKEY_CTX* kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+   EVP_PKEY* pkey = NULL;
+   X509* x = X509_new();
+   FILE* fp;
+
+   if (!kctx || !x || (EVP_PKEY_keygen_init(kctx) <= 0) ||
+       (EVP_PKEY_CTX_set_ec_paramgen_curve_nid(kctx, NID_X9_62_prime256v1) <= 0) || (EVP_PKEY_keygen(kctx, &pkey) <= 0))
+      return false;
+   EVP_PKEY_CTX_free(kctx);
+   ASN1_INTEGER_set(X509_get_serialNumber(x), 1);
+   X509_gmtime_adj(X509_getm_notBefore(x), 0);
+   X509_gmtime_adj(X509_getm_notAfter(x), 3600);
+   X509_set_pubkey(x, pkey);
+   X509_NAME_add_entry_by_txt(X509_get_subject_name(x), "CN", MBSTRING_ASC, (unsigned char*) "tlsbench", -1, -1, 0);
+   X509_set_issuer_name(x, X509_get_subject_name(x));
+   if (!X509_sign(x, pkey, EVP_sha256()))
+      return false;
+   if (NULL == (fp = fopen(cert_path, "w")))
+      return false;
+   PEM_write_X509(fp, x);
+   fclose(fp);
+   if (NULL == (fp = fopen(key_path, "w")))
+      return false;
+   PEM_write_PrivateKey(fp, pkey, NULL, NULL, 0, NULL, NULL);
+   fclose(fp);
+   X509_free(x);
+   EVP_PKEY_free(pkey);
+   return true;
+}
+
+static double
+now_sec (void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+cpu_sec (int who)
+{
+   struct rusage ru;
+   getrusage(who, &ru);
+   return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/* sender: raspivid (send) or the relay playback (sendfile) */
+static void
+sender (int fd, bool bTls, bool bSendfile, size_t total)
+{
+   static char buf[CHUNK];
+   RPI_TLS t = { fd };
+   size_t sent = 0;
+
+   if (bTls && !rpi_tls_accept(&t, fd, cert_path, key_path, false))
+      exit(1);
+   if (bSendfile)
+   {
+      int in = open(file_path, O_RDONLY);
+      off_t off = 0;
+      while (sent < total)
+      {
+         ssize_t n;
+         if (off == (off_t) (32 * CHUNK))
+            off = 0;
+         if ((n = rpi_tls_sendfile(&t, in, &off, 32 * CHUNK - off)) <= 0)
+            exit(1);
+         sent += n;
+      }
+      close(in);
+   }
+   else
+   {
+      while (sent < total)
+      {
+         ssize_t n = rpi_tls_send(&t, buf, CHUNK, MSG_NOSIGNAL);
+         if (n <= 0)
+            exit(1);
+         sent += n;
+      }
+   }
+   if (bTls)
+      rpi_tls_close(&t);
+   close(fd);
+   exit((bTls && !t.bKernelTx) ? 3 : 0);
+}
+
+/* receiver: video.c */
+static size_t
+receiver (int fd, bool bTls)
+{
+   static char buf[CHUNK];
+   RPI_TLS t = { fd };
+   size_t got = 0;
+   ssize_t n;
+
+   if (bTls && !rpi_tls_connect(&t, fd, cert_path, false))
+      exit(1);
+   while ((n = rpi_tls_recv(&t, buf, sizeof(buf))) > 0)
+      got += n;
+   if (bTls)
+      rpi_tls_close(&t);
+   return got;
+}
+
+static void
+run (const char* name, bool bTls, bool bKernel, bool bSendfile, size_t total)
+{
+   struct in_addr lo = { htonl(INADDR_LOOPBACK) };
+   int lsock = OpenListenSocket(&lo, 0, 1), fd, status;
+   struct sockaddr_in sa;
+   socklen_t sl = sizeof(sa);
+   double t0, c0, wall, cpu;
+   size_t got;
+   pid_t pid;
+
+   if (bKernel)
+      unsetenv("RPI_TLS_NO_KTLS");
+   else
+      setenv("RPI_TLS_NO_KTLS", "1", 1);
+   getsockname(lsock, (struct sockaddr*) &sa, &sl);
+   t0 = now_sec();
+   c0 = cpu_sec(RUSAGE_SELF) + cpu_sec(RUSAGE_CHILDREN);
+   fflush(stdout);
+   if (0 == (pid = fork()))
+   {
+      int s = accept(lsock, NULL, NULL);
+      sender(s, bTls, bSendfile, total);
+   }
+   close(lsock);
+   fd = socket(AF_INET, SOCK_STREAM, 0);
+   if (connect(fd, (struct sockaddr*) &sa, sizeof(sa)))
+      exit(1);
+   got = receiver(fd, bTls);
+   close(fd);
+   waitpid(pid, &status, 0);
+   wall = now_sec() - t0;
+   cpu = cpu_sec(RUSAGE_SELF) + cpu_sec(RUSAGE_CHILDREN) - c0;
+   printf("%-22s %8.1f MB/s %8.2f CPU s/GB %s%s\n", name, got / wall / 1e6, cpu / (got / 1e9),
+          (got < total) ? "(short) " : "", (bKernel && (3 == WEXITSTATUS(status))) ? "(no kTLS here, user space)" : "");
+}
+
+int
+main (int argc, char** argv)
+{
+   size_t total = ((argc > 1) ? atoi(argv[1]) : 512) * (size_t) 1000000;
+   char* buf = calloc(1, 32 * CHUNK);
+   FILE* fp;
+
+   if (!make_cert())
+   {
+      fprintf(stderr, "cannot make a test certificate\n");
+      return 1;
+   }
+   if ((NULL == (fp = fopen(file_path, "w"))) || (1 != fwrite(buf, 32 * CHUNK, 1, fp)))
+      return 1;
+   fclose(fp);
+
+   run("plain send", false, false, false, total);
+   run("plain sendfile", false, false, true, total);
+   run("kTLS send", true, true, false, total);
+   run("kTLS sendfile", true, true, true, total);
+   run("user space TLS send", true, false, false, total);
+   run("user space TLS file", true, false, true, total);
+   unlink(cert_path);
+   unlink(key_path);
+   unlink(file_path);
+   return 0;
+}
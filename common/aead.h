@@ -0,0 +1,507 @@
+/*
+ * Per packet authenticated encryption of the video stream, SRTP style.
+ *
+ * ChaCha20-Poly1305 (RFC 8439) in plain C. None of the Pi SoCs (BCM2835 up
+ * to BCM2711) has the ARMv8 crypto extensions, so AES-GCM would be a table
+ * based software AES everywhere; ChaCha20 is only adds, rotates and xors,
+ * and gcc turns the xor loops into NEON on armv7/aarch64.
+ *
+ * Both ends share a 32 byte master key (key file, 64 hex digits). Every run
+ * of the sender and every key rotation starts a session, its 64 bit id is the
+ * start time in ms above 20 random bits and always bigger than the one before
+ * (aead_session_id()). The session key is derived from the master key and the
+ * id, so a restart never reuses a nonce, and the receiver only ever switches
+ * to a newer session: a replayed packet of an earlier run is refused. The
+ * sender's clock must not go back between runs (a Pi without RTC keeps it
+ * with fake-hwclock until NTP).
+ *
+ *    packet: [session id 8][seq 8][ciphertext][tag 16]    (ids big endian)
+ *    nonce:  0 0 0 0 | seq,  AAD: the 16 byte header
+ *
+ * The receiver drops a packet it has already seen or that is older than a
+ * 64 packet window. A key rotation over the control channel is sealed under
+ * the current master key, see aead_rotate_seal().
+ */
+#ifndef AEAD_H
+#define AEAD_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define AEAD_KEY_LEN        32
+#define AEAD_TAG_LEN        16
+#define AEAD_HDR_LEN        16
+#define AEAD_OVERHEAD       (AEAD_HDR_LEN + AEAD_TAG_LEN)
+#define AEAD_DGRAM_PAYLOAD  1400        /// UDP: video bytes per datagram, fits a 1500 byte MTU
+#define AEAD_REPLAY_WINDOW  64
+#define AEAD_ROTATE_HEX_LEN (2 * (12 + AEAD_KEY_LEN + AEAD_TAG_LEN))
+
+static inline uint32_t
+aead_le32 (const uint8_t* p)
+{
+   return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline void
+aead_st32 (uint8_t* p, uint32_t v)
+{
+   p[0] = v;
+   p[1] = v >> 8;
+   p[2] = v >> 16;
+   p[3] = v >> 24;
+}
+
+static inline uint64_t
+aead_be64 (const uint8_t* p)
+{
+   uint64_t v = 0;
+   int i;
+   for (i = 0; i < 8; i++)
+      v = (v << 8) | p[i];
+   return v;
+}
+
+static inline void
+aead_st_be64 (uint8_t* p, uint64_t v)
+{
+   int i;
+   for (i = 7; i >= 0; i--, v >>= 8)
+      p[i] = v;
+}
+
+#define AEAD_ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define AEAD_QR(a, b, c, d) \
+   a += b; d ^= a; d = AEAD_ROTL32(d, 16); \
+   c += d; b ^= c; b = AEAD_ROTL32(b, 12); \
+   a += b; d ^= a; d = AEAD_ROTL32(d, 8);  \
+   c += d; b ^= c; b = AEAD_ROTL32(b, 7)
+
+static inline void
+chacha20_block (const uint32_t in[16], uint8_t out[64])
+{
+   uint32_t x[16];
+   int i;
+
+   memcpy(x, in, sizeof(x));
+   for (i = 0; i < 10; i++)
+   {
+      AEAD_QR(x[0], x[4], x[8], x[12]);
+      AEAD_QR(x[1], x[5], x[9], x[13]);
+      AEAD_QR(x[2], x[6], x[10], x[14]);
+      AEAD_QR(x[3], x[7], x[11], x[15]);
+      AEAD_QR(x[0], x[5], x[10], x[15]);
+      AEAD_QR(x[1], x[6], x[11], x[12]);
+      AEAD_QR(x[2], x[7], x[8], x[13]);
+      AEAD_QR(x[3], x[4], x[9], x[14]);
+   }
+   for (i = 0; i < 16; i++)
+      aead_st32(out + 4 * i, x[i] + in[i]);
+}
+
+static inline void
+chacha20_xor (const uint8_t key[32], uint32_t counter, const uint8_t nonce[12], const uint8_t* in, uint8_t* out, size_t len)
+{
+   uint32_t st[16] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };
+   uint8_t ks[64];
+   size_t i, n;
+
+   for (i = 0; i < 8; i++)
+      st[4 + i] = aead_le32(key + 4 * i);
+   st[12] = counter;
+   for (i = 0; i < 3; i++)
+      st[13 + i] = aead_le32(nonce + 4 * i);
+   while (len)
+   {
+      chacha20_block(st, ks);
+      n = (len < 64) ? len : 64;
+      for (i = 0; i < n; i++)
+         out[i] = in[i] ^ ks[i];
+      st[12]++;
+      in += n;
+      out += n;
+      len -= n;
+   }
+}
+
+/* Poly1305 with 26 bit limbs, no 128 bit multiply needed on 32 bit ARM */
+typedef struct
+{
+   uint32_t r[5], h[5], pad[4];
+} POLY1305;
+
+static inline void
+poly1305_init (POLY1305* p, const uint8_t key[32])
+{
+   int i;
+   p->r[0] = aead_le32(key + 0) & 0x3ffffff;
+   p->r[1] = (aead_le32(key + 3) >> 2) & 0x3ffff03;
+   p->r[2] = (aead_le32(key + 6) >> 4) & 0x3ffc0ff;
+   p->r[3] = (aead_le32(key + 9) >> 6) & 0x3f03fff;
+   p->r[4] = (aead_le32(key + 12) >> 8) & 0x00fffff;
+   memset(p->h, 0, sizeof(p->h));
+   for (i = 0; i < 4; i++)
+      p->pad[i] = aead_le32(key + 16 + 4 * i);
+}
+
+static inline void
+poly1305_blocks (POLY1305* p, const uint8_t* m, size_t len)
+{
+   const uint32_t r0 = p->r[0], r1 = p->r[1], r2 = p->r[2], r3 = p->r[3], r4 = p->r[4];
+   const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+   uint32_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3], h4 = p->h[4];
+
+   while (len >= 16)
+   {
+      uint64_t d0, d1, d2, d3, d4;
+      uint32_t c;
+
+      h0 += aead_le32(m + 0) & 0x3ffffff;
+      h1 += (aead_le32(m + 3) >> 2) & 0x3ffffff;
+      h2 += (aead_le32(m + 6) >> 4) & 0x3ffffff;
+      h3 += (aead_le32(m + 9) >> 6) & 0x3ffffff;
+      h4 += (aead_le32(m + 12) >> 8) | (1 << 24);
+
+      d0 = (uint64_t) h0 * r0 + (uint64_t) h1 * s4 + (uint64_t) h2 * s3 + (uint64_t) h3 * s2 + (uint64_t) h4 * s1;
+      d1 = (uint64_t) h0 * r1 + (uint64_t) h1 * r0 + (uint64_t) h2 * s4 + (uint64_t) h3 * s3 + (uint64_t) h4 * s2;
+      d2 = (uint64_t) h0 * r2 + (uint64_t) h1 * r1 + (uint64_t) h2 * r0 + (uint64_t) h3 * s4 + (uint64_t) h4 * s3;
+      d3 = (uint64_t) h0 * r3 + (uint64_t) h1 * r2 + (uint64_t) h2 * r1 + (uint64_t) h3 * r0 + (uint64_t) h4 * s4;
+      d4 = (uint64_t) h0 * r4 + (uint64_t) h1 * r3 + (uint64_t) h2 * r2 + (uint64_t) h3 * r1 + (uint64_t) h4 * r0;
+
+      c = d0 >> 26; h0 = d0 & 0x3ffffff; d1 += c;
+      c = d1 >> 26; h1 = d1 & 0x3ffffff; d2 += c;
+      c = d2 >> 26; h2 = d2 & 0x3ffffff; d3 += c;
+      c = d3 >> 26; h3 = d3 & 0x3ffffff; d4 += c;
+      c = d4 >> 26; h4 = d4 & 0x3ffffff;
+      h0 += c * 5;
+      c = h0 >> 26; h0 &= 0x3ffffff; h1 += c;
+
+      m += 16;
+      len -= 16;
+   }
+   p->h[0] = h0; p->h[1] = h1; p->h[2] = h2; p->h[3] = h3; p->h[4] = h4;
+}
+
+/* the AEAD pads every part to 16 bytes with zeros, so there is no short final block */
+static inline void
+poly1305_update_padded (POLY1305* p, const uint8_t* m, size_t len)
+{
+   uint8_t last[16] = { 0 };
+
+   poly1305_blocks(p, m, len & ~(size_t) 15);
+   if (len & 15)
+   {
+      memcpy(last, m + (len & ~(size_t) 15), len & 15);
+      poly1305_blocks(p, last, 16);
+   }
+}
+
+static inline void
+poly1305_finish (POLY1305* p, uint8_t tag[16])
+{
+   uint32_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3], h4 = p->h[4];
+   uint32_t g0, g1, g2, g3, g4, c, mask;
+   uint64_t f;
+
+   c = h1 >> 26; h1 &= 0x3ffffff; h2 += c;
+   c = h2 >> 26; h2 &= 0x3ffffff; h3 += c;
+   c = h3 >> 26; h3 &= 0x3ffffff; h4 += c;
+   c = h4 >> 26; h4 &= 0x3ffffff; h0 += c * 5;
+   c = h0 >> 26; h0 &= 0x3ffffff; h1 += c;
+
+   //h - p, keep it if it did not go negative
+   g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+   g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+   g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+   g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+   g4 = h4 + c - (1 << 26);
+   mask = (g4 >> 31) - 1;
+   h0 = (h0 & ~mask) | (g0 & mask);
+   h1 = (h1 & ~mask) | (g1 & mask);
+   h2 = (h2 & ~mask) | (g2 & mask);
+   h3 = (h3 & ~mask) | (g3 & mask);
+   h4 = (h4 & ~mask) | (g4 & mask);
+
+   h0 = h0 | (h1 << 26);
+   h1 = (h1 >> 6) | (h2 << 20);
+   h2 = (h2 >> 12) | (h3 << 14);
+   h3 = (h3 >> 18) | (h4 << 8);
+
+   f = (uint64_t) h0 + p->pad[0];              aead_st32(tag + 0, f);
+   f = (uint64_t) h1 + p->pad[1] + (f >> 32);  aead_st32(tag + 4, f);
+   f = (uint64_t) h2 + p->pad[2] + (f >> 32);  aead_st32(tag + 8, f);
+   f = (uint64_t) h3 + p->pad[3] + (f >> 32);  aead_st32(tag + 12, f);
+}
+
+static inline void
+aead_mac (const uint8_t key[32], const uint8_t nonce[12], const uint8_t* ad, size_t ad_len,
+          const uint8_t* ct, size_t ct_len, uint8_t tag[16])
+{
+   uint8_t otk[64], lens[16];
+   static const uint8_t zero[64];
+   POLY1305 p;
+
+   chacha20_xor(key, 0, nonce, zero, otk, 64);
+   poly1305_init(&p, otk);
+   poly1305_update_padded(&p, ad, ad_len);
+   poly1305_update_padded(&p, ct, ct_len);
+   aead_st32(lens + 0, ad_len);
+   aead_st32(lens + 4, (uint64_t) ad_len >> 32);
+   aead_st32(lens + 8, ct_len);
+   aead_st32(lens + 12, (uint64_t) ct_len >> 32);
+   poly1305_blocks(&p, lens, 16);
+   poly1305_finish(&p, tag);
+}
+
+static inline void
+aead_seal (const uint8_t key[32], const uint8_t nonce[12], const uint8_t* ad, size_t ad_len,
+           const uint8_t* in, size_t len, uint8_t* out, uint8_t tag[16])
+{
+   chacha20_xor(key, 1, nonce, in, out, len);
+   aead_mac(key, nonce, ad, ad_len, out, len, tag);
+}
+
+/* out may be in, nothing is decrypted if the tag does not match */
+static inline bool
+aead_open (const uint8_t key[32], const uint8_t nonce[12], const uint8_t* ad, size_t ad_len,
+           const uint8_t* in, size_t len, uint8_t* out, const uint8_t tag[16])
+{
+   uint8_t calc[16], diff = 0;
+   int i;
+
+   aead_mac(key, nonce, ad, ad_len, in, len, calc);
+   for (i = 0; i < 16; i++)
+      diff |= calc[i] ^ tag[i];
+   if (diff)
+      return false;
+   chacha20_xor(key, 1, nonce, in, out, len);
+   return true;
+}
+
+typedef struct
+{
+   uint8_t master[AEAD_KEY_LEN];
+   uint8_t key[AEAD_KEY_LEN];          /// derived from master and session
+   uint64_t session;
+   uint64_t seq;                       /// sender: next sequence number
+   bool bStarted;
+} AEAD_SESSION;
+
+static inline void
+aead_session_start (AEAD_SESSION* s, const uint8_t master[AEAD_KEY_LEN], uint64_t session)
+{
+   static const uint8_t zero[AEAD_KEY_LEN];
+   uint8_t nonce[12] = { 'S', 'E', 'S', 'S' };
+
+   if (s->master != master)
+      memcpy(s->master, master, AEAD_KEY_LEN);
+   aead_st_be64(nonce + 4, session);
+   chacha20_xor(s->master, 0, nonce, zero, s->key, AEAD_KEY_LEN);
+   s->session = session;
+   s->seq = 0;
+   s->bStarted = true;
+}
+
+/* out gets len + AEAD_OVERHEAD bytes */
+static inline size_t
+aead_packet_seal (AEAD_SESSION* s, const uint8_t* in, size_t len, uint8_t* out)
+{
+   uint8_t nonce[12] = { 0 };
+
+   aead_st_be64(out, s->session);
+   aead_st_be64(out + 8, s->seq);
+   aead_st_be64(nonce + 4, s->seq++);
+   aead_seal(s->key, nonce, out, AEAD_HDR_LEN, in, len, out + AEAD_HDR_LEN, out + AEAD_HDR_LEN + len);
+   return len + AEAD_OVERHEAD;
+}
+
+static inline uint64_t
+aead_packet_session (const uint8_t* pkt)
+{
+   return aead_be64(pkt);
+}
+
+static inline uint64_t
+aead_packet_seq (const uint8_t* pkt)
+{
+   return aead_be64(pkt + 8);
+}
+
+/* out gets len - AEAD_OVERHEAD bytes, false if it is not from this session or was tampered with */
+static inline bool
+aead_packet_open (const AEAD_SESSION* s, const uint8_t* pkt, size_t len, uint8_t* out)
+{
+   uint8_t nonce[12] = { 0 };
+
+   if ((len < AEAD_OVERHEAD) || !s->bStarted || (aead_packet_session(pkt) != s->session))
+      return false;
+   memcpy(nonce + 4, pkt + 8, 8);
+   len -= AEAD_OVERHEAD;
+   return aead_open(s->key, nonce, pkt, AEAD_HDR_LEN, pkt + AEAD_HDR_LEN, len, out, pkt + AEAD_HDR_LEN + len);
+}
+
+/* sliding window of the last AEAD_REPLAY_WINDOW sequence numbers, as in SRTP */
+typedef struct
+{
+   uint64_t top;                       /// highest sequence number accepted
+   uint64_t bitmap;                    /// bit n: top - n was accepted
+   bool bValid;
+} AEAD_REPLAY;
+
+static inline bool
+aead_replay_check (const AEAD_REPLAY* w, uint64_t seq)
+{
+   if (!w->bValid || (seq > w->top))
+      return true;
+   if (w->top - seq >= AEAD_REPLAY_WINDOW)
+      return false;
+   return !(w->bitmap & (1ULL << (w->top - seq)));
+}
+
+/* only after the packet authenticated */
+static inline void
+aead_replay_update (AEAD_REPLAY* w, uint64_t seq)
+{
+   if (!w->bValid)
+   {
+      w->bValid = true;
+      w->top = seq;
+      w->bitmap = 1;
+   }
+   else if (seq > w->top)
+   {
+      w->bitmap = (seq - w->top >= AEAD_REPLAY_WINDOW) ? 0 : (w->bitmap << (seq - w->top));
+      w->bitmap |= 1;
+      w->top = seq;
+   }
+   else
+      w->bitmap |= 1ULL << (w->top - seq);
+}
+
+static inline bool
+aead_random (void* buf, size_t len)
+{
+   int fd = open("/dev/urandom", O_RDONLY);
+   bool bOK = (fd >= 0) && (read(fd, buf, len) == (ssize_t) len);
+   if (fd >= 0)
+      close(fd);
+   return bOK;
+}
+
+/* a session id bigger than prev: ms since 1970 above 20 random bits, false without random numbers */
+static inline bool
+aead_session_id (uint64_t prev, uint64_t* id)
+{
+   struct timespec ts;
+   uint32_t r;
+
+   if (!aead_random(&r, sizeof(r)))
+      return false;
+   clock_gettime(CLOCK_REALTIME, &ts);
+   *id = (((uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000) << 20) | (r & 0xfffff);
+   if (*id <= prev)
+      *id = prev + 1;
+   return true;
+}
+
+static inline void
+aead_to_hex (const uint8_t* in, size_t len, char* out)
+{
+   static const char digits[] = "0123456789abcdef";
+   size_t i;
+   for (i = 0; i < len; i++)
+   {
+      out[2 * i] = digits[in[i] >> 4];
+      out[2 * i + 1] = digits[in[i] & 15];
+   }
+   out[2 * len] = 0;
+}
+
+static inline bool
+aead_from_hex (const char* in, uint8_t* out, size_t len)
+{
+   size_t i;
+   for (i = 0; i < len; i++)
+   {
+      unsigned int v;
+      if (1 != sscanf(in + 2 * i, "%2x", &v))
+         return false;
+      out[i] = v;
+   }
+   return true;
+}
+
+/* key file: 64 hex digits, anything after them is ignored */
+static inline bool
+aead_load_key (const char* path, uint8_t key[AEAD_KEY_LEN])
+{
+   char hex[2 * AEAD_KEY_LEN + 1] = "";
+   FILE* fp = fopen(path, "r");
+   bool bOK;
+
+   if (!fp)
+      return false;
+   bOK = (1 == fscanf(fp, "%64s", hex)) && (strlen(hex) == 2 * AEAD_KEY_LEN) && aead_from_hex(hex, key, AEAD_KEY_LEN);
+   fclose(fp);
+   return bOK;
+}
+
+/* written to a temp file and renamed, a power cut never leaves half a key */
+static inline bool
+aead_save_key (const char* path, const uint8_t key[AEAD_KEY_LEN])
+{
+   char hex[2 * AEAD_KEY_LEN + 1], tmp[1024];
+   FILE* fp;
+   int fd;
+
+   snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+   if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+      return false;
+   if (NULL == (fp = fdopen(fd, "w")))
+   {
+      close(fd);
+      return false;
+   }
+   aead_to_hex(key, AEAD_KEY_LEN, hex);
+   fprintf(fp, "%s\n", hex);
+   if (fflush(fp) || fsync(fd))
+   {
+      fclose(fp);
+      return false;
+   }
+   fclose(fp);
+   return 0 == rename(tmp, path);
+}
+
+/*
+ * Key rotation command for the control channel, "key=" + hex out:
+ * [nonce 12: "ROT1" + 8 random][new key sealed under the current master key][tag].
+ * A replayed rotation was sealed under an older key and no longer opens.
+ */
+static inline bool
+aead_rotate_seal (const uint8_t master[AEAD_KEY_LEN], const uint8_t newkey[AEAD_KEY_LEN], char out[AEAD_ROTATE_HEX_LEN + 1])
+{
+   uint8_t msg[12 + AEAD_KEY_LEN + AEAD_TAG_LEN] = { 'R', 'O', 'T', '1' };
+
+   if (!aead_random(msg + 4, 8))
+      return false;
+   aead_seal(master, msg, NULL, 0, newkey, AEAD_KEY_LEN, msg + 12, msg + 12 + AEAD_KEY_LEN);
+   aead_to_hex(msg, sizeof(msg), out);
+   return true;
+}
+
+static inline bool
+aead_rotate_open (const uint8_t master[AEAD_KEY_LEN], const char* hex, uint8_t newkey[AEAD_KEY_LEN])
+{
+   uint8_t msg[12 + AEAD_KEY_LEN + AEAD_TAG_LEN];
+
+   if (!aead_from_hex(hex, msg, sizeof(msg)) || memcmp(msg, "ROT1", 4))
+      return false;
+   return aead_open(master, msg, NULL, 0, msg + 12, AEAD_KEY_LEN, newkey, msg + 12 + AEAD_KEY_LEN);
+}
+
+#endif //AEAD_H
@@ -0,0 +1,321 @@
+/*
+ * BLAKE3 hash and keyed hash, 32 byte output, in plain C.
+ *
+ * Like ChaCha20 in aead.h it is only adds, rotates and xors. Four whole chunks
+ * at a time go through a 4 lane version of the compression function written
+ * with gcc vector types, which gcc turns into NEON on armv7/aarch64 (and SSE2
+ * on x86), everything else is one lane. None of the Pi SoCs has the ARMv8
+ * SHA-2 instructions, so SHA-256 would be the slower choice.
+ *
+ * Only what the recorder needs: no XOF, no derive_key.
+ */
+#ifndef BLAKE3_H
+#define BLAKE3_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define BLAKE3_OUT_LEN   32
+#define BLAKE3_KEY_LEN   32
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_MAX_DEPTH 54                 /// 2^54 chunks are 2^64 bytes
+
+#define BLAKE3_CHUNK_START 1
+#define BLAKE3_CHUNK_END   2
+#define BLAKE3_PARENT      4
+#define BLAKE3_ROOT        8
+#define BLAKE3_KEYED_HASH  16
+
+static const uint32_t blake3_iv[8] =
+{
+   0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const uint8_t blake3_schedule[7][16] =
+{
+   {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+   {  2,  6,  3, 10,  7,  0,  4, 13,  1, 11, 12,  5,  9, 14, 15,  8 },
+   {  3,  4, 10, 12, 13,  2,  7, 14,  6,  5,  9,  0, 11, 15,  8,  1 },
+   { 10,  7, 12,  9, 14,  3, 13, 15,  4,  0, 11,  2,  5,  8,  1,  6 },
+   { 12, 13,  9, 11, 15, 10, 14,  8,  7,  2,  5,  3,  0,  1,  6,  4 },
+   {  9, 14, 11,  5,  8, 12, 15,  1, 13,  3,  0, 10,  2,  6,  4,  7 },
+   { 11, 15,  5,  0,  1,  9,  8,  6, 14, 10,  2, 12,  3,  4,  7, 13 },
+};
+
+typedef struct
+{
+   uint32_t key[8];                         /// IV, or the key words of a keyed hash
+   uint8_t flags;                           /// 0 or BLAKE3_KEYED_HASH
+   //the chunk being filled
+   uint32_t cv[8];
+   uint64_t chunk;                          /// its index
+   uint8_t block[BLAKE3_BLOCK_LEN];
+   uint8_t block_len;
+   uint8_t blocks;                          /// compressed blocks of the chunk
+   //chaining values of complete subtrees, one per set bit of the chunk count
+   uint32_t stack[BLAKE3_MAX_DEPTH + 1][8];
+   uint8_t stack_len;
+} BLAKE3;
+
+static inline uint32_t
+blake3_le32 (const uint8_t* p)
+{
+   return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+#define BLAKE3_ROTR(v, n) (((v) >> (n)) | ((v) << (32 - (n))))
+#define BLAKE3_G(v, a, b, c, d, x, y) \
+   do { \
+      v[a] = v[a] + v[b] + (x); v[d] = BLAKE3_ROTR(v[d] ^ v[a], 16); \
+      v[c] = v[c] + v[d];       v[b] = BLAKE3_ROTR(v[b] ^ v[c], 12); \
+      v[a] = v[a] + v[b] + (y); v[d] = BLAKE3_ROTR(v[d] ^ v[a], 8); \
+      v[c] = v[c] + v[d];       v[b] = BLAKE3_ROTR(v[b] ^ v[c], 7); \
+   } while (0)
+#define BLAKE3_ROUND(v, m, s) \
+   do { \
+      BLAKE3_G(v, 0, 4,  8, 12, m[s[0]],  m[s[1]]); \
+      BLAKE3_G(v, 1, 5,  9, 13, m[s[2]],  m[s[3]]); \
+      BLAKE3_G(v, 2, 6, 10, 14, m[s[4]],  m[s[5]]); \
+      BLAKE3_G(v, 3, 7, 11, 15, m[s[6]],  m[s[7]]); \
+      BLAKE3_G(v, 0, 5, 10, 15, m[s[8]],  m[s[9]]); \
+      BLAKE3_G(v, 1, 6, 11, 12, m[s[10]], m[s[11]]); \
+      BLAKE3_G(v, 2, 7,  8, 13, m[s[12]], m[s[13]]); \
+      BLAKE3_G(v, 3, 4,  9, 14, m[s[14]], m[s[15]]); \
+   } while (0)
+
+/* cv = first half of the compression of one block, what everything but the root output needs */
+static inline void
+blake3_compress (uint32_t cv[8], const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len, uint64_t counter, uint8_t flags)
+{
+   uint32_t m[16], v[16];
+   int i;
+
+   for (i = 0; i < 16; i++)
+      m[i] = blake3_le32(block + 4 * i);
+   for (i = 0; i < 8; i++)
+   {
+      v[i] = cv[i];
+      v[i + 8] = (i < 4) ? blake3_iv[i] : 0;
+   }
+   v[12] = (uint32_t) counter;
+   v[13] = (uint32_t)(counter >> 32);
+   v[14] = block_len;
+   v[15] = flags;
+   for (i = 0; i < 7; i++)
+      BLAKE3_ROUND(v, m, blake3_schedule[i]);
+   for (i = 0; i < 8; i++)
+      cv[i] = v[i] ^ v[i + 8];
+}
+
+typedef uint32_t blake3_vec __attribute__ ((vector_size (16)));
+
+/*
+ * Four complete chunks at once, chunk index counter .. counter + 3, one per
+ * lane. Not the last chunk of the input, so never a root.
+ */
+static inline void
+blake3_hash4 (const uint32_t key[8], uint8_t flags, const uint8_t* in, uint64_t counter, uint32_t out[4][8])
+{
+   blake3_vec cv[8], m[16], v[16];
+   int b, i, l;
+
+   for (i = 0; i < 8; i++)
+      cv[i] = (blake3_vec) { key[i], key[i], key[i], key[i] };
+   for (b = 0; b < BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN; b++)
+   {
+      uint32_t f = flags | (b ? 0 : BLAKE3_CHUNK_START) | ((b == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1) ? BLAKE3_CHUNK_END : 0);
+
+      //transposed: word i of the block of every lane
+      for (i = 0; i < 16; i++)
+         for (l = 0; l < 4; l++)
+            m[i][l] = blake3_le32(in + l * BLAKE3_CHUNK_LEN + b * BLAKE3_BLOCK_LEN + 4 * i);
+      for (i = 0; i < 8; i++)
+      {
+         v[i] = cv[i];
+         v[i + 8] = (i < 4) ? (blake3_vec) { blake3_iv[i], blake3_iv[i], blake3_iv[i], blake3_iv[i] } : (blake3_vec) { 0 };
+      }
+      for (l = 0; l < 4; l++)
+      {
+         v[12][l] = (uint32_t)(counter + l);
+         v[13][l] = (uint32_t)((counter + l) >> 32);
+      }
+      v[14] = (blake3_vec) { BLAKE3_BLOCK_LEN, BLAKE3_BLOCK_LEN, BLAKE3_BLOCK_LEN, BLAKE3_BLOCK_LEN };
+      v[15] = (blake3_vec) { f, f, f, f };
+      for (i = 0; i < 7; i++)
+         BLAKE3_ROUND(v, m, blake3_schedule[i]);
+      for (i = 0; i < 8; i++)
+         cv[i] = v[i] ^ v[i + 8];
+   }
+   for (l = 0; l < 4; l++)
+      for (i = 0; i < 8; i++)
+         out[l][i] = cv[i][l];
+}
+
+static inline void
+blake3_words_to_bytes (const uint32_t w[8], uint8_t out[32])
+{
+   int i;
+   for (i = 0; i < 8; i++)
+   {
+      out[4 * i] = (uint8_t) w[i];
+      out[4 * i + 1] = (uint8_t)(w[i] >> 8);
+      out[4 * i + 2] = (uint8_t)(w[i] >> 16);
+      out[4 * i + 3] = (uint8_t)(w[i] >> 24);
+   }
+}
+
+static inline void
+blake3_parent (const BLAKE3* h, const uint32_t left[8], const uint32_t right[8], uint32_t out[8], uint8_t extra)
+{
+   uint8_t block[BLAKE3_BLOCK_LEN];
+
+   blake3_words_to_bytes(left, block);
+   blake3_words_to_bytes(right, block + 32);
+   memcpy(out, h->key, sizeof(h->key));
+   blake3_compress(out, block, BLAKE3_BLOCK_LEN, 0, h->flags | BLAKE3_PARENT | extra);
+}
+
+/* a complete chunk, total = chunks so far with it: merge as many subtrees as the count has trailing zeros */
+static inline void
+blake3_push_chunk (BLAKE3* h, uint32_t cv[8], uint64_t total)
+{
+   while (!(total & 1))
+   {
+      blake3_parent(h, h->stack[--h->stack_len], cv, cv, 0);
+      total >>= 1;
+   }
+   memcpy(h->stack[h->stack_len++], cv, 32);
+}
+
+static inline void
+blake3_start_chunk (BLAKE3* h, uint64_t chunk)
+{
+   memcpy(h->cv, h->key, sizeof(h->key));
+   h->chunk = chunk;
+   h->block_len = h->blocks = 0;
+}
+
+static inline void
+blake3_init_keyed (BLAKE3* h, const uint8_t* key)
+{
+   int i;
+
+   for (i = 0; i < 8; i++)
+      h->key[i] = key ? blake3_le32(key + 4 * i) : blake3_iv[i];
+   h->flags = key ? BLAKE3_KEYED_HASH : 0;
+   h->stack_len = 0;
+   blake3_start_chunk(h, 0);
+}
+
+static inline void
+blake3_init (BLAKE3* h)
+{
+   blake3_init_keyed(h, NULL);
+}
+
+static inline void
+blake3_update (BLAKE3* h, const void* data, size_t len)
+{
+   const uint8_t* in = data;
+
+   while (len)
+   {
+      size_t n;
+
+      //the chunk is full and more comes, so it is not the root
+      if (h->blocks * BLAKE3_BLOCK_LEN + h->block_len == BLAKE3_CHUNK_LEN)
+      {
+         blake3_compress(h->cv, h->block, BLAKE3_BLOCK_LEN, h->chunk, h->flags | BLAKE3_CHUNK_END);
+         blake3_push_chunk(h, h->cv, h->chunk + 1);
+         blake3_start_chunk(h, h->chunk + 1);
+      }
+      //on a chunk boundary four whole chunks with more input after them go through the lanes
+      while (!h->blocks && !h->block_len && (len > 4 * BLAKE3_CHUNK_LEN))
+      {
+         uint32_t cv[4][8];
+         int l;
+
+         blake3_hash4(h->key, h->flags, in, h->chunk, cv);
+         for (l = 0; l < 4; l++)
+            blake3_push_chunk(h, cv[l], h->chunk + l + 1);
+         blake3_start_chunk(h, h->chunk + 4);
+         in += 4 * BLAKE3_CHUNK_LEN;
+         len -= 4 * BLAKE3_CHUNK_LEN;
+      }
+      //a full block with more input after it is compressed, the last one waits for finalize
+      if ((h->block_len == BLAKE3_BLOCK_LEN) && (h->blocks * BLAKE3_BLOCK_LEN + BLAKE3_BLOCK_LEN < BLAKE3_CHUNK_LEN))
+      {
+         blake3_compress(h->cv, h->block, BLAKE3_BLOCK_LEN, h->chunk, h->flags | (h->blocks ? 0 : BLAKE3_CHUNK_START));
+         h->blocks++;
+         h->block_len = 0;
+      }
+      n = BLAKE3_BLOCK_LEN - h->block_len;
+      if (!n)
+         continue;                           //the chunk is full, handled at the top with the next byte
+      if (n > len)
+         n = len;
+      memcpy(h->block + h->block_len, in, n);
+      h->block_len += n;
+      in += n;
+      len -= n;
+   }
+}
+
+static inline void
+blake3_final (const BLAKE3* h, uint8_t out[BLAKE3_OUT_LEN])
+{
+   uint8_t block[BLAKE3_BLOCK_LEN];
+   uint32_t cv[8], words[16], v[16];
+   uint8_t flags = h->flags | BLAKE3_CHUNK_END | (h->blocks ? 0 : BLAKE3_CHUNK_START);
+   uint64_t counter = h->chunk;
+   uint8_t block_len = h->block_len;
+   int i, n = h->stack_len;
+
+   //the output of the last chunk, then of the parents on the way up; the root one gets ROOT
+   memcpy(cv, h->cv, sizeof(cv));
+   memset(block, 0, sizeof(block));
+   memcpy(block, h->block, h->block_len);
+   while (n)
+   {
+      uint32_t right[8];
+
+      memcpy(right, cv, sizeof(cv));
+      blake3_compress(right, block, block_len, counter, flags);
+      blake3_words_to_bytes(h->stack[--n], block);
+      blake3_words_to_bytes(right, block + 32);
+      memcpy(cv, h->key, sizeof(cv));
+      counter = 0;
+      block_len = BLAKE3_BLOCK_LEN;
+      flags = h->flags | BLAKE3_PARENT;
+   }
+   flags |= BLAKE3_ROOT;
+   for (i = 0; i < 16; i++)
+      words[i] = blake3_le32(block + 4 * i);
+   for (i = 0; i < 8; i++)
+   {
+      v[i] = cv[i];
+      v[i + 8] = (i < 4) ? blake3_iv[i] : 0;
+   }
+   v[12] = (uint32_t) counter;
+   v[13] = (uint32_t)(counter >> 32);
+   v[14] = block_len;
+   v[15] = flags;
+   for (i = 0; i < 7; i++)
+      BLAKE3_ROUND(v, words, blake3_schedule[i]);
+   for (i = 0; i < 8; i++)
+      cv[i] = v[i] ^ v[i + 8];
+   blake3_words_to_bytes(cv, out);
+}
+
+static inline void
+blake3 (const void* data, size_t len, uint8_t out[BLAKE3_OUT_LEN])
+{
+   BLAKE3 h;
+   blake3_init(&h);
+   blake3_update(&h, data, len);
+   blake3_final(&h, out);
+}
+
+#endif
@@ -0,0 +1,261 @@
+/*
+ * Available bandwidth of a TCP connection, measured by the sender alone.
+ *
+ * A packet train of H264 filler NAL units (type 12, every decoder drops them)
+ * is written to the socket and the send queue (SIOCOUTQ) is sampled while the
+ * receiver acknowledges it. The ACKs leave the bottleneck link spaced by its
+ * capacity, so the slope of acknowledged bytes over time from the first ACK
+ * to the last one is the bandwidth, the round trip is not in it. A ramp of
+ * doubling trains gets TCP out of slow start and stops when the rate no longer
+ * grows.
+ *
+ * Other threads may keep writing to the socket after a train, *queued counts
+ * what they wrote so their bytes are not taken for ours. The train itself must
+ * go out in one piece between two frames.
+ */
+#ifndef BW_PROBE_H
+#define BW_PROBE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <pthread.h>
+
+#define BW_PROBE_NAL_LEN   16384           /// one filler NAL, one send() of the train
+#define BW_PROBE_MIN_TRAIN 16384
+#define BW_PROBE_MAX_TRAIN (1024 * 1024)
+#define BW_PROBE_POLL_NS   100000
+#define BW_PROBE_IDLE_POLL_US 10000
+
+typedef struct
+{
+   int fd;                                      /// socket whose send queue is sampled
+   bool (*send)(const uint8_t* data, uint32_t len); /// writes to fd, through TLS/AEAD if there is any
+   pthread_mutex_t* lock;                       /// held around send() and *queued, NULL if nobody else writes to fd
+   uint64_t* queued;                            /// bytes written to fd by everybody else, under lock
+   bool (*boundary)(void);                      /// under lock: true if a train may go in now, between two frames
+   bool bVerbose;
+} BW_PROBE;
+
+static inline int64_t
+bw_probe_now_us (void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* bytes in the send queue, not sent yet or not acknowledged yet */
+static inline int64_t
+bw_probe_outq (int fd)
+{
+   int n = 0;
+
+   if (ioctl(fd, SIOCOUTQ, &n) < 0)
+      return -1;
+   return n;
+}
+
+/* len bytes of filler NAL units, at most BW_PROBE_NAL_LEN each */
+static inline void
+bw_probe_filler (uint8_t* buf, size_t len)
+{
+   while (len >= 6)
+   {
+      size_t n = (len > BW_PROBE_NAL_LEN) ? BW_PROBE_NAL_LEN : len;
+
+      if (len - n < 6)
+         n = len;                       //no stub at the end
+      buf[0] = buf[1] = buf[2] = 0;
+      buf[3] = 1;
+      buf[4] = 12;                      //filler data, nal_ref_idc 0
+      memset(buf + 5, 0xff, n - 6);
+      buf[n - 1] = 0x80;                //rbsp_trailing_bits
+      buf += n;
+      len -= n;
+   }
+   memset(buf, 0, len);                 //trailing_zero_8bits, only when asked for less than 6 bytes
+}
+
+/*
+ * bytes of the train acknowledged so far, base_outq/base_queued taken before it
+ * was sent, sent = how much of it went out
+ */
+static inline int64_t
+bw_probe_acked (BW_PROBE* p, int64_t base_outq, uint64_t base_queued, size_t sent)
+{
+   uint64_t others = 0;
+   int64_t outq;
+
+   if (p->lock)
+      pthread_mutex_lock(p->lock);
+   outq = bw_probe_outq(p->fd);
+   if (p->queued)
+      others = *p->queued - base_queued;
+   if (p->lock)
+      pthread_mutex_unlock(p->lock);
+   if (outq < 0)
+      return -1;
+   //what was queued before is acknowledged first, what others sent after us last
+   outq -= base_outq;
+   outq = (outq > (int64_t)(sent + others)) ? (int64_t)(sent + others) : outq;
+   outq = (int64_t)sent + (int64_t)others - outq;
+   return (outq < 0) ? 0 : ((outq > (int64_t)sent) ? (int64_t)sent : outq);
+}
+
+/*
+ * Sends one train of len bytes and waits up to timeout_us for its ACKs.
+ * Returns bits per second, 0 if nothing could be measured, -1 if the connection
+ * failed. *pbLowerBound is set when all ACKs came in before the first sample,
+ * the link is faster than the train could show and the result only counts the
+ * whole train over the whole time.
+ * With p->lock the caller already holds it, it is released once the train is out.
+ */
+static inline int64_t
+bw_probe_train (BW_PROBE* p, size_t len, int64_t timeout_us, bool* pbLowerBound)
+{
+   uint8_t* buf = malloc(len);
+   int64_t base_outq, t0, t1 = 0, a1 = 0, t = 0, a = 0, rate = 0;
+   uint64_t base_queued = p->queued ? *p->queued : 0;
+   struct timespec poll = { 0, BW_PROBE_POLL_NS };
+   size_t sent = 0;
+
+   *pbLowerBound = false;
+   if (!buf || ((base_outq = bw_probe_outq(p->fd)) < 0))
+   {
+      if (p->lock)
+         pthread_mutex_unlock(p->lock);
+      free(buf);
+      return buf ? -1 : 0;
+   }
+   bw_probe_filler(buf, len);
+   t0 = bw_probe_now_us();
+   while (sent < len)
+   {
+      size_t n = (len - sent > BW_PROBE_NAL_LEN) ? BW_PROBE_NAL_LEN : len - sent;
+
+      if (!p->send(buf + sent, n))
+      {
+         if (p->lock)
+            pthread_mutex_unlock(p->lock);
+         free(buf);
+         return -1;
+      }
+      sent += n;
+      //without a lock nobody else sends and the queue can be read while sending
+      if (!p->lock && !t1 && ((a = bw_probe_acked(p, base_outq, base_queued, sent)) > 0))
+      {
+         t1 = bw_probe_now_us();
+         a1 = a;
+      }
+   }
+   if (p->lock)
+      pthread_mutex_unlock(p->lock);
+   free(buf);
+
+   do
+   {
+      if ((a = bw_probe_acked(p, base_outq, base_queued, len)) < 0)
+         return -1;
+      t = bw_probe_now_us();
+      if (!t1 && a)
+      {
+         t1 = t;
+         a1 = a;
+      }
+      if (a < (int64_t)len)
+         nanosleep(&poll, NULL);
+   } while ((a < (int64_t)len) && (t - t0 < timeout_us));
+
+   if ((a > a1) && (t > t1))
+      rate = (a - a1) * 8 * 1000000 / (t - t1);
+   else if (a && (t > t0))
+   {
+      //everything was acknowledged at the first look
+      rate = a * 8 * 1000000 / (t - t0);
+      *pbLowerBound = true;
+   }
+   if (p->bVerbose)
+      fprintf(stderr, "probe: train %zu bytes, %lld of them acked in %lld us, %.2f Mbit/s%s\n", len, (long long) a,
+              (long long)(t - t0), rate / 1e6, *pbLowerBound ? " or more" : "");
+   return rate;
+}
+
+/*
+ * Connect time ramp: trains of 16 KB, 32 KB, ... until the rate stops growing
+ * by 10%, is at least enough_bps, the next train would exceed the time budget
+ * or BW_PROBE_MAX_TRAIN. Returns bits per second, 0 if nothing could be
+ * measured, -1 if the connection failed.
+ */
+static inline int64_t
+bw_probe_ramp (BW_PROBE* p, int64_t enough_bps, int64_t budget_us)
+{
+   int64_t start = bw_probe_now_us(), best = 0, bound = 0, prev = 0, rate;
+   size_t len;
+   int flat = 0;
+   bool bLower;
+
+   for (len = BW_PROBE_MIN_TRAIN; len <= BW_PROBE_MAX_TRAIN; len *= 2)
+   {
+      int64_t left = budget_us - (bw_probe_now_us() - start);
+
+      //the next one takes about twice as long as the last one did at the rate seen so far
+      if ((left <= 0) || (prev && ((int64_t)len * 8 * 1000000 / prev > left)))
+         break;
+      if (p->lock)
+         pthread_mutex_lock(p->lock);
+      if ((rate = bw_probe_train(p, len, left, &bLower)) < 0)
+         return -1;
+      if (bLower)
+      {
+         //the link was too fast for this train, a longer one can tell
+         bound = (rate > bound) ? rate : bound;
+         continue;
+      }
+      if (rate > best)
+         best = rate;
+      if (rate < prev * 11 / 10)
+         flat++;
+      else
+         flat = 0;
+      prev = rate;
+      if ((flat >= 2) || (best >= enough_bps))
+         break;
+   }
+   return best ? best : bound;
+}
+
+/*
+ * Lightweight probe while streaming: looks for a moment between two frames when
+ * the send queue is empty, at most window_us long, and sends one train of len
+ * bytes then. *pbIdle is false if there was no such moment, the link never
+ * caught up with the stream. Return values as bw_probe_train(), p->lock is
+ * required.
+ */
+static inline int64_t
+bw_probe_idle (BW_PROBE* p, size_t len, int64_t window_us, bool* pbIdle, bool* pbLowerBound)
+{
+   int64_t start = bw_probe_now_us();
+   struct timespec wait = { 0, BW_PROBE_IDLE_POLL_US * 1000 };
+
+   *pbIdle = *pbLowerBound = false;
+   do
+   {
+      pthread_mutex_lock(p->lock);
+      if ((!p->boundary || p->boundary()) && !bw_probe_outq(p->fd))
+      {
+         *pbIdle = true;
+         return bw_probe_train(p, len, window_us, pbLowerBound);
+      }
+      pthread_mutex_unlock(p->lock);
+      nanosleep(&wait, NULL);
+   } while (bw_probe_now_us() - start < window_us);
+   return 0;
+}
+
+#endif
@@ -0,0 +1,385 @@
+/*
+ * Append-only binary event log: motion alarms, events, drops, (re)connects.
+ *
+ * The file is a 64 byte header and fixed size records, written through a
+ * shared mapping by one background thread, evlog_add() only queues. The
+ * header count is the commit point, records beyond it are garbage after a
+ * crash. Every EVLOG_INDEX_EVERY records the time and offset of a record go
+ * to the .idx sidecar (same format as the recordings index), so a range
+ * query jumps close to its start and reads nothing else.
+ */
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "rec_index.h"
+
+#define EVLOG_MAGIC         "RPIEVLG1"
+#define EVLOG_INDEX_EVERY   256
+#define EVLOG_GROW          (1 << 20)   /// the file grows by this much at a time
+#define EVLOG_QUEUE_LEN     1024
+
+typedef enum
+{
+   EVLOG_START = 1,                    /// value: pid
+   EVLOG_STOP,                         /// program exit
+   EVLOG_CONNECT,                      /// extra: IPv4 << 16 | port
+   EVLOG_DISCONNECT,                   /// extra: IPv4 << 16 | port
+   EVLOG_ALARM,                        /// value: motion strength, at most one per second
+   EVLOG_EVENT_OPEN,                   /// value: motion strength, extra: zones
+   EVLOG_EVENT_CLOSE,                  /// value: duration ms, extra: zones
+   EVLOG_SNAPSHOT,                     /// value: bytes
+   EVLOG_VIEWER_DROP,                  /// value: drops of this viewer so far
+   EVLOG_REC_DROP,                     /// value: frames the recorder dropped so far
+   EVLOG_OVERFLOW,                     /// value: records lost because the log queue was full
+   EVLOG_CAMERA_MODE,                  /// value: 1 night, 0 day, extra: h264_mode_sei_value()
+   EVLOG_RECOVERY,                     /// value: ms from the rebuild to the first frame, extra: ms without frames before it
+   EVLOG_TYPE_MAX
+} EVLOG_TYPE;
+
+static const char* const evlog_type_names[EVLOG_TYPE_MAX] =
+{
+   "?", "start", "stop", "connect", "disconnect", "alarm", "event_open", "event_close",
+   "snapshot", "viewer_drop", "rec_drop", "overflow", "camera_mode", "recovery"
+};
+
+typedef struct
+{
+   char magic[8];
+   uint32_t record_size;
+   uint32_t reserved;
+   uint64_t count;                     /// records written
+   char pad[40];
+} EVLOG_HEADER;
+
+typedef struct
+{
+   int64_t time_us;                    /// wall clock (CLOCK_REALTIME)
+   uint16_t type;                      /// EVLOG_TYPE
+   uint16_t source;                    /// stream index in the relay, 0 on the camera
+   uint32_t value;                     /// meaning depends on the type
+   uint64_t extra;
+} EVLOG_RECORD;
+
+typedef struct
+{
+   int fd;
+   FILE* idx_fp;
+   EVLOG_HEADER* map;
+   size_t map_size;
+
+   pthread_mutex_t io_lock;            /// writer thread vs. evlog_flush() at exit
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   EVLOG_RECORD q[EVLOG_QUEUE_LEN];
+   unsigned q_rd, q_wr;                /// free running
+   uint32_t ulOverflow;
+} EVLOG;
+
+static inline int64_t
+evlog_now_us (void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_REALTIME, &ts);
+   return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline bool
+evlog_map (EVLOG* log, size_t size)
+{
+   if (log->map)
+      munmap(log->map, log->map_size);
+   log->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, log->fd, 0);
+   if (MAP_FAILED == log->map)
+   {
+      log->map = NULL;
+      return false;
+   }
+   log->map_size = size;
+   return true;
+}
+
+/* called with io_lock held */
+static inline void
+evlog_write (EVLOG* log, const EVLOG_RECORD* r, unsigned n)
+{
+   unsigned i;
+   for (i = 0; i < n; i++)
+   {
+      uint64_t off = sizeof(EVLOG_HEADER) + log->map->count * sizeof(EVLOG_RECORD);
+      if (off + sizeof(EVLOG_RECORD) > log->map_size)
+      {
+         size_t size = log->map_size + EVLOG_GROW;
+         if (ftruncate(log->fd, size) || !evlog_map(log, size))
+         {
+            fprintf(stderr, "event log: cannot grow to %zu bytes: %s\n", size, strerror(errno));
+            return;
+         }
+      }
+      memcpy((char*) log->map + off, &r[i], sizeof(EVLOG_RECORD));
+      __atomic_store_n(&log->map->count, log->map->count + 1, __ATOMIC_RELEASE);
+      if (log->idx_fp && (0 == (log->map->count - 1) % EVLOG_INDEX_EVERY))
+         rec_index_append(log->idx_fp, r[i].time_us, off);
+   }
+}
+
+static inline void*
+evlog_thread (void* arg)
+{
+   EVLOG* log = (EVLOG*) arg;
+   EVLOG_RECORD batch[64];
+
+   for (;;)
+   {
+      unsigned n = 0;
+
+      pthread_mutex_lock(&log->lock);
+      while (log->q_rd == log->q_wr)
+         pthread_cond_wait(&log->cond, &log->lock);
+      pthread_mutex_unlock(&log->lock);
+
+      pthread_mutex_lock(&log->io_lock);
+      pthread_mutex_lock(&log->lock);
+      while ((log->q_rd != log->q_wr) && (n < sizeof(batch) / sizeof(batch[0])))
+         batch[n++] = log->q[log->q_rd++ % EVLOG_QUEUE_LEN];
+      pthread_mutex_unlock(&log->lock);
+      evlog_write(log, batch, n);
+      pthread_mutex_unlock(&log->io_lock);
+   }
+   return NULL;
+}
+
+/* opens or continues path and path.idx, starts the writer thread. NULL on error */
+static inline EVLOG*
+evlog_open (const char* path)
+{
+   EVLOG* log = calloc(1, sizeof(EVLOG));
+   char idx[1024];
+   struct stat st;
+   pthread_t thread;
+
+   if (!log)
+      return NULL;
+   if (((log->fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) || fstat(log->fd, &st))
+      goto error;
+   if (st.st_size < (off_t) sizeof(EVLOG_HEADER))
+   {
+      if (ftruncate(log->fd, EVLOG_GROW) || !evlog_map(log, EVLOG_GROW))
+         goto error;
+      memset(log->map, 0, sizeof(EVLOG_HEADER));
+      memcpy(log->map->magic, EVLOG_MAGIC, 8);
+      log->map->record_size = sizeof(EVLOG_RECORD);
+   }
+   else if (!evlog_map(log, st.st_size) || memcmp(log->map->magic, EVLOG_MAGIC, 8) ||
+            (log->map->record_size != sizeof(EVLOG_RECORD)) ||
+            (sizeof(EVLOG_HEADER) + log->map->count * sizeof(EVLOG_RECORD) > (uint64_t) st.st_size))
+   {
+      fprintf(stderr, "%s is not an event log\n", path);
+      goto error;
+   }
+
+   snprintf(idx, sizeof(idx), "%s.idx", path);
+   if (NULL == (log->idx_fp = fopen(idx, "ab")))
+      fprintf(stderr, "event log: no index %s: %s, queries will scan\n", idx, strerror(errno));
+
+   pthread_mutex_init(&log->io_lock, NULL);
+   pthread_mutex_init(&log->lock, NULL);
+   pthread_cond_init(&log->cond, NULL);
+   if (pthread_create(&thread, NULL, evlog_thread, log))
+      goto error;
+   pthread_detach(thread);
+   return log;
+
+error:
+   fprintf(stderr, "event log %s: %s\n", path, strerror(errno));
+   if (log->map)
+      munmap(log->map, log->map_size);
+   if (log->fd >= 0)
+      close(log->fd);
+   free(log);
+   return NULL;
+}
+
+/* never blocks on I/O, log may be NULL (no -evlog given) */
+static inline void
+evlog_add (EVLOG* log, EVLOG_TYPE type, uint16_t source, uint32_t value, uint64_t extra)
+{
+   EVLOG_RECORD* r;
+
+   if (!log)
+      return;
+   pthread_mutex_lock(&log->lock);
+   if (log->q_wr - log->q_rd >= EVLOG_QUEUE_LEN - 1)
+   {
+      //keep the last slot for the overflow record itself
+      log->ulOverflow++;
+      pthread_mutex_unlock(&log->lock);
+      return;
+   }
+   if (log->ulOverflow && (EVLOG_OVERFLOW != type))
+   {
+      r = &log->q[log->q_wr++ % EVLOG_QUEUE_LEN];
+      r->time_us = evlog_now_us();
+      r->type = EVLOG_OVERFLOW;
+      r->source = 0;
+      r->value = log->ulOverflow;
+      r->extra = 0;
+      log->ulOverflow = 0;
+   }
+   r = &log->q[log->q_wr++ % EVLOG_QUEUE_LEN];
+   //the time is taken under the lock, so records are in time order
+   r->time_us = evlog_now_us();
+   r->type = type;
+   r->source = source;
+   r->value = value;
+   r->extra = extra;
+   pthread_cond_signal(&log->cond);
+   pthread_mutex_unlock(&log->lock);
+}
+
+/* writes what is queued right now, for atexit() */
+static inline void
+evlog_flush (EVLOG* log)
+{
+   EVLOG_RECORD batch[EVLOG_QUEUE_LEN];
+   unsigned n = 0;
+
+   if (!log)
+      return;
+   pthread_mutex_lock(&log->io_lock);
+   pthread_mutex_lock(&log->lock);
+   while (log->q_rd != log->q_wr)
+      batch[n++] = log->q[log->q_rd++ % EVLOG_QUEUE_LEN];
+   pthread_mutex_unlock(&log->lock);
+   evlog_write(log, batch, n);
+   pthread_mutex_unlock(&log->io_lock);
+}
+
+/* "YYYYmmdd-HHMMSS" or "HH:MM:SS" (today), local time, or seconds since the epoch. -1 if none of them */
+static inline int64_t
+evlog_parse_time (const char* str)
+{
+   struct tm tm;
+   time_t t = time(NULL);
+   long long secs;
+   char c;
+
+   localtime_r(&t, &tm);
+   tm.tm_isdst = -1;
+   if (6 == sscanf(str, "%4d%2d%2d-%2d%2d%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec))
+   {
+      tm.tm_year -= 1900;
+      tm.tm_mon--;
+   }
+   else if (3 != sscanf(str, "%2d:%2d:%2d", &tm.tm_hour, &tm.tm_min, &tm.tm_sec))
+   {
+      if (1 == sscanf(str, "%lld%c", &secs, &c))
+         return secs * 1000000;
+      return -1;
+   }
+   return (int64_t) mktime(&tm) * 1000000;
+}
+
+/* "alarm,event_open" -> bit 1 << type for every name, false if a name is unknown */
+static inline bool
+evlog_parse_types (char* str, uint32_t* mask)
+{
+   char* save = NULL;
+   char* tok;
+   int i;
+
+   *mask = 0;
+   for (tok = strtok_r(str, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+   {
+      for (i = 1; i < EVLOG_TYPE_MAX; i++)
+         if (!strcmp(tok, evlog_type_names[i]))
+            break;
+      if (i == EVLOG_TYPE_MAX)
+         return false;
+      *mask |= 1u << i;
+   }
+   return true;
+}
+
+/* one line of text, "2024-05-01 14:03:12.345 alarm src=0 value=42 extra=0x0" */
+static inline int
+evlog_format (const EVLOG_RECORD* r, char* buf, size_t size)
+{
+   time_t t = r->time_us / 1000000;
+   struct tm tm;
+   char ts[32];
+
+   strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", localtime_r(&t, &tm));
+   if ((EVLOG_CONNECT == r->type) || (EVLOG_DISCONNECT == r->type))
+      return snprintf(buf, size, "%s.%03d %s src=%u peer=%u.%u.%u.%u:%u\n", ts, (int) (r->time_us / 1000 % 1000),
+                      evlog_type_names[r->type], r->source, (unsigned) (r->extra >> 40) & 0xFF, (unsigned) (r->extra >> 32) & 0xFF,
+                      (unsigned) (r->extra >> 24) & 0xFF, (unsigned) (r->extra >> 16) & 0xFF, (unsigned) r->extra & 0xFFFF);
+   return snprintf(buf, size, "%s.%03d %s src=%u value=%u extra=0x%"PRIx64"\n", ts, (int) (r->time_us / 1000 % 1000),
+                   (r->type < EVLOG_TYPE_MAX) ? evlog_type_names[r->type] : "?", r->source, r->value, r->extra);
+}
+
+/*
+ * Calls cb for every record in [from_us, to_us] whose type is in type_mask
+ * (bit 1 << type, 0 = all), stops early if cb returns false. Returns the
+ * number of matching records or -1 if path can't be read. Other processes
+ * can query while the log is written.
+ */
+static inline long
+evlog_query (const char* path, int64_t from_us, int64_t to_us, uint32_t type_mask,
+             bool (*cb)(const EVLOG_RECORD* r, void* ctx), void* ctx)
+{
+   char idx[1024];
+   struct stat st;
+   uint64_t off, count, i;
+   const EVLOG_HEADER* h;
+   const EVLOG_RECORD* r;
+   long n = 0;
+   int fd = open(path, O_RDONLY);
+
+   if (fd < 0)
+      return -1;
+   if (fstat(fd, &st) || (st.st_size < (off_t) sizeof(EVLOG_HEADER)) ||
+       (MAP_FAILED == (h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0))))
+   {
+      close(fd);
+      return -1;
+   }
+   if (memcmp(h->magic, EVLOG_MAGIC, 8) || (h->record_size != sizeof(EVLOG_RECORD)))
+   {
+      n = -1;
+      goto out;
+   }
+   count = __atomic_load_n(&h->count, __ATOMIC_ACQUIRE);
+   if (sizeof(EVLOG_HEADER) + count * sizeof(EVLOG_RECORD) > (uint64_t) st.st_size)
+      count = (st.st_size - sizeof(EVLOG_HEADER)) / sizeof(EVLOG_RECORD);
+
+   snprintf(idx, sizeof(idx), "%s.idx", path);
+   if (!rec_index_lookup(idx, from_us, &off) || (off < sizeof(EVLOG_HEADER)))
+      off = sizeof(EVLOG_HEADER);
+   r = (const EVLOG_RECORD*) (h + 1);
+   for (i = (off - sizeof(EVLOG_HEADER)) / sizeof(EVLOG_RECORD); i < count; i++)
+   {
+      if (r[i].time_us < from_us)
+         continue;
+      if (r[i].time_us > to_us)
+         break;
+      if (type_mask && !(type_mask & (1u << r[i].type)))
+         continue;
+      n++;
+      if (!cb(&r[i], ctx))
+         break;
+   }
+out:
+   munmap((void*) h, st.st_size);
+   close(fd);
+   return n;
+}
+
+#endif //EVENT_LOG_H
@@ -0,0 +1,292 @@
+/*
+ * Refcounted encoded frames for one stream going to many sinks (viewers, the
+ * recorder, analytics): every sink holds a reference instead of a copy, the
+ * last frame_unref() gives the memory back. Used by RPI_Relay/relay.c,
+ * measured by RPI_Tools/framebench.
+ *
+ * A frame is a header and up to FRAME_MAX_FRAGS fragments, the data is
+ * behind them in one of three ways:
+ *    slab   fixed size blocks of a FRAME_POOL, frame_alloc(), frame_write().
+ *           For data that has to be copied anyway (a receive buffer that is
+ *           reused, MMAL buffers that must go back to the encoder quickly).
+ *           Blocks and headers go back to the pool, nothing is freed.
+ *    heap   one malloc() for the header and the data, frame_alloc() when
+ *           there is no pool, the pool is empty or the frame needs more
+ *           blocks than a frame has fragments.
+ *    held   buffers that stay with their owner until the last reference is
+ *           gone, frame_held() and frame_hold() per buffer with the owner's
+ *           reference (e.g. mmal_buffer_header_acquire() per encoder buffer,
+ *           release = mmal_buffer_header_release). No copy at all, but the
+ *           encoder pool has to be large enough for the slowest sink.
+ *
+ * Thread safe: references from any thread, the pool has its own lock. The
+ * data of a frame is written before it is shared and never after.
+ */
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#define FRAME_MAX_FRAGS 32
+
+typedef enum
+{
+   FRAME_HEAP = 0,
+   FRAME_SLAB,
+   FRAME_HELD
+} FRAME_BACKING;
+
+typedef struct
+{
+   uint8_t* data;
+   uint32_t len;
+   void* holder;                        /// FRAME_HELD: the owner's buffer, given to release()
+} FRAME_FRAG;
+
+typedef struct FRAME
+{
+   int refcnt;
+   uint32_t len;                        /// all fragments
+   uint8_t flags;                       /// the user's
+   uint8_t backing;                     /// FRAME_BACKING
+   int64_t ts_us;
+   int nfrags;
+   FRAME_FRAG frag[FRAME_MAX_FRAGS];
+   struct FRAME_POOL* pool;             /// FRAME_SLAB: where the blocks and the header go back to
+   void (*release)(void* holder);       /// FRAME_HELD
+   struct FRAME* next;                  /// free list of the pool
+} FRAME;
+
+typedef struct FRAME_POOL
+{
+   pthread_mutex_t lock;
+   uint32_t block_size;
+   uint32_t blocks;
+   uint8_t* mem;                        /// blocks * block_size
+   uint32_t* free_blocks;               /// stack of free block numbers
+   uint32_t free_cnt;
+   FRAME* free_frames;                  /// headers to reuse
+   uint32_t in_use, peak;               /// blocks
+   uint64_t allocs, fallbacks;          /// fallbacks: went to the heap instead
+} FRAME_POOL;
+
+/* blocks * block_size bytes up front, false without memory */
+static inline bool
+frame_pool_init (FRAME_POOL* pool, uint32_t block_size, uint32_t blocks)
+{
+   uint32_t i;
+
+   memset(pool, 0, sizeof(*pool));
+   pthread_mutex_init(&pool->lock, NULL);
+   pool->block_size = block_size;
+   pool->blocks = blocks;
+   pool->mem = malloc((size_t) block_size * blocks);
+   pool->free_blocks = malloc(blocks * sizeof(uint32_t));
+   if (!pool->mem || !pool->free_blocks)
+      return false;
+   for (i = 0; i < blocks; i++)
+      pool->free_blocks[i] = blocks - 1 - i;
+   pool->free_cnt = blocks;
+   return true;
+}
+
+/* only once every frame of it is released */
+static inline void
+frame_pool_free (FRAME_POOL* pool)
+{
+   while (pool->free_frames)
+   {
+      FRAME* f = pool->free_frames;
+      pool->free_frames = f->next;
+      free(f);
+   }
+   free(pool->mem);
+   free(pool->free_blocks);
+   pool->mem = NULL;
+   pool->free_blocks = NULL;
+}
+
+static inline FRAME*
+frame_heap (uint32_t len)
+{
+   FRAME* f = malloc(sizeof(FRAME) + len);
+
+   if (!f)
+      return NULL;
+   memset(f, 0, sizeof(FRAME));
+   f->refcnt = 1;
+   f->len = len;
+   f->backing = FRAME_HEAP;
+   f->nfrags = len ? 1 : 0;
+   f->frag[0].data = (uint8_t*)(f + 1);
+   f->frag[0].len = len;
+   return f;
+}
+
+/*
+ * A frame for len bytes with one reference, the data still to be written
+ * (frame_write()). From the pool if it has the blocks, else from the heap.
+ * NULL without memory.
+ */
+static inline FRAME*
+frame_alloc (FRAME_POOL* pool, uint32_t len)
+{
+   uint32_t need, i;
+   FRAME* f;
+
+   if (!pool)
+      return frame_heap(len);
+   need = (len + pool->block_size - 1) / pool->block_size;
+   pthread_mutex_lock(&pool->lock);
+   pool->allocs++;
+   if ((need > FRAME_MAX_FRAGS) || (need > pool->free_cnt))
+   {
+      pool->fallbacks++;
+      pthread_mutex_unlock(&pool->lock);
+      return frame_heap(len);
+   }
+   if ((f = pool->free_frames))
+      pool->free_frames = f->next;
+   else if (!(f = malloc(sizeof(FRAME))))
+   {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+   }
+   for (i = 0; i < need; i++)
+   {
+      uint32_t b = pool->free_blocks[--pool->free_cnt];
+      f->frag[i].data = pool->mem + (size_t) b * pool->block_size;
+      f->frag[i].len = (i + 1 < need) ? pool->block_size : len - i * pool->block_size;
+      f->frag[i].holder = NULL;
+   }
+   pool->in_use += need;
+   if (pool->in_use > pool->peak)
+      pool->peak = pool->in_use;
+   pthread_mutex_unlock(&pool->lock);
+
+   f->refcnt = 1;
+   f->len = len;
+   f->flags = 0;
+   f->backing = FRAME_SLAB;
+   f->ts_us = 0;
+   f->nfrags = need;
+   f->pool = pool;
+   f->release = NULL;
+   f->next = NULL;
+   return f;
+}
+
+/* an empty frame for buffers of an owner that release() gives back, NULL without memory */
+static inline FRAME*
+frame_held (void (*release)(void* holder))
+{
+   FRAME* f = frame_heap(0);
+
+   if (f)
+   {
+      f->backing = FRAME_HELD;
+      f->release = release;
+   }
+   return f;
+}
+
+/* one more buffer at the end, the caller's reference to holder goes to the frame; false if the frame is full */
+static inline bool
+frame_hold (FRAME* f, uint8_t* data, uint32_t len, void* holder)
+{
+   if ((FRAME_HELD != f->backing) || (f->nfrags >= FRAME_MAX_FRAGS))
+      return false;
+   f->frag[f->nfrags].data = data;
+   f->frag[f->nfrags].len = len;
+   f->frag[f->nfrags].holder = holder;
+   f->nfrags++;
+   f->len += len;
+   return true;
+}
+
+/* len bytes at off of the frame, across fragments */
+static inline void
+frame_write (FRAME* f, uint32_t off, const void* src, uint32_t len)
+{
+   const uint8_t* p = src;
+   int i;
+
+   for (i = 0; (i < f->nfrags) && len; i++)
+   {
+      FRAME_FRAG* fr = &f->frag[i];
+
+      if (off >= fr->len)
+      {
+         off -= fr->len;
+         continue;
+      }
+      uint32_t n = (fr->len - off < len) ? fr->len - off : len;
+      memcpy(fr->data + off, p, n);
+      p += n;
+      len -= n;
+      off = 0;
+   }
+}
+
+/* the data in one piece if it is one, else NULL */
+static inline uint8_t*
+frame_contig (const FRAME* f)
+{
+   return (1 == f->nfrags) ? f->frag[0].data : NULL;
+}
+
+/* the fragments as iovecs, at most max; the number filled in */
+static inline int
+frame_iov (const FRAME* f, struct iovec* iov, int max)
+{
+   int i;
+
+   for (i = 0; (i < f->nfrags) && (i < max); i++)
+      iov[i] = (struct iovec){ f->frag[i].data, f->frag[i].len };
+   return i;
+}
+
+static inline FRAME*
+frame_ref (FRAME* f)
+{
+   __atomic_add_fetch(&f->refcnt, 1, __ATOMIC_RELAXED);
+   return f;
+}
+
+static inline void
+frame_unref (FRAME* f)
+{
+   int i;
+
+   if (!f || (0 != __atomic_sub_fetch(&f->refcnt, 1, __ATOMIC_ACQ_REL)))
+      return;
+   switch (f->backing)
+   {
+      case FRAME_SLAB:
+      {
+         FRAME_POOL* pool = f->pool;
+
+         pthread_mutex_lock(&pool->lock);
+         for (i = 0; i < f->nfrags; i++)
+            pool->free_blocks[pool->free_cnt++] = (f->frag[i].data - pool->mem) / pool->block_size;
+         pool->in_use -= f->nfrags;
+         f->next = pool->free_frames;
+         pool->free_frames = f;
+         pthread_mutex_unlock(&pool->lock);
+         return;
+      }
+      case FRAME_HELD:
+         for (i = 0; i < f->nfrags; i++)
+            f->release(f->frag[i].holder);
+         break;
+   }
+   free(f);
+}
+
+#endif //FRAME_H
@@ -0,0 +1,194 @@
+/*
+ * Minimal Annex-B helpers: start code search and NAL unit classification.
+ * Nothing here decodes, we only look at the NAL header byte.
+ */
+#ifndef H264_NAL_H
+#define H264_NAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define NAL_TYPE_SLICE     1
+#define NAL_TYPE_IDR       5
+#define NAL_TYPE_SEI       6
+#define NAL_TYPE_SPS       7
+#define NAL_TYPE_PPS       8
+#define NAL_TYPE_AUD       9
+#define NAL_TYPE_FILLER    12
+
+#define NAL_TYPE(b) ((b) & 0x1f)
+
+typedef uint8_t h264_vec __attribute__ ((vector_size (16)));
+typedef int8_t h264_vec_mask __attribute__ ((vector_size (16)));
+
+/* true if one of the 16 positions from p starts 00 00, reads p[0..16] */
+static inline bool
+h264_zero_pair16 (const uint8_t* p)
+{
+   h264_vec a, b;
+   h264_vec_mask z;
+   uint64_t w[2];
+
+   memcpy(&a, p, 16);
+   memcpy(&b, p + 1, 16);
+   z = (a | b) == (h264_vec) { 0 };
+   memcpy(w, &z, 16);
+   return w[0] | w[1];
+}
+
+/*
+ * Returns a pointer to the first 00 00 01 in [p, end) or end if there is none.
+ * A 4 byte start code (00 00 00 01) is found at its last three bytes, callers
+ * that care about the leading zero check p[-1].
+ *
+ * Emulation prevention keeps 00 00 out of NAL payloads, so 16 positions at a
+ * time are skipped while none of them starts 00 00 (gcc vector types, NEON
+ * on the Pi), the byte loop only runs around the candidates.
+ */
+static inline const uint8_t*
+h264_find_start_code (const uint8_t* p, const uint8_t* end)
+{
+   while (p + 3 <= end)
+   {
+      const uint8_t* stop;
+
+      while ((p + 17 <= end) && !h264_zero_pair16(p))
+         p += 16;
+      stop = (end - p > 18) ? p + 18 : end;
+      while (p + 3 <= stop)
+      {
+         if (p[2] > 1)
+            p += 3;
+         else if (p[2] == 0)
+            p++;
+         else if ((p[0] == 0) && (p[1] == 0))
+            return p;
+         else
+            p += 3;
+      }
+   }
+   return end;
+}
+
+/* NAL type of the first NAL unit in an Annex-B buffer, -1 if none */
+static inline int
+h264_first_nal_type (const uint8_t* p, size_t len)
+{
+   const uint8_t* end = p + len;
+   const uint8_t* sc = h264_find_start_code(p, end);
+   if (sc + 3 >= end)
+      return -1;
+   return NAL_TYPE(sc[3]);
+}
+
+/* true if the buffer contains a NAL unit of the given type */
+static inline bool
+h264_has_nal_type (const uint8_t* p, size_t len, int type)
+{
+   const uint8_t* end = p + len;
+   const uint8_t* sc;
+   while ((sc = h264_find_start_code(p, end)) + 3 < end)
+   {
+      if (NAL_TYPE(sc[3]) == type)
+         return true;
+      p = sc + 3;
+   }
+   return false;
+}
+
+/*
+ * SEI user_data_unregistered with a 64 bit value as 16 hex digits after our
+ * own UUID, so the payload never needs emulation prevention; decoders skip
+ * unknown UUIDs.
+ */
+#define H264_TIME_SEI_LEN 40
+#define H264_HEX_SEI_LEN  40
+
+/* the sender's wall clock time in us, in front of a frame so the receiver can tell network from local delay */
+static const uint8_t h264_time_sei_uuid[16] =
+{
+   0x52, 0x50, 0x49, 0x43, 0x41, 0x4d, 0x2d, 0x54, 0x49, 0x4d, 0x45, 0x2d, 0x55, 0x53, 0x45, 0x43  //"RPICAM-TIME-USEC"
+};
+
+/* the camera changed sensor mode or frame rate range, see h264_mode_sei_value() */
+static const uint8_t h264_mode_sei_uuid[16] =
+{
+   0x52, 0x50, 0x49, 0x43, 0x41, 0x4d, 0x2d, 0x43, 0x41, 0x4d, 0x2d, 0x4d, 0x4f, 0x44, 0x45, 0x31  //"RPICAM-CAM-MODE1"
+};
+
+/* night flag, sensor mode and frame rate range in 1/100 fps */
+#define h264_mode_sei_value(bNight, mode, fps_low_x100, fps_high_x100) \
+   (((uint64_t)!!(bNight) << 56) | ((uint64_t)((mode) & 0xff) << 48) | \
+    ((uint64_t)((fps_high_x100) & 0xffff) << 16) | (uint64_t)((fps_low_x100) & 0xffff))
+
+static inline size_t
+h264_make_hex_sei (uint8_t* out, const uint8_t uuid[16], uint64_t value)
+{
+   static const char digits[] = "0123456789abcdef";
+   int i;
+
+   out[0] = out[1] = out[2] = 0;
+   out[3] = 1;
+   out[4] = NAL_TYPE_SEI;
+   out[5] = 5;                         //user_data_unregistered
+   out[6] = 32;                        //payload size
+   for (i = 0; i < 16; i++)
+      out[7 + i] = uuid[i];
+   for (i = 0; i < 16; i++)
+      out[23 + i] = digits[(value >> (60 - 4 * i)) & 15];
+   out[39] = 0x80;                     //rbsp trailing bits
+   return H264_HEX_SEI_LEN;
+}
+
+/* the value of the first SEI with this UUID in the buffer, false if there is none */
+static inline bool
+h264_find_hex_sei (const uint8_t* p, size_t len, const uint8_t uuid[16], uint64_t* value)
+{
+   const uint8_t* end = p + len;
+   const uint8_t* sc;
+   int i;
+
+   while ((sc = h264_find_start_code(p, end)) + H264_HEX_SEI_LEN - 1 <= end)
+   {
+      if ((NAL_TYPE_SEI == sc[3]) && (5 == sc[4]) && (32 == sc[5]))
+      {
+         uint64_t v = 0;
+         for (i = 0; (i < 16) && (sc[6 + i] == uuid[i]); i++)
+            ;
+         if (16 == i)
+         {
+            for (i = 0; i < 16; i++)
+            {
+               uint8_t c = sc[22 + i];
+               v = (v << 4) | ((c <= '9') ? (c - '0') : (c - 'a' + 10));
+            }
+            *value = v;
+            return true;
+         }
+      }
+      p = sc + 3;
+   }
+   return false;
+}
+
+static inline size_t
+h264_make_time_sei (uint8_t* out, int64_t time_us)
+{
+   return h264_make_hex_sei(out, h264_time_sei_uuid, (uint64_t) time_us);
+}
+
+/* the time of the first time SEI in the buffer, false if there is none */
+static inline bool
+h264_find_time_sei (const uint8_t* p, size_t len, int64_t* time_us)
+{
+   uint64_t v;
+
+   if (!h264_find_hex_sei(p, len, h264_time_sei_uuid, &v))
+      return false;
+   *time_us = (int64_t) v;
+   return true;
+}
+
+#endif //H264_NAL_H
@@ -0,0 +1,108 @@
+/*
+ * Fixed bucket latency histogram, cheap enough to add every frame.
+ * 0.25 ms buckets up to 256 ms, everything slower lands in the last one.
+ */
+#ifndef LAT_HIST_H
+#define LAT_HIST_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define LAT_HIST_BUCKETS 1024
+#define LAT_HIST_BUCKET_US 250
+
+typedef struct
+{
+   uint32_t bucket[LAT_HIST_BUCKETS];
+   uint64_t n;
+   int64_t sum_us;
+   int64_t min_us;
+   int64_t max_us;
+} LAT_HIST;
+
+static inline void
+lat_hist_reset (LAT_HIST* h)
+{
+   memset(h, 0, sizeof(*h));
+}
+
+static inline void
+lat_hist_add (LAT_HIST* h, int64_t us)
+{
+   int64_t i = (us < 0) ? 0 : us / LAT_HIST_BUCKET_US;
+
+   h->bucket[(i < LAT_HIST_BUCKETS) ? i : LAT_HIST_BUCKETS - 1]++;
+   if (!h->n || (us < h->min_us))
+      h->min_us = us;
+   if (!h->n || (us > h->max_us))
+      h->max_us = us;
+   h->sum_us += us;
+   h->n++;
+}
+
+/*
+ * upper edge of the bucket holding the p-th fraction of the samples, p in [0, 1],
+ * kept within min..max so that p50 <= p90 <= p99 <= max holds in the printout
+ */
+static inline int64_t
+lat_hist_percentile (const LAT_HIST* h, double p)
+{
+   uint64_t want = (uint64_t)(p * h->n + 0.5), seen = 0;
+   int64_t us;
+   unsigned i;
+
+   if (!want)
+      want = 1;
+   for (i = 0; i < LAT_HIST_BUCKETS - 1; i++)
+      if ((seen += h->bucket[i]) >= want)
+         break;
+   us = (i == LAT_HIST_BUCKETS - 1) ? h->max_us : (int64_t)(i + 1) * LAT_HIST_BUCKET_US;
+   if (us > h->max_us)
+      us = h->max_us;
+   if (us < h->min_us)
+      us = h->min_us;
+   return us;
+}
+
+/*
+ * "<name> n=.. avg/p50/p90/p99/max .. ms", with bBars one line per 2 ms that has
+ * samples: "   32-34 ms ######## 123"
+ */
+static inline void
+lat_hist_print (FILE* fp, const char* name, const LAT_HIST* h, bool bBars)
+{
+   const unsigned per_row = 2000 / LAT_HIST_BUCKET_US;
+   uint32_t top = 0, row[LAT_HIST_BUCKETS / (2000 / LAT_HIST_BUCKET_US)];
+   unsigned i, j;
+
+   if (!h->n)
+   {
+      fprintf(fp, "%s n=0\n", name);
+      return;
+   }
+   fprintf(fp, "%s n=%llu avg/p50/p90/p99/max %.2f/%.2f/%.2f/%.2f/%.2f ms\n", name, (unsigned long long) h->n,
+           h->sum_us / 1000.0 / h->n, lat_hist_percentile(h, 0.5) / 1000.0, lat_hist_percentile(h, 0.9) / 1000.0,
+           lat_hist_percentile(h, 0.99) / 1000.0, h->max_us / 1000.0);
+   if (!bBars)
+      return;
+   for (i = 0; i < LAT_HIST_BUCKETS / per_row; i++)
+   {
+      for (row[i] = 0, j = 0; j < per_row; j++)
+         row[i] += h->bucket[i * per_row + j];
+      if (row[i] > top)
+         top = row[i];
+   }
+   for (i = 0; i < LAT_HIST_BUCKETS / per_row; i++)
+   {
+      if (!row[i])
+         continue;
+      fprintf(fp, "  %4u-%-4u ms ", i * 2, (i + 1 == LAT_HIST_BUCKETS / per_row) ? 9999 : (i + 1) * 2);
+      for (j = 0; j < 1 + row[i] * 39 / top; j++)
+         fputc('#', fp);
+      fprintf(fp, " %u\n", row[i]);
+   }
+}
+
+#endif
@@ -0,0 +1,126 @@
+/*
+ * Low-light policy: when to leave the day sensor mode and frame rate for a
+ * binned mode and a frame rate range that may go down, and when to come back.
+ *
+ * Nothing here touches the camera, the caller feeds one sample per tick
+ * (exposure, gain, measured frame interval) and applies what lowlight_step()
+ * says. That keeps it testable against recorded traces, see RPI_Tools/lowlight.c.
+ *
+ * Night starts when the exposure fills the frame period and the gain is high,
+ * or when the camera no longer keeps the requested rate. It ends when the light
+ * the scene needs (exposure * gain) would fit into the day frame period at a
+ * fraction of the day gain. Both conditions have to hold for a while and
+ * nothing is looked at while AE settles after a switch.
+ */
+#ifndef LOWLIGHT_H
+#define LOWLIGHT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define LL_TICK_US 200000
+
+typedef struct
+{
+   int day_mode;                        /// sensor mode by day, 0 = auto
+   int night_mode;                      /// sensor mode at night, 0 = the day mode
+   int day_fps;                         /// the requested frame rate
+   int night_fps;                       /// the lowest one at night, the range is night_fps..day_fps
+   float night_sens;                    /// night mode sensitivity relative to the day mode, 2x2 binning sums four pixels
+   float enter_gain;                    /// total gain that counts as high
+   float leave_frac;                    /// back to day when the need fits into this fraction of enter_gain
+   int64_t enter_hold_us;
+   int64_t leave_hold_us;
+   int64_t settle_us;                   /// samples ignored after a switch
+} LL_CONFIG;
+
+typedef struct
+{
+   int64_t exposure_us;
+   float gain;                          /// analog * digital
+   int64_t frame_interval_us;           /// mean over the tick, 0 = no frames
+} LL_SAMPLE;
+
+typedef struct
+{
+   bool bNight;
+   int64_t switched_us;                 /// time of the last switch
+   int64_t since_us;                    /// the switch condition holds since, 0 = it does not
+   float fps;                           /// smoothed measured frame rate, 0 = none yet
+} LL_STATE;
+
+typedef enum
+{
+   LL_NONE = 0,
+   LL_TO_NIGHT,
+   LL_TO_DAY
+} LL_ACTION;
+
+static inline void
+lowlight_default (LL_CONFIG* cfg, int day_mode, int day_fps, int night_mode, int night_fps)
+{
+   cfg->day_mode = day_mode;
+   cfg->night_mode = night_mode ? night_mode : day_mode;
+   cfg->day_fps = day_fps;
+   cfg->night_fps = night_fps;
+   cfg->night_sens = 1.0f;
+   cfg->enter_gain = 6.0f;
+   cfg->leave_frac = 0.5f;
+   cfg->enter_hold_us = 3000000;
+   cfg->leave_hold_us = 10000000;
+   cfg->settle_us = 2000000;
+}
+
+static inline void
+lowlight_reset (LL_STATE* st)
+{
+   st->bNight = false;
+   st->switched_us = 0;
+   st->since_us = 0;
+   st->fps = 0;
+}
+
+/* feeds one sample taken at now_us, returns what to switch to */
+static inline LL_ACTION
+lowlight_step (const LL_CONFIG* cfg, LL_STATE* st, int64_t now_us, const LL_SAMPLE* s)
+{
+   float day_period_us = 1e6f / cfg->day_fps;
+   float need = (float) s->exposure_us * s->gain;
+   bool bCond;
+
+   if (s->frame_interval_us > 0)
+   {
+      float fps = 1e6f / s->frame_interval_us;
+      st->fps = st->fps ? st->fps + 0.3f * (fps - st->fps) : fps;
+   }
+   if (st->switched_us && (now_us - st->switched_us < cfg->settle_us))
+   {
+      st->since_us = 0;
+      return LL_NONE;
+   }
+
+   if (!st->bNight)
+      bCond = ((s->exposure_us >= 0.9f * day_period_us) && (s->gain >= cfg->enter_gain)) ||
+              (st->fps && (st->fps < 0.9f * cfg->day_fps));
+   else
+      //what the night mode needs, in day mode it would need night_sens times more
+      bCond = need * cfg->night_sens <= cfg->leave_frac * 0.9f * day_period_us * cfg->enter_gain;
+
+   if (!bCond)
+   {
+      st->since_us = 0;
+      return LL_NONE;
+   }
+   if (!st->since_us)
+      st->since_us = now_us;
+   if (now_us - st->since_us < (st->bNight ? cfg->leave_hold_us : cfg->enter_hold_us))
+      return LL_NONE;
+
+   st->bNight = !st->bNight;
+   st->switched_us = now_us;
+   st->since_us = 0;
+   st->fps = 0;
+   return st->bNight ? LL_TO_NIGHT : LL_TO_DAY;
+}
+
+#endif
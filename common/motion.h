@@ -0,0 +1,240 @@
+/*
+ * Motion analysis on the encoder's inline motion vectors, one frame at a time.
+ * Everything a stream keeps between frames is in its MOTION_STATE, nothing is
+ * global, so any number of streams can be analyzed on any threads as long as
+ * the frames of one stream are not analyzed concurrently.
+ *
+ * The vector field has mbx + 1 vectors per row (the encoder adds one column)
+ * and mby rows.
+ */
+#ifndef MOTION_H
+#define MOTION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#define MOTION_GRID          3          /// zones are a MOTION_GRID x MOTION_GRID grid
+#define MOTION_MAX_MB        (120 * 68) /// 1920x1088
+#define MOTION_MAX_BLOBS     8
+#define MOTION_DEFAULT_LEVEL 4          /// for blobs while the alarm level is 0
+#define MOTION_HEAT_HOT      128        /// a macroblock moving in most of the last ~8 frames
+
+typedef struct
+{
+   signed char x_vector;
+   signed char y_vector;
+   short sad;
+} MOTION_VECTOR;
+
+typedef struct
+{
+   unsigned short mbx;                 /// macroblocks in x direction
+   unsigned short mby;                 /// macroblocks in y direction
+   int level;                          /// alarm above this vector length, 0 is no alarm
+   int min_blob;                       /// smaller blobs (in macroblocks) are noise
+} MOTION_CONFIG;
+
+typedef struct
+{
+   uint16_t x0, y0, x1, y1;            /// bounding box in macroblocks, inclusive
+   uint16_t mbs;                       /// macroblocks in the blob
+   float cx, cy;                       /// centroid
+} MOTION_BLOB;
+
+typedef struct
+{
+   uint8_t strength;                   /// length of the longest vector
+   bool bAlarm;                        /// strength above the alarm level
+   uint16_t zones;                     /// bit row*MOTION_GRID+col for every zone with a vector above the level
+   uint16_t active;                    /// macroblocks above the level
+   uint16_t hot;                       /// macroblocks that kept moving, see MOTION_HEAT_HOT
+   uint8_t n_blobs;
+   MOTION_BLOB blob[MOTION_MAX_BLOBS]; /// largest first
+   bool bTrack;                        /// the largest blob was there in the last frame too
+   float track_dx, track_dy;           /// its centroid moved by this many macroblocks
+} MOTION_RESULT;
+
+typedef struct
+{
+   MOTION_CONFIG cfg;
+   uint64_t frames;
+   bool bLast;
+   float last_cx, last_cy;
+   uint8_t heat[MOTION_MAX_MB];        /// decaying activity per macroblock
+   uint16_t label[MOTION_MAX_MB];      /// scratch of motion_analyze()
+   uint16_t stack[MOTION_MAX_MB];
+} MOTION_STATE;
+
+/* length of the longest vector, clipped to 255 */
+static inline uint8_t
+motion_strength (const MOTION_VECTOR* imv, unsigned mbx, unsigned mby)
+{
+   unsigned x, j;
+   int max_sq = 0;
+
+   //the square root only once, of the longest
+   for (j = 0; j < mby; j++)
+   {
+      const MOTION_VECTOR* row = imv + (mbx + 1) * j;
+      for (x = 0; x < mbx; x++)
+      {
+         int sq = row[x].x_vector * row[x].x_vector + row[x].y_vector * row[x].y_vector;
+         if (sq > max_sq)
+            max_sq = sq;
+      }
+   }
+   return (uint8_t) sqrt(max_sq);
+}
+
+/* bit row*MOTION_GRID+col for every zone with a vector longer than level */
+static inline uint16_t
+motion_zones (const MOTION_VECTOR* imv, unsigned mbx, unsigned mby, int level)
+{
+   uint16_t zones = 0;
+   unsigned x, j;
+
+   for (j = 0; j < mby; j++)
+   {
+      const MOTION_VECTOR* row = imv + (mbx + 1) * j;
+      for (x = 0; x < mbx; x++)
+      {
+         if (row[x].x_vector * row[x].x_vector + row[x].y_vector * row[x].y_vector > level * level)
+            zones |= 1 << (j * MOTION_GRID / mby * MOTION_GRID + x * MOTION_GRID / mbx);
+      }
+   }
+   return zones;
+}
+
+/* false if the frame size does not fit MOTION_MAX_MB */
+static inline bool
+motion_init (MOTION_STATE* s, const MOTION_CONFIG* cfg)
+{
+   if ((unsigned) cfg->mbx * cfg->mby > MOTION_MAX_MB)
+      return false;
+   memset(s, 0, sizeof(*s) - sizeof(s->label) - sizeof(s->stack));
+   s->cfg = *cfg;
+   return true;
+}
+
+/* keeps the MOTION_MAX_BLOBS largest, largest first */
+static inline void
+motion_add_blob (MOTION_RESULT* r, const MOTION_BLOB* b)
+{
+   int i;
+
+   if (r->n_blobs < MOTION_MAX_BLOBS)
+      i = r->n_blobs++;
+   else if (r->blob[MOTION_MAX_BLOBS - 1].mbs >= b->mbs)
+      return;
+   else
+      i = MOTION_MAX_BLOBS - 1;
+   while ((i > 0) && (r->blob[i - 1].mbs < b->mbs))
+   {
+      r->blob[i] = r->blob[i - 1];
+      i--;
+   }
+   r->blob[i] = *b;
+}
+
+/*
+ * One frame: strength and alarm, zones, the heat map, blobs of 4-connected
+ * macroblocks above the level and the movement of the largest blob.
+ */
+static inline void
+motion_analyze (MOTION_STATE* s, const MOTION_VECTOR* imv, MOTION_RESULT* r)
+{
+   const unsigned mbx = s->cfg.mbx, mby = s->cfg.mby;
+   const int level = s->cfg.level ? s->cfg.level : MOTION_DEFAULT_LEVEL;
+   int max_sq = 0;
+   unsigned x, j, i;
+
+   memset(r, 0, sizeof(*r));
+   //label 1 marks a macroblock above the level that no blob has taken yet
+   for (j = 0; j < mby; j++)
+   {
+      const MOTION_VECTOR* row = imv + (mbx + 1) * j;
+      uint8_t* heat = s->heat + mbx * j;
+      uint16_t* label = s->label + mbx * j;
+
+      for (x = 0; x < mbx; x++)
+      {
+         int sq = row[x].x_vector * row[x].x_vector + row[x].y_vector * row[x].y_vector;
+         bool bActive = sq > level * level;
+
+         if (sq > max_sq)
+            max_sq = sq;
+         heat[x] -= heat[x] >> 3;
+         if (bActive)
+         {
+            heat[x] = (heat[x] > 255 - 32) ? 255 : heat[x] + 32;
+            r->zones |= 1 << (j * MOTION_GRID / mby * MOTION_GRID + x * MOTION_GRID / mbx);
+            r->active++;
+         }
+         if (heat[x] >= MOTION_HEAT_HOT)
+            r->hot++;
+         label[x] = bActive;
+      }
+   }
+   r->strength = (uint8_t) sqrt(max_sq);
+   r->bAlarm = s->cfg.level && (r->strength > s->cfg.level);
+
+   for (i = 0; r->active && (i < mbx * mby); i++)
+   {
+      MOTION_BLOB b;
+      unsigned sp = 0;
+      float sx = 0, sy = 0;
+
+      if (s->label[i] != 1)
+         continue;
+      b.x0 = b.x1 = i % mbx;
+      b.y0 = b.y1 = i / mbx;
+      b.mbs = 0;
+      s->label[i] = 2;
+      s->stack[sp++] = i;
+      while (sp)
+      {
+         unsigned k = s->stack[--sp];
+         unsigned kx = k % mbx, ky = k / mbx;
+
+         b.mbs++;
+         sx += kx;
+         sy += ky;
+         if (kx < b.x0) b.x0 = kx;
+         if (kx > b.x1) b.x1 = kx;
+         if (ky < b.y0) b.y0 = ky;
+         if (ky > b.y1) b.y1 = ky;
+         //every macroblock is pushed once, so the stack never holds more than mbx * mby
+         if ((kx > 0) && (s->label[k - 1] == 1))
+            s->label[k - 1] = 2, s->stack[sp++] = k - 1;
+         if ((kx + 1 < mbx) && (s->label[k + 1] == 1))
+            s->label[k + 1] = 2, s->stack[sp++] = k + 1;
+         if ((ky > 0) && (s->label[k - mbx] == 1))
+            s->label[k - mbx] = 2, s->stack[sp++] = k - mbx;
+         if ((ky + 1 < mby) && (s->label[k + mbx] == 1))
+            s->label[k + mbx] = 2, s->stack[sp++] = k + mbx;
+      }
+      if (b.mbs < s->cfg.min_blob)
+         continue;
+      b.cx = sx / b.mbs;
+      b.cy = sy / b.mbs;
+      motion_add_blob(r, &b);
+   }
+
+   if (r->n_blobs)
+   {
+      if (s->bLast)
+      {
+         r->bTrack = true;
+         r->track_dx = r->blob[0].cx - s->last_cx;
+         r->track_dy = r->blob[0].cy - s->last_cy;
+      }
+      s->last_cx = r->blob[0].cx;
+      s->last_cy = r->blob[0].cy;
+   }
+   s->bLast = r->n_blobs;
+   s->frames++;
+}
+
+#endif //MOTION_H
@@ -0,0 +1,694 @@
+/*
+ * One stream over several UDP paths at once (Wi-Fi and an LTE dongle, ...):
+ * raspivid -o multipath://..., video -M, RPI_Tools/multipath.
+ *
+ * Every path is a UDP socket bound to an interface (or a local address) and
+ * sending to the receiver. The stream is cut into packets with one sequence
+ * number across all paths and each packet goes to the path where it is
+ * expected to arrive first: the time the path is still busy with what it got
+ * already at its estimated rate plus half its RTT. Packets of IDR frames and
+ * SPS/PPS go over the two best paths too when the second copy is not much
+ * later, the receiver drops it.
+ *
+ * The receiver answers every path over the same path with what it got there
+ * (highest path sequence number, packets and bytes, the send time of the
+ * newest packet and how long ago it came), the sender takes RTT, loss and
+ * delivered rate from it. Paths that send nothing get a probe every 100 ms,
+ * a path without an answer for 4 RTT + 100 ms (a second at most) is dead until
+ * it answers again.
+ * The receiver puts the packets back in order and gives a missing one
+ * reorder_ms before it goes on without it.
+ *
+ *    data      1, path, flags, 0, seq 4, path seq 4, send time us 4, payload
+ *    probe     2, path, 0, 0, 0 4, path seq 4, send time us 4
+ *    feedback  3, path, 0, 0, highest path seq 4, packets 4, bytes 4, echoed send time 4, hold us 4
+ * (little endian, times are the low 32 bits of the sender's CLOCK_MONOTONIC in us)
+ */
+#ifndef MULTIPATH_H
+#define MULTIPATH_H
+
+#ifndef _GNU_SOURCE
+   #define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "rpi_net.h"
+
+#define MP_MAX_PATHS       4
+#define MP_HDR_LEN         16
+#define MP_FEEDBACK_LEN    24
+#define MP_PAYLOAD         1200         /// fits the MTU of LTE tunnels too
+#define MP_TYPE_DATA       1
+#define MP_TYPE_PROBE      2
+#define MP_TYPE_FEEDBACK   3
+#define MP_FLAG_KEY        1            /// IDR or SPS/PPS, sent twice
+#define MP_PROBE_US        100000
+#define MP_DEAD_US         1000000      /// at most, 4 RTT + 100 ms with answers before
+#define MP_FEEDBACK_US     50000
+#define MP_COPY_SLACK_US   100000       /// no second copy that would come this much after the first
+#define MP_MIN_RATE        (64000 / 8)  /// bytes/s
+#define MP_MAX_RATE        (100000000 / 8)
+#define MP_REORDER_SLOTS   2048
+#define MP_DEFAULT_REORDER 80           /// ms
+
+static inline int64_t
+mp_now_us (void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline void
+mp_put32 (uint8_t* p, uint32_t v)
+{
+   p[0] = v;
+   p[1] = v >> 8;
+   p[2] = v >> 16;
+   p[3] = v >> 24;
+}
+
+static inline uint32_t
+mp_get32 (const uint8_t* p)
+{
+   return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/******************************* sender *******************************/
+
+typedef struct
+{
+   char name[IFNAMSIZ + 16];           /// interface or local address it is bound to
+   int fd;
+   struct sockaddr_in dst;
+   uint32_t seq;                       /// next path sequence number
+   double srtt_us;
+   uint32_t min_rtt_us;
+   double loss;                        /// smoothed fraction lost
+   double rate;                        /// bytes/s it is believed to take
+   int64_t busy_until_us;              /// when what it got so far is through at rate
+   int64_t last_send_us, last_feedback_us;
+   bool bAlive;
+   bool bFeedback;                     /// fb_* are valid
+   uint32_t fb_high, fb_recv, fb_bytes;
+   uint64_t fb_sent;
+   int64_t fb_us;
+   uint64_t packets, bytes, dups, errors;
+} MP_PATH;
+
+typedef struct
+{
+   MP_PATH path[MP_MAX_PATHS];
+   int n;
+   uint32_t seq;
+   pthread_mutex_t lock;
+   pthread_t thread;
+   bool bStop;
+   uint64_t unsent;                    /// packets no path took (all sockets full)
+} MP_TX;
+
+/*
+ * via is an interface name (SO_BINDTODEVICE, needs CAP_NET_RAW) or a local
+ * IPv4 address, optionally followed by @ip:port when this path goes elsewhere
+ * than dst. False with a message on stderr.
+ */
+static inline bool
+mp_tx_add_path (MP_TX* tx, const char* via, const struct sockaddr_in* dst)
+{
+   MP_PATH* p = &tx->path[tx->n];
+   const char* at = strchr(via, '@');
+   size_t len = at ? (size_t)(at - via) : strlen(via);
+   struct sockaddr_in local = { AF_INET };
+
+   if ((tx->n >= MP_MAX_PATHS) || !len || (len >= sizeof(p->name)))
+   {
+      fprintf(stderr, "multipath: at most %d paths, \"%s\" is not one\n", MP_MAX_PATHS, via);
+      return false;
+   }
+   memset(p, 0, sizeof(*p));
+   memcpy(p->name, via, len);
+   p->dst = *dst;
+   if (at && !ParseIPv4Port(at + 1, &p->dst))
+   {
+      fprintf(stderr, "multipath: %s is not a valid IPv4:port\n", at + 1);
+      return false;
+   }
+   if ((p->fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+      return false;
+   if (inet_aton(p->name, &local.sin_addr))
+   {
+      if (bind(p->fd, (struct sockaddr*) &local, sizeof(local)))
+      {
+         fprintf(stderr, "multipath: bind to %s: %s\n", p->name, strerror(errno));
+         return false;
+      }
+   }
+   else if (setsockopt(p->fd, SOL_SOCKET, SO_BINDTODEVICE, p->name, strlen(p->name) + 1))
+   {
+      fprintf(stderr, "multipath: interface %s: %s\n", p->name, strerror(errno));
+      return false;
+   }
+   if (connect(p->fd, (struct sockaddr*) &p->dst, sizeof(p->dst)))
+   {
+      fprintf(stderr, "multipath: %s to %s: %s\n", p->name, inet_ntoa(p->dst.sin_addr), strerror(errno));
+      return false;
+   }
+   SetNonBlocking(p->fd, true);
+   //until the first answer: alive, 100 ms RTT, 1 Mbit/s
+   p->srtt_us = 100000;
+   p->rate = 1000000 / 8;
+   p->bAlive = true;
+   p->last_feedback_us = mp_now_us();
+   tx->n++;
+   return true;
+}
+
+static inline void
+mp_tx_feedback (MP_PATH* p, const uint8_t* fb, int64_t now)
+{
+   uint32_t high = mp_get32(fb + 4), recv = mp_get32(fb + 8), bytes = mp_get32(fb + 12);
+   uint32_t rtt = (uint32_t) now - mp_get32(fb + 16) - mp_get32(fb + 20);
+
+   if (rtt < 10000000)
+   {
+      p->srtt_us = p->bFeedback ? 0.875 * p->srtt_us + 0.125 * rtt : rtt;
+      if (!p->min_rtt_us || (rtt < p->min_rtt_us))
+         p->min_rtt_us = rtt;
+   }
+   if (p->bFeedback && ((int32_t)(high - p->fb_high) > 0))
+   {
+      uint32_t sent = high - p->fb_high, got = recv - p->fb_recv;
+      double lost = (got < sent) ? 1.0 - (double) got / sent : 0;
+      double dt = (now - p->fb_us) / 1e6;
+
+      p->loss = 0.8 * p->loss + 0.2 * lost;
+      if (dt > 0.02)
+      {
+         double delivered = (bytes - p->fb_bytes) / dt, offered = (p->bytes - p->fb_sent) / dt;
+
+         //a queue building up (or heavy loss) says the link takes less than what got through
+         //when it got about its rate, just less when it got little; a bit of random loss on a
+         //radio link says nothing. Slowly up while the path is used fully.
+         if ((rtt > 1.25 * p->min_rtt_us + 20000) || (p->loss > 0.1))
+            p->rate = (delivered > 0.5 * p->rate) ? 0.95 * ((delivered < p->rate) ? delivered : p->rate) : 0.85 * p->rate;
+         else if (offered > 0.7 * p->rate)
+            p->rate *= 1.05;
+         if (p->rate < MP_MIN_RATE)
+            p->rate = MP_MIN_RATE;
+         if (p->rate > MP_MAX_RATE)
+            p->rate = MP_MAX_RATE;
+      }
+   }
+   if (!p->bFeedback || ((int32_t)(high - p->fb_high) > 0) || (now - p->fb_us > 200000))
+   {
+      p->fb_high = high;
+      p->fb_recv = recv;
+      p->fb_bytes = bytes;
+      p->fb_sent = p->bytes;
+      p->fb_us = now;
+   }
+   p->bFeedback = true;
+   p->bAlive = true;
+   p->last_feedback_us = now;
+}
+
+static inline bool
+mp_tx_write (MP_PATH* p, uint8_t* pkt, size_t len, int64_t now)
+{
+   mp_put32(pkt + 8, p->seq++);
+   mp_put32(pkt + 12, (uint32_t) now);
+   if (send(p->fd, pkt, len, MSG_NOSIGNAL) != (ssize_t) len)
+   {
+      p->errors++;
+      return false;
+   }
+   p->last_send_us = now;
+   return true;
+}
+
+/* feedback in, probes out, dead paths */
+static void*
+mp_tx_thread (void* arg)
+{
+   MP_TX* tx = arg;
+   struct pollfd pfd[MP_MAX_PATHS];
+   uint8_t buf[64];
+   int i;
+
+   for (i = 0; i < tx->n; i++)
+   {
+      pfd[i].fd = tx->path[i].fd;
+      pfd[i].events = POLLIN;
+   }
+   while (!tx->bStop)
+   {
+      int64_t now;
+
+      poll(pfd, tx->n, MP_PROBE_US / 2000);
+      now = mp_now_us();
+      pthread_mutex_lock(&tx->lock);
+      for (i = 0; i < tx->n; i++)
+      {
+         MP_PATH* p = &tx->path[i];
+         ssize_t n;
+
+         while ((n = recv(p->fd, buf, sizeof(buf), MSG_DONTWAIT)) >= MP_FEEDBACK_LEN)
+            if ((MP_TYPE_FEEDBACK == buf[0]) && (i == buf[1]))
+               mp_tx_feedback(p, buf, now);
+         //answers come every MP_FEEDBACK_US while it gets data, far less than MP_DEAD_US
+         if (p->bAlive && (now - p->last_feedback_us > ((p->bFeedback && (4 * p->srtt_us + 100000 < MP_DEAD_US)) ?
+                                                          4 * p->srtt_us + 100000 : MP_DEAD_US)))
+         {
+            p->bAlive = false;
+            p->bFeedback = false;
+            p->min_rtt_us = 0;
+         }
+         if (now - p->last_send_us >= MP_PROBE_US)
+         {
+            uint8_t probe[MP_HDR_LEN] = { MP_TYPE_PROBE, i };
+            mp_tx_write(p, probe, sizeof(probe), now);
+         }
+      }
+      pthread_mutex_unlock(&tx->lock);
+   }
+   return NULL;
+}
+
+static inline bool
+mp_tx_start (MP_TX* tx)
+{
+   pthread_mutex_init(&tx->lock, NULL);
+   return tx->n && !pthread_create(&tx->thread, NULL, mp_tx_thread, tx);
+}
+
+static inline void
+mp_tx_stop (MP_TX* tx)
+{
+   int i;
+
+   tx->bStop = true;
+   pthread_join(tx->thread, NULL);
+   for (i = 0; i < tx->n; i++)
+      close(tx->path[i].fd);
+}
+
+/* when a packet of len bytes sent now would be through path p */
+static inline double
+mp_arrival_us (const MP_PATH* p, size_t len, int64_t now)
+{
+   double rate = p->rate * (1.0 - ((p->loss < 0.5) ? p->loss : 0.5));
+   int64_t start = (p->busy_until_us > now) ? p->busy_until_us : now;
+
+   return (start - now) + len * 1e6 / rate + p->srtt_us / 2;
+}
+
+/*
+ * The best path and, for redundancy, the second best; -1 if there is none,
+ * or for the second when a copy there would come too late to matter.
+ */
+static inline void
+mp_tx_pick (MP_TX* tx, size_t len, int64_t now, int* best, int* second)
+{
+   double t_best = 0, t_second = 0;
+   bool bAny = false;
+   int i;
+
+   for (i = 0; i < tx->n; i++)
+      bAny = bAny || tx->path[i].bAlive;
+   *best = *second = -1;
+   for (i = 0; i < tx->n; i++)
+   {
+      double t;
+
+      //with every path dead, all of them get a chance
+      if (bAny && !tx->path[i].bAlive)
+         continue;
+      t = mp_arrival_us(&tx->path[i], len, now);
+      if ((*best < 0) || (t < t_best))
+      {
+         *second = *best;
+         t_second = t_best;
+         *best = i;
+         t_best = t;
+      }
+      else if ((*second < 0) || (t < t_second))
+      {
+         *second = i;
+         t_second = t;
+      }
+   }
+   if ((*second >= 0) && (t_second > t_best + MP_COPY_SLACK_US))
+      *second = -1;
+}
+
+/* the stream in packets over the paths, never blocks; false only without any path */
+static inline bool
+mp_tx_send (MP_TX* tx, const uint8_t* data, size_t len, bool bKey)
+{
+   uint8_t pkt[MP_HDR_LEN + MP_PAYLOAD];
+
+   if (!tx->n)
+      return false;
+   pthread_mutex_lock(&tx->lock);
+   while (len)
+   {
+      size_t n = (len < MP_PAYLOAD) ? len : MP_PAYLOAD;
+      int64_t now = mp_now_us();
+      int best, second, k;
+      bool bSent = false;
+
+      pkt[0] = MP_TYPE_DATA;
+      pkt[2] = bKey ? MP_FLAG_KEY : 0;
+      pkt[3] = 0;
+      mp_put32(pkt + 4, tx->seq++);
+      memcpy(pkt + MP_HDR_LEN, data, n);
+      mp_tx_pick(tx, MP_HDR_LEN + n, now, &best, &second);
+      for (k = 0; k < ((bKey && (second >= 0)) ? 2 : 1); k++)
+      {
+         MP_PATH* p = &tx->path[k ? second : best];
+         int64_t start = (p->busy_until_us > now) ? p->busy_until_us : now;
+
+         pkt[1] = k ? second : best;
+         if (mp_tx_write(p, pkt, MP_HDR_LEN + n, now))
+         {
+            p->busy_until_us = start + (int64_t)((MP_HDR_LEN + n) * 1e6 / p->rate);
+            p->packets++;
+            p->bytes += MP_HDR_LEN + n;
+            p->dups += k;
+            bSent = true;
+         }
+      }
+      //the socket buffer of the best one is full, another path takes it
+      if (!bSent && (second >= 0) && !bKey)
+      {
+         pkt[1] = second;
+         bSent = mp_tx_write(&tx->path[second], pkt, MP_HDR_LEN + n, now);
+      }
+      tx->unsent += !bSent;
+      data += n;
+      len -= n;
+   }
+   pthread_mutex_unlock(&tx->lock);
+   return true;
+}
+
+/* one line per path: "wlan0 alive rtt=12.3ms loss=0.5% rate=4.20Mbit/s packets=.. dups=.." */
+static inline void
+mp_tx_print (FILE* fp, MP_TX* tx)
+{
+   int i;
+
+   pthread_mutex_lock(&tx->lock);
+   for (i = 0; i < tx->n; i++)
+   {
+      MP_PATH* p = &tx->path[i];
+      fprintf(fp, "multipath: %s %s rtt=%.1fms loss=%.1f%% rate=%.2fMbit/s packets=%llu dups=%llu errors=%llu\n", p->name,
+              p->bAlive ? "alive" : "dead", p->srtt_us / 1000, p->loss * 100, p->rate * 8 / 1e6,
+              (unsigned long long) p->packets, (unsigned long long) p->dups, (unsigned long long) p->errors);
+   }
+   pthread_mutex_unlock(&tx->lock);
+}
+
+/*
+ * "1.2.3.4:5000?via=wlan0&via=wwan0[&via=...]", the via items as in
+ * mp_tx_add_path(). False with a message on stderr.
+ */
+static inline bool
+mp_tx_open (MP_TX* tx, const char* url)
+{
+   struct sockaddr_in dst;
+   char host[64];
+   const char* q = strchr(url, '?');
+   size_t n = q ? (size_t)(q - url) : strlen(url);
+
+   memset(tx, 0, sizeof(*tx));
+   if (!n || (n >= sizeof(host)))
+      return false;
+   memcpy(host, url, n);
+   host[n] = 0;
+   if (!ParseIPv4Port(host, &dst))
+   {
+      fprintf(stderr, "multipath: %s is not a valid IPv4:port\n", host);
+      return false;
+   }
+   while (q && *q)
+   {
+      char via[64];
+
+      q++;
+      if ((1 != sscanf(q, "via=%63[^&]", via)) || !mp_tx_add_path(tx, via, &dst))
+         return false;
+      q = strchr(q, '&');
+   }
+   if (!tx->n)
+      fprintf(stderr, "multipath: no paths, add ?via=<interface or local ip>&via=...\n");
+   return tx->n > 0;
+}
+
+/******************************* receiver *******************************/
+
+typedef struct
+{
+   bool bHave;
+   uint32_t seq;
+   uint16_t len;
+   int64_t arrival_us;
+   uint8_t data[MP_PAYLOAD];
+} MP_SLOT;
+
+typedef struct
+{
+   bool bSeen;
+   struct sockaddr_in from;
+   uint32_t high, recv, bytes, last_ts;
+   int64_t last_us, feedback_us;
+   uint64_t packets;
+} MP_RX_PATH;
+
+typedef struct
+{
+   int fd;
+   int64_t reorder_us;
+   bool bStarted;
+   uint32_t next;                      /// sequence number due
+   uint32_t high;                      /// highest seen
+   MP_RX_PATH path[MP_MAX_PATHS];
+   MP_SLOT* slot;                      /// MP_REORDER_SLOTS
+   MP_SLOT out;                        /// what mp_rx_next() returned last
+   uint64_t packets, delivered, dups, lost;
+   uint64_t late;                      /// after their turn, mostly the second copy of key packets
+} MP_RX;
+
+/* listens on port (all addresses), false with errno set */
+static inline bool
+mp_rx_open (MP_RX* rx, unsigned short port, int reorder_ms)
+{
+   struct sockaddr_in a = { AF_INET, htons(port), { htonl(INADDR_ANY) } };
+   int size = 4 << 20;
+
+   memset(rx, 0, sizeof(*rx));
+   rx->reorder_us = (int64_t)(reorder_ms ? reorder_ms : MP_DEFAULT_REORDER) * 1000;
+   if (!(rx->slot = calloc(MP_REORDER_SLOTS, sizeof(MP_SLOT))))
+      return false;
+   if ((rx->fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+      return false;
+   setsockopt(rx->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+   return !bind(rx->fd, (struct sockaddr*) &a, sizeof(a));
+}
+
+static inline void
+mp_rx_close (MP_RX* rx)
+{
+   close(rx->fd);
+   free(rx->slot);
+   rx->slot = NULL;
+}
+
+/* what came over path i, back over it */
+static inline void
+mp_rx_feedback (MP_RX* rx, int i, int64_t now)
+{
+   MP_RX_PATH* p = &rx->path[i];
+   uint8_t fb[MP_FEEDBACK_LEN] = { MP_TYPE_FEEDBACK, i };
+
+   mp_put32(fb + 4, p->high);
+   mp_put32(fb + 8, p->recv);
+   mp_put32(fb + 12, p->bytes);
+   mp_put32(fb + 16, p->last_ts);
+   mp_put32(fb + 20, (uint32_t)(now - p->last_us));
+   sendto(rx->fd, fb, sizeof(fb), MSG_DONTWAIT, (struct sockaddr*) &p->from, sizeof(p->from));
+   p->feedback_us = now;
+}
+
+static inline void
+mp_rx_packet (MP_RX* rx, const uint8_t* pkt, size_t len, const struct sockaddr_in* from, int64_t now)
+{
+   MP_RX_PATH* p;
+   uint32_t seq, pseq;
+   MP_SLOT* s;
+   int i;
+
+   if ((len < MP_HDR_LEN) || (len > MP_HDR_LEN + MP_PAYLOAD) || (pkt[1] >= MP_MAX_PATHS) ||
+       ((MP_TYPE_DATA != pkt[0]) && (MP_TYPE_PROBE != pkt[0])))
+      return;
+   i = pkt[1];
+   p = &rx->path[i];
+   pseq = mp_get32(pkt + 8);
+   //the sender came back with new sockets, or the NAT on the way moved
+   if (!p->bSeen || (p->from.sin_addr.s_addr != from->sin_addr.s_addr) || (p->from.sin_port != from->sin_port))
+   {
+      memset(p, 0, sizeof(*p));
+      p->bSeen = true;
+      p->from = *from;
+      p->high = pseq - 1;
+   }
+   p->recv++;
+   p->bytes += len;
+   p->packets++;
+   if ((int32_t)(pseq - p->high) > 0)
+   {
+      p->high = pseq;
+      p->last_ts = mp_get32(pkt + 12);
+      p->last_us = now;
+   }
+   if ((MP_TYPE_PROBE == pkt[0]) || (now - p->feedback_us >= MP_FEEDBACK_US))
+      mp_rx_feedback(rx, i, now);
+   if (MP_TYPE_PROBE == pkt[0])
+      return;
+
+   rx->packets++;
+   seq = mp_get32(pkt + 4);
+   if (!rx->bStarted || ((int32_t)(seq - rx->next) < -(int32_t)(4 * MP_REORDER_SLOTS)))
+   {
+      //first packet, or a sender that restarted
+      for (i = 0; i < MP_REORDER_SLOTS; i++)
+         rx->slot[i].bHave = false;
+      rx->bStarted = true;
+      rx->next = rx->high = seq;
+   }
+   if ((int32_t)(seq - rx->next) < 0)
+   {
+      rx->late++;
+      return;
+   }
+   //far ahead: what does not fit the window any more is given up
+   while ((int32_t)(seq - rx->next) >= MP_REORDER_SLOTS)
+   {
+      rx->lost += !rx->slot[rx->next % MP_REORDER_SLOTS].bHave;
+      rx->slot[rx->next % MP_REORDER_SLOTS].bHave = false;
+      rx->next++;
+   }
+   s = &rx->slot[seq % MP_REORDER_SLOTS];
+   if (s->bHave && (s->seq == seq))
+   {
+      rx->dups++;
+      return;
+   }
+   s->bHave = true;
+   s->seq = seq;
+   s->len = len - MP_HDR_LEN;
+   s->arrival_us = now;
+   memcpy(s->data, pkt + MP_HDR_LEN, s->len);
+   if ((int32_t)(seq - rx->high) > 0)
+      rx->high = seq;
+}
+
+static inline bool
+mp_rx_have (const MP_RX* rx, uint32_t seq)
+{
+   const MP_SLOT* s = &rx->slot[seq % MP_REORDER_SLOTS];
+   return s->bHave && (s->seq == seq);
+}
+
+/*
+ * The next payload in order, NULL when the socket fails. The data stays
+ * valid until the next call.
+ */
+static inline const uint8_t*
+mp_rx_next (MP_RX* rx, uint32_t* len)
+{
+   uint8_t pkt[MP_HDR_LEN + MP_PAYLOAD + 1];
+
+   for (;;)
+   {
+      struct pollfd pfd = { rx->fd, POLLIN };
+      int timeout = -1;
+
+      if (rx->bStarted && ((int32_t)(rx->high - rx->next) >= 0))
+      {
+         MP_SLOT* s = &rx->slot[rx->next % MP_REORDER_SLOTS];
+         uint32_t seq;
+         int64_t wait;
+
+         if (mp_rx_have(rx, rx->next))
+         {
+            rx->out = *s;
+            s->bHave = false;
+            rx->next++;
+            rx->delivered++;
+            *len = rx->out.len;
+            return rx->out.data;
+         }
+         //missing: it gets reorder_ms from when the first one behind it came
+         for (seq = rx->next + 1; !mp_rx_have(rx, seq); seq++)
+            ;
+         wait = rx->slot[seq % MP_REORDER_SLOTS].arrival_us + rx->reorder_us - mp_now_us();
+         if (wait <= 0)
+         {
+            rx->lost++;
+            rx->next++;
+            continue;
+         }
+         timeout = (int)((wait + 999) / 1000);
+      }
+      if (poll(&pfd, 1, timeout) < 0)
+      {
+         if (EINTR == errno)
+            continue;
+         return NULL;
+      }
+      while (pfd.revents)
+      {
+         struct sockaddr_in from;
+         socklen_t flen = sizeof(from);
+         ssize_t n = recvfrom(rx->fd, pkt, sizeof(pkt), MSG_DONTWAIT, (struct sockaddr*) &from, &flen);
+
+         if (n < 0)
+         {
+            if ((EAGAIN == errno) || (EINTR == errno))
+               break;
+            return NULL;
+         }
+         mp_rx_packet(rx, pkt, n, &from, mp_now_us());
+      }
+   }
+}
+
+static inline void
+mp_rx_print (FILE* fp, const MP_RX* rx)
+{
+   int i;
+
+   fprintf(fp, "multipath: delivered=%llu lost=%llu dups=%llu late=%llu", (unsigned long long) rx->delivered,
+           (unsigned long long) rx->lost, (unsigned long long) rx->dups, (unsigned long long) rx->late);
+   for (i = 0; i < MP_MAX_PATHS; i++)
+      if (rx->path[i].bSeen)
+         fprintf(fp, " path%d=%s:%u/%llu", i, inet_ntoa(rx->path[i].from.sin_addr), ntohs(rx->path[i].from.sin_port),
+                 (unsigned long long) rx->path[i].packets);
+   fprintf(fp, "\n");
+}
+
+#endif //MULTIPATH_H
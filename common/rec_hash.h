@@ -0,0 +1,195 @@
+/*
+ * Hash chain of recorded segments, tamper evidence for the recorder.
+ *
+ * Next to every segment name-YYYYmmdd-HHMMSS.h264 the recorder writes
+ * name-YYYYmmdd-HHMMSS.hsh: a header with the last link of the segment before
+ * it, then one record per GOP (SPS/PPS + IDR up to the next IDR):
+ *
+ *    link = BLAKE3(previous link | offset | len | time_us | BLAKE3(GOP bytes))
+ *
+ * so the links run from the first segment of a stream to the last one and a
+ * changed, inserted or removed GOP or segment breaks every link after it. Every
+ * seal interval and at the end of a segment a seal record follows a GOP record:
+ *
+ *    seal = keyed BLAKE3(key, link | offset | time_us)
+ *
+ * Without the key nobody can recompute the chain after an edit and make the
+ * seals fit again. The key is the same 64 hex digit format as common/aead.h.
+ * Numbers are little endian (the records are written as they are in memory,
+ * like rec_index.h), the ones that go into a hash are serialized explicitly.
+ */
+#ifndef REC_HASH_H
+#define REC_HASH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "blake3.h"
+
+#define REC_HASH_MAGIC   "RPIHASH1"
+#define REC_HASH_GOP     0
+#define REC_HASH_SEAL    1
+
+typedef struct
+{
+   char magic[8];
+   uint32_t version;                   /// 1
+   uint32_t reserved;
+   uint8_t prev[32];                   /// last link of the previous segment, zeros for the first one of a stream
+   char prev_name[64];                 /// its file name, for people
+} REC_HASH_HEADER;
+
+typedef struct
+{
+   uint32_t type;                      /// REC_HASH_GOP or REC_HASH_SEAL
+   uint32_t reserved;
+   uint64_t offset;                    /// GOP: where it starts in the segment, seal: where the sealed part ends
+   uint64_t len;                       /// GOP: its bytes, seal: 0
+   int64_t time_us;                    /// wall clock of the IDR, of the seal
+   uint8_t hash[32];                   /// the link, the seal
+} REC_HASH_RECORD;
+
+typedef struct
+{
+   BLAKE3 gop;                         /// the GOP being written
+   bool bOpen;
+   uint64_t offset, len;
+   int64_t time_us;
+   uint8_t link[32];                   /// the last one
+} REC_HASH;
+
+static inline void
+rec_hash_st64 (uint8_t* p, uint64_t v)
+{
+   int i;
+   for (i = 0; i < 8; i++)
+      p[i] = (uint8_t)(v >> (8 * i));
+}
+
+/* the link after prev for a GOP whose bytes hash to digest */
+static inline void
+rec_hash_link (const uint8_t prev[32], uint64_t offset, uint64_t len, int64_t time_us, const uint8_t digest[32], uint8_t link[32])
+{
+   uint8_t msg[32 + 24 + 32];
+
+   memcpy(msg, prev, 32);
+   rec_hash_st64(msg + 32, offset);
+   rec_hash_st64(msg + 40, len);
+   rec_hash_st64(msg + 48, (uint64_t) time_us);
+   memcpy(msg + 56, digest, 32);
+   blake3(msg, sizeof(msg), link);
+}
+
+static inline void
+rec_hash_seal (const uint8_t key[32], const uint8_t link[32], uint64_t offset, int64_t time_us, uint8_t seal[32])
+{
+   uint8_t msg[32 + 16];
+   BLAKE3 h;
+
+   memcpy(msg, link, 32);
+   rec_hash_st64(msg + 32, offset);
+   rec_hash_st64(msg + 40, (uint64_t) time_us);
+   blake3_init_keyed(&h, key);
+   blake3_update(&h, msg, sizeof(msg));
+   blake3_final(&h, seal);
+}
+
+/* the chain continues from prev, NULL starts a new one */
+static inline void
+rec_hash_init (REC_HASH* h, const uint8_t prev[32])
+{
+   h->bOpen = false;
+   if (prev)
+      memcpy(h->link, prev, 32);
+   else
+      memset(h->link, 0, 32);
+}
+
+static inline void
+rec_hash_begin (REC_HASH* h, uint64_t offset, int64_t time_us)
+{
+   blake3_init(&h->gop);
+   h->bOpen = true;
+   h->offset = offset;
+   h->len = 0;
+   h->time_us = time_us;
+}
+
+static inline void
+rec_hash_update (REC_HASH* h, const void* data, size_t len)
+{
+   if (!h->bOpen)
+      return;
+   blake3_update(&h->gop, data, len);
+   h->len += len;
+}
+
+/* closes the GOP, false if none was open */
+static inline bool
+rec_hash_end (REC_HASH* h, REC_HASH_RECORD* rec)
+{
+   uint8_t digest[32];
+
+   if (!h->bOpen)
+      return false;
+   h->bOpen = false;
+   blake3_final(&h->gop, digest);
+   rec_hash_link(h->link, h->offset, h->len, h->time_us, digest, h->link);
+   memset(rec, 0, sizeof(*rec));
+   rec->type = REC_HASH_GOP;
+   rec->offset = h->offset;
+   rec->len = h->len;
+   rec->time_us = h->time_us;
+   memcpy(rec->hash, h->link, 32);
+   return true;
+}
+
+static inline bool
+rec_hash_write_header (FILE* fp, const uint8_t prev[32], const char* prev_name)
+{
+   REC_HASH_HEADER hdr;
+
+   memset(&hdr, 0, sizeof(hdr));
+   memcpy(hdr.magic, REC_HASH_MAGIC, sizeof(hdr.magic));
+   hdr.version = 1;
+   memcpy(hdr.prev, prev, 32);
+   if (prev_name)
+      snprintf(hdr.prev_name, sizeof(hdr.prev_name), "%s", prev_name);
+   return (1 == fwrite(&hdr, sizeof(hdr), 1, fp)) && (0 == fflush(fp));
+}
+
+static inline bool
+rec_hash_append (FILE* fp, const REC_HASH_RECORD* rec)
+{
+   return (1 == fwrite(rec, sizeof(*rec), 1, fp)) && (0 == fflush(fp));
+}
+
+/*
+ * The link a new segment continues from: the last GOP record of the file, the
+ * header's prev if it has none. Returns false if it is no hash file.
+ */
+static inline bool
+rec_hash_last_link (const char* path, uint8_t link[32])
+{
+   FILE* fp = fopen(path, "rb");
+   REC_HASH_HEADER hdr;
+   REC_HASH_RECORD rec;
+   bool bOk = false;
+
+   if (!fp)
+      return false;
+   if ((1 == fread(&hdr, sizeof(hdr), 1, fp)) && !memcmp(hdr.magic, REC_HASH_MAGIC, sizeof(hdr.magic)))
+   {
+      memcpy(link, hdr.prev, 32);
+      while (1 == fread(&rec, sizeof(rec), 1, fp))
+         if (REC_HASH_GOP == rec.type)
+            memcpy(link, rec.hash, 32);
+      bOk = true;
+   }
+   fclose(fp);
+   return bOk;
+}
+
+#endif
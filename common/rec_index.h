@@ -0,0 +1,77 @@
+/*
+ * Time index of recorded segments.
+ *
+ * Next to every segment name-YYYYmmdd-HHMMSS.h264 the recorder appends one
+ * fixed size record per IDR to name-YYYYmmdd-HHMMSS.idx. The offset points
+ * to SPS/PPS + IDR, so a reader can start streaming right there without
+ * parsing anything.
+ */
+#ifndef REC_INDEX_H
+#define REC_INDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef struct
+{
+   int64_t time_us;                    /// wall clock (CLOCK_REALTIME) of the IDR
+   uint64_t offset;                    /// byte offset in the segment
+} REC_INDEX_ENTRY;
+
+static inline bool
+rec_index_append (FILE* fp, int64_t time_us, uint64_t offset)
+{
+   REC_INDEX_ENTRY e = { time_us, offset };
+   if (1 != fwrite(&e, sizeof(e), 1, fp))
+      return false;
+   //readers may look at it while we are still recording
+   return 0 == fflush(fp);
+}
+
+/*
+ * Offset of the last IDR at or before time_us, 0 if time_us is before the
+ * first one. Returns false if the index can't be read.
+ */
+static inline bool
+rec_index_lookup (const char* idx_path, int64_t time_us, uint64_t* offset)
+{
+   struct stat st;
+   int fd = open(idx_path, O_RDONLY);
+   bool bOk = false;
+
+   *offset = 0;
+   if (fd < 0)
+      return false;
+   if ((0 == fstat(fd, &st)) && (st.st_size >= (off_t) sizeof(REC_INDEX_ENTRY)))
+   {
+      size_t n = st.st_size / sizeof(REC_INDEX_ENTRY);
+      const REC_INDEX_ENTRY* e = mmap(NULL, n * sizeof(REC_INDEX_ENTRY), PROT_READ, MAP_SHARED, fd, 0);
+      if (MAP_FAILED != e)
+      {
+         size_t lo = 0, hi = n;
+         while (lo < hi)
+         {
+            size_t mid = (lo + hi) / 2;
+            if (e[mid].time_us <= time_us)
+               lo = mid + 1;
+            else
+               hi = mid;
+         }
+         if (lo)
+            *offset = e[lo - 1].offset;
+         munmap((void*) e, n * sizeof(REC_INDEX_ENTRY));
+         bOk = true;
+      }
+   }
+   else
+      bOk = true; //empty index, start of the segment
+   close(fd);
+   return bOk;
+}
+
+#endif //REC_INDEX_H
@@ -0,0 +1,331 @@
+/*
+ * Motion event publisher: MQTT 3.1.1 (QoS 1) or an HTTP POST webhook.
+ *
+ * event_publish() only queues the record, it never blocks the caller (an
+ * MMAL callback or the clip writer). One thread delivers the records and
+ * retries with a growing delay while the broker is away. The queue is
+ * bounded, when it is full the oldest record is dropped and counted.
+ */
+#ifndef RPI_EVENT_H
+#define RPI_EVENT_H
+
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "rpi_net.h"
+
+#define EVENT_QUEUE_LEN       32
+#define EVENT_IO_TIMEOUT_SEC  5
+#define EVENT_RETRY_MAX_SEC   60
+
+typedef struct
+{
+   int64_t time_us;                    /// wall clock (CLOCK_REALTIME) of the first alarm
+   int duration_ms;                    /// first alarm until the last one + post-roll
+   uint16_t zones;                     /// bit row*3+col set for every cell of a 3x3 grid that had motion above the alarm level
+   uint8_t strength;                   /// strongest motion vector seen during the event
+   char clip[256];                     /// clip file, empty if clips are not written
+} EVENT_RECORD;
+
+typedef enum
+{
+   EVENT_PUB_NONE = 0,
+   EVENT_PUB_MQTT,                     /// mqtt://1.2.3.4:1883/topic
+   EVENT_PUB_HTTP                      /// http://1.2.3.4:8080/path
+} EVENT_PUB_KIND;
+
+typedef struct
+{
+   EVENT_PUB_KIND kind;
+   struct sockaddr_in saddr;
+   char host[64];                      /// "ip:port" for the Host: header
+   char topic[128];                    /// MQTT topic or HTTP path
+   char client_id[32];
+   uint16_t packet_id;
+   bool verbose;
+
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   EVENT_RECORD q[EVENT_QUEUE_LEN];
+   unsigned q_rd, q_wr;                /// free running, q_wr - q_rd records queued
+   unsigned long ulDropped;
+} EVENT_PUBLISHER;
+
+/* {"time":"2024-05-01T14:03:12.345Z","duration_ms":..,"zones":..,"strength":..,"clip":".."} */
+static inline int
+event_format_json (const EVENT_RECORD* ev, char* buf, size_t size)
+{
+   time_t t = ev->time_us / 1000000;
+   struct tm tm;
+   char ts[32], clip[2 * sizeof(ev->clip)];
+   const char* s;
+   char* d = clip;
+
+   gmtime_r(&t, &tm);
+   strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", &tm);
+   for (s = ev->clip; *s; s++)
+   {
+      if (('"' == *s) || ('\\' == *s))
+         *d++ = '\\';
+      *d++ = *s;
+   }
+   *d = 0;
+   return snprintf(buf, size, "{\"time\":\"%s.%03dZ\",\"duration_ms\":%d,\"zones\":%u,\"strength\":%u,\"clip\":\"%s\"}",
+                   ts, (int) (ev->time_us / 1000 % 1000), ev->duration_ms, ev->zones, ev->strength, clip);
+}
+
+static inline bool
+event_send_all (int fd, const void* buf, size_t len)
+{
+   const char* p = (const char*) buf;
+   while (len)
+   {
+      ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+      if ((n < 0) && (EINTR == errno))
+         continue;
+      if (n <= 0)
+         return false;
+      p += n;
+      len -= n;
+   }
+   return true;
+}
+
+static inline bool
+event_recv_all (int fd, void* buf, size_t len)
+{
+   char* p = (char*) buf;
+   while (len)
+   {
+      ssize_t n = recv(fd, p, len, 0);
+      if ((n < 0) && (EINTR == errno))
+         continue;
+      if (n <= 0)
+         return false;
+      p += n;
+      len -= n;
+   }
+   return true;
+}
+
+/* blocking socket with send/receive (and so connect) timeouts, a dead broker never hangs the publisher forever */
+static inline int
+event_connect (EVENT_PUBLISHER* pub)
+{
+   struct timeval tv = { EVENT_IO_TIMEOUT_SEC, 0 };
+   int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+   if (fd < 0)
+      return -1;
+   setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+   setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+   if (connect(fd, (struct sockaddr*) &pub->saddr, sizeof(pub->saddr)))
+   {
+      close(fd);
+      return -1;
+   }
+   return fd;
+}
+
+/* MQTT remaining length, 7 bits per byte */
+static inline int
+event_mqtt_varint (unsigned char* p, uint32_t len)
+{
+   int n = 0;
+   do
+   {
+      p[n] = len & 0x7F;
+      len >>= 7;
+      if (len)
+         p[n] |= 0x80;
+      n++;
+   } while (len);
+   return n;
+}
+
+static inline int
+event_mqtt_string (unsigned char* p, const char* str)
+{
+   size_t len = strlen(str);
+   p[0] = len >> 8;
+   p[1] = len & 0xFF;
+   memcpy(p + 2, str, len);
+   return 2 + len;
+}
+
+/* CONNECT, PUBLISH QoS 1, wait for PUBACK, DISCONNECT. Events are rare, no need to keep a session */
+static inline bool
+event_deliver_mqtt (EVENT_PUBLISHER* pub, const char* json, int json_len)
+{
+   unsigned char pkt[1024], body[1024], ack[4];
+   int fd, len, n;
+   bool bOK = false;
+
+   if ((fd = event_connect(pub)) < 0)
+      return false;
+
+   //CONNECT: protocol "MQTT" level 4, clean session, keep alive 60s
+   len = event_mqtt_string(body, "MQTT");
+   body[len++] = 4;
+   body[len++] = 0x02;
+   body[len++] = 0;
+   body[len++] = 60;
+   len += event_mqtt_string(body + len, pub->client_id);
+   pkt[0] = 0x10;
+   n = 1 + event_mqtt_varint(pkt + 1, len);
+   memcpy(pkt + n, body, len);
+   if (!event_send_all(fd, pkt, n + len) || !event_recv_all(fd, ack, 4) || (0x20 != ack[0]) || (0 != ack[3]))
+      goto out;
+
+   //PUBLISH QoS 1
+   if (0 == ++pub->packet_id)
+      pub->packet_id = 1;
+   len = event_mqtt_string(body, pub->topic);
+   body[len++] = pub->packet_id >> 8;
+   body[len++] = pub->packet_id & 0xFF;
+   if (len + json_len > (int) sizeof(body))
+      goto out;
+   memcpy(body + len, json, json_len);
+   len += json_len;
+   pkt[0] = 0x32;
+   n = 1 + event_mqtt_varint(pkt + 1, len);
+   memcpy(pkt + n, body, len);
+   if (!event_send_all(fd, pkt, n + len) || !event_recv_all(fd, ack, 4) || (0x40 != ack[0]) ||
+       (ack[2] != (pub->packet_id >> 8)) || (ack[3] != (pub->packet_id & 0xFF)))
+      goto out;
+
+   pkt[0] = 0xE0;
+   pkt[1] = 0;
+   event_send_all(fd, pkt, 2);
+   bOK = true;
+out:
+   close(fd);
+   return bOK;
+}
+
+static inline bool
+event_deliver_http (EVENT_PUBLISHER* pub, const char* json, int json_len)
+{
+   char req[1536], resp[64];
+   int fd, len, status = 0;
+   ssize_t n;
+   bool bOK = false;
+
+   if ((fd = event_connect(pub)) < 0)
+      return false;
+   len = snprintf(req, sizeof(req), "POST %s HTTP/1.1\r\nHost: %s\r\nContent-Type: application/json\r\n"
+                  "Content-Length: %d\r\nConnection: close\r\n\r\n%s", pub->topic, pub->host, json_len, json);
+   if ((len < (int) sizeof(req)) && event_send_all(fd, req, len))
+   {
+      //only the status line matters
+      while (((n = recv(fd, resp, sizeof(resp) - 1, 0)) < 0) && (EINTR == errno))
+         ;
+      if (n > 0)
+      {
+         resp[n] = 0;
+         bOK = (1 == sscanf(resp, "HTTP/%*d.%*d %d", &status)) && (status >= 200) && (status < 300);
+      }
+   }
+   close(fd);
+   return bOK;
+}
+
+static inline void*
+event_publisher_thread (void* arg)
+{
+   EVENT_PUBLISHER* pub = (EVENT_PUBLISHER*) arg;
+   int retry_sec = 1;
+
+   for (;;)
+   {
+      EVENT_RECORD ev;
+      char json[768];
+      unsigned seq;
+      int len;
+      bool bOK;
+
+      pthread_mutex_lock(&pub->lock);
+      while (pub->q_rd == pub->q_wr)
+         pthread_cond_wait(&pub->cond, &pub->lock);
+      seq = pub->q_rd;
+      ev = pub->q[seq % EVENT_QUEUE_LEN];
+      pthread_mutex_unlock(&pub->lock);
+
+      len = event_format_json(&ev, json, sizeof(json));
+      if (EVENT_PUB_MQTT == pub->kind)
+         bOK = event_deliver_mqtt(pub, json, len);
+      else
+         bOK = event_deliver_http(pub, json, len);
+
+      if (pub->verbose)
+         fprintf(stderr, "event %s: %s\n", bOK ? "published" : "not published", json);
+      if (bOK)
+      {
+         pthread_mutex_lock(&pub->lock);
+         if (pub->q_rd == seq) //not dropped meanwhile by a full queue
+            pub->q_rd++;
+         pthread_mutex_unlock(&pub->lock);
+         retry_sec = 1;
+      }
+      else
+      {
+         sleep(retry_sec);
+         if (retry_sec < EVENT_RETRY_MAX_SEC)
+            retry_sec *= 2;
+      }
+   }
+   return NULL;
+}
+
+/* "mqtt://1.2.3.4:1883/topic" or "http://1.2.3.4:8080/path", starts the delivery thread */
+static inline bool
+event_publisher_start (EVENT_PUBLISHER* pub, const char* url, bool verbose)
+{
+   const char* hostport;
+   const char* slash;
+   pthread_t thread;
+
+   memset(pub, 0, sizeof(*pub));
+   if (!strncmp(url, "mqtt://", 7))
+      pub->kind = EVENT_PUB_MQTT;
+   else if (!strncmp(url, "http://", 7))
+      pub->kind = EVENT_PUB_HTTP;
+   else
+      return false;
+   hostport = url + 7;
+   slash = strchr(hostport, '/');
+   if (!slash || (slash - hostport >= (int) sizeof(pub->host)) || (strlen(slash) >= sizeof(pub->topic)))
+      return false;
+   memcpy(pub->host, hostport, slash - hostport);
+   if (!ParseIPv4Port(pub->host, &pub->saddr))
+      return false;
+   //MQTT topics have no leading slash, HTTP paths do
+   strcpy(pub->topic, (EVENT_PUB_MQTT == pub->kind) ? slash + 1 : slash);
+   snprintf(pub->client_id, sizeof(pub->client_id), "raspivid-%d", (int) getpid());
+   pub->verbose = verbose;
+   pthread_mutex_init(&pub->lock, NULL);
+   pthread_cond_init(&pub->cond, NULL);
+   if (pthread_create(&thread, NULL, event_publisher_thread, pub))
+      return false;
+   pthread_detach(thread);
+   return true;
+}
+
+/* never blocks, drops the oldest record if the broker has been away for long */
+static inline void
+event_publish (EVENT_PUBLISHER* pub, const EVENT_RECORD* ev)
+{
+   pthread_mutex_lock(&pub->lock);
+   if (pub->q_wr - pub->q_rd == EVENT_QUEUE_LEN)
+   {
+      pub->q_rd++;
+      if (0 == (pub->ulDropped++ % 10))
+         fprintf(stderr, "event queue full, %lu events dropped\n", pub->ulDropped);
+   }
+   pub->q[pub->q_wr++ % EVENT_QUEUE_LEN] = *ev;
+   pthread_cond_signal(&pub->cond);
+   pthread_mutex_unlock(&pub->lock);
+}
+
+#endif //RPI_EVENT_H
@@ -0,0 +1,268 @@
+/*
+ * Socket helpers shared by the client (video.c) and the relay (relay.c).
+ *
+ * Header only on purpose: every program here is built from a single .c file,
+ * so including this is all that is needed, no extra object to link.
+ */
+#ifndef RPI_NET_H
+#define RPI_NET_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static inline int
+SetNonBlocking (int fd, bool bNonBlocking)
+{
+   int flags = fcntl(fd, F_GETFL, 0);
+   if (flags < 0)
+      return -1;
+   if (bNonBlocking)
+      flags |= O_NONBLOCK;
+   else
+      flags &= ~O_NONBLOCK;
+   return fcntl(fd, F_SETFL, flags);
+}
+
+/* "1.2.3.4:1234" -> saddr, returns false if it is not a valid IPv4:port */
+static inline bool
+ParseIPv4Port (const char* str, struct sockaddr_in* saddr)
+{
+   char host[64];
+   unsigned short port;
+   const char* colon = strchr(str, ':');
+   if ((NULL == colon) || (colon - str >= (int) sizeof(host)))
+      return false;
+   memcpy(host, str, colon - str);
+   host[colon - str] = 0;
+   if (1 != sscanf(colon + 1, "%hu", &port))
+      return false;
+   memset(saddr, 0, sizeof(*saddr));
+   saddr->sin_family = AF_INET;
+   saddr->sin_port = htons(port);
+   return 0 != inet_aton(host, &saddr->sin_addr);
+}
+
+/* socket + SO_REUSEADDR + bind + listen, returns the listening socket or -1 */
+static inline int
+OpenListenSocket (struct in_addr* ip, unsigned short port, int backlog)
+{
+   struct sockaddr_in saddr={};
+   saddr.sin_family = AF_INET;
+   saddr.sin_port = htons(port);
+   saddr.sin_addr = *ip;
+
+   int sockListen = socket(AF_INET, SOCK_STREAM, 0);
+   if (sockListen < 0)
+   {
+      fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
+      return -1;
+   }
+
+   int iTmp = 1;
+   setsockopt(sockListen, SOL_SOCKET, SO_REUSEADDR, &iTmp, sizeof(int)); //no error handling, just go on
+   if (bind(sockListen, (struct sockaddr *) &saddr, sizeof(saddr)) < 0)
+   {
+      fprintf(stderr, "Error on binding socket: %s\n", strerror(errno));
+      close(sockListen);
+      return -1;
+   }
+   while ((-1 == (iTmp = listen(sockListen, backlog))) && (EINTR == errno))
+      ;
+   if (-1 == iTmp)
+   {
+      fprintf(stderr, "Error trying to listen on a socket: %s\n", strerror(errno));
+      close(sockListen);
+      return -1;
+   }
+   return sockListen;
+}
+
+static inline int
+SetupListenSocket (struct in_addr* ip, unsigned short port, unsigned short rcv_timeout, bool bVerbose)
+{
+   int sfd = -1;
+   int sockListen = OpenListenSocket(ip, port, 0);
+   if (sockListen < 0)
+      return -1;
+
+   fprintf(stderr, "Waiting for a TCP connection on %s:%"SCNu16"...", inet_ntoa(*ip), port);
+   struct sockaddr_in cli_addr;
+   socklen_t clilen = sizeof(cli_addr);
+   while ((-1 == (sfd = accept(sockListen, (struct sockaddr *) &cli_addr, &clilen))) && (EINTR == errno))
+      ;
+   if (sfd >= 0)
+   {
+      struct timeval timeout;
+      timeout.tv_sec = rcv_timeout;
+      timeout.tv_usec = 0;
+      if (setsockopt(sfd, SOL_SOCKET, SO_RCVTIMEO, (char *) &timeout, sizeof(timeout)) < 0)
+         fprintf(stderr, "setsockopt failed\n");
+      fprintf(stderr, "Client connected from %s:%"SCNu16"\n", inet_ntoa(cli_addr.sin_addr), ntohs(cli_addr.sin_port));
+   }
+   else
+      fprintf(stderr, "Error on accept: %s\n", strerror(errno));
+
+   close(sockListen); //do not listen on a given port anymore
+
+   return sfd;
+}
+
+/* non-blocking connect, the socket is returned in progress (EINPROGRESS) or connected */
+static inline int
+StartConnect (struct sockaddr_in* saddr, int socktype)
+{
+   int sfd = socket(AF_INET, socktype, 0);
+   if (sfd < 0)
+   {
+      fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
+      return -1;
+   }
+   SetNonBlocking(sfd, true);
+   if ((-1 == connect(sfd, (struct sockaddr *) saddr, sizeof(*saddr))) && (errno != EINPROGRESS))
+   {
+      close(sfd);
+      return -1;
+   }
+   return sfd;
+}
+
+static inline int
+ConnectToHost (struct in_addr* ip, unsigned short port, bool bVerbose)
+{
+   int sfd = -1;
+
+   struct sockaddr_in saddr = {};
+   saddr.sin_family = AF_INET;
+   saddr.sin_port = htons(port);
+   saddr.sin_addr = *ip;
+
+   bool bConnected = false;
+   int iConnectCnt = 0;
+   while ((!bConnected) && (iConnectCnt++ < 10000000))
+   {
+      if (0 <= (sfd = socket(AF_INET, SOCK_STREAM, 0)))
+      {
+         fcntl(sfd, F_SETFL, O_NONBLOCK);
+
+         if(bVerbose)
+            fprintf(stderr, "Connecting(%d) to %s:%hu...", iConnectCnt, inet_ntoa(saddr.sin_addr), port);
+         int iTmp = connect(sfd, (struct sockaddr *) &saddr, sizeof(struct sockaddr_in));
+         if ((iTmp == -1) && (errno != EINPROGRESS))
+         {
+            fprintf(stderr, "connect error: %s\n", strerror(errno));
+            return 1;
+         }
+         if (iTmp == 0)
+         {
+            bConnected = true;
+            continue; //connected immediately, not realistic
+         }
+         fd_set fdset;
+         FD_ZERO(&fdset);
+         FD_SET(sfd, &fdset);
+         struct timeval tv;
+         tv.tv_sec = 1;
+         tv.tv_usec = 0;
+
+         iTmp = select(sfd + 1, NULL, &fdset, NULL, &tv);
+         switch (iTmp)
+         {
+            case 1: // data to read
+            {
+               int so_error;
+               socklen_t len = sizeof(so_error);
+               getsockopt(sfd, SOL_SOCKET, SO_ERROR, &so_error, &len);
+               if (so_error == 0)
+               {
+                  if(bVerbose)
+                     fprintf(stderr, "connected, receiving data\n");
+                  bConnected = true;
+                  continue;
+               }
+               else
+               { // error
+                  if ((ECONNREFUSED == so_error)||
+                      (EHOSTUNREACH == so_error))
+                  {
+                     if(bVerbose)
+                        fprintf(stderr, "%s\n", strerror(so_error));
+                     close(sfd);
+                     usleep(100000);
+                     continue;
+                  }
+
+                  fprintf(stderr, "socket select %d, %s\n", so_error, strerror(so_error));
+                  return -1;
+               }
+            }
+               break;
+            case 0: //timeout
+               if(bVerbose)
+                  fprintf(stderr, "timeout connecting\n");
+               close(sfd);
+               break;
+         }
+      }
+      else
+      {
+         fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
+         return -1;
+      }
+   }
+
+   if (bConnected && (-1 != sfd))
+   {
+      int flags = fcntl(sfd, F_GETFL, 0);
+      if (0 != fcntl(sfd, F_SETFL, flags ^ O_NONBLOCK))
+      {
+         fprintf(stderr, "fcntl O_NONBLOCK");
+         close(sfd);
+         exit(134);
+      }
+      return sfd;
+   }
+   return -1;
+}
+
+/* UDP socket bound to ip:port, receives what a sender started with -o udp://ip:port sends */
+static inline int
+OpenUDPSocket (struct in_addr* ip, unsigned short port, bool bVerbose)
+{
+   struct sockaddr_in saddr={};
+   saddr.sin_family = AF_INET;
+   saddr.sin_port = htons(port);
+   saddr.sin_addr = *ip;
+
+   int sfd = socket(AF_INET, SOCK_DGRAM, 0);
+   if (sfd < 0)
+   {
+      fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
+      return -1;
+   }
+   //an IDR frame arrives as a burst of datagrams
+   int iTmp = 1 << 20;
+   setsockopt(sfd, SOL_SOCKET, SO_RCVBUF, &iTmp, sizeof(iTmp)); //no error handling, just go on
+   if (bind(sfd, (struct sockaddr *) &saddr, sizeof(saddr)) < 0)
+   {
+      fprintf(stderr, "Error on binding socket: %s\n", strerror(errno));
+      close(sfd);
+      return -1;
+   }
+   if (bVerbose)
+      fprintf(stderr, "Receiving UDP on %s:%"SCNu16"\n", inet_ntoa(*ip), port);
+   return sfd;
+}
+
+#endif //RPI_NET_H
@@ -0,0 +1,377 @@
+/*
+ * TLS 1.3 for the TCP stream and for recorded file serving, encrypted in the
+ * kernel (kTLS) so send(), sendmsg() and sendfile() keep working unchanged
+ * and zero copy.
+ *
+ * OpenSSL only does the handshake. The traffic secrets come from the key log
+ * callback, the record keys are derived from them (RFC 8446 7.3) and handed
+ * to the kernel with TCP_ULP "tls" + TLS_TX/TLS_RX. No session tickets are
+ * sent, so both directions start at record sequence 0 after the handshake.
+ * This works the same with OpenSSL 1.1.1 and 3.x, no ktls enabled OpenSSL
+ * build needed.
+ *
+ * Without the tls module (or with a cipher the kernel lacks, ChaCha20 came
+ * with 5.11) every call falls back to SSL_write/SSL_read in user space, as
+ * it does with RPI_TLS_NO_KTLS set in the environment.
+ *
+ * Opt in: build with -DRPI_WITH_TLS -lssl -lcrypto. Without RPI_WITH_TLS the calls
+ * below exist but refuse, so callers need no #ifdef.
+ */
+#ifndef RPI_TLS_H
+#define RPI_TLS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+
+/* a zeroed RPI_TLS with just fd set is a plain socket, the calls below then are send(), recv() ... */
+typedef struct
+{
+   int fd;
+   bool bKernelTx;                     /// sends go straight to the socket, the kernel encrypts
+   bool bKernelRx;
+   void* ssl;                          /// SSL*, only used for the handshake and in user space mode
+   void* ctx;                          /// SSL_CTX*
+   pthread_mutex_t lock;               /// user space mode: an SSL object is not safe for a concurrent read and write
+   unsigned char secret[2][48];        /// [0] client, [1] server application traffic secret
+   int secret_len;
+} RPI_TLS;
+
+#ifdef RPI_WITH_TLS
+
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/hmac.h>
+#include <openssl/evp.h>
+
+#ifndef SOL_TLS
+   #define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+   #define TCP_ULP 31
+#endif
+
+/* OpenSSL calls this with "CLIENT_TRAFFIC_SECRET_0 <random> <hex>" etc. */
+static inline void
+rpi_tls_keylog (const SSL* ssl, const char* line)
+{
+   RPI_TLS* t = (RPI_TLS*) SSL_get_app_data(ssl);
+   char hex[2 * 48 + 1];
+   int i, n, which;
+
+   if (!strncmp(line, "CLIENT_TRAFFIC_SECRET_0 ", 24))
+      which = 0;
+   else if (!strncmp(line, "SERVER_TRAFFIC_SECRET_0 ", 24))
+      which = 1;
+   else
+      return;
+   if (1 != sscanf(line, "%*s %*s %96s", hex))
+      return;
+   n = strlen(hex) / 2;
+   for (i = 0; i < n; i++)
+   {
+      unsigned int v;
+      sscanf(hex + 2 * i, "%2x", &v);
+      t->secret[which][i] = v;
+   }
+   t->secret_len = n;
+}
+
+/* HKDF-Expand-Label(secret, label, "", len) with SHA-256, len <= 32 so one HMAC block */
+static inline bool
+rpi_tls_expand_label (const unsigned char* secret, int secret_len, const char* label, unsigned char* out, int len)
+{
+   unsigned char info[64], md[EVP_MAX_MD_SIZE];
+   unsigned int md_len;
+   int n = 0, l = strlen(label);
+
+   info[n++] = 0;
+   info[n++] = len;
+   info[n++] = 6 + l;
+   memcpy(info + n, "tls13 ", 6);
+   n += 6;
+   memcpy(info + n, label, l);
+   n += l;
+   info[n++] = 0;                      //empty context
+   info[n++] = 1;                      //HKDF-Expand block counter
+   if (!HMAC(EVP_sha256(), secret, secret_len, info, n, md, &md_len))
+      return false;
+   memcpy(out, md, len);
+   return true;
+}
+
+/* one direction to the kernel, false leaves it to user space */
+static inline bool
+rpi_tls_kernel_dir (RPI_TLS* t, int optname, const unsigned char* secret)
+{
+   union
+   {
+      struct tls12_crypto_info_aes_gcm_128 gcm;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+      struct tls12_crypto_info_chacha20_poly1305 chacha;
+#endif
+   } info;
+   unsigned char key[32], iv[12];
+   unsigned long id = SSL_CIPHER_get_id(SSL_get_current_cipher((SSL*) t->ssl)) & 0xFFFF;
+   socklen_t len;
+
+   memset(&info, 0, sizeof(info));
+   if (0x1301 == id)                   //TLS_AES_128_GCM_SHA256
+   {
+      if (!rpi_tls_expand_label(secret, t->secret_len, "key", key, 16) || !rpi_tls_expand_label(secret, t->secret_len, "iv", iv, 12))
+         return false;
+      info.gcm.info.version = TLS_1_3_VERSION;
+      info.gcm.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+      memcpy(info.gcm.key, key, 16);
+      memcpy(info.gcm.salt, iv, 4);
+      memcpy(info.gcm.iv, iv + 4, 8);
+      len = sizeof(info.gcm);
+   }
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+   else if (0x1303 == id)              //TLS_CHACHA20_POLY1305_SHA256
+   {
+      if (!rpi_tls_expand_label(secret, t->secret_len, "key", key, 32) || !rpi_tls_expand_label(secret, t->secret_len, "iv", iv, 12))
+         return false;
+      info.chacha.info.version = TLS_1_3_VERSION;
+      info.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+      memcpy(info.chacha.key, key, 32);
+      memcpy(info.chacha.iv, iv, 12);
+      len = sizeof(info.chacha);
+   }
+#endif
+   else
+      return false;
+   return 0 == setsockopt(t->fd, SOL_TLS, optname, &info, len);
+}
+
+static inline void
+rpi_tls_kernel (RPI_TLS* t, bool bServer, bool bVerbose)
+{
+   SSL* ssl = (SSL*) t->ssl;
+
+   //anything OpenSSL already read past the handshake would be lost to the kernel
+   if (getenv("RPI_TLS_NO_KTLS") || (32 != t->secret_len) || SSL_has_pending(ssl) ||
+       setsockopt(t->fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")))
+   {
+      if (bVerbose)
+         fprintf(stderr, "TLS in user space (%s)\n", (32 != t->secret_len) ? "no secrets" : "no kTLS");
+      return;
+   }
+   t->bKernelTx = rpi_tls_kernel_dir(t, TLS_TX, t->secret[bServer ? 1 : 0]);
+   t->bKernelRx = rpi_tls_kernel_dir(t, TLS_RX, t->secret[bServer ? 0 : 1]);
+   if (bVerbose)
+      fprintf(stderr, "%s, kTLS tx %s rx %s\n", SSL_get_cipher_name(ssl), t->bKernelTx ? "on" : "off", t->bKernelRx ? "on" : "off");
+}
+
+static inline SSL_CTX*
+rpi_tls_ctx (bool bServer)
+{
+   SSL_CTX* ctx = SSL_CTX_new(bServer ? TLS_server_method() : TLS_client_method());
+
+   if (!ctx)
+      return NULL;
+   SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION);
+   //the two suites the kernel can take over; no AES instructions on a Pi, ChaCha20 first there
+#if defined(__arm__) || defined(__aarch64__)
+   SSL_CTX_set_ciphersuites(ctx, "TLS_CHACHA20_POLY1305_SHA256:TLS_AES_128_GCM_SHA256");
+#else
+   SSL_CTX_set_ciphersuites(ctx, "TLS_AES_128_GCM_SHA256:TLS_CHACHA20_POLY1305_SHA256");
+#endif
+   SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+   SSL_CTX_set_num_tickets(ctx, 0);
+   SSL_CTX_set_keylog_callback(ctx, rpi_tls_keylog);
+   return ctx;
+}
+
+static inline bool
+rpi_tls_handshake (RPI_TLS* t, SSL_CTX* ctx, int fd, bool bServer, bool bVerbose)
+{
+   SSL* ssl;
+   int r;
+
+   memset(t, 0, sizeof(*t));
+   t->fd = fd;
+   t->ctx = ctx;
+   pthread_mutex_init(&t->lock, NULL);
+   if (NULL == (ssl = SSL_new(ctx)))
+      return false;
+   t->ssl = ssl;
+   SSL_set_app_data(ssl, t);
+   SSL_set_fd(ssl, fd);
+   while (((r = bServer ? SSL_accept(ssl) : SSL_connect(ssl)) <= 0) && (SSL_ERROR_SYSCALL == SSL_get_error(ssl, r)) && (EINTR == errno))
+      ;
+   if (r <= 0)
+   {
+      fprintf(stderr, "TLS handshake failed: ");
+      ERR_print_errors_fp(stderr);
+      fprintf(stderr, "\n");
+      return false;
+   }
+   rpi_tls_kernel(t, bServer, bVerbose);
+   return true;
+}
+
+/* server side of an accepted (or connected) TCP socket */
+static inline bool
+rpi_tls_accept (RPI_TLS* t, int fd, const char* cert, const char* key, bool bVerbose)
+{
+   SSL_CTX* ctx = rpi_tls_ctx(true);
+
+   if (!ctx || (1 != SSL_CTX_use_certificate_chain_file(ctx, cert)) || (1 != SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM)))
+   {
+      fprintf(stderr, "%s, %s: cannot load the certificate or key\n", cert, key);
+      return false;
+   }
+   return rpi_tls_handshake(t, ctx, fd, true, bVerbose);
+}
+
+/* client side, the server certificate must be signed by (or be) the one in cafile */
+static inline bool
+rpi_tls_connect (RPI_TLS* t, int fd, const char* cafile, bool bVerbose)
+{
+   SSL_CTX* ctx = rpi_tls_ctx(false);
+
+   if (!ctx || (1 != SSL_CTX_load_verify_locations(ctx, cafile, NULL)))
+   {
+      fprintf(stderr, "%s: cannot load the certificate\n", cafile);
+      return false;
+   }
+   SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+   return rpi_tls_handshake(t, ctx, fd, false, bVerbose);
+}
+
+/* SSL_write of all of it, in user space mode only */
+static inline bool
+rpi_tls_write_all (RPI_TLS* t, const void* buf, size_t len)
+{
+   const char* p = (const char*) buf;
+   while (len)
+   {
+      int n = SSL_write((SSL*) t->ssl, p, (len > (1 << 30)) ? (1 << 30) : len);
+      if (n <= 0)
+         return false;
+      p += n;
+      len -= n;
+   }
+   return true;
+}
+
+static inline ssize_t
+rpi_tls_sendmsg (RPI_TLS* t, const struct msghdr* msg, int flags)
+{
+   ssize_t total = 0;
+   size_t i;
+
+   if (!t->ssl || t->bKernelTx)
+      return sendmsg(t->fd, msg, flags);
+   pthread_mutex_lock(&t->lock);
+   for (i = 0; i < msg->msg_iovlen; i++)
+   {
+      if (!rpi_tls_write_all(t, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len))
+      {
+         total = -1;
+         break;
+      }
+      total += msg->msg_iov[i].iov_len;
+   }
+   pthread_mutex_unlock(&t->lock);
+   return total;
+}
+
+static inline ssize_t
+rpi_tls_send (RPI_TLS* t, const void* buf, size_t len, int flags)
+{
+   struct iovec iov = { (void*) buf, len };
+   struct msghdr msg = {};
+
+   if (!t->ssl || t->bKernelTx)
+      return send(t->fd, buf, len, flags);
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   return rpi_tls_sendmsg(t, &msg, flags);
+}
+
+static inline ssize_t
+rpi_tls_recv (RPI_TLS* t, void* buf, size_t len)
+{
+   int n;
+
+   if (!t->ssl || t->bKernelRx)
+      return recv(t->fd, buf, len, 0);
+   if (!t->bKernelTx)
+   {
+      //wait outside the lock, the sender must not block behind an idle reader
+      struct pollfd pfd = { t->fd, POLLIN, 0 };
+      while (!SSL_pending((SSL*) t->ssl) && (poll(&pfd, 1, -1) < 0) && (EINTR == errno))
+         ;
+      pthread_mutex_lock(&t->lock);
+   }
+   n = SSL_read((SSL*) t->ssl, buf, len);
+   if (!t->bKernelTx)
+      pthread_mutex_unlock(&t->lock);
+   return (n > 0) ? n : ((SSL_ERROR_ZERO_RETURN == SSL_get_error((SSL*) t->ssl, n)) ? 0 : -1);
+}
+
+/* kTLS: real sendfile, the page cache goes to the socket without a copy to user space */
+static inline ssize_t
+rpi_tls_sendfile (RPI_TLS* t, int in, off_t* off, size_t count)
+{
+   char buf[64 * 1024];
+   ssize_t n;
+
+   if (!t->ssl || t->bKernelTx)
+      return sendfile(t->fd, in, off, count);
+   if ((n = pread(in, buf, (count < sizeof(buf)) ? count : sizeof(buf), *off)) <= 0)
+      return n;
+   pthread_mutex_lock(&t->lock);
+   if (!rpi_tls_write_all(t, buf, n))
+      n = -1;
+   pthread_mutex_unlock(&t->lock);
+   if (n > 0)
+      *off += n;
+   return n;
+}
+
+static inline void
+rpi_tls_close (RPI_TLS* t)
+{
+   if (t->ssl && !t->bKernelTx)
+      SSL_shutdown((SSL*) t->ssl);
+   if (t->ssl)
+      SSL_free((SSL*) t->ssl);
+   if (t->ctx)
+      SSL_CTX_free((SSL_CTX*) t->ctx);
+   t->ssl = t->ctx = NULL;
+}
+
+#else //RPI_WITH_TLS
+
+static inline bool
+rpi_tls_unavailable (void)
+{
+   fprintf(stderr, "built without TLS, rebuild with -DRPI_WITH_TLS -lssl -lcrypto\n");
+   return false;
+}
+
+static inline bool rpi_tls_accept (RPI_TLS* t, int fd, const char* cert, const char* key, bool bVerbose) { return rpi_tls_unavailable(); }
+static inline bool rpi_tls_connect (RPI_TLS* t, int fd, const char* cafile, bool bVerbose) { return rpi_tls_unavailable(); }
+static inline ssize_t rpi_tls_sendmsg (RPI_TLS* t, const struct msghdr* msg, int flags) { return sendmsg(t->fd, msg, flags); }
+static inline ssize_t rpi_tls_send (RPI_TLS* t, const void* buf, size_t len, int flags) { return send(t->fd, buf, len, flags); }
+static inline ssize_t rpi_tls_recv (RPI_TLS* t, void* buf, size_t len) { return recv(t->fd, buf, len, 0); }
+static inline ssize_t rpi_tls_sendfile (RPI_TLS* t, int in, off_t* off, size_t count) { return sendfile(t->fd, in, off, count); }
+static inline void rpi_tls_close (RPI_TLS* t) { }
+
+#endif //RPI_WITH_TLS
+
+#endif //RPI_TLS_H
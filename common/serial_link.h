@@ -0,0 +1,719 @@
+/*
+ * Video over a serial port or a UART telemetry radio (a few hundred kbit/s,
+ * bytes get lost or flipped, no retransmission): raspivid -o serial://...,
+ * video -S, RPI_Tools/seriallink.
+ *
+ * A frame (SPS/PPS go with the IDR after them) is cut into packets of
+ * mtu payload bytes:
+ *    flags 1, frame id 2, index 2, count 2, fragment size 2 (little endian), payload, CRC-32C 4
+ * COBS encoded and ended by a 0 byte, so the receiver finds the next packet
+ * after any damage. A packet that fails the CRC is dropped, a frame with a
+ * dropped packet is lost and the receiver waits for the next key frame.
+ *
+ * The sender keeps key frames in front: a key frame throws away the P frames
+ * still waiting, P frames beyond the budget are dropped until the next key
+ * frame, which the request_key callback may ask the encoder for.
+ */
+#ifndef SERIAL_LINK_H
+#define SERIAL_LINK_H
+
+#ifndef _GNU_SOURCE
+   #define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <pthread.h>
+#if defined(__SSE4_2__)
+   #include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+   #include <arm_acle.h>
+#endif
+
+#define SL_FLAG_KEY      1              /// IDR, with SPS/PPS if the encoder sent them
+#define SL_FLAG_CONFIG   2              /// has SPS/PPS
+
+#define SL_HDR_LEN       9
+#define SL_CRC_LEN       4
+#define SL_DEFAULT_MTU   200            /// payload per packet, a packet then fits the 252 bytes of a SiK radio frame
+#define SL_MAX_MTU       1024
+#define SL_MAX_FRAME     (4 << 20)
+#define SL_MAX_PACKET    (SL_HDR_LEN + SL_MAX_MTU + SL_CRC_LEN)
+/* COBS adds a byte per 254 and one, the delimiter one more */
+#define SL_WIRE_LEN(n)   ((n) + (n) / 254 + 2)
+
+/******************************* CRC-32C *******************************/
+
+static uint32_t sl_crc_table[256];
+
+/* bytewise with a table, also what the hardware versions are checked against */
+static inline uint32_t
+sl_crc32c_sw (uint32_t crc, const uint8_t* p, size_t len)
+{
+   if (!__atomic_load_n(&sl_crc_table[1], __ATOMIC_RELAXED))
+   {
+      uint32_t i, k, c;
+
+      //every thread computes the same values, a race is harmless
+      for (i = 0; i < 256; i++)
+      {
+         for (c = i, k = 0; k < 8; k++)
+            c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+         __atomic_store_n(&sl_crc_table[i], c, __ATOMIC_RELAXED);
+      }
+   }
+   crc = ~crc;
+   while (len--)
+      crc = sl_crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+   return ~crc;
+}
+
+/*
+ * Castagnoli polynomial, because both SSE4.2 (crc32) and ARMv8 (crc32c*)
+ * have it in hardware. The Pi Zero/1 and 32 bit builds without
+ * -march=armv8-a+crc take the table.
+ */
+static inline uint32_t
+sl_crc32c (uint32_t crc, const uint8_t* p, size_t len)
+{
+#if defined(__SSE4_2__) && defined(__x86_64__)
+   crc = ~crc;
+   for (; len >= 8; p += 8, len -= 8)
+   {
+      uint64_t v;
+      memcpy(&v, p, 8);
+      crc = (uint32_t) _mm_crc32_u64(crc, v);
+   }
+   while (len--)
+      crc = _mm_crc32_u8(crc, *p++);
+   return ~crc;
+#elif defined(__ARM_FEATURE_CRC32)
+   crc = ~crc;
+   for (; len >= 4; p += 4, len -= 4)
+   {
+      uint32_t v;
+      memcpy(&v, p, 4);
+      crc = __crc32cw(crc, v);
+   }
+   while (len--)
+      crc = __crc32cb(crc, *p++);
+   return ~crc;
+#else
+   return sl_crc32c_sw(crc, p, len);
+#endif
+}
+
+static inline const char*
+sl_crc32c_impl (void)
+{
+#if defined(__SSE4_2__) && defined(__x86_64__)
+   return "sse4.2";
+#elif defined(__ARM_FEATURE_CRC32)
+   return "armv8 crc";
+#else
+   return "table";
+#endif
+}
+
+/******************************* COBS *******************************/
+
+/* out needs SL_WIRE_LEN(len) - 1 bytes, returns the encoded length without the delimiter */
+static inline size_t
+sl_cobs_encode (const uint8_t* in, size_t len, uint8_t* out)
+{
+   uint8_t* code = out;
+   uint8_t* o = out + 1;
+   uint8_t n = 1;
+   size_t i;
+
+   for (i = 0; i < len; i++)
+   {
+      if (in[i])
+      {
+         *o++ = in[i];
+         if (++n < 0xff)
+            continue;
+      }
+      *code = n;
+      code = o++;
+      n = 1;
+   }
+   *code = n;
+   return o - out;
+}
+
+/* 0 if in is not valid COBS or does not fit into size */
+static inline size_t
+sl_cobs_decode (const uint8_t* in, size_t len, uint8_t* out, size_t size)
+{
+   size_t i = 0, o = 0;
+
+   while (i < len)
+   {
+      uint8_t code = in[i++], k;
+
+      if (!code || (i + code - 1 > len) || (o + code > size + 1))
+         return 0;
+      for (k = 1; k < code; k++)
+         out[o++] = in[i++];
+      if ((code != 0xff) && (i < len))
+      {
+         if (o >= size)
+            return 0;
+         out[o++] = 0;
+      }
+   }
+   return o;
+}
+
+/******************************* the port *******************************/
+
+static inline speed_t
+sl_baud (unsigned baud)
+{
+   static const struct { unsigned baud; speed_t speed; } map[] =
+   {
+      { 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 },
+      { 230400, B230400 }, { 460800, B460800 }, { 500000, B500000 }, { 921600, B921600 },
+      { 1000000, B1000000 }, { 1500000, B1500000 }, { 2000000, B2000000 }, { 3000000, B3000000 },
+   };
+   unsigned i;
+
+   for (i = 0; i < sizeof(map) / sizeof(map[0]); i++)
+      if (map[i].baud == baud)
+         return map[i].speed;
+   return 0;
+}
+
+/* raw 8N1 without flow control, -1 with errno set; a pty takes any baud */
+static inline int
+sl_open_tty (const char* path, unsigned baud, int flags)
+{
+   struct termios tio;
+   speed_t speed = sl_baud(baud);
+   int fd;
+
+   if (!speed)
+   {
+      errno = EINVAL;
+      return -1;
+   }
+   if ((fd = open(path, flags | O_NOCTTY)) < 0)
+      return -1;
+   if (!tcgetattr(fd, &tio))
+   {
+      cfmakeraw(&tio);
+      tio.c_cflag |= CLOCAL | CREAD;
+      tio.c_cflag &= ~(CRTSCTS | CSTOPB);
+      tio.c_cc[VMIN] = 1;
+      tio.c_cc[VTIME] = 0;
+      cfsetispeed(&tio, speed);
+      cfsetospeed(&tio, speed);
+      tcsetattr(fd, TCSANOW, &tio);
+   }
+   return fd;
+}
+
+/*
+ * "/dev/ttyS0?baud=115200&mtu=200" -> path (up to the '?'), baud and mtu,
+ * whatever is not given keeps its value. False on an unknown parameter.
+ */
+static inline bool
+sl_parse_url (const char* url, char* path, size_t size, unsigned* baud, unsigned* mtu)
+{
+   const char* q = strchr(url, '?');
+   size_t n = q ? (size_t)(q - url) : strlen(url);
+
+   if (!n || (n >= size))
+      return false;
+   memcpy(path, url, n);
+   path[n] = 0;
+   while (q && *q)
+   {
+      q++;
+      if (1 == sscanf(q, "baud=%u", baud))
+         ;
+      else if (1 == sscanf(q, "mtu=%u", mtu))
+         ;
+      else
+         return false;
+      q = strchr(q, '&');
+   }
+   return (*mtu >= 16) && (*mtu <= SL_MAX_MTU);
+}
+
+/******************************* sender *******************************/
+
+/* a frame's packets, appended to out (SL_WIRE_LEN(SL_HDR_LEN + mtu + SL_CRC_LEN) per packet), returns the bytes */
+static inline size_t
+sl_packetize (const uint8_t* frame, uint32_t len, uint8_t flags, uint16_t id, unsigned mtu, uint8_t* out)
+{
+   uint8_t pkt[SL_MAX_PACKET];
+   uint32_t count = len ? (len + mtu - 1) / mtu : 1, i;
+   size_t total = 0;
+
+   for (i = 0; i < count; i++)
+   {
+      uint32_t n = (i + 1 < count) ? mtu : len - i * mtu, crc;
+
+      pkt[0] = flags;
+      pkt[1] = id;
+      pkt[2] = id >> 8;
+      pkt[3] = i;
+      pkt[4] = i >> 8;
+      pkt[5] = count;
+      pkt[6] = count >> 8;
+      pkt[7] = mtu;
+      pkt[8] = mtu >> 8;
+      memcpy(pkt + SL_HDR_LEN, frame + i * mtu, n);
+      crc = sl_crc32c(0, pkt, SL_HDR_LEN + n);
+      pkt[SL_HDR_LEN + n] = crc;
+      pkt[SL_HDR_LEN + n + 1] = crc >> 8;
+      pkt[SL_HDR_LEN + n + 2] = crc >> 16;
+      pkt[SL_HDR_LEN + n + 3] = crc >> 24;
+      total += sl_cobs_encode(pkt, SL_HDR_LEN + n + SL_CRC_LEN, out + total);
+      out[total++] = 0;
+   }
+   return total;
+}
+
+#define SL_TX_FRAMES 64
+
+typedef struct
+{
+   uint8_t* data;
+   uint32_t len, off;                  /// packets of the frame, what went out
+} SL_TX_FRAME;
+
+typedef struct
+{
+   SL_TX_FRAME f[SL_TX_FRAMES];
+   unsigned rd, wr;
+   uint32_t bytes;                     /// not sent yet
+} SL_TX_QUEUE;
+
+typedef struct
+{
+   int fd;
+   unsigned mtu;
+   uint32_t budget;                    /// P frame bytes that may wait, what the link sends in about half a second
+   void (*request_key)(void* arg);     /// a P frame had to go, the receiver needs an IDR; called with the lock held
+   void* arg;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   SL_TX_QUEUE key, p;
+   bool bWaitKey;                      /// P frames are dropped until the next key frame
+   bool bFailed;                       /// write() failed, the port is gone
+   bool bStop;
+   uint16_t id;
+   pthread_t thread;
+   uint64_t frames, packets, bytes;
+   uint64_t dropped;                   /// P frames never sent or thrown away for a key frame
+} SL_TX;
+
+static inline void
+sl_queue_clear (SL_TX_QUEUE* q, uint64_t* dropped)
+{
+   for (; q->rd != q->wr; q->rd++)
+   {
+      free(q->f[q->rd % SL_TX_FRAMES].data);
+      if (dropped)
+         (*dropped)++;
+   }
+   q->bytes = 0;
+}
+
+/* one packet at a time, so a key frame gets in between the packets of a P frame */
+static void*
+sl_tx_thread (void* arg)
+{
+   SL_TX* tx = arg;
+   uint8_t pkt[SL_WIRE_LEN(SL_MAX_PACKET)];
+
+   pthread_mutex_lock(&tx->lock);
+   for (;;)
+   {
+      SL_TX_QUEUE* q;
+      SL_TX_FRAME* f;
+      uint8_t* end;
+      uint32_t n, done;
+
+      while (!tx->bStop && (tx->key.rd == tx->key.wr) && (tx->p.rd == tx->p.wr))
+         pthread_cond_wait(&tx->cond, &tx->lock);
+      if (tx->bStop)
+         break;
+      q = (tx->key.rd != tx->key.wr) ? &tx->key : &tx->p;
+      f = &q->f[q->rd % SL_TX_FRAMES];
+      end = memchr(f->data + f->off, 0, f->len - f->off);
+      n = end - (f->data + f->off) + 1;
+      memcpy(pkt, f->data + f->off, n);
+      f->off += n;
+      q->bytes -= n;
+      if (f->off == f->len)
+      {
+         free(f->data);
+         q->rd++;
+         tx->frames++;
+      }
+      tx->packets++;
+      tx->bytes += n;
+      pthread_mutex_unlock(&tx->lock);
+
+      for (done = 0; done < n; )
+      {
+         ssize_t w = write(tx->fd, pkt + done, n - done);
+         if ((w < 0) && (EINTR == errno))
+            continue;
+         if (w <= 0)
+            break;
+         done += w;
+      }
+
+      pthread_mutex_lock(&tx->lock);
+      if (done < n)
+      {
+         tx->bFailed = true;
+         break;
+      }
+   }
+   pthread_mutex_unlock(&tx->lock);
+   return NULL;
+}
+
+/* budget for about half a second of the link: 10 bits per byte with start and stop bit */
+static inline bool
+sl_tx_start (SL_TX* tx, int fd, unsigned baud, unsigned mtu)
+{
+   memset(tx, 0, sizeof(*tx));
+   tx->fd = fd;
+   tx->mtu = mtu;
+   tx->budget = baud / 10 / 2;
+   pthread_mutex_init(&tx->lock, NULL);
+   pthread_cond_init(&tx->cond, NULL);
+   return !pthread_create(&tx->thread, NULL, sl_tx_thread, tx);
+}
+
+/*
+ * Queues a whole frame, never blocks on the port. False once the port
+ * failed. flags: SL_FLAG_KEY and/or SL_FLAG_CONFIG.
+ */
+static inline bool
+sl_tx_frame (SL_TX* tx, const uint8_t* frame, uint32_t len, uint8_t flags)
+{
+   uint32_t count = len ? (len + tx->mtu - 1) / tx->mtu : 1;
+   bool bKey = flags & (SL_FLAG_KEY | SL_FLAG_CONFIG);
+   SL_TX_QUEUE* q = bKey ? &tx->key : &tx->p;
+   uint8_t* out;
+   size_t n;
+   uint16_t id;
+   bool bOK;
+
+   pthread_mutex_lock(&tx->lock);
+   id = tx->id++;
+   if (tx->bFailed || (len > SL_MAX_FRAME) || (count > 0xffff))
+   {
+      bOK = !tx->bFailed;
+      pthread_mutex_unlock(&tx->lock);
+      return bOK;
+   }
+   if (!bKey && (tx->bWaitKey || (tx->p.bytes + len > tx->budget) || (q->wr - q->rd == SL_TX_FRAMES)))
+   {
+      //the frames after this one are of no use without it
+      tx->dropped++;
+      if (!tx->bWaitKey && tx->request_key)
+         tx->request_key(tx->arg);
+      tx->bWaitKey = true;
+      pthread_mutex_unlock(&tx->lock);
+      return true;
+   }
+   pthread_mutex_unlock(&tx->lock);
+
+   //the CRC and COBS work outside the lock
+   out = malloc(count * SL_WIRE_LEN(SL_HDR_LEN + tx->mtu + SL_CRC_LEN));
+   if (!out)
+      return true;
+   n = sl_packetize(frame, len, flags, id, tx->mtu, out);
+
+   pthread_mutex_lock(&tx->lock);
+   if (bKey)
+   {
+      //what is left of older P frames would only be dropped by the receiver
+      sl_queue_clear(&tx->p, &tx->dropped);
+      tx->bWaitKey = false;
+      if (q->wr - q->rd == SL_TX_FRAMES)
+      {
+         free(q->f[q->rd % SL_TX_FRAMES].data);
+         q->bytes -= q->f[q->rd % SL_TX_FRAMES].len - q->f[q->rd % SL_TX_FRAMES].off;
+         q->rd++;
+         tx->dropped++;
+      }
+   }
+   q->f[q->wr % SL_TX_FRAMES] = (SL_TX_FRAME) { out, n, 0 };
+   q->wr++;
+   q->bytes += n;
+   pthread_cond_signal(&tx->cond);
+   pthread_mutex_unlock(&tx->lock);
+   return true;
+}
+
+/* waits until everything queued went out (or the port failed) */
+static inline void
+sl_tx_drain (SL_TX* tx)
+{
+   pthread_mutex_lock(&tx->lock);
+   while (!tx->bFailed && ((tx->key.rd != tx->key.wr) || (tx->p.rd != tx->p.wr)))
+   {
+      pthread_mutex_unlock(&tx->lock);
+      usleep(10000);
+      pthread_mutex_lock(&tx->lock);
+   }
+   pthread_mutex_unlock(&tx->lock);
+}
+
+static inline void
+sl_tx_stop (SL_TX* tx)
+{
+   pthread_mutex_lock(&tx->lock);
+   tx->bStop = true;
+   pthread_cond_signal(&tx->cond);
+   pthread_mutex_unlock(&tx->lock);
+   pthread_join(tx->thread, NULL);
+   sl_queue_clear(&tx->key, NULL);
+   sl_queue_clear(&tx->p, NULL);
+}
+
+/******************************* receiver *******************************/
+
+#define SL_RX_SLOTS 4
+
+typedef struct
+{
+   bool bUsed;
+   uint16_t id;
+   uint8_t flags;
+   uint16_t count, got, frag;
+   uint32_t last_len;
+   uint8_t* data;
+   uint32_t size;
+   uint8_t* have;                      /// one bit per packet
+} SL_RX_SLOT;
+
+typedef struct
+{
+   int fd;
+   uint8_t in[4096];
+   uint32_t in_off, in_len;
+   uint8_t pkt[SL_WIRE_LEN(SL_MAX_PACKET)];
+   uint32_t pkt_len;
+   bool bOverflow;                     /// garbage longer than a packet, skipped to the next 0
+   SL_RX_SLOT slot[SL_RX_SLOTS];
+   bool bStarted;
+   bool bWaitKey;
+   uint16_t last_id;
+   uint8_t* frame;                     /// what sl_rx_frame() returned last
+   uint64_t packets, crc_errors, bad, frames, lost, skipped;
+} SL_RX;
+
+static inline void
+sl_rx_init (SL_RX* rx, int fd)
+{
+   memset(rx, 0, sizeof(*rx));
+   rx->fd = fd;
+   rx->bWaitKey = true;
+}
+
+static inline void
+sl_rx_free (SL_RX* rx)
+{
+   int i;
+
+   for (i = 0; i < SL_RX_SLOTS; i++)
+   {
+      free(rx->slot[i].data);
+      free(rx->slot[i].have);
+   }
+   free(rx->frame);
+   rx->frame = NULL;
+}
+
+/* frames before id will not complete any more, the gap in the ids counts them as lost */
+static inline void
+sl_rx_expire (SL_RX* rx, uint16_t id)
+{
+   int i;
+
+   for (i = 0; i < SL_RX_SLOTS; i++)
+      if (rx->slot[i].bUsed && ((int16_t)(rx->slot[i].id - id) < 0))
+         rx->slot[i].bUsed = false;
+}
+
+/* one COBS packet without its delimiter; the slot of the frame it completed or NULL */
+static inline SL_RX_SLOT*
+sl_rx_packet (SL_RX* rx, const uint8_t* wire, uint32_t len)
+{
+   uint8_t pkt[SL_MAX_PACKET];
+   size_t n = sl_cobs_decode(wire, len, pkt, sizeof(pkt));
+   uint32_t crc, payload, need;
+   uint16_t id, index, count, frag;
+   SL_RX_SLOT* s = NULL;
+   int i;
+
+   if (n < SL_HDR_LEN + SL_CRC_LEN)
+   {
+      rx->bad++;
+      return NULL;
+   }
+   payload = n - SL_HDR_LEN - SL_CRC_LEN;
+   crc = pkt[n - 4] | (pkt[n - 3] << 8) | (pkt[n - 2] << 16) | ((uint32_t) pkt[n - 1] << 24);
+   if (crc != sl_crc32c(0, pkt, n - SL_CRC_LEN))
+   {
+      rx->crc_errors++;
+      return NULL;
+   }
+   id = pkt[1] | (pkt[2] << 8);
+   index = pkt[3] | (pkt[4] << 8);
+   count = pkt[5] | (pkt[6] << 8);
+   frag = pkt[7] | (pkt[8] << 8);
+   if (!count || (index >= count) || !frag || (frag > SL_MAX_MTU) || ((uint64_t) count * frag > SL_MAX_FRAME) ||
+       ((index + 1 < count) ? (payload != frag) : (payload > frag)))
+   {
+      rx->bad++;
+      return NULL;
+   }
+   rx->packets++;
+   if (rx->bStarted && ((int16_t)(id - rx->last_id) <= 0))
+   {
+      //nothing is sent twice, an old id with a key frame is a sender that restarted
+      if (!(pkt[0] & SL_FLAG_KEY))
+         return NULL;
+      rx->bStarted = false;
+      for (i = 0; i < SL_RX_SLOTS; i++)
+         rx->slot[i].bUsed = false;
+   }
+
+   for (i = 0; i < SL_RX_SLOTS; i++)
+      if (rx->slot[i].bUsed && (rx->slot[i].id == id))
+         s = &rx->slot[i];
+   if (!s)
+   {
+      //a free slot, or the oldest frame is given up
+      for (i = 0; i < SL_RX_SLOTS; i++)
+      {
+         SL_RX_SLOT* c = &rx->slot[i];
+         if (!s || (s->bUsed && (!c->bUsed || ((int16_t)(c->id - s->id) < 0))))
+            s = c;
+      }
+      need = (uint32_t) count * frag;
+      if (s->size < need)
+      {
+         s->data = realloc(s->data, need);
+         s->size = need;
+      }
+      s->have = realloc(s->have, (count + 7) / 8);
+      memset(s->have, 0, (count + 7) / 8);
+      s->bUsed = true;
+      s->id = id;
+      s->flags = pkt[0];
+      s->count = count;
+      s->frag = frag;
+      s->got = 0;
+   }
+   if ((s->count != count) || (s->frag != frag) || (s->have[index / 8] & (1 << (index % 8))))
+      return NULL;
+   s->have[index / 8] |= 1 << (index % 8);
+   memcpy(s->data + (uint32_t) index * frag, pkt + SL_HDR_LEN, payload);
+   if (index + 1 == count)
+      s->last_len = payload;
+   return (++s->got == count) ? s : NULL;
+}
+
+/*
+ * The next complete frame from the port, in order; after a lost frame the
+ * P frames up to the next key frame are skipped (the decoder would only show
+ * garbage). NULL when the port is closed or read() fails. The frame is valid
+ * until the next call.
+ */
+static inline const uint8_t*
+sl_rx_frame (SL_RX* rx, uint32_t* len, uint8_t* flags)
+{
+   for (;;)
+   {
+      SL_RX_SLOT* s = NULL;
+      uint8_t* zero;
+      uint32_t n;
+
+      if (rx->in_off == rx->in_len)
+      {
+         ssize_t r = read(rx->fd, rx->in, sizeof(rx->in));
+         if ((r < 0) && (EINTR == errno))
+            continue;
+         if (r <= 0)
+            return NULL;
+         rx->in_off = 0;
+         rx->in_len = r;
+      }
+      zero = memchr(rx->in + rx->in_off, 0, rx->in_len - rx->in_off);
+      n = (zero ? (uint32_t)(zero - rx->in) : rx->in_len) - rx->in_off;
+      if (!rx->bOverflow && (rx->pkt_len + n <= sizeof(rx->pkt)))
+      {
+         memcpy(rx->pkt + rx->pkt_len, rx->in + rx->in_off, n);
+         rx->pkt_len += n;
+      }
+      else
+         rx->bOverflow = true;
+      rx->in_off += n;
+      if (!zero)
+         continue;
+      rx->in_off++;
+      if (rx->bOverflow)
+         rx->bad++;
+      else if (rx->pkt_len)
+         s = sl_rx_packet(rx, rx->pkt, rx->pkt_len);
+      rx->pkt_len = 0;
+      rx->bOverflow = false;
+      if (!s)
+         continue;
+
+      s->bUsed = false;
+      sl_rx_expire(rx, s->id);
+      if (!(s->flags & SL_FLAG_KEY) && (rx->bWaitKey || (s->id != (uint16_t)(rx->last_id + 1))))
+      {
+         rx->bWaitKey = true;
+         rx->skipped++;
+      }
+      else
+         rx->bWaitKey = false;
+      rx->lost += rx->bStarted ? (uint16_t)(s->id - rx->last_id - 1) : 0;
+      rx->bStarted = true;
+      rx->last_id = s->id;
+      if (rx->bWaitKey)
+         continue;
+
+      //the slot may be reused by the next packet, the caller keeps a frame of its own
+      *len = (uint32_t)(s->count - 1) * s->frag + s->last_len;
+      *flags = s->flags;
+      free(rx->frame);
+      rx->frame = malloc(*len ? *len : 1);
+      if (!rx->frame)
+         return NULL;
+      memcpy(rx->frame, s->data, *len);
+      rx->frames++;
+      return rx->frame;
+   }
+}
+
+static inline void
+sl_rx_print (FILE* fp, const SL_RX* rx)
+{
+   fprintf(fp, "serial: frames=%llu lost=%llu skipped=%llu packets=%llu crc_errors=%llu bad=%llu\n",
+           (unsigned long long) rx->frames, (unsigned long long) rx->lost, (unsigned long long) rx->skipped,
+           (unsigned long long) rx->packets, (unsigned long long) rx->crc_errors, (unsigned long long) rx->bad);
+}
+
+#endif //SERIAL_LINK_H
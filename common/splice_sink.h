@@ -0,0 +1,262 @@
+/*
+ * Writes encoder buffers to a file or a pipe without stdio and without copying
+ * them in user space.
+ *
+ * Regular file: the buffer pages are vmsplice()d into a private pipe and
+ * spliced on to the file right away. Splice into a file copies into the page
+ * cache, so once splice_sink_write() returns the buffer is free again.
+ *
+ * Pipe (-o - | ffmpeg ...): the pages go into the pipe by reference and the
+ * reader copies them out whenever it reads. Until then the encoder must not
+ * refill them, so the buffer is held (acquire) and given back (release) once
+ * FIONREAD shows the reader is past it. SPLICE_F_GIFT would hand the pages to
+ * the kernel for good, that only works for page aligned memory nobody reuses,
+ * not for an MMAL pool. A reader that splices the pipe onward instead of
+ * reading it keeps references we can not see, use -o with a file then.
+ * Data without a holder (a SEI on the stack) is copied in with write().
+ *
+ * Where splice is not supported (some file systems) everything falls back to
+ * write(), still without stdio. Needs _GNU_SOURCE before the first include.
+ */
+#ifndef SPLICE_SINK_H
+#define SPLICE_SINK_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define SPLICE_SINK_MAX_HOLD 64
+#define SPLICE_SINK_PIPE_SIZE (1024 * 1024)
+#define SPLICE_SINK_POLL_NS 500000
+
+typedef struct
+{
+   int fd;                              /// destination
+   int pipe[2];                         /// regular file: vmsplice() into [1], splice() from [0] to fd
+   bool bFifo;                          /// fd is a pipe, pages stay referenced until the reader got them
+   bool bFallback;                      /// no splice here, write()
+   uint64_t written;                    /// bytes into fd
+   uint64_t spliced, copied;            /// of them without and with a copy in user space
+   void (*acquire)(void* holder);
+   void (*release)(void* holder);
+   int max_hold;                        /// the encoder needs the rest of its pool
+   int n_hold;
+   struct
+   {
+      void* holder;
+      uint64_t end;                     /// written after it
+   } hold[SPLICE_SINK_MAX_HOLD];
+} SPLICE_SINK;
+
+static inline bool
+splice_sink_write_all (int fd, const uint8_t* data, size_t len)
+{
+   while (len)
+   {
+      ssize_t n = write(fd, data, len);
+
+      if ((n < 0) && (EINTR == errno))
+         continue;
+      if (n <= 0)
+         return false;
+      data += n;
+      len -= n;
+   }
+   return true;
+}
+
+/* max_hold: how many buffers a pipe reader may be behind, at most SPLICE_SINK_MAX_HOLD */
+static inline bool
+splice_sink_open (SPLICE_SINK* s, int fd, void (*acquire)(void*), void (*release)(void*), int max_hold)
+{
+   struct stat st;
+
+   memset(s, 0, sizeof(*s));
+   s->fd = fd;
+   s->pipe[0] = s->pipe[1] = -1;
+   s->acquire = acquire;
+   s->release = release;
+   s->max_hold = (max_hold > SPLICE_SINK_MAX_HOLD) ? SPLICE_SINK_MAX_HOLD : ((max_hold < 1) ? 1 : max_hold);
+   if (fstat(fd, &st))
+      return false;
+   if (S_ISFIFO(st.st_mode))
+   {
+      s->bFifo = true;
+      //a bigger pipe blocks less often, the limit for users is /proc/sys/fs/pipe-max-size
+      fcntl(fd, F_SETPIPE_SZ, SPLICE_SINK_PIPE_SIZE);
+   }
+   else if (pipe2(s->pipe, O_CLOEXEC))
+      s->bFallback = true;
+   else
+      fcntl(s->pipe[1], F_SETPIPE_SZ, SPLICE_SINK_PIPE_SIZE);
+   return true;
+}
+
+/* gives back every held buffer the pipe reader is past */
+static inline void
+splice_sink_reap (SPLICE_SINK* s)
+{
+   struct pollfd pfd = { s->fd, 0, 0 };
+   int unread = 0, i, done;
+
+   if (!s->n_hold)
+      return;
+   //POLLERR on the write end: the reader is gone, nobody looks at the pages any more
+   if ((ioctl(s->fd, FIONREAD, &unread) < 0) || ((poll(&pfd, 1, 0) > 0) && (pfd.revents & POLLERR)))
+      unread = 0;
+   for (done = 0; (done < s->n_hold) && (s->hold[done].end <= s->written - (uint64_t) unread); done++)
+      s->release(s->hold[done].holder);
+   if (done)
+   {
+      for (i = done; i < s->n_hold; i++)
+         s->hold[i - done] = s->hold[i];
+      s->n_hold -= done;
+   }
+}
+
+/* pipe: waits for the reader until a buffer may be held, the same back pressure as a blocking write() */
+static inline void
+splice_sink_wait (SPLICE_SINK* s, int max_hold)
+{
+   struct timespec wait = { 0, SPLICE_SINK_POLL_NS };
+
+   splice_sink_reap(s);
+   while (s->n_hold > max_hold)
+   {
+      nanosleep(&wait, NULL);
+      splice_sink_reap(s);
+   }
+}
+
+static inline bool
+splice_sink_vmsplice (int fd, const uint8_t* data, size_t len, size_t* done)
+{
+   *done = 0;
+   while (*done < len)
+   {
+      struct iovec iov = { (void*)(data + *done), len - *done };
+      ssize_t n = vmsplice(fd, &iov, 1, 0);
+
+      if ((n < 0) && (EINTR == errno))
+         continue;
+      if (n <= 0)
+         return false;
+      *done += n;
+   }
+   return true;
+}
+
+/* file: through the private pipe, one pipe full at a time */
+static inline bool
+splice_sink_file (SPLICE_SINK* s, const uint8_t* data, size_t len)
+{
+   size_t off = 0;
+
+   while (off < len)
+   {
+      size_t chunk = (len - off > SPLICE_SINK_PIPE_SIZE) ? SPLICE_SINK_PIPE_SIZE : len - off, in, out = 0;
+      bool bOK = splice_sink_vmsplice(s->pipe[1], data + off, chunk, &in);
+
+      while (out < in)
+      {
+         ssize_t n = splice(s->pipe[0], NULL, s->fd, NULL, in - out, SPLICE_F_MOVE);
+
+         if ((n < 0) && (EINTR == errno))
+            continue;
+         if (n <= 0)
+         {
+            bOK = false;
+            break;
+         }
+         out += n;
+      }
+      s->written += out;
+      s->spliced += out;
+      off += out;
+      if (!bOK)
+      {
+         //empty the pipe, the rest goes out with write() from the buffer
+         uint8_t scratch[4096];
+         size_t left = in - out;
+         int err = errno;
+         ssize_t n;
+
+         while (left && ((n = read(s->pipe[0], scratch, (left > sizeof(scratch)) ? sizeof(scratch) : left)) > 0))
+            left -= n;
+         if ((EINVAL != err) && (ENOSYS != err))
+            return false;
+         s->bFallback = true;
+         if (!splice_sink_write_all(s->fd, data + off, len - off))
+            return false;
+         s->written += len - off;
+         s->copied += len - off;
+         return true;
+      }
+   }
+   return true;
+}
+
+/*
+ * holder: what keeps data alive (the MMAL buffer header), acquire()d while a
+ * pipe reader may still need the pages. NULL if data is gone after the call,
+ * then it is copied.
+ */
+static inline bool
+splice_sink_write (SPLICE_SINK* s, const uint8_t* data, size_t len, void* holder)
+{
+   size_t done;
+
+   if (!len)
+      return true;
+   if (s->bFallback || (s->bFifo && !holder))
+   {
+      if (!splice_sink_write_all(s->fd, data, len))
+         return false;
+      s->written += len;
+      s->copied += len;
+      return true;
+   }
+   if (!s->bFifo)
+      return splice_sink_file(s, data, len);
+
+   splice_sink_wait(s, s->max_hold - 1);
+   if (!splice_sink_vmsplice(s->fd, data, len, &done))
+   {
+      s->written += done;
+      if (done || ((EINVAL != errno) && (ENOSYS != errno)))
+         return false;
+      s->bFallback = true;
+      return splice_sink_write(s, data, len, holder);
+   }
+   s->written += len;
+   s->spliced += len;
+   s->acquire(holder);
+   s->hold[s->n_hold].holder = holder;
+   s->hold[s->n_hold].end = s->written;
+   s->n_hold++;
+   return true;
+}
+
+/* waits until the reader has everything (or is gone), then gives back what is still held */
+static inline void
+splice_sink_close (SPLICE_SINK* s)
+{
+   splice_sink_wait(s, 0);
+   if (s->pipe[0] >= 0)
+   {
+      close(s->pipe[0]);
+      close(s->pipe[1]);
+   }
+   s->pipe[0] = s->pipe[1] = -1;
+}
+
+#endif
@@ -0,0 +1,410 @@
+/*
+ * Thread pool for per-stream work such as motion analysis of many cameras.
+ *
+ * Jobs are submitted to a stream and run in order, one at a time, so the
+ * job function may keep the stream's state without locks. A stream with jobs
+ * is queued on its home worker (id % workers), that worker's caches keep its
+ * state; a worker without streams of its own steals a whole stream from the
+ * far end of another worker's queue. Results go to one bounded lock-free ring
+ * (wp_result()), a full ring makes the workers wait rather than lose results.
+ *
+ * Link with -pthread.
+ */
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#ifndef _GNU_SOURCE
+   #define _GNU_SOURCE
+#endif
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#define WP_STREAM_JOBS 32               /// queued jobs per stream, wp_submit() fails beyond
+#define WP_BATCH       4                /// jobs of one stream before the worker looks at the others
+#define WP_CACHE_LINE  64
+
+/*
+ * Bounded MPMC ring of fixed size items (D. Vyukov): every cell has a
+ * sequence number telling whether it is free for the producer or full for
+ * the consumer of a given position, so producers and consumers only contend
+ * on their own counter.
+ */
+typedef struct
+{
+   uint8_t* cells;
+   uint32_t stride;                    /// sequence number + item, cache line aligned
+   uint32_t item_size;
+   uint64_t mask;
+   uint64_t enq __attribute__ ((aligned (WP_CACHE_LINE)));
+   uint64_t deq __attribute__ ((aligned (WP_CACHE_LINE)));
+} WP_RING;
+
+/* size is rounded up to a power of 2 */
+static inline bool
+wp_ring_init (WP_RING* r, uint32_t size, uint32_t item_size)
+{
+   uint64_t n = 2, i;
+
+   while (n < size)
+      n <<= 1;
+   memset(r, 0, sizeof(*r));
+   r->item_size = item_size;
+   r->stride = (sizeof(uint64_t) + item_size + WP_CACHE_LINE - 1) / WP_CACHE_LINE * WP_CACHE_LINE;
+   r->mask = n - 1;
+   if (posix_memalign((void**) &r->cells, WP_CACHE_LINE, n * r->stride))
+      return false;
+   for (i = 0; i < n; i++)
+      *(uint64_t*)(r->cells + i * r->stride) = i;
+   return true;
+}
+
+static inline void
+wp_ring_free (WP_RING* r)
+{
+   free(r->cells);
+   r->cells = NULL;
+}
+
+/* false if the ring is full */
+static inline bool
+wp_ring_push (WP_RING* r, const void* item)
+{
+   uint64_t pos = __atomic_load_n(&r->enq, __ATOMIC_RELAXED);
+
+   for (;;)
+   {
+      uint8_t* cell = r->cells + (pos & r->mask) * r->stride;
+      int64_t dif = (int64_t)(__atomic_load_n((uint64_t*) cell, __ATOMIC_ACQUIRE) - pos);
+
+      if (!dif)
+      {
+         if (__atomic_compare_exchange_n(&r->enq, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+         {
+            memcpy(cell + sizeof(uint64_t), item, r->item_size);
+            __atomic_store_n((uint64_t*) cell, pos + 1, __ATOMIC_RELEASE);
+            return true;
+         }
+      }
+      else if (dif < 0)
+         return false;
+      else
+         pos = __atomic_load_n(&r->enq, __ATOMIC_RELAXED);
+   }
+}
+
+/* false if the ring is empty */
+static inline bool
+wp_ring_pop (WP_RING* r, void* item)
+{
+   uint64_t pos = __atomic_load_n(&r->deq, __ATOMIC_RELAXED);
+
+   for (;;)
+   {
+      uint8_t* cell = r->cells + (pos & r->mask) * r->stride;
+      int64_t dif = (int64_t)(__atomic_load_n((uint64_t*) cell, __ATOMIC_ACQUIRE) - (pos + 1));
+
+      if (!dif)
+      {
+         if (__atomic_compare_exchange_n(&r->deq, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+         {
+            memcpy(item, cell + sizeof(uint64_t), r->item_size);
+            __atomic_store_n((uint64_t*) cell, pos + r->mask + 1, __ATOMIC_RELEASE);
+            return true;
+         }
+      }
+      else if (dif < 0)
+         return false;
+      else
+         pos = __atomic_load_n(&r->deq, __ATOMIC_RELAXED);
+   }
+}
+
+struct WP_POOL;
+
+typedef struct
+{
+   struct WP_POOL* pool;
+   int id;
+   int home;                           /// worker that runs it unless another one steals it
+   void* ctx;                          /// the caller's per-stream state
+   pthread_mutex_t lock;
+   void* job[WP_STREAM_JOBS];
+   uint32_t head, tail;
+   bool bQueued;                       /// on a worker queue or running, a stream is never on two
+   uint64_t rejected;                  /// wp_submit() with WP_STREAM_JOBS queued
+} WP_STREAM;
+
+/* runs job of stream s and fills the result (result_size bytes) that goes to the ring */
+typedef void (*WP_FN)(WP_STREAM* s, void* job, void* result);
+
+typedef struct
+{
+   struct WP_POOL* pool;
+   pthread_mutex_t lock;
+   WP_STREAM** q;                      /// ring of max_streams, the owner takes from the head, thieves from the tail
+   uint32_t head, tail;
+   uint64_t jobs;
+   uint64_t steals;                    /// streams this worker took from others
+   uint64_t ring_full;                 /// waits for the consumer of the results
+   pthread_t thread;
+} __attribute__ ((aligned (WP_CACHE_LINE))) WP_WORKER;
+
+typedef struct WP_POOL
+{
+   int workers;
+   int max_streams;
+   int n_streams;
+   WP_FN fn;
+   WP_RING results;
+   WP_STREAM* streams;
+   WP_WORKER* w;
+   int ready;                          /// streams on worker queues, atomic
+   bool bStop;
+   int sleepers;
+   pthread_mutex_t sleep_lock;
+   pthread_cond_t wake;
+} WP_POOL;
+
+static inline void
+wp_enqueue (WP_POOL* p, WP_STREAM* s)
+{
+   WP_WORKER* w = &p->w[s->home];
+
+   pthread_mutex_lock(&w->lock);
+   w->q[w->tail++ % p->max_streams] = s;
+   pthread_mutex_unlock(&w->lock);
+   __atomic_add_fetch(&p->ready, 1, __ATOMIC_SEQ_CST);
+   pthread_mutex_lock(&p->sleep_lock);
+   if (p->sleepers)
+      pthread_cond_signal(&p->wake);
+   pthread_mutex_unlock(&p->sleep_lock);
+}
+
+static inline WP_STREAM*
+wp_dequeue (WP_POOL* p, WP_WORKER* w, bool bOwn)
+{
+   WP_STREAM* s = NULL;
+
+   pthread_mutex_lock(&w->lock);
+   if (w->head != w->tail)
+      s = bOwn ? w->q[w->head++ % p->max_streams] : w->q[--w->tail % p->max_streams];
+   pthread_mutex_unlock(&w->lock);
+   if (s)
+      __atomic_sub_fetch(&p->ready, 1, __ATOMIC_SEQ_CST);
+   return s;
+}
+
+static inline void
+wp_run (WP_POOL* p, WP_WORKER* w, WP_STREAM* s, void* result)
+{
+   int i;
+
+   for (i = 0; i < WP_BATCH; i++)
+   {
+      void* job;
+
+      pthread_mutex_lock(&s->lock);
+      if (s->head == s->tail)
+      {
+         s->bQueued = false;
+         pthread_mutex_unlock(&s->lock);
+         return;
+      }
+      job = s->job[s->head % WP_STREAM_JOBS];
+      pthread_mutex_unlock(&s->lock);
+
+      p->fn(s, job, result);
+      while (!wp_ring_push(&p->results, result))
+      {
+         w->ring_full++;
+         sched_yield();
+      }
+      w->jobs++;
+      //the slot is free only now, so the job stays valid while it runs
+      pthread_mutex_lock(&s->lock);
+      s->head++;
+      pthread_mutex_unlock(&s->lock);
+   }
+
+   //more to do, behind the streams that are waiting
+   pthread_mutex_lock(&s->lock);
+   if (s->head == s->tail)
+   {
+      s->bQueued = false;
+      pthread_mutex_unlock(&s->lock);
+      return;
+   }
+   pthread_mutex_unlock(&s->lock);
+   wp_enqueue(p, s);
+}
+
+static void*
+wp_thread (void* arg)
+{
+   WP_WORKER* w = arg;
+   WP_POOL* p = w->pool;
+   void* result = malloc(p->results.item_size);
+   int me = w - p->w, i;
+
+   for (;;)
+   {
+      WP_STREAM* s = wp_dequeue(p, w, true);
+
+      for (i = 1; !s && (i < p->workers); i++)
+      {
+         s = wp_dequeue(p, &p->w[(me + i) % p->workers], false);
+         if (s)
+            w->steals++;
+      }
+      if (s)
+      {
+         wp_run(p, w, s, result);
+         continue;
+      }
+
+      pthread_mutex_lock(&p->sleep_lock);
+      if (p->bStop)
+      {
+         pthread_mutex_unlock(&p->sleep_lock);
+         break;
+      }
+      if (!__atomic_load_n(&p->ready, __ATOMIC_SEQ_CST))
+      {
+         p->sleepers++;
+         pthread_cond_wait(&p->wake, &p->sleep_lock);
+         p->sleepers--;
+      }
+      pthread_mutex_unlock(&p->sleep_lock);
+   }
+   free(result);
+   return NULL;
+}
+
+/*
+ * workers threads, pinned to CPU i % CPUs with bPin; results of result_size
+ * bytes, up to ring_size waiting. NULL if a thread or the memory is missing.
+ */
+static inline WP_POOL*
+wp_create (int workers, int max_streams, WP_FN fn, uint32_t result_size, uint32_t ring_size, bool bPin)
+{
+   WP_POOL* p = calloc(1, sizeof(*p));
+   int i, cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+   if (!p)
+      return NULL;
+   p->workers = workers;
+   p->max_streams = max_streams;
+   p->fn = fn;
+   pthread_mutex_init(&p->sleep_lock, NULL);
+   pthread_cond_init(&p->wake, NULL);
+   p->streams = calloc(max_streams, sizeof(p->streams[0]));
+   if (posix_memalign((void**) &p->w, WP_CACHE_LINE, workers * sizeof(p->w[0])) || !p->streams ||
+       !wp_ring_init(&p->results, ring_size, result_size))
+      return NULL;
+   memset(p->w, 0, workers * sizeof(p->w[0]));
+   for (i = 0; i < workers; i++)
+   {
+      p->w[i].pool = p;
+      pthread_mutex_init(&p->w[i].lock, NULL);
+      if (!(p->w[i].q = calloc(max_streams, sizeof(WP_STREAM*))))
+         return NULL;
+   }
+   for (i = 0; i < workers; i++)
+   {
+      if (pthread_create(&p->w[i].thread, NULL, wp_thread, &p->w[i]))
+         return NULL;
+      if (bPin && (cpus > 0))
+      {
+         cpu_set_t set;
+
+         CPU_ZERO(&set);
+         CPU_SET(i % cpus, &set);
+         pthread_setaffinity_np(p->w[i].thread, sizeof(set), &set);
+      }
+   }
+   return p;
+}
+
+/* a new stream with the caller's state ctx, NULL after max_streams; not thread safe */
+static inline WP_STREAM*
+wp_add_stream (WP_POOL* p, void* ctx)
+{
+   WP_STREAM* s;
+
+   if (p->n_streams >= p->max_streams)
+      return NULL;
+   s = &p->streams[p->n_streams];
+   s->pool = p;
+   s->id = p->n_streams++;
+   s->home = s->id % p->workers;
+   s->ctx = ctx;
+   pthread_mutex_init(&s->lock, NULL);
+   return s;
+}
+
+/*
+ * Queues job for stream s, the job must stay valid until its result is out.
+ * False with WP_STREAM_JOBS queued already: the stream falls behind, the
+ * caller decides whether to drop the job or to wait.
+ */
+static inline bool
+wp_submit (WP_STREAM* s, void* job)
+{
+   bool bEnqueue;
+
+   pthread_mutex_lock(&s->lock);
+   if (s->tail - s->head >= WP_STREAM_JOBS)
+   {
+      s->rejected++;
+      pthread_mutex_unlock(&s->lock);
+      return false;
+   }
+   s->job[s->tail++ % WP_STREAM_JOBS] = job;
+   bEnqueue = !s->bQueued;
+   s->bQueued = true;
+   pthread_mutex_unlock(&s->lock);
+   if (bEnqueue)
+      wp_enqueue(s->pool, s);
+   return true;
+}
+
+/* the next result of any stream, false if there is none yet; results of one stream come in order */
+static inline bool
+wp_result (WP_POOL* p, void* result)
+{
+   return wp_ring_pop(&p->results, result);
+}
+
+/* runs what is queued and stops the workers, keep popping results while it waits */
+static inline void
+wp_stop (WP_POOL* p)
+{
+   int i;
+
+   pthread_mutex_lock(&p->sleep_lock);
+   p->bStop = true;
+   pthread_cond_broadcast(&p->wake);
+   pthread_mutex_unlock(&p->sleep_lock);
+   for (i = 0; i < p->workers; i++)
+      pthread_join(p->w[i].thread, NULL);
+}
+
+static inline void
+wp_free (WP_POOL* p)
+{
+   int i;
+
+   for (i = 0; i < p->workers; i++)
+      free(p->w[i].q);
+   free(p->w);
+   free(p->streams);
+   wp_ring_free(&p->results);
+   free(p);
+}
+
+#endif //WORK_POOL_H